@@ -36,6 +36,9 @@
 #include <errno.h>
 #include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #endif
 
 /**#define SIF_ASSERT assert(0)**/  /** used for debugging.**/
@@ -44,6 +47,35 @@
 #include <assert.h>
 #include <math.h>
 
+/** Vectorized code paths are selected at compile time. Building with
+    -mssse3 (or an -march that implies it) enables the SSSE3 paths; the
+    portable code paths are used otherwise. */
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIF_HAVE_SSE2
+#endif
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define SIF_HAVE_SSSE3
+#endif
+
+/** Half precision conversions use the F16C instructions when available
+    (-mf16c), and the 512-bit forms when building for AVX-512. */
+
+#if defined(__F16C__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#if defined(__F16C__)
+#define SIF_HAVE_F16C
+#endif
+
+#if defined(__AVX512F__)
+#define SIF_HAVE_AVX512F
+#endif
+
 /** By defining the macro definition below, as opposed to the one above,
     SIF does not return when an error occurs when executing a function
     in the SIF API. */
@@ -62,12 +94,204 @@
 #define SIF_ERROR_RETURN(code) if (file->error != 0) { SIF_RECORD; SIF_ASSERT; return code; }
 #define SIF_ERROR_RETURN_V() if (file->error != 0) { SIF_RECORD; SIF_ASSERT; return; }
 
+/** Storage for the per-thread error state of concurrent reads. */
+
+#if defined(_MSC_VER)
+#define SIF_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define SIF_THREAD_LOCAL __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define SIF_THREAD_LOCAL _Thread_local
+#else
+#error "No thread-local storage: the error state of concurrent reads needs it."
+#endif
+
+static SIF_THREAD_LOCAL int _sif_thread_error = 0;
+
+/** Atomically adds to a long and returns its previous value. */
+
+#if defined(_MSC_VER)
+#define SIF_ATOMIC_FETCH_ADD(p, v) InterlockedExchangeAdd((volatile LONG*)(p), (v))
+#else
+#define SIF_ATOMIC_FETCH_ADD(p, v) __sync_fetch_and_add((p), (v))
+#endif
+
+/** Atomically replaces a 64-bit word if it holds an expected value. Evaluates
+    to non-zero if the word was replaced. */
+
+#if defined(_MSC_VER)
+#define SIF_ATOMIC_CAS64(p, o, n) (InterlockedCompareExchange64((volatile LONGLONG*)(p), (n), (o)) == (LONGLONG)(o))
+#else
+#define SIF_ATOMIC_CAS64(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#endif
+
+/** Atomically replaces an int if it holds an expected value. Evaluates to
+    non-zero if the int was replaced. */
+
+#if defined(_MSC_VER)
+#define SIF_ATOMIC_CAS(p, o, n) (InterlockedCompareExchange((volatile LONG*)(p), (n), (o)) == (LONG)(o))
+#else
+#define SIF_ATOMIC_CAS(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#endif
+
+/** Atomically replaces a pointer if it holds an expected value. Evaluates
+    to the pointer it held. */
+
+#if defined(_MSC_VER)
+#define SIF_ATOMIC_CAS_PTR(p, o, n) InterlockedCompareExchangePointer((PVOID volatile*)(p), (n), (o))
+#else
+#define SIF_ATOMIC_CAS_PTR(p, o, n) __sync_val_compare_and_swap((p), (o), (n))
+#endif
+
+/** Atomically sets a bit of a bit set, whose bytes may hold the bits of
+    tiles guarded by different locks. */
+
+#if defined(_MSC_VER)
+#define SIF_ATOMIC_SET_BIT(uca, i) InterlockedOr8((volatile char*)((uca) + (i) / 8), (char)(0x1 << (7 - ((i) % 8))))
+#else
+#define SIF_ATOMIC_SET_BIT(uca, i) __sync_fetch_and_or((uca) + (i) / 8, (u_char)(0x1 << (7 - ((i) % 8))))
+#endif
+
+/** Mutexes guarding the tile directory in concurrent write mode. */
+
+#ifdef WIN32
+typedef CRITICAL_SECTION _sif_mutex;
+#define SIF_MUTEX_INIT(m) InitializeCriticalSection(m)
+#define SIF_MUTEX_DESTROY(m) DeleteCriticalSection(m)
+#define SIF_MUTEX_LOCK(m) EnterCriticalSection(m)
+#define SIF_MUTEX_UNLOCK(m) LeaveCriticalSection(m)
+#else
+typedef pthread_mutex_t _sif_mutex;
+#define SIF_MUTEX_INIT(m) pthread_mutex_init((m), NULL)
+#define SIF_MUTEX_DESTROY(m) pthread_mutex_destroy(m)
+#define SIF_MUTEX_LOCK(m) pthread_mutex_lock(m)
+#define SIF_MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+#endif
+
+/**
+ * The number of locks over which the tiles are striped in concurrent
+ * write mode. Tile i is guarded by lock i % SIF_LOCK_STRIPES.
+ */
+
+#ifndef SIF_LOCK_STRIPES
+#define SIF_LOCK_STRIPES 64
+#endif
+
+/**
+ * The number of tiles whose headers are read at once, with a single read,
+ * from a file opened with sif_open_lazy.
+ */
+
+#ifndef SIF_LAZY_CHUNK_TILES
+#define SIF_LAZY_CHUNK_TILES 1024
+#endif
+
+/**
+ * The number of bytes of the buffer on the stack that a tile header is
+ * packed into before a positional write, or read into before it is
+ * unpacked. Only the headers of files with many bands are larger, and
+ * go through the heap instead.
+ */
+
+#ifndef SIF_TILE_HEADER_STACK_BYTES
+#define SIF_TILE_HEADER_STACK_BYTES 256
+#endif
+
+/**
+ * The number of bytes at the start of a file locked to allocate storage
+ * blocks, flush, or open the file in shared access mode.
+ */
+
+#define SIF_ALLOC_LOCK_BYTES 4
+
+/**
+ * The fcntl commands for byte-range locks. Locks on an open file
+ * description belong to the handle that took them, so another handle of
+ * the same process neither changes nor releases them when it locks,
+ * unlocks, or is closed. Other locks belong to the process.
+ */
+
+#if defined(F_OFD_SETLKW)
+#define SIF_SETLK F_OFD_SETLK
+#define SIF_SETLKW F_OFD_SETLKW
+#else
+#define SIF_SETLK F_SETLK
+#define SIF_SETLKW F_SETLKW
+#endif
+
 #define SIF_SIZE_FLAG_ARRAY(num_bits) (CEIL_DIV(num_bits, 8))
 #define SIF_GET_BIT(uca, i) ((uca[i / 8] >> (7-(i % 8))) & 0x1)
 #define SIF_SET_BIT(uca, i) (uca[i / 8] |= ((0x1) << (7-(i % 8))))
 #define SIF_CLEAR_BIT(uca, i) (uca[i / 8] &= ~((0x1) << (7-(i % 8))))
 
-#define SIF_HASH_TABLE_SIZE 128
+/**
+ * The number of slots in the meta-data table of a file when its first
+ * field is added.
+ */
+
+#define SIF_META_DATA_MIN_SLOTS 16
+
+/**
+ * The smallest block of memory added to the meta-data arena of a file
+ * when the pairs set after it was opened outgrow the blocks it has.
+ */
+
+#ifndef SIF_META_DATA_ARENA_BYTES
+#define SIF_META_DATA_ARENA_BYTES 4096
+#endif
+
+/** Rounds a size up so that whatever follows it in an arena is aligned. */
+
+#define SIF_ARENA_ALIGN(n) (CEIL_DIV((n), sizeof(double)) * sizeof(double))
+
+/**
+ * The number of bytes of a record in the meta-data extent before its key:
+ * the room of the record, the key length, the value length, and the flags.
+ */
+
+#define SIF_META_DATA_RECORD_BYTES 16
+
+/**
+ * The flag of a record in the meta-data extent whose value is stored out
+ * of line. The record holds the location of the value instead.
+ */
+
+#define SIF_META_DATA_OUT_OF_LINE 0x1
+
+/**
+ * The smallest value stored out of line, apart from the meta-data extent,
+ * in files of format version 4 and higher. It is written to the file as
+ * soon as it is set and read only when it is asked for.
+ */
+
+#ifndef SIF_META_DATA_OUT_OF_LINE_BYTES
+#define SIF_META_DATA_OUT_OF_LINE_BYTES (64 * 1024)
+#endif
+
+/**
+ * The number of bytes of a value stored out of line copied at a time when
+ * it is moved in the file.
+ */
+
+#ifndef SIF_META_DATA_COPY_BYTES
+#define SIF_META_DATA_COPY_BYTES (1024 * 1024)
+#endif
+
+/**
+ * The number of bytes of a file header of format version 4 and higher.
+ */
+
+#define SIF_HEADER_BYTES_V4 (4 + SIF_MAGIC_NUMBER_SIZE + 17 * 4 + 6 * 8 + 2 * 8)
+
+/**
+ * When storage blocks are allocated over the meta-data extent, it is
+ * moved past them with room for 1 / SIF_META_DATA_HEADROOM_DIV more
+ * blocks, so that a file that keeps growing moves it only a few times.
+ */
+
+#ifndef SIF_META_DATA_HEADROOM_DIV
+#define SIF_META_DATA_HEADROOM_DIV 8
+#endif
 
 /** The three below are function versions of the three macros above. **/
 
@@ -135,7 +359,7 @@ void _sif_swap_bytes(unsigned char *buffer,
   const int esz_h = elem_size / 2;   /** Half the number of bytes per element. */
   unsigned char tmp;
   for (i = 0; i < esz_h; i++) {
-    m = esz_h - i - 1;  /* The byte index to byte swapped. */
+    m = elem_size - i - 1;  /* The byte index to byte swapped. */
     /** For each element, the i'th byte of the element is going to be swapped with
         the m'th.
 
@@ -147,8 +371,8 @@ void _sif_swap_bytes(unsigned char *buffer,
     **/
     for (j = i, k = m; k < n_bytes; j += elem_size, k += elem_size) {
       tmp = buffer[k];
-      buffer[k] = buffer[i];
-      buffer[i] = tmp;
+      buffer[k] = buffer[j];
+      buffer[j] = tmp;
     }
   }
 }
@@ -204,28 +428,6 @@ void _sif_buffer_code_to_host(unsigned char *buffer, int n_bytes, int elem_size,
   }
 }
 
-void _sif_fwrite64_with_swap(sif_file *file, size_t size, size_t nmemb, const void *buffer) {
-  SIF_ERROR_CHECK_RETURN_V(_sif_simple_alloc_region_buffer(file, size * nmemb) == 0, SIF_ERROR_MEM);
-  memcpy(file->simple_region_buffer, buffer, size * nmemb);
-  _sif_swap_bytes(file->simple_region_buffer, size * nmemb, size);
-  FWRITE64V(file->simple_region_buffer, size, nmemb, file->fp);
-}
-
-void _sif_fwrite64_without_swap(sif_file *file, size_t size, size_t nmemb, const void *buffer) {
-  FWRITE64V(buffer, size, nmemb, file->fp);
-}
-
-void _sif_fread64_with_swap(sif_file *file, size_t size, size_t nmemb, void *buffer) {
-  FREAD64V(buffer, size, nmemb, file->fp);
-  _sif_swap_bytes(buffer, size * nmemb, size);
-}
-
-void _sif_fread64_without_swap(sif_file *file, size_t size, size_t nmemb, void *buffer) {
-  FREAD64V(buffer, size, nmemb, file->fp);
-}
-
-typedef void (*sif_buffer_preprocessor) (sif_file *file, size_t size, size_t nmemb, void *buffer);
-
 /** These two macros check if the file pointer is null, the header is not null, and if the file version
     is compatible with this library version. */
 
@@ -264,6 +466,7 @@ typedef void (*sif_buffer_preprocessor) (sif_file *file, size_t size, size_t nme
 #define FWRITE64CNT(buf, cnt, fp) cnt += sizeof(buf); SIF_ERROR_CHECK_RETURN(_sif_fwrite_win(fp, &(buf), sizeof(buf)) == 0, SIF_ERROR_WRITE, 0)
 #define FWRITE64INT32CNT(vv, cnt, fp) cnt += 4; SIF_ERROR_CHECK_RETURN(_sif_write_int32(fp, vv) == 0, SIF_ERROR_WRITE, 0)
 #define FWRITE64INT32(vv, fp) SIF_ERROR_CHECK_RETURN(_sif_write_int32(fp, vv) == 0, SIF_ERROR_WRITE, 0)
+#define FWRITE64INT64CNT(vv, cnt, fp) cnt += 8; SIF_ERROR_CHECK_RETURN(_sif_write_int64(fp, vv) == 0, SIF_ERROR_WRITE, 0)
 #define FWRITE64DOUBLE64CNT(vv, cnt, fp) cnt += 8; SIF_ERROR_CHECK_RETURN(_sif_write_double64(fp, vv) == 0, SIF_ERROR_WRITE, 0)
 #define FWRITE64DOUBLE64(vv, fp) SIF_ERROR_CHECK_RETURN(_sif_write_double64(fp, vv) == 0, SIF_ERROR_WRITE, 0)
 #define FWRITE64NEC(buf, els, nel, fp) (_sif_fwrite_win(fp, buf, els * nel) / els)
@@ -272,6 +475,7 @@ typedef void (*sif_buffer_preprocessor) (sif_file *file, size_t size, size_t nme
 #define FREAD64CNT(buf, cnt, fp) cnt += sizeof(buf); SIF_ERROR_CHECK_RETURN(_sif_fread_win(fp, &(buf), sizeof(buf)) == 0, SIF_ERROR_READ, 0)
 #define FREAD64INT32CNT(vv, cnt, fp) cnt += 4; SIF_ERROR_CHECK_RETURN(_sif_read_int32(fp, &(vv)) == 0, SIF_ERROR_READ, 0)
 #define FREAD64INT32(vv, fp) SIF_ERROR_CHECK_RETURN(_sif_read_int32(fp, &(vv)) == 0, SIF_ERROR_READ, 0)
+#define FREAD64INT64CNT(vv, cnt, fp) cnt += 8; SIF_ERROR_CHECK_RETURN(_sif_read_int64(fp, &(vv)) == 0, SIF_ERROR_READ, 0)
 #define FREAD64INT32NEC(vv, fp) _sif_read_int32(fp, &(vv))
 /** NEC -- No Error Checking. */
 #define FREAD64NEC(buf, els, nel, fp) (_sif_fread_win(fp, buf, els * nel) / els)
@@ -289,6 +493,7 @@ typedef void (*sif_buffer_preprocessor) (sif_file *file, size_t size, size_t nme
 #define FWRITE64CNT(buf, cnt, fp) cnt += sizeof(buf); SIF_ERROR_CHECK_RETURN(fwrite(&(buf), sizeof(buf), 1, fp) != 1, SIF_ERROR_WRITE, 0)
 #define FWRITE64INT32(vv, fp) SIF_ERROR_CHECK_RETURN(_sif_write_int32(fp, vv) == 0, SIF_ERROR_WRITE, 0)
 #define FWRITE64INT32CNT(vv, cnt, fp) cnt += 4; SIF_ERROR_CHECK_RETURN(_sif_write_int32(fp, vv) == 0, SIF_ERROR_WRITE, 0)
+#define FWRITE64INT64CNT(vv, cnt, fp) cnt += 8; SIF_ERROR_CHECK_RETURN(_sif_write_int64(fp, vv) == 0, SIF_ERROR_WRITE, 0)
 #define FWRITE64DOUBLE64(vv, fp) SIF_ERROR_CHECK_RETURN(_sif_write_double64(fp, vv) == 0, SIF_ERROR_WRITE, 0)
 #define FWRITE64DOUBLE64CNT(vv, cnt, fp) cnt += 8; SIF_ERROR_CHECK_RETURN(_sif_write_double64(fp, vv) == 0, SIF_ERROR_WRITE, 0)
 #define FWRITE64NEC(buf, els, nel, fp) fwrite(buf, els, nel, fp)
@@ -297,6 +502,7 @@ typedef void (*sif_buffer_preprocessor) (sif_file *file, size_t size, size_t nme
 #define FREAD64CNT(buf, cnt, fp) cnt += sizeof(buf); SIF_ERROR_CHECK_RETURN(fread(&(buf), sizeof(buf), 1, fp) != 1, SIF_ERROR_READ, 0)
 #define FREAD64INT32CNT(vv, cnt, fp) cnt += 4; SIF_ERROR_CHECK_RETURN(_sif_read_int32(fp, &(vv)) == 0, SIF_ERROR_READ, 0)
 #define FREAD64INT32(vv, fp) SIF_ERROR_CHECK_RETURN(_sif_read_int32(fp, &(vv)) == 0, SIF_ERROR_READ, 0)
+#define FREAD64INT64CNT(vv, cnt, fp) cnt += 8; SIF_ERROR_CHECK_RETURN(_sif_read_int64(fp, &(vv)) == 0, SIF_ERROR_READ, 0)
 #define FREAD64DOUBLE64CNT(vv, cnt, fp) cnt += 8; SIF_ERROR_CHECK_RETURN(_sif_read_double64(fp, &(vv)) == 0, SIF_ERROR_READ, 0)
 #define FREAD64DOUBLE64(vv, fp) SIF_ERROR_CHECK_RETURN(_sif_read_double64(fp, &(vv)) == 0, SIF_ERROR_READ, 0)
 #define FREAD64INT32NEC(vv, fp) _sif_read_int32(fp, &(vv))
@@ -329,7 +535,7 @@ typedef void (*sif_buffer_preprocessor) (sif_file *file, size_t size, size_t nme
 #define CEIL_DIV(x, y) ((((double)x)/(double)y) == ((double)((x)/(y))) ? ((x)/(y)) : ((x)/(y) + 1))
 #endif
 
-#define SIF_VERSION 2
+#define SIF_VERSION 4
 
 /**
  * Returns the latest version of the SIF file format that the
@@ -346,6 +552,10 @@ long sif_get_version() {
 documentation.*/
 
 static int _sif_is_uniform(sif_file *file, const void *data, int extentX, int extentY);
+static int _sif_load_meta_data(sif_file *file);
+static LONGLONG _sif_get_free_value_location(sif_file *file);
+static void _sif_note_meta_data_value(sif_file *file, LONGLONG loc, unsigned long len);
+static int _sif_reread_meta_data_header(sif_file *file);
 #ifdef WIN32
 
 /**
@@ -554,7 +764,7 @@ static void _sif_int64_to_packed_bytes(long long val, u_char *ptr) {
   ptr[0] = (val >> 56) & 0xFF;
   ptr[1] = (val >> 48) & 0xFF;
   ptr[2] = (val >> 40) & 0xFF;
-  ptr[2] = (val >> 32) & 0xFF;
+  ptr[3] = (val >> 32) & 0xFF;
   ptr[4] = (val >> 24) & 0xFF;
   ptr[5] = (val >> 16) & 0xFF;
   ptr[6] = (val >> 8) & 0xFF;
@@ -574,9 +784,10 @@ static void _sif_int64_to_packed_bytes(long long val, u_char *ptr) {
  */
 
 static long _sif_packed_bytes_to_int32(const u_char* ptr) {
- // MSB first
- return ((long)ptr[0] << 24) | ((long)ptr[1] << 16)
-   | ((long)ptr[2] << 8) | (long)ptr[3];
+ // MSB first. The value is sign-extended so that a block number of -1
+ // survives the round trip on platforms where a long is 64 bits.
+ return (long)(int)(((unsigned int)ptr[0] << 24) | ((unsigned int)ptr[1] << 16)
+   | ((unsigned int)ptr[2] << 8) | (unsigned int)ptr[3]);
 } 
 
 
@@ -592,7 +803,7 @@ static long _sif_packed_bytes_to_int32(const u_char* ptr) {
  * @return The long value.
  */
 
-static long long sif_packed_bytes_to_int64(const u_char* ptr) {
+static long long _sif_packed_bytes_to_int64(const u_char* ptr) {
  // MSB first
  return ((long long)ptr[0] << 56) | ((long long)ptr[1] << 48)
    | ((long long)ptr[2] << 40) | ((long long)ptr[3] << 32)
@@ -698,6 +909,61 @@ static int _sif_read_int32(sif_file *file, long *val) {
   return 1;
 }
 
+/**
+ * Write a 64-bit integer to a file in big endian network byte order.
+ *
+ * @param file   The file on which to write an integer.
+ * @param long   The integer to write.
+ *
+ * @return 1 if successful, 0 if an error occurred.
+ */
+
+static int _sif_write_int64(sif_file *file, long long val) {
+  _sif_int64_to_packed_bytes(val, (u_char*)&(file->ubuf));
+  if (FWRITE64NEC(&(file->ubuf), sizeof(u_char), 8, file->fp) != 8) {
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Read a 64-bit integer from a file in big endian network byte order.
+ *
+ * @param file   The file from which to read an integer.
+ * @param long   The integer read.
+ *
+ * @return 1 if successful, 0 if an error occurred.
+ */
+
+static int _sif_read_int64(sif_file *file, long long *val) {
+  if (FREAD64NEC(&(file->ubuf), sizeof(u_char), 8, file->fp) != 8) {
+    return 0;
+  }
+  *val = _sif_packed_bytes_to_int64((const u_char *)&(file->ubuf));
+  return 1;
+}
+
+/**
+ * Points a tile header view at the entries of a tile in the tile
+ * directory.
+ *
+ * @param file      The file containing the tile.
+ * @param tile_num  The tile.
+ * @param view      The view to fill in.
+ *
+ * @return          The view.
+ */
+
+static sif_tile*        _sif_tile_view(const sif_file *file, long tile_num, sif_tile *view) {
+  const sif_header *hd = file->header;
+  size_t t = (size_t)tile_num, upvb = (size_t)hd->bands * hd->data_unit_size;
+  view->uniform_flags = file->tiles.uniform_flags + t * hd->n_uniform_flags;
+  view->uniform_pixel_values = file->tiles.uniform_pixel_values + t * upvb;
+  view->slice_encodings = file->tiles.slice_encodings + t * hd->bands;
+  view->slice_gradients = file->tiles.slice_gradients + t * upvb * 2;
+  return view;
+}
+
 /**
  * A shallow check for complete uniformity. Each flag in the tiles
  * header is examined however the raster is not scanned for
@@ -709,15 +975,17 @@ static int _sif_read_int32(sif_file *file, long *val) {
  */
 
 static int _sif_completely_uniform_shallow(sif_file *file, long i) {
-  sif_tile *tile = file->tiles + i;
   sif_header *hd = file->header;
-  int j, retval = 0xFF;
-  u_char *last_flag_byte = tile->uniform_flags + (hd->n_uniform_flags - 1);
-  *last_flag_byte = (u_char)(0xFF >> (8 - (hd->bands % 8))) | *last_flag_byte;
-  for (j = 0; j < hd->n_uniform_flags && retval == 0xFF; j++) {
-    retval = retval & tile->uniform_flags[j];
+  const u_char *flags = file->tiles.uniform_flags + (size_t)i * hd->n_uniform_flags;
+  /** The unused bits of the last flag byte are ignored. */
+  u_char last = (u_char)(hd->bands % 8 == 0 ? 0xFF : 0xFF << (8 - hd->bands % 8));
+  long j;
+  for (j = 0; j < hd->n_uniform_flags - 1; j++) {
+    if (flags[j] != 0xFF) {
+      return 0;
+    }
   }
-  return retval == 0xFF;
+  return (flags[j] & last) == last;
 }
 
 /**
@@ -725,8 +993,33 @@ static int _sif_completely_uniform_shallow(sif_file *file, long i) {
  */
 
 static int _sif_band_of_tile_is_uniform_shallow(sif_file *file, long i, long b) {
-  sif_tile *tile = file->tiles + i;
-  return SIF_GET_BIT(tile->uniform_flags, b);
+  const u_char *flags = file->tiles.uniform_flags + (size_t)i * file->header->n_uniform_flags;
+  return SIF_GET_BIT(flags, b);
+}
+
+/**
+ * Returns true if any band in a tile must be stored in a block. Uniform
+ * slices and linear ramps are stored entirely in the tile header.
+ *
+ * @param file    The file containing the tile.
+ * @param i       The tile to check.
+ *
+ * @return Returns true iff the tile needs a block.
+ */
+
+static int _sif_tile_needs_block(sif_file *file, long i) {
+  sif_tile tile_view, *tile = _sif_tile_view(file, i, &tile_view);
+  long b;
+  if (_sif_completely_uniform_shallow(file, i)) {
+    return 0;
+  }
+  for (b = 0; b < file->header->bands; b++) {
+    if (!SIF_GET_BIT(tile->uniform_flags, b)
+        && tile->slice_encodings[b] != SIF_SLICE_ENCODING_PLANE) {
+      return 1;
+    }
+  }
+  return 0;
 }
 
 /**
@@ -747,883 +1040,5226 @@ static LONGLONG          _sif_get_block_location(const sif_file *file, long bloc
 }
 
 /**
- * Allocates enough space for the meta-data table.
+ * Returns true if the tile headers of a file store a slice encoding code
+ * and slice increments for each band. This is the case for files of format
+ * version 3 and higher. The tile header size recorded in the file header
+ * tells us whether they are present.
+ *
+ * @param file      The file to check.
  *
- * @return The newly allocated meta-data table.
+ * @return          A non-zero value if slice encodings are stored.
  */
 
-static sif_meta_data   **_sif_alloc_meta_data_table() {
-  sif_meta_data **result = (sif_meta_data**)malloc(sizeof(sif_meta_data*) * SIF_HASH_TABLE_SIZE);
-  if (result != 0) {
-    bzero(result, sizeof(sif_meta_data*) * SIF_HASH_TABLE_SIZE);
-  }
-  return result;
+static int               _sif_has_slice_encodings(const sif_file *file) {
+  const sif_header *hd = file->header;
+  return hd->tile_header_bytes >= hd->bands * hd->data_unit_size * 3 + hd->n_uniform_flags + 4 + hd->bands;
 }
 
 /**
- * Frees the space for the meta-data table and the items inside of it.
+ * Returns true if the non-uniform slices of a file are bit-packed. This is
+ * the case for 1-bit mask files, whose blocks are smaller than a raster of
+ * data units.
+ *
+ * @param file      The file to check.
+ *
+ * @return          A non-zero value if slices are bit-packed.
  */
 
-static void            _sif_free_meta_data(sif_file *file) {
-  int j;
-  sif_meta_data *cur, *next = 0;
-  for (j = 0; j < SIF_HASH_TABLE_SIZE; j++) {
-    for (cur = file->meta_data[j]; cur != 0; cur = next) {
-      next = cur->next;
-      free(cur->value);
-      free(cur->key);
-    }
-  }
-  free(file->meta_data);
+static int               _sif_has_packed_slices(const sif_file *file) {
+  return file->header->tile_bytes < file->header->data_unit_size * file->units_per_tile;
 }
 
 /**
- * Allocates enough space for a header struct. Sets all header values to their
- * defaults (usually zero).
+ * Computes the starting offset of a tile slice in its tile's block.
  *
- * @return          A pointer to a newly allocated header struct.
- *                  Returns zero if an error occurred during allocation.
+ * @param file      The file containing the tile.
+ * @param tile_num  The tile, which must have a block.
+ * @param band      The band of the slice.
+ *
+ * @return          The offset where the slice is stored.
  */
 
-static sif_header       *_sif_alloc_header() {
-  sif_header *retval = 0;
-  retval = (sif_header*)malloc(sizeof(sif_header));
-  if (retval != 0) {
-    bzero(retval, sizeof(sif_header));
-  }
-  return retval;
+static LONGLONG          _sif_get_slice_location(const sif_file *file, long tile_num, long band) {
+  const sif_header *hd = file->header;
+  return _sif_get_block_location(file, file->tiles.block_nums[tile_num])
+    + (LONGLONG)(hd->tile_bytes / hd->bands) * band;
 }
 
 /**
- * Allocates enough space for a SIF file pointer struct. Sets all values to
- * their defaults (usually zero).
+ * Returns the slot at which probing for a key starts in a meta-data
+ * table. The hash is spread with a multiplicative hash so that keys that
+ * differ only in their last characters do not crowd neighbouring slots.
  *
- * @return          A pointer to a newly allocated file pointer struct.
- *                  Returns zero if an error occurred during allocation.
+ * @param hash      The hash of the key.
+ * @param n_slots   The number of slots in the table, a power of two.
+ *
+ * @return          The slot index.
  */
 
-static sif_file         *_sif_alloc_fp() {
-  sif_file *retval = 0;
-  retval = (sif_file*)malloc(sizeof(sif_file));
-  if (retval != 0) {
-    bzero(retval, sizeof(sif_file));
+static unsigned long    _sif_meta_data_home(unsigned long hash, unsigned long n_slots) {
+  return (unsigned long)(((unsigned long long)hash * 0x9E3779B97F4A7C15ULL) >> 32) & (n_slots - 1);
+}
+
+/**
+ * Finds the slot of a key in the meta-data table of a file.
+ *
+ * @param file      The file.
+ * @param key       The key.
+ * @param hash      The hash of the key.
+ *
+ * @return          The slot index, or -1 if the key is not in the table.
+ */
+
+static long             _sif_meta_data_find(const sif_file *file, const char *key, unsigned long hash) {
+  const sif_meta_data_table *t = &file->meta_data;
+  unsigned long i, mask = t->n_slots - 1;
+  if (t->n_slots == 0) {
+    return -1;
   }
-  return retval;
+  for (i = _sif_meta_data_home(hash, t->n_slots); t->slots[i] != 0; i = (i + 1) & mask) {
+    if (t->hashes[i] == hash && strcmp(t->slots[i]->key, key) == 0) {
+      return (long)i;
+    }
+  }
+  return -1;
 }
 
 /**
- * Allocates enough space for all the SIF tile header structures.
+ * Makes room in the meta-data table of a file for a number of fields,
+ * doubling the table until they fill less than three quarters of it. The
+ * fields are moved by their stored hashes.
  *
- * @param           n_tiles The number of tiles to allocate.
+ * @param file      The file.
+ * @param n_keys    The number of fields the table must hold.
  *
- * @return          A pointer to a newly allocated file pointer struct.
- *                  Returns zero if an error occurred during allocation.
+ * @return          1 if successful, 0 otherwise.
  */
 
-static sif_tile         *_sif_alloc_tile_headers(sif_file *file) {
-  sif_tile *retval = 0, *tile;
-  sif_header *hd = file->header;
-  int i, s = SIF_SIZE_FLAG_ARRAY(hd->bands);
+static int              _sif_meta_data_reserve(sif_file *file, unsigned long n_keys) {
+  sif_meta_data_table *t = &file->meta_data;
+  unsigned long n = t->n_slots == 0 ? SIF_META_DATA_MIN_SLOTS : t->n_slots, i, j;
+  sif_meta_data **slots;
+  unsigned long *hashes;
+  while (n_keys >= n / 4 * 3) {
+    n *= 2;
+  }
+  if (n == t->n_slots) {
+    return 1;
+  }
+  slots = (sif_meta_data**)calloc(n, sizeof(sif_meta_data*));
+  hashes = (unsigned long*)malloc(n * sizeof(unsigned long));
+  if (slots == 0 || hashes == 0) {
+    free(slots);
+    free(hashes);
+    SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_MEM, 0);
+  }
+  for (i = 0; i < t->n_slots; i++) {
+    if (t->slots[i] != 0) {
+      for (j = _sif_meta_data_home(t->hashes[i], n); slots[j] != 0; j = (j + 1) & (n - 1)) {
+      }
+      slots[j] = t->slots[i];
+      hashes[j] = t->hashes[i];
+    }
+  }
+  free(t->slots);
+  free(t->hashes);
+  t->slots = slots;
+  t->hashes = hashes;
+  t->n_slots = n;
+  return 1;
+}
 
-  /** Allocate enough space (in bytes) to hold the "band" number of
-      flags for all tiles. */
-  u_char *master_uf = (u_char*)malloc(hd->n_tiles * s);
+/**
+ * A block of the meta-data arena of a file. The blocks are chained from
+ * the newest, and the bytes after each are handed out in order.
+ */
 
-  /** Allocate enough space to hold the uniform pixel values for each
-      tile and for each band.*/
-  u_char *master_upv = (u_char*)malloc(hd->n_tiles * hd->bands * hd->data_unit_size);
-  retval = (sif_tile*)malloc(sizeof(sif_tile) * hd->n_tiles);
+typedef struct _sif_arena_block {
+  struct _sif_arena_block *next;   /** the block allocated before this one. */
+  size_t size;                     /** the number of bytes after the block header. */
+  size_t used;                     /** the number of those handed out. */
+} _sif_arena_block;
 
-  /** If there was an error allocating any block, free all allocated blocks
-      and exit. */
-  if (retval == 0 || master_uf == 0 || master_upv == 0) {
-    free(master_uf);
-    free(master_upv);
-    free(retval);
-    return 0;
-  }
+/**
+ * Makes sure the newest block of the meta-data arena of a file has room for
+ * a number of bytes, adding a block if it does not.
+ *
+ * @param file      The file.
+ * @param n_bytes   The number of bytes needed.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
 
-  /** Set everything to be initially uniform. */
-  bzero(master_upv, hd->n_tiles * hd->bands * hd->data_unit_size);
-  memset(master_uf, 0xFF, s * hd->n_tiles);
-  if (retval != 0) {
-    for (i = 0; i < hd->n_tiles; i++) {
-      tile = retval + i;
-      /** The flags for ALL the tiles are stored in one big array. Do
-       some point arithmetic so the tile's header points to its
-       flags.*/
-      tile->uniform_flags = master_uf + (i * s);
+static int             _sif_arena_reserve(sif_file *file, size_t n_bytes) {
+  _sif_arena_block *b = (_sif_arena_block*)file->meta_data_arena;
+  size_t size;
+  if (b != 0 && b->size - b->used >= n_bytes) {
+    return 1;
+  }
+  size = MAX(n_bytes, SIF_META_DATA_ARENA_BYTES);
+  b = (_sif_arena_block*)malloc(SIF_ARENA_ALIGN(sizeof(_sif_arena_block)) + size);
+  SIF_ERROR_CHECK_RETURN(b == 0, SIF_ERROR_MEM, 0);
+  b->next = (_sif_arena_block*)file->meta_data_arena;
+  b->size = size;
+  b->used = 0;
+  file->meta_data_arena = b;
+  return 1;
+}
 
-      /** Do the same kind of thing for the uniform pixel values. */
-      tile->uniform_pixel_values = master_upv + (i * hd->bands * hd->data_unit_size);
+/**
+ * Allocates bytes from the meta-data arena of a file. They are freed with
+ * the rest of the meta-data.
+ *
+ * @param file      The file.
+ * @param n_bytes   The number of bytes to allocate.
+ *
+ * @return          The bytes, aligned for a meta-data pair, or 0 if they
+ *                  could not be allocated.
+ */
 
-      /** Initially, no raster block is allocated for the tiles. */
-      tile->block_num = -1;
-    }
+static void*           _sif_arena_alloc(sif_file *file, size_t n_bytes) {
+  _sif_arena_block *b;
+  u_char *p;
+  n_bytes = SIF_ARENA_ALIGN(n_bytes);
+  if (!_sif_arena_reserve(file, n_bytes)) {
+    return 0;
   }
+  b = (_sif_arena_block*)file->meta_data_arena;
+  p = (u_char*)b + SIF_ARENA_ALIGN(sizeof(_sif_arena_block)) + b->used;
+  b->used += n_bytes;
+  return p;
+}
 
-  /** We need enough space to hold uniform pixel values,
-      the uniformity flags, and the block number (32-bits).*/
-  hd->tile_header_bytes = hd->bands * hd->data_unit_size + s + 4;
+/**
+ * Frees the space for the meta-data table and the items inside of it.
+ */
 
-  /**
-   * The number of bytes to store the uniformity flags. Thus,
-   * s = Ceil(number_of_flags / 8).
-   */
-  hd->n_uniform_flags = s;
-  return retval;
+static void            _sif_free_meta_data(sif_file *file) {
+  _sif_arena_block *b, *next;
+  for (b = (_sif_arena_block*)file->meta_data_arena; b != 0; b = next) {
+    next = b->next;
+    free(b);
+  }
+  file->meta_data_arena = 0;
+  free(file->meta_data.slots);
+  free(file->meta_data.hashes);
+  bzero(&file->meta_data, sizeof(sif_meta_data_table));
 }
 
 /**
- * Free the tile headers for a file.
+ * Returns the number of bytes of the meta-data arena a pair takes once
+ * moved by _sif_compact_meta_data.
  *
- * @param file  The file to free the headers.
+ * @param md         The pair.
+ * @param with_value Non-zero if its value is moved with it.
+ *
+ * @return           The number of bytes.
  */
 
-static void            _sif_free_tile_headers(sif_file *file) {
-  /** Since the fields uniform flags and uniform_pixel_values
-      are both located in a continguous blocks across all
-      tile headers, we can free the fields of the first tile,
-      thereby free all the data for the other tiles. */
-  free(file->tiles->uniform_flags);
-  free(file->tiles->uniform_pixel_values);
-  free(file->tiles);
-  file->tiles = 0;
+static size_t          _sif_compact_meta_data_bytes(const sif_meta_data *md, int with_value) {
+  return SIF_ARENA_ALIGN(sizeof(sif_meta_data) + md->key_length + (with_value ? md->value_length : 0));
 }
 
 /**
- * Writes the header for the file passed.
+ * Copies a meta-data pair, its key, and optionally its value into the
+ * newest block of the meta-data arena, which has room for them. The prev
+ * field of the old pair is set to the copy, so that the links to it can be
+ * followed to the copy.
  *
- * @param           file The file pointer corresponding to the file
- *                       to write the header.
+ * @param file       The file.
+ * @param md         The pair.
+ * @param with_value Non-zero to copy the value, zero to drop it.
  */
 
-static int             _sif_write_header(sif_file *file) {
-  sif_header *hd = file->header;
-  int cnt = 0, dummy = 0, i;
-  REWIND64(file->fp);
-  FWRITE64INT32CNT(dummy, cnt, file);
-  FWRITE64CNT(hd->magic_number, cnt, file->fp);
-  FWRITE64INT32CNT(file->use_file_version, cnt, file);
-  hd->version = file->use_file_version;
-  FWRITE64INT32CNT(hd->width, cnt, file);
-  FWRITE64INT32CNT(hd->height, cnt, file);
-  FWRITE64INT32CNT(hd->bands, cnt, file);
-  FWRITE64INT32CNT(hd->n_keys, cnt, file);
-  FWRITE64INT32CNT(hd->n_tiles, cnt, file);
-  FWRITE64INT32CNT(hd->tile_width, cnt, file);
-  FWRITE64INT32CNT(hd->tile_height, cnt, file);
-  FWRITE64INT32CNT(hd->tile_bytes, cnt, file);
-  FWRITE64INT32CNT(hd->n_tiles_across, cnt, file);
-  FWRITE64INT32CNT(hd->data_unit_size, cnt, file);
-  FWRITE64INT32CNT(hd->user_data_type, cnt, file);
-  FWRITE64INT32CNT(hd->defragment, cnt, file);
-  FWRITE64INT32CNT(hd->consolidate, cnt, file);
-  FWRITE64INT32CNT(hd->intrinsic_write, cnt, file);
-  FWRITE64INT32CNT(hd->tile_header_bytes, cnt, file);
-  FWRITE64INT32CNT(hd->n_uniform_flags, cnt, file);
-  /** For SIF file versions 2 and higher, floats/doubles are big-endian.
-      SIF file version 1 has an anomaly where the float is written as
-      little-endian while the ints are written as big-endian. */
-
-  /** Version 1 logic. **/
-  if (hd->version < 2 || file->use_file_version < 2) {
-    for (i = 0; i < 6; i++) {
-      FWRITE64CNT(hd->affine_geo_transform[i], cnt, file->fp);
-    }
-  }
-  /** Version 2 and higher logic. **/
-  else {
-    for (i = 0; i < 6; i++) {
-      FWRITE64DOUBLE64CNT(hd->affine_geo_transform[i], cnt, file);
+static void            _sif_compact_meta_data_pair(sif_file *file, sif_meta_data *md, int with_value) {
+  sif_meta_data *n = (sif_meta_data*)_sif_arena_alloc(file, sizeof(sif_meta_data) + md->key_length
+                                                       + (with_value ? md->value_length : 0));
+  *n = *md;
+  n->key = (char*)(n + 1);
+  memcpy(n->key, md->key, md->key_length);
+  n->value = 0;
+  if (with_value) {
+    n->value = n->key + n->key_length;
+    memcpy(n->value, md->value, md->value_length);
+    /** the room of a value stored out of line is in the file. */
+    if (n->value_location < 0) {
+      n->value_capacity = n->value_length;
     }
   }
-  REWIND64(file->fp);
-  FWRITE64INT32(cnt, file);
-  file->header_bytes = cnt;
-  return 1;
+  md->prev = n;
 }
 
 /**
- * Reads the header from the file passed.
+ * Moves the meta-data pairs of a file, their keys, and the values held in
+ * memory into a single new block of its arena, and frees the old blocks.
+ * The arena otherwise keeps the values replaced, the pairs removed, and
+ * the records of the extent around the pairs read from it until the file
+ * is closed. Pairs removed but whose records are not freed yet are moved
+ * without their values. Keys and values handed out earlier move too, so
+ * this is only done when asked for, by sif_trim_memory.
  *
- * @param           file The file pointer corresponding to the file
- *                       to write the header.
+ * @param file      The file.
+ *
+ * @return          1 if successful, 0 if the new block could not be
+ *                  allocated, in which case the arena is left as it was.
  */
 
-static int             _sif_read_header(sif_file *file) {
-  sif_header *hd = file->header;
-  int cnt = 0, i;
-  REWIND64(file->fp);
-  FREAD64INT32CNT(file->header_bytes, cnt, file);
-  FREAD64CNT(hd->magic_number, cnt, file->fp);
-  FREAD64INT32CNT(hd->version, cnt, file);
-  file->use_file_version = hd->version;
-  FREAD64INT32CNT(hd->width, cnt, file);
-  FREAD64INT32CNT(hd->height, cnt, file);
-  FREAD64INT32CNT(hd->bands, cnt, file);
-  FREAD64INT32CNT(hd->n_keys, cnt, file);
-  FREAD64INT32CNT(hd->n_tiles, cnt, file);
-  FREAD64INT32CNT(hd->tile_width, cnt, file);
-  FREAD64INT32CNT(hd->tile_height, cnt, file);
-  FREAD64INT32CNT(hd->tile_bytes, cnt, file);
-  FREAD64INT32CNT(hd->n_tiles_across, cnt, file);
-  FREAD64INT32CNT(hd->data_unit_size, cnt, file);
-  FREAD64INT32CNT(hd->user_data_type, cnt, file);
-  FREAD64INT32CNT(hd->defragment, cnt, file);
-  FREAD64INT32CNT(hd->consolidate, cnt, file);
-  FREAD64INT32CNT(hd->intrinsic_write, cnt, file);
-  FREAD64INT32CNT(hd->tile_header_bytes, cnt, file);
-  FREAD64INT32CNT(hd->n_uniform_flags, cnt, file);
-
-  if (hd->version < 2) {
-    for (i = 0; i < 6; i++) {
-      FREAD64CNT(hd->affine_geo_transform[i], cnt, file->fp);
+static int             _sif_compact_meta_data(sif_file *file) {
+  sif_meta_data_table *t = &file->meta_data;
+  _sif_arena_block *b, *old = (_sif_arena_block*)file->meta_data_arena, *next;
+  sif_meta_data *md, *n;
+  size_t used = 0, live = 0;
+  unsigned long i;
+  for (b = old; b != 0; b = b->next) {
+    used += b->used;
+  }
+  for (md = t->first; md != 0; md = md->next) {
+    live += _sif_compact_meta_data_bytes(md, md->value != 0);
+  }
+  for (md = t->dirty; md != 0; md = md->next_dirty) {
+    if (md->dirty == 2) {
+      live += _sif_compact_meta_data_bytes(md, 0);
     }
   }
-  else if (hd->version >= 2) {
-    for (i = 0; i < 6; i++) {
-      FREAD64DOUBLE64CNT(hd->affine_geo_transform[i], cnt, file);
+  if (used <= live) {
+    return 1;
+  }
+  b = 0;
+  if (live > 0) {
+    b = (_sif_arena_block*)malloc(SIF_ARENA_ALIGN(sizeof(_sif_arena_block)) + live);
+    if (b == 0) {
+      return 0;
+    }
+    b->next = 0;
+    b->size = live;
+    b->used = 0;
+  }
+  file->meta_data_arena = b;
+  for (md = t->first; md != 0; md = md->next) {
+    _sif_compact_meta_data_pair(file, md, md->value != 0);
+  }
+  for (md = t->dirty; md != 0; md = md->next_dirty) {
+    if (md->dirty == 2) {
+      _sif_compact_meta_data_pair(file, md, 0);
+    }
+  }
+  /** Every old pair now points to its copy, so the links of the copies,
+      still to the old pairs, are followed to the new ones. */
+  for (md = t->first; md != 0; md = md->next) {
+    n = md->prev;
+    n->prev = n->prev != 0 ? n->prev->prev : 0;
+    n->next = md->next != 0 ? md->next->prev : 0;
+    n->next_dirty = n->next_dirty != 0 ? n->next_dirty->prev : 0;
+  }
+  for (md = t->dirty; md != 0; md = md->next_dirty) {
+    if (md->dirty == 2) {
+      n = md->prev;
+      n->next_dirty = md->next_dirty != 0 ? md->next_dirty->prev : 0;
     }
   }
+  for (i = 0; i < t->n_slots; i++) {
+    if (t->slots[i] != 0) {
+      t->slots[i] = t->slots[i]->prev;
+    }
+  }
+  t->first = t->first != 0 ? t->first->prev : 0;
+  t->last = t->last != 0 ? t->last->prev : 0;
+  t->dirty = t->dirty != 0 ? t->dirty->prev : 0;
+  for (b = old; b != 0; b = next) {
+    next = b->next;
+    free(b);
+  }
   return 1;
 }
 
 /**
- * Writes tile headers for the file passed.
+ * Allocates enough space for a header struct. Sets all header values to their
+ * defaults (usually zero).
  *
- * @param           file The file pointer corresponding to the file
- *                       to write the header.
+ * @return          A pointer to a newly allocated header struct.
+ *                  Returns zero if an error occurred during allocation.
  */
 
-static int             _sif_write_tile_headers(sif_file *file) {
-  long i = 0;
-  long long base = file->header_bytes;
-  sif_tile *tile = 0;
-  sif_header *hd = file->header;
-  FSEEK64(file->fp, base, SEEK_SET);
-  for (; i < hd->n_tiles; i++, base += hd->tile_header_bytes) {
-    tile = file->tiles + i;
-    FWRITE64(tile->uniform_pixel_values, hd->data_unit_size, hd->bands, file->fp);
-    FWRITE64(tile->uniform_flags, 1, hd->n_uniform_flags, file->fp);
-    FWRITE64INT32(tile->block_num, file);
+static sif_header       *_sif_alloc_header() {
+  sif_header *retval = 0;
+  retval = (sif_header*)malloc(sizeof(sif_header));
+  if (retval != 0) {
+    bzero(retval, sizeof(sif_header));
   }
-  return 0;
+  return retval;
 }
 
 /**
- * Reads tile headers for the file passed.
+ * Allocates enough space for a SIF file pointer struct. Sets all values to
+ * their defaults (usually zero).
  *
- * @param           file The file pointer corresponding to the file
- *                       to write the header.
+ * @return          A pointer to a newly allocated file pointer struct.
+ *                  Returns zero if an error occurred during allocation.
  */
 
-static int             _sif_read_tile_headers(sif_file *file) {
-  long i = 0, j = 1;
-  long long base = file->header_bytes;
-  sif_header *hd = file->header;
-  sif_tile *tile = 0;
-  FSEEK64(file->fp, base, SEEK_SET);
-  for (; i < hd->n_tiles; i++, base += hd->tile_header_bytes) {
-    tile = file->tiles + i;
-    FREAD64(tile->uniform_pixel_values, hd->data_unit_size, hd->bands, file->fp);
-    FREAD64(tile->uniform_flags, 1, hd->n_uniform_flags, file->fp);
-    FREAD64INT32(tile->block_num, file);
+static sif_file         *_sif_alloc_fp() {
+  sif_file *retval = 0;
+  retval = (sif_file*)malloc(sizeof(sif_file));
+  if (retval != 0) {
+    bzero(retval, sizeof(sif_file));
   }
-  return j;
+  return retval;
 }
 
 /**
- * Writes a specific tile header for the file passed.
+ * Free the tile directory, the block map, and the dirty tile set of a
+ * file.
  *
- * @param           file     The file pointer corresponding to the file
- *                           to write the header.
- * @param           tile     The tile to write.
- * @param           tile_num The number of the tile to write.
+ * @param file  The file to free the headers.
  */
 
-static int               _sif_write_tile_header(sif_file *file, sif_tile *tile, long tile_num) {
-  LONGLONG loc;
-  sif_header *hd = file->header;
-  assert(file);
-  assert(tile_num >= 0L);
-  assert(tile_num < file->header->n_tiles);
-  /** In theory, our tile header block would never be longer than the size of a long long.*/
-  loc = (LONGLONG)(file->header_bytes + tile_num * file->header->tile_header_bytes);
-  /** Set the location.*/
-  FSEEK64(file->fp, loc, SEEK_SET);
-  /** Write to the file. */
-  FWRITE64(tile->uniform_pixel_values, hd->data_unit_size, hd->bands, file->fp);
-  FWRITE64(tile->uniform_flags, 1, hd->n_uniform_flags, file->fp);
-  FWRITE64INT32(tile->block_num, file);
-  return 1;
+static void            _sif_free_tile_headers(sif_file *file) {
+  free(file->tiles.uniform_flags);
+  free(file->tiles.uniform_pixel_values);
+  free(file->tiles.block_nums);
+  free(file->tiles.slice_encodings);
+  free(file->tiles.slice_gradients);
+  free(file->blocks_to_tiles);
+  free(file->dirty_tiles);
+  bzero(&file->tiles, sizeof(sif_tile_directory));
+  file->blocks_to_tiles = 0;
+  file->dirty_tiles = 0;
 }
 
 /**
- * Retrieves a meta-data pair by its key so that its value may be inspected
- * or modified. Returns 0 if the meta-data pair corresponding to the key
- * could not be found.
- *
- * @param file     The file on which to perform the operation.
- * @param key      The key of the meta-data pair to retrieve.
+ * Sets a range of tiles of the tile directory of a file to be uniform,
+ * without a block.
  *
- * @return A pointer to the meta-data pair, 0 if not found.
+ * @param           file  The file.
+ * @param           first The first tile of the range.
+ * @param           n     The number of tiles of the range.
  */
 
-sif_meta_data*   _sif_get_meta_data_pair(sif_file *file, const char *key) {
-  sif_header *hd = 0;
-  sif_meta_data *q = 0, *r = 0, *result = 0;
-  unsigned int hash;
-  SIF_CHECK_FILE(file);
-  hash = _sif_hash(key) % SIF_HASH_TABLE_SIZE;
-  hd = file->header;
-  q = file->meta_data[hash];
-  for (r = q; r != 0; r = r->next) {
-    if (strcmp(key, r->key) == 0) {
-      result = r;
-      break;
-    }
+static void              _sif_init_tile_headers(sif_file *file, long first, long n) {
+  sif_tile_directory *dir = &file->tiles;
+  sif_header *hd = file->header;
+  size_t upvb = (size_t)hd->bands * hd->data_unit_size;
+  long i;
+  bzero(dir->uniform_pixel_values + first * upvb, n * upvb);
+  memset(dir->uniform_flags + first * hd->n_uniform_flags, 0xFF, n * hd->n_uniform_flags);
+  memset(dir->slice_encodings + first * hd->bands, SIF_SLICE_ENCODING_RAW, n * hd->bands);
+  bzero(dir->slice_gradients + first * upvb * 2, n * upvb * 2);
+  for (i = first; i < first + n; i++) {
+    dir->block_nums[i] = -1;
   }
-  result = r;
-  return result;
 }
 
 /**
- * Unlink a meta-data pair by its key. The function simply unlinks it from
- * the collision chain but does not delocate the pair or its key and value
- * fields. Returns the pair unlinked so it may be deallocated by the
- * caller.
+ * Allocates the tile directory of a file, the block map, and the dirty
+ * tile set. Every tile starts out uniform, without a block. The directory
+ * of a file opened with sif_open_lazy is set a chunk at a time as its
+ * headers are loaded, and its block map is built once they all are, so
+ * opening it takes no time for the directory and touches none of it: the
+ * system only backs the pages of the chunks loaded with memory.
  *
- * This function is guaranteed to modify only the next field of any
- * meta-data pair in the file. The next field of the meta-data pair unlinked
- * is set to NULL for safety.
+ * @param           file The file, whose header has been read or set, and
+ *                       whose loading state is allocated if it is opened
+ *                       lazily.
  *
- * @param     file       The file on which to perform the operation.
- * @param     key        The key of the meta-data pair to remove.
- *
- * @return The unlinked meta-data pair.
+ * @return          1 if successful, 0 if an error occurred during
+ *                  allocation, in which case nothing is left allocated.
  */
-sif_meta_data           *_sif_unlink_meta_data_pair(sif_file *file, const char *key) {
-  sif_meta_data *q = 0, *r = 0, *result = 0, *prev = 0;
-  unsigned int hash;
-  SIF_CHECK_FILE(file);
-  hash = _sif_hash(key) % SIF_HASH_TABLE_SIZE;
-  q = file->meta_data[hash];
-  for (r = q; r != 0; r = r->next) {
-    if (strcmp(key, r->key) == 0) {
-      result = r;
-      /** If the previous is NULL, then the pair we're unlinking is certainly
-	  the first element. Thus, the new first element becomes the result's
-          next.*/
-      if (prev == 0) {
-	file->meta_data[hash] = result->next;
-      }
-      else {
-	prev->next = result->next;
-      }
-      result->next = 0;
-      break;
-    }
-    prev = r;
-  }
-  return r;
-}
 
-void           _sif_insert_meta_data_pair(sif_file *file, const char *key, sif_meta_data *to_insert) {
-  sif_meta_data *q = 0, *result = 0;
-  unsigned int hash;
-  SIF_CHECK_FILE_V(file);
-  hash = _sif_hash(key) % SIF_HASH_TABLE_SIZE;
-  to_insert->next = file->meta_data[hash];
-  file->meta_data[hash] = to_insert;
-  (file->header->n_keys)++;
-}
+static int               _sif_alloc_tile_headers(sif_file *file) {
+  sif_tile_directory *dir = &file->tiles;
+  sif_header *hd = file->header;
+  long i, s = SIF_SIZE_FLAG_ARRAY(hd->bands);
+  size_t n = (size_t)hd->n_tiles, upvb = (size_t)hd->bands * hd->data_unit_size;
+  int lazy = file->lazy != 0;
 
-const int        _sif_null_terminator_check(const char *v, int n) {
-  int i;
-  for (i = 0; i < n; i++) {
-    if (v[0] == 0x00) { return 1; }
-  }
-  return 0;
-}
+  /** Allocate enough space (in bytes) to hold the "band" number of
+      flags for all tiles. */
+  dir->uniform_flags = (u_char*)malloc(n * s);
 
+  /** Allocate enough space to hold the uniform pixel values for each
+      tile and for each band.*/
+  dir->uniform_pixel_values = (u_char*)malloc(n * upvb);
 
-/* See sif-io.h for detailed documentation of public functions. */
-const void*      sif_get_meta_data_binary(sif_file *file, const char *key, int *n_bytes) {
-  const void *retval = 0; /** By default, null is returned (not found).*/
-  sif_meta_data *q = 0;
-  SIF_CHECK_FILE(file);
-  q = _sif_get_meta_data_pair(file, key);
-  if (q == 0) {
-    file->error = SIF_ERROR_META_DATA_KEY;
-    *n_bytes = 0;
+  /** ... a block number (32-bits) for each tile... */
+  dir->block_nums = (int*)malloc(n * sizeof(int));
+
+  /** ... a slice encoding code for each tile and for each band... */
+  dir->slice_encodings = (u_char*)malloc(n * hd->bands);
+
+  /** ... and two increments for each tile and for each band. */
+  dir->slice_gradients = (u_char*)malloc(n * upvb * 2);
+  file->blocks_to_tiles = (int*)malloc(n * sizeof(int));
+  file->dirty_tiles = (u_char*)calloc(SIF_SIZE_FLAG_ARRAY(n), 1);
+
+  /** If there was an error allocating any block, free all allocated blocks
+      and exit. */
+  if (dir->uniform_flags == 0 || dir->uniform_pixel_values == 0 || dir->block_nums == 0
+      || dir->slice_encodings == 0 || dir->slice_gradients == 0
+      || file->blocks_to_tiles == 0 || file->dirty_tiles == 0) {
+    _sif_free_tile_headers(file);
+    return 0;
   }
-  else {
-    *n_bytes = q->value_length;
-    retval = q->value;
+
+  /** We need enough space to hold uniform pixel values,
+      the uniformity flags, and the block number (32-bits). Version 3
+      and higher also store one slice encoding code and two increments
+      per band. When
+      opening an existing file, keep the size stored in its header
+      since it tells us whether the slice encodings are there. */
+  if (hd->tile_header_bytes == 0) {
+    hd->tile_header_bytes = hd->bands * hd->data_unit_size + s + 4;
+    if (hd->version >= 3) {
+      hd->tile_header_bytes += hd->bands + hd->bands * hd->data_unit_size * 2;
+    }
   }
-  return retval;
-}
 
+  /**
+   * The number of bytes to store the uniformity flags. Thus,
+   * s = Ceil(number_of_flags / 8).
+   */
+  hd->n_uniform_flags = s;
 
-/* See sif-io.h for detailed documentation of public functions. */
-const char       *sif_get_meta_data(sif_file *file, const char *key) {
-  const char *retval = 0; /** By default, null is returned (not found).*/
-  sif_meta_data *q = 0;
-  SIF_CHECK_FILE(file);
-  q = _sif_get_meta_data_pair(file, key);
-  if (q == 0) {
-    file->error = SIF_ERROR_META_DATA_KEY;
-    retval = 0;
-  }
-  else {
-    retval = (char*)q->value;
-    if (!_sif_null_terminator_check(retval, q->value_length)) {
-      file->error = SIF_ERROR_META_DATA_VALUE;
+  /** Set everything to be initially uniform. Initially, no raster block
+      is allocated for the tiles. */
+  if (!lazy) {
+    _sif_init_tile_headers(file, 0, hd->n_tiles);
+    for (i = 0; i < hd->n_tiles; i++) {
+      file->blocks_to_tiles[i] = -1;
     }
   }
-  return retval;
+  return 1;
 }
 
 /**
- * Sets a meta-data field with a given key to a value. The
- * length of the value is specified, thereby allowing for
- * binary, non-null-terminated, meta-data.
- *
- * @param file      The file to set the meta-data.
- * @param key       The key of the field to set.
- * @param value     The value for which to set the field.
- * @param value_len The length of the value.
+ * The queues of the slice cache. A slice read from disk is put on
+ * probation. If it is read again before it reaches the head of the
+ * probation queue, or soon after it was evicted from there (which a ghost
+ * entry holding only its key remembers), it is protected. Protected slices
+ * are evicted in CLOCK order, and only once probation has shrunk to a
+ * quarter of the cache, so a single pass over many slices cannot push out
+ * those in repeated use. Entries dropped from the cache while pinned are
+ * detached, and freed when the last pin is released.
  */
 
-static void             _sif_set_meta_data_len(sif_file *file, const char *key, const char *value, int value_len) {
-  int success = 0, key_len;       /** We need room for the null terminator. */
-  sif_meta_data *i = 0;
+#define SIF_CACHE_PROBATION 0
+#define SIF_CACHE_PROTECTED 1
+#define SIF_CACHE_GHOST     2
+#define SIF_CACHE_DETACHED  3
 
-  assert(file);
-  i = _sif_get_meta_data_pair(file, key);
-  if (i == 0) {
-    key_len = strlen(key) + 1;
-    SIF_ERROR_CHECK_RETURN_V((i = (sif_meta_data*)malloc(sizeof(sif_meta_data))) == 0, SIF_ERROR_MEM);
-    SIF_ERROR_CHECK_RETURN_V((i->value = (char*)malloc(value_len * sizeof(char))) == 0, SIF_ERROR_MEM);
-    SIF_ERROR_CHECK_RETURN_V((i->key = (char*)malloc(key_len * sizeof(char))) == 0, SIF_ERROR_MEM);
-    i->key_length = key_len;
-    i->value_length = value_len;
-    memcpy(i->key, key, sizeof(char) * key_len);
-    memcpy(i->value, value, sizeof(char) * value_len);
-    _sif_insert_meta_data_pair(file, key, i);
+/**
+ * An entry of the slice cache. The decoded slice follows the entry in
+ * memory.
+ */
+
+typedef struct _sif_cache_entry {
+  long file_id;                        /** the identity of the file. */
+  long tile_num;                       /** the tile. */
+  long band;                           /** the band. */
+  long nbytes;                         /** the size of the slice, zero for a ghost. */
+  int queue;                           /** the queue the entry is on. */
+  int pins;                            /** the number of pins held on the slice. */
+  int referenced;                      /** set when the slice is read from the cache. */
+  long generation;                     /** the generation of the file the slice was read in. */
+  struct _sif_cache_entry *hash_next;  /** the next entry of the hash bucket. */
+  struct _sif_cache_entry *prev;       /** the previous entry of the queue. */
+  struct _sif_cache_entry *next;       /** the next entry of the queue. */
+} _sif_cache_entry;
+
+/**
+ * A file with handles open on it, identified by its device and inode
+ * (volume serial number and file index on Windows).
+ */
+
+typedef struct _sif_cache_file {
+  unsigned long long dev;
+  unsigned long long ino;
+  long id;                             /** the identity used in cache keys. */
+  long refs;                           /** the number of handles open on it. */
+  long generation;                     /** advanced whenever slices of the file are dropped. */
+  struct _sif_cache_file *next;
+} _sif_cache_file;
+
+/**
+ * A block of the scratch pool. The buffer follows the header in memory.
+ */
+
+typedef struct _sif_scratch {
+  long nbytes;                         /** the size of the buffer. */
+  struct _sif_scratch *next;           /** the next free block. */
+} _sif_scratch;
+
+/**
+ * The number of free scratch blocks kept in the pool for reuse.
+ */
+
+#ifndef SIF_SCRATCH_POOL_BLOCKS
+#define SIF_SCRATCH_POOL_BLOCKS 8
+#endif
+
+/**
+ * The process-wide slice cache and scratch pool. Everything is guarded by
+ * the mutex.
+ */
+
+typedef struct {
+  _sif_mutex mutex;
+  size_t budget;                       /** the most bytes of slices kept. */
+  size_t queue_bytes[3];               /** the bytes of slices on each queue. */
+  long queue_count[3];                 /** the number of entries on each queue. */
+  _sif_cache_entry *head[3];           /** the entries next to be evicted. */
+  _sif_cache_entry *tail[3];           /** the entries last queued. */
+  _sif_cache_entry **buckets;          /** the hash table, a power of two long. */
+  long n_buckets;
+  long n_hashed;
+  _sif_cache_file *files;              /** the files with handles open. */
+  long last_id;
+  _sif_scratch *scratch;               /** the free scratch blocks, most recent first. */
+  long n_scratch;
+} _sif_cache_state;
+
+#ifdef WIN32
+static _sif_cache_state _sif_cache;
+static volatile LONG _sif_cache_init = 0;
+#else
+static _sif_cache_state _sif_cache = { PTHREAD_MUTEX_INITIALIZER };
+#endif
+
+/**
+ * Locks the slice cache, initializing its mutex on first use on Windows.
+ */
+
+static void              _sif_cache_lock(void) {
+#ifdef WIN32
+  if (_sif_cache_init != 2) {
+    if (InterlockedCompareExchange(&_sif_cache_init, 1, 0) == 0) {
+      InitializeCriticalSection(&_sif_cache.mutex);
+      _sif_cache_init = 2;
+    }
+    while (_sif_cache_init != 2) {
+      Sleep(0);
+    }
+  }
+#endif
+  SIF_MUTEX_LOCK(&_sif_cache.mutex);
+}
+
+/**
+ * Unlocks the slice cache.
+ */
+
+static void              _sif_cache_unlock(void) {
+  SIF_MUTEX_UNLOCK(&_sif_cache.mutex);
+}
+
+/**
+ * Returns the hash bucket of a cache key. The table must not be empty.
+ */
+
+static _sif_cache_entry** _sif_cache_bucket(long file_id, long tile_num, long band) {
+  unsigned long long h = (unsigned long long)file_id * 0x9E3779B97F4A7C15ULL;
+  h ^= (unsigned long long)tile_num * 0xC2B2AE3D27D4EB4FULL + (unsigned long long)band;
+  h ^= h >> 29;
+  return _sif_cache.buckets + (h & (unsigned long long)(_sif_cache.n_buckets - 1));
+}
+
+/**
+ * Looks up a slice, or the ghost of one, in the cache.
+ *
+ * @return          The entry, or null if the key is not in the cache.
+ */
+
+static _sif_cache_entry* _sif_cache_find(long file_id, long tile_num, long band) {
+  _sif_cache_entry *e;
+  if (_sif_cache.n_buckets == 0) {
+    return 0;
+  }
+  for (e = *_sif_cache_bucket(file_id, tile_num, band); e != 0; e = e->hash_next) {
+    if (e->file_id == file_id && e->tile_num == tile_num && e->band == band) {
+      return e;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Adds an entry to the hash table, doubling the table when it is full.
+ *
+ * @return          1 if successful, 0 if the table could not be allocated.
+ */
+
+static int               _sif_cache_hash(_sif_cache_entry *e) {
+  _sif_cache_entry **old = _sif_cache.buckets, *o, **b;
+  long n_old = _sif_cache.n_buckets, i;
+  if (_sif_cache.n_hashed >= n_old) {
+    i = n_old == 0 ? 256 : n_old * 2;
+    b = (_sif_cache_entry**)calloc(i, sizeof(_sif_cache_entry*));
+    if (b == 0 && n_old == 0) {
+      return 0;
+    }
+    if (b != 0) {
+      _sif_cache.buckets = b;
+      _sif_cache.n_buckets = i;
+      for (i = 0; i < n_old; i++) {
+        while ((o = old[i]) != 0) {
+          old[i] = o->hash_next;
+          b = _sif_cache_bucket(o->file_id, o->tile_num, o->band);
+          o->hash_next = *b;
+          *b = o;
+        }
+      }
+      free(old);
+    }
+  }
+  b = _sif_cache_bucket(e->file_id, e->tile_num, e->band);
+  e->hash_next = *b;
+  *b = e;
+  _sif_cache.n_hashed++;
+  return 1;
+}
+
+/**
+ * Removes an entry from the hash table.
+ */
+
+static void              _sif_cache_unhash(_sif_cache_entry *e) {
+  _sif_cache_entry **p = _sif_cache_bucket(e->file_id, e->tile_num, e->band);
+  while (*p != e) {
+    p = &(*p)->hash_next;
+  }
+  *p = e->hash_next;
+  _sif_cache.n_hashed--;
+}
+
+/**
+ * Appends an entry to the tail of a queue.
+ */
+
+static void              _sif_cache_enqueue(_sif_cache_entry *e, int queue) {
+  e->queue = queue;
+  e->next = 0;
+  e->prev = _sif_cache.tail[queue];
+  if (e->prev != 0) {
+    e->prev->next = e;
+  }
+  else {
+    _sif_cache.head[queue] = e;
+  }
+  _sif_cache.tail[queue] = e;
+  _sif_cache.queue_bytes[queue] += e->nbytes;
+  _sif_cache.queue_count[queue]++;
+}
+
+/**
+ * Takes an entry off its queue.
+ */
+
+static void              _sif_cache_unqueue(_sif_cache_entry *e) {
+  int queue = e->queue;
+  if (e->prev != 0) {
+    e->prev->next = e->next;
+  }
+  else {
+    _sif_cache.head[queue] = e->next;
+  }
+  if (e->next != 0) {
+    e->next->prev = e->prev;
+  }
+  else {
+    _sif_cache.tail[queue] = e->prev;
+  }
+  _sif_cache.queue_bytes[queue] -= e->nbytes;
+  _sif_cache.queue_count[queue]--;
+}
+
+/**
+ * Drops an entry from the cache. A pinned entry is detached rather than
+ * freed.
+ */
+
+static void              _sif_cache_remove(_sif_cache_entry *e) {
+  _sif_cache_unqueue(e);
+  _sif_cache_unhash(e);
+  if (e->pins == 0) {
+    free(e);
+  }
+  else {
+    e->queue = SIF_CACHE_DETACHED;
+  }
+}
+
+/**
+ * Evicts slices until the cache is within its budget or every slice left
+ * is pinned, and trims the ghost entries.
+ */
+
+static void              _sif_cache_evict(void) {
+  _sif_cache_entry *e, *g;
+  long guard = 2 * (_sif_cache.queue_count[SIF_CACHE_PROBATION]
+                    + _sif_cache.queue_count[SIF_CACHE_PROTECTED]) + 1;
+  while (_sif_cache.queue_bytes[SIF_CACHE_PROBATION] + _sif_cache.queue_bytes[SIF_CACHE_PROTECTED]
+         > _sif_cache.budget && guard-- > 0) {
+    if (_sif_cache.head[SIF_CACHE_PROBATION] != 0
+        && (_sif_cache.queue_bytes[SIF_CACHE_PROBATION] > _sif_cache.budget / 4
+            || _sif_cache.head[SIF_CACHE_PROTECTED] == 0)) {
+      e = _sif_cache.head[SIF_CACHE_PROBATION];
+      _sif_cache_unqueue(e);
+      if (e->pins != 0) {
+        _sif_cache_enqueue(e, SIF_CACHE_PROBATION);
+      }
+      else if (e->referenced) {
+        e->referenced = 0;
+        _sif_cache_enqueue(e, SIF_CACHE_PROTECTED);
+      }
+      else {
+        /** leave a ghost behind so that a slice read again soon is
+            protected. */
+        _sif_cache_unhash(e);
+        g = (_sif_cache_entry*)malloc(sizeof(_sif_cache_entry));
+        if (g != 0) {
+          *g = *e;
+          g->nbytes = 0;
+          if (_sif_cache_hash(g)) {
+            _sif_cache_enqueue(g, SIF_CACHE_GHOST);
+          }
+          else {
+            free(g);
+          }
+        }
+        free(e);
+      }
+    }
+    else if (_sif_cache.head[SIF_CACHE_PROTECTED] != 0) {
+      e = _sif_cache.head[SIF_CACHE_PROTECTED];
+      _sif_cache_unqueue(e);
+      if (e->pins != 0 || e->referenced) {
+        e->referenced = 0;
+        _sif_cache_enqueue(e, SIF_CACHE_PROTECTED);
+      }
+      else {
+        _sif_cache_unhash(e);
+        free(e);
+      }
+    }
+    else {
+      break;
+    }
+  }
+  /** remember as many evicted slices as there are cached ones. A longer
+      history would protect the slices of a scan repeated over an area
+      larger than the cache. */
+  while (_sif_cache.queue_count[SIF_CACHE_GHOST] > (_sif_cache.budget == 0 ? 0 :
+         _sif_cache.queue_count[SIF_CACHE_PROBATION] + _sif_cache.queue_count[SIF_CACHE_PROTECTED])) {
+    _sif_cache_remove(_sif_cache.head[SIF_CACHE_GHOST]);
+  }
+}
+
+/**
+ * Drops every cached slice of a file. The cache is locked by the caller.
+ */
+
+static void              _sif_cache_purge(long file_id) {
+  _sif_cache_entry *e, *next;
+  int q;
+  for (q = SIF_CACHE_PROBATION; q <= SIF_CACHE_GHOST; q++) {
+    for (e = _sif_cache.head[q]; e != 0; e = next) {
+      next = e->next;
+      if (e->file_id == file_id) {
+        _sif_cache_remove(e);
+      }
+    }
+  }
+}
+
+/**
+ * Finds a file with handles open by its cache identity. The cache is
+ * locked by the caller.
+ *
+ * @param file_id   The identity of the file.
+ *
+ * @return          The file, or null if it has no handles open.
+ */
+
+static _sif_cache_file*  _sif_cache_file_of(long file_id) {
+  _sif_cache_file *f;
+  for (f = _sif_cache.files; f != 0 && f->id != file_id; f = f->next);
+  return f;
+}
+
+/**
+ * Gives a newly opened handle the cache identity of its file, so that
+ * every handle on the file shares its cached slices. If no identity can be
+ * found, the handle is not cached.
+ *
+ * @param file      The file handle.
+ * @param reset     Non-zero if the file was just created, so that slices
+ *                  cached by other handles on it are stale.
+ */
+
+static void              _sif_cache_attach(sif_file *file, int reset) {
+  unsigned long long dev, ino;
+  _sif_cache_file *f;
+#ifdef WIN32
+  BY_HANDLE_FILE_INFORMATION info;
+  if (!GetFileInformationByHandle(file->fp, &info)) {
+    return;
+  }
+  dev = info.dwVolumeSerialNumber;
+  ino = ((unsigned long long)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+#else
+  struct stat st;
+  if (fstat(fileno(file->fp), &st) != 0) {
+    return;
+  }
+  dev = (unsigned long long)st.st_dev;
+  ino = (unsigned long long)st.st_ino;
+#endif
+  _sif_cache_lock();
+  for (f = _sif_cache.files; f != 0 && (f->dev != dev || f->ino != ino); f = f->next);
+  if (f != 0) {
+    f->refs++;
+    if (reset) {
+      f->generation++;
+      _sif_cache_purge(f->id);
+    }
+  }
+  else if ((f = (_sif_cache_file*)malloc(sizeof(_sif_cache_file))) != 0) {
+    f->dev = dev;
+    f->ino = ino;
+    f->id = ++_sif_cache.last_id;
+    f->refs = 1;
+    f->generation = 0;
+    f->next = _sif_cache.files;
+    _sif_cache.files = f;
+  }
+  file->cache_id = f != 0 ? f->id : 0;
+  _sif_cache_unlock();
+}
+
+/**
+ * Releases the cache identity of a handle being closed. The slices of the
+ * file are dropped with its last handle, since the file may then change
+ * outside the process.
+ *
+ * @param file      The file handle.
+ */
+
+static void              _sif_cache_detach(sif_file *file) {
+  _sif_cache_file **p, *f;
+  if (file->cache_id == 0) {
+    return;
+  }
+  _sif_cache_lock();
+  for (p = &_sif_cache.files; (f = *p) != 0 && f->id != file->cache_id; p = &f->next);
+  if (f != 0 && --f->refs == 0) {
+    *p = f->next;
+    _sif_cache_purge(f->id);
+    free(f);
+  }
+  _sif_cache_unlock();
+  file->cache_id = 0;
+}
+
+/**
+ * Drops the cached slices of a file just flushed if other handles are open
+ * on it. Tiles written through a handle are invalidated as they are
+ * written, but other handles may read and cache the old slices again until
+ * the new ones reach the file, which buffered writes only do on a flush.
+ *
+ * @param file      The file handle.
+ */
+
+static void              _sif_cache_flushed(sif_file *file) {
+  _sif_cache_file *f;
+  if (file->cache_id == 0) {
+    return;
+  }
+  _sif_cache_lock();
+  if ((f = _sif_cache_file_of(file->cache_id)) != 0 && f->refs > 1) {
+    f->generation++;
+    _sif_cache_purge(f->id);
+  }
+  _sif_cache_unlock();
+}
+
+/**
+ * Takes a scratch buffer from the pool, or allocates one. The smallest
+ * free block that is large enough is reused, unless it is more than twice
+ * the size needed.
+ *
+ * @param nbytes    The size of the buffer.
+ *
+ * @return          The buffer, or null if it could not be allocated.
+ */
+
+static void*             _sif_scratch_get(long nbytes) {
+  _sif_scratch **p, **best = 0, *b;
+  _sif_cache_lock();
+  for (p = &_sif_cache.scratch; *p != 0; p = &(*p)->next) {
+    if ((*p)->nbytes >= nbytes && (*p)->nbytes / 2 <= nbytes
+        && (best == 0 || (*p)->nbytes < (*best)->nbytes)) {
+      best = p;
+    }
+  }
+  if (best != 0) {
+    b = *best;
+    *best = b->next;
+    _sif_cache.n_scratch--;
+    _sif_cache_unlock();
+    return b + 1;
+  }
+  _sif_cache_unlock();
+  b = (_sif_scratch*)malloc(sizeof(_sif_scratch) + nbytes);
+  if (b == 0) {
+    return 0;
+  }
+  b->nbytes = nbytes;
+  return b + 1;
+}
+
+/**
+ * Gives a scratch buffer back to the pool. The least recently used free
+ * block is freed when the pool is full.
+ *
+ * @param buffer    The buffer, from _sif_scratch_get, or null.
+ */
+
+static void              _sif_scratch_put(void *buffer) {
+  _sif_scratch *b = ((_sif_scratch*)buffer) - 1, **p;
+  if (buffer == 0) {
+    return;
+  }
+  _sif_cache_lock();
+  b->next = _sif_cache.scratch;
+  _sif_cache.scratch = b;
+  if (++_sif_cache.n_scratch > SIF_SCRATCH_POOL_BLOCKS) {
+    for (p = &_sif_cache.scratch; (*p)->next != 0; p = &(*p)->next);
+    b = *p;
+    *p = 0;
+    _sif_cache.n_scratch--;
+  }
+  else {
+    b = 0;
+  }
+  _sif_cache_unlock();
+  free(b);
+}
+
+/**
+ * Borrows the two block buffers of a handle from the scratch pool for the
+ * length of a call, unless an enclosing call already has them. Idle
+ * handles hold no block buffers.
+ *
+ * @param file      The file.
+ *
+ * @return          1 if successful, 0 if the buffers could not be allocated.
+ */
+
+static int               _sif_borrow_buffers(sif_file *file) {
+  long tile_bytes = file->header->data_unit_size * file->units_per_tile;
+  if (file->scratch_depth == 0) {
+    file->buffer[0] = _sif_scratch_get(tile_bytes * 2);
+    SIF_ERROR_CHECK_RETURN(file->buffer[0] == 0, SIF_ERROR_MEM, 0);
+    file->buffer[1] = ((u_char*)file->buffer[0]) + tile_bytes;
+  }
+  file->scratch_depth++;
+  return 1;
+}
+
+/**
+ * Ends a call that borrowed the block buffers of a handle, returning them
+ * to the pool if no enclosing call needs them.
+ *
+ * @param file      The file.
+ */
+
+static void              _sif_return_buffers(sif_file *file) {
+  if (--file->scratch_depth == 0) {
+    _sif_scratch_put(file->buffer[0]);
+    file->buffer[0] = 0;
+    file->buffer[1] = 0;
+  }
+}
+
+/**
+ * Drops the cached slices of a tile about to be changed. The caller holds
+ * the tile's lock, which only keeps out the handles sharing it, so the
+ * generation of the file is advanced as well.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param tile_num  The tile.
+ */
+
+static void              _sif_cache_invalidate(sif_file *file, long tile_num) {
+  _sif_cache_entry *e;
+  _sif_cache_file *f;
+  long band;
+  if (file->cache_id == 0) {
+    return;
+  }
+  _sif_cache_lock();
+  /** another handle on the file may be reading the old slice; its entry
+      is refused by _sif_cache_add. */
+  if ((f = _sif_cache_file_of(file->cache_id)) != 0) {
+    f->generation++;
+  }
+  for (band = 0; band < file->header->bands && _sif_cache.n_hashed > 0; band++) {
+    if ((e = _sif_cache_find(file->cache_id, tile_num, band)) != 0) {
+      _sif_cache_remove(e);
+    }
+  }
+  _sif_cache_unlock();
+}
+
+/**
+ * Writes the header for the file passed.
+ *
+ * @param           file The file pointer corresponding to the file
+ *                       to write the header.
+ */
+
+static int             _sif_write_header(sif_file *file) {
+  sif_header *hd = file->header;
+  int cnt = 0, dummy = 0, i;
+  REWIND64(file->fp);
+  FWRITE64INT32CNT(dummy, cnt, file);
+  FWRITE64CNT(hd->magic_number, cnt, file->fp);
+  FWRITE64INT32CNT(file->use_file_version, cnt, file);
+  hd->version = file->use_file_version;
+  FWRITE64INT32CNT(hd->width, cnt, file);
+  FWRITE64INT32CNT(hd->height, cnt, file);
+  FWRITE64INT32CNT(hd->bands, cnt, file);
+  FWRITE64INT32CNT(hd->n_keys, cnt, file);
+  FWRITE64INT32CNT(hd->n_tiles, cnt, file);
+  FWRITE64INT32CNT(hd->tile_width, cnt, file);
+  FWRITE64INT32CNT(hd->tile_height, cnt, file);
+  FWRITE64INT32CNT(hd->tile_bytes, cnt, file);
+  FWRITE64INT32CNT(hd->n_tiles_across, cnt, file);
+  FWRITE64INT32CNT(hd->data_unit_size, cnt, file);
+  FWRITE64INT32CNT(hd->user_data_type, cnt, file);
+  FWRITE64INT32CNT(hd->defragment, cnt, file);
+  FWRITE64INT32CNT(hd->consolidate, cnt, file);
+  FWRITE64INT32CNT(hd->intrinsic_write, cnt, file);
+  FWRITE64INT32CNT(hd->tile_header_bytes, cnt, file);
+  FWRITE64INT32CNT(hd->n_uniform_flags, cnt, file);
+  /** For SIF file versions 2 and higher, floats/doubles are big-endian.
+      SIF file version 1 has an anomaly where the float is written as
+      little-endian while the ints are written as big-endian. */
+
+  /** Version 1 logic. **/
+  if (hd->version < 2 || file->use_file_version < 2) {
+    for (i = 0; i < 6; i++) {
+      FWRITE64CNT(hd->affine_geo_transform[i], cnt, file->fp);
+    }
+  }
+  /** Version 2 and higher logic. **/
+  else {
+    for (i = 0; i < 6; i++) {
+      FWRITE64DOUBLE64CNT(hd->affine_geo_transform[i], cnt, file);
+    }
+  }
+  /** Version 4 and higher logic. **/
+  if (file->use_file_version >= 4) {
+    FWRITE64INT64CNT(file->meta_data_location, cnt, file);
+    FWRITE64INT64CNT(file->meta_data_bytes, cnt, file);
+  }
+  /** A shorter header of an older version keeps the room of the longer
+      one, so that the tile headers stay where they are. */
+  while (cnt < file->header_bytes) {
+    FWRITE64INT32CNT(dummy, cnt, file);
+  }
+  REWIND64(file->fp);
+  FWRITE64INT32(cnt, file);
+  file->header_bytes = cnt;
+  return 1;
+}
+
+/**
+ * Reads the header from the file passed.
+ *
+ * @param           file The file pointer corresponding to the file
+ *                       to write the header.
+ */
+
+static int             _sif_read_header(sif_file *file) {
+  sif_header *hd = file->header;
+  int cnt = 0, i;
+  REWIND64(file->fp);
+  FREAD64INT32CNT(file->header_bytes, cnt, file);
+  FREAD64CNT(hd->magic_number, cnt, file->fp);
+  FREAD64INT32CNT(hd->version, cnt, file);
+  file->use_file_version = hd->version;
+  FREAD64INT32CNT(hd->width, cnt, file);
+  FREAD64INT32CNT(hd->height, cnt, file);
+  FREAD64INT32CNT(hd->bands, cnt, file);
+  FREAD64INT32CNT(hd->n_keys, cnt, file);
+  FREAD64INT32CNT(hd->n_tiles, cnt, file);
+  FREAD64INT32CNT(hd->tile_width, cnt, file);
+  FREAD64INT32CNT(hd->tile_height, cnt, file);
+  FREAD64INT32CNT(hd->tile_bytes, cnt, file);
+  FREAD64INT32CNT(hd->n_tiles_across, cnt, file);
+  FREAD64INT32CNT(hd->data_unit_size, cnt, file);
+  FREAD64INT32CNT(hd->user_data_type, cnt, file);
+  FREAD64INT32CNT(hd->defragment, cnt, file);
+  FREAD64INT32CNT(hd->consolidate, cnt, file);
+  FREAD64INT32CNT(hd->intrinsic_write, cnt, file);
+  FREAD64INT32CNT(hd->tile_header_bytes, cnt, file);
+  FREAD64INT32CNT(hd->n_uniform_flags, cnt, file);
+
+  if (hd->version < 2) {
+    for (i = 0; i < 6; i++) {
+      FREAD64CNT(hd->affine_geo_transform[i], cnt, file->fp);
+    }
+  }
+  else if (hd->version >= 2) {
+    for (i = 0; i < 6; i++) {
+      FREAD64DOUBLE64CNT(hd->affine_geo_transform[i], cnt, file);
+    }
+  }
+  if (hd->version >= 4) {
+    FREAD64INT64CNT(file->meta_data_location, cnt, file);
+    FREAD64INT64CNT(file->meta_data_bytes, cnt, file);
+  }
+  return 1;
+}
+
+/**
+ * Writes tile headers for the file passed.
+ *
+ * @param           file The file pointer corresponding to the file
+ *                       to write the header.
+ */
+
+static int             _sif_write_tile_headers(sif_file *file) {
+  long i = 0;
+  long long base = file->header_bytes;
+  sif_tile tile_view, *tile = 0;
+  sif_header *hd = file->header;
+  int encodings = _sif_has_slice_encodings(file);
+  FSEEK64(file->fp, base, SEEK_SET);
+  for (; i < hd->n_tiles; i++, base += hd->tile_header_bytes) {
+    tile = _sif_tile_view(file, i, &tile_view);
+    FWRITE64(tile->uniform_pixel_values, hd->data_unit_size, hd->bands, file->fp);
+    FWRITE64(tile->uniform_flags, 1, hd->n_uniform_flags, file->fp);
+    FWRITE64INT32(file->tiles.block_nums[i], file);
+    if (encodings) {
+      FWRITE64(tile->slice_encodings, 1, hd->bands, file->fp);
+      FWRITE64(tile->slice_gradients, hd->data_unit_size, hd->bands * 2, file->fp);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Reads tile headers for the file passed.
+ *
+ * @param           file The file pointer corresponding to the file
+ *                       to write the header.
+ */
+
+static int             _sif_read_tile_headers(sif_file *file) {
+  long i = 0, j = 1, block_num;
+  long long base = file->header_bytes;
+  sif_header *hd = file->header;
+  sif_tile tile_view, *tile = 0;
+  int encodings = _sif_has_slice_encodings(file);
+  FSEEK64(file->fp, base, SEEK_SET);
+  for (; i < hd->n_tiles; i++, base += hd->tile_header_bytes) {
+    tile = _sif_tile_view(file, i, &tile_view);
+    FREAD64(tile->uniform_pixel_values, hd->data_unit_size, hd->bands, file->fp);
+    FREAD64(tile->uniform_flags, 1, hd->n_uniform_flags, file->fp);
+    FREAD64INT32(block_num, file);
+    file->tiles.block_nums[i] = (int)block_num;
+    if (encodings) {
+      FREAD64(tile->slice_encodings, 1, hd->bands, file->fp);
+      FREAD64(tile->slice_gradients, hd->data_unit_size, hd->bands * 2, file->fp);
+    }
+  }
+  return j;
+}
+
+/**
+ * Writes out what the C library still buffers for a file about to be
+ * read with positional I/O, which would not see it. A file open for
+ * reading only has nothing to write, and nothing is buffered on Windows.
+ *
+ * @param file      The file.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
+
+static int               _sif_sync_for_positional_io(sif_file *file) {
+#ifndef WIN32
+  if (!file->read_only) {
+    SIF_ERROR_CHECK_RETURN(fflush(file->fp) != 0, SIF_ERROR_WRITE, 0);
+  }
+#endif
+  return 1;
+}
+
+/**
+ * Reads a run of bytes at an absolute offset. In concurrent read mode a
+ * positional read is used so the shared file position is neither used
+ * nor moved; otherwise the file position is set and read from.
+ *
+ * @param file      The file to read.
+ * @param buffer    The buffer to store the bytes.
+ * @param nbytes    The number of bytes to read.
+ * @param pos       The byte offset of the first byte.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
+
+static int               _sif_read_at(sif_file *file, void *buffer, long nbytes, LONGLONG pos) {
+#ifdef WIN32
+  OVERLAPPED ov;
+  DWORD bytes_read;
+  if (file->concurrent_reads) {
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)(pos & 0xFFFFFFFF);
+    ov.OffsetHigh = (DWORD)(pos >> 32);
+    return ReadFile(file->fp, buffer, (DWORD)nbytes, &bytes_read, &ov) != 0
+      && bytes_read == (DWORD)nbytes;
+  }
+#else
+  ssize_t n;
+  u_char *p = (u_char*)buffer;
+  if (file->concurrent_reads) {
+    while (nbytes > 0) {
+      n = pread(fileno(file->fp), p, nbytes, (off_t)pos);
+      if (n < 0 && errno == EINTR) {
+	continue;
+      }
+      if (n <= 0) {
+	return 0;
+      }
+      p += n;
+      pos += n;
+      nbytes -= n;
+    }
+    return 1;
+  }
+#endif
+  if (FSEEK64NEC(file->fp, pos, SEEK_SET) != 0) {
+    return 0;
+  }
+  return FREAD64NEC(buffer, 1, nbytes, file->fp) == (size_t)nbytes;
+}
+
+/**
+ * Writes bytes at a given offset of a file. In concurrent write mode the
+ * bytes are written with positional I/O, which leaves the shared file
+ * position alone; otherwise the file position is moved.
+ *
+ * @param file      The file to write.
+ * @param buffer    The bytes to write.
+ * @param nbytes    The number of bytes to write.
+ * @param pos       The byte offset of the first byte.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
+
+static int               _sif_write_at(sif_file *file, const void *buffer, long nbytes, LONGLONG pos) {
+#ifdef WIN32
+  OVERLAPPED ov;
+  DWORD bytes_written;
+  if (file->concurrent_writes) {
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)(pos & 0xFFFFFFFF);
+    ov.OffsetHigh = (DWORD)(pos >> 32);
+    return WriteFile(file->fp, buffer, (DWORD)nbytes, &bytes_written, &ov) != 0
+      && bytes_written == (DWORD)nbytes;
+  }
+#else
+  ssize_t n;
+  const u_char *p = (const u_char*)buffer;
+  if (file->concurrent_writes) {
+    while (nbytes > 0) {
+      n = pwrite(fileno(file->fp), p, nbytes, (off_t)pos);
+      if (n < 0 && errno == EINTR) {
+	continue;
+      }
+      if (n <= 0) {
+	return 0;
+      }
+      p += n;
+      pos += n;
+      nbytes -= n;
+    }
+    return 1;
+  }
+#endif
+  if (FSEEK64NEC(file->fp, pos, SEEK_SET) != 0) {
+    return 0;
+  }
+  return FWRITE64NEC((void*)buffer, 1, nbytes, file->fp) == (size_t)nbytes;
+}
+
+/**
+ * Stores a tile header in the layout it has on disk.
+ *
+ * @param file      The file.
+ * @param tile_num  The tile.
+ * @param rec       A buffer of tile_header_bytes bytes.
+ *
+ * @return          The number of bytes stored.
+ */
+
+static long              _sif_pack_tile_header(const sif_file *file, long tile_num, u_char *rec) {
+  const sif_header *hd = file->header;
+  sif_tile tile_view, *tile = _sif_tile_view(file, tile_num, &tile_view);
+  u_char *p = rec;
+  memcpy(p, tile->uniform_pixel_values, hd->data_unit_size * hd->bands);
+  p += hd->data_unit_size * hd->bands;
+  memcpy(p, tile->uniform_flags, hd->n_uniform_flags);
+  p += hd->n_uniform_flags;
+  _sif_int32_to_packed_bytes(file->tiles.block_nums[tile_num], p);
+  p += 4;
+  if (_sif_has_slice_encodings(file)) {
+    memcpy(p, tile->slice_encodings, hd->bands);
+    p += hd->bands;
+    memcpy(p, tile->slice_gradients, hd->data_unit_size * hd->bands * 2);
+    p += hd->data_unit_size * hd->bands * 2;
+  }
+  return (long)(p - rec);
+}
+
+/**
+ * Loads a tile header from its layout on disk into the tile directory.
+ * The inverse of _sif_pack_tile_header.
+ *
+ * @param file      The file.
+ * @param tile_num  The tile.
+ * @param rec       The stored tile header.
+ */
+
+static void              _sif_unpack_tile_header(sif_file *file, long tile_num, const u_char *rec) {
+  const sif_header *hd = file->header;
+  sif_tile tile_view, *tile = _sif_tile_view(file, tile_num, &tile_view);
+  const u_char *p = rec;
+  memcpy(tile->uniform_pixel_values, p, hd->data_unit_size * hd->bands);
+  p += hd->data_unit_size * hd->bands;
+  memcpy(tile->uniform_flags, p, hd->n_uniform_flags);
+  p += hd->n_uniform_flags;
+  file->tiles.block_nums[tile_num] = (int)_sif_packed_bytes_to_int32(p);
+  p += 4;
+  if (_sif_has_slice_encodings(file)) {
+    memcpy(tile->slice_encodings, p, hd->bands);
+    p += hd->bands;
+    memcpy(tile->slice_gradients, p, hd->data_unit_size * hd->bands * 2);
+  }
+}
+
+/**
+ * Writes a specific tile header for the file passed.
+ *
+ * @param           file     The file pointer corresponding to the file
+ *                           to write the header.
+ * @param           tile_num The number of the tile to write.
+ */
+
+static int               _sif_write_tile_header(sif_file *file, long tile_num) {
+  LONGLONG loc;
+  sif_header *hd = file->header;
+  sif_tile tile_view, *tile = _sif_tile_view(file, tile_num, &tile_view);
+  u_char stack_rec[SIF_TILE_HEADER_STACK_BYTES], *rec;
+  int ok;
+  assert(file);
+  assert(tile_num >= 0L);
+  assert(tile_num < file->header->n_tiles);
+  /** In theory, our tile header block would never be longer than the size of a long long.*/
+  loc = (LONGLONG)(file->header_bytes + tile_num * file->header->tile_header_bytes);
+  /** The tile is changing, so its cached slices are stale. */
+  _sif_cache_invalidate(file, tile_num);
+  /** Concurrent writers share the file position, so the header is put
+      together in memory and written with a single positional write. */
+  if (file->concurrent_writes) {
+    rec = hd->tile_header_bytes <= SIF_TILE_HEADER_STACK_BYTES ? stack_rec : (u_char*)malloc(hd->tile_header_bytes);
+    SIF_ERROR_CHECK_RETURN(rec == 0, SIF_ERROR_MEM, 0);
+    ok = _sif_write_at(file, rec, _sif_pack_tile_header(file, tile_num, rec), loc);
+    if (rec != stack_rec) {
+      free(rec);
+    }
+    SIF_ERROR_CHECK_RETURN(ok == 0, SIF_ERROR_WRITE, 0);
+    return 1;
+  }
+  /** Set the location.*/
+  FSEEK64(file->fp, loc, SEEK_SET);
+  /** Write to the file. */
+  FWRITE64(tile->uniform_pixel_values, hd->data_unit_size, hd->bands, file->fp);
+  FWRITE64(tile->uniform_flags, 1, hd->n_uniform_flags, file->fp);
+  FWRITE64INT32(file->tiles.block_nums[tile_num], file);
+  if (_sif_has_slice_encodings(file)) {
+    FWRITE64(tile->slice_encodings, 1, hd->bands, file->fp);
+    FWRITE64(tile->slice_gradients, hd->data_unit_size, hd->bands * 2, file->fp);
+  }
+  return 1;
+}
+
+/**
+ * Retrieves a meta-data pair by its key so that its value may be inspected
+ * or modified. Returns 0 if the meta-data pair corresponding to the key
+ * could not be found.
+ *
+ * @param file     The file on which to perform the operation.
+ * @param key      The key of the meta-data pair to retrieve.
+ *
+ * @return A pointer to the meta-data pair, 0 if not found.
+ */
+
+sif_meta_data*   _sif_get_meta_data_pair(sif_file *file, const char *key) {
+  long i;
+  SIF_CHECK_FILE(file);
+  _sif_load_meta_data(file);
+  i = _sif_meta_data_find(file, key, _sif_hash((const unsigned char*)key));
+  return i < 0 ? 0 : file->meta_data.slots[i];
+}
+
+/**
+ * Unlink a meta-data pair by its key. The function removes it from the
+ * table and from the list of pairs but does not delocate the pair or its
+ * key and value fields. Returns the pair unlinked.
+ *
+ * The pairs that followed it in its probe sequence are moved back, so
+ * that the table needs no markers for removed pairs. The next and prev
+ * fields of the meta-data pair unlinked are set to NULL for safety.
+ *
+ * @param     file       The file on which to perform the operation.
+ * @param     key        The key of the meta-data pair to remove.
+ *
+ * @return The unlinked meta-data pair.
+ */
+sif_meta_data           *_sif_unlink_meta_data_pair(sif_file *file, const char *key) {
+  sif_meta_data_table *t = &file->meta_data;
+  sif_meta_data *result = 0;
+  unsigned long i, j, k, mask;
+  long found;
+  SIF_CHECK_FILE(file);
+  _sif_load_meta_data(file);
+  found = _sif_meta_data_find(file, key, _sif_hash((const unsigned char*)key));
+  if (found < 0) {
+    return 0;
+  }
+  result = t->slots[found];
+  mask = t->n_slots - 1;
+  /** Move each pair after the hole back into it unless its home slot
+      lies cyclically between the hole and the pair. */
+  for (i = (unsigned long)found, j = (i + 1) & mask; t->slots[j] != 0; j = (j + 1) & mask) {
+    k = _sif_meta_data_home(t->hashes[j], t->n_slots);
+    if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+      t->slots[i] = t->slots[j];
+      t->hashes[i] = t->hashes[j];
+      i = j;
+    }
+  }
+  t->slots[i] = 0;
+  if (result->prev != 0) {
+    result->prev->next = result->next;
+  }
+  else {
+    t->first = result->next;
+  }
+  if (result->next != 0) {
+    result->next->prev = result->prev;
+  }
+  else {
+    t->last = result->prev;
+  }
+  result->next = 0;
+  result->prev = 0;
+  return result;
+}
+
+/**
+ * Adds a meta-data pair whose key is not in the table yet, at the end of
+ * the list of pairs.
+ *
+ * @param     file       The file on which to perform the operation.
+ * @param     hash       The hash of the pair's key.
+ * @param     to_insert  The pair to add.
+ *
+ * @return 1 if successful, 0 if the table could not grow.
+ */
+static int             _sif_insert_meta_data_pair(sif_file *file, unsigned long hash, sif_meta_data *to_insert) {
+  sif_meta_data_table *t = &file->meta_data;
+  unsigned long i;
+  if (!_sif_meta_data_reserve(file, file->header->n_keys + 1)) {
+    return 0;
+  }
+  for (i = _sif_meta_data_home(hash, t->n_slots); t->slots[i] != 0; i = (i + 1) & (t->n_slots - 1)) {
+  }
+  t->slots[i] = to_insert;
+  t->hashes[i] = hash;
+  to_insert->next = 0;
+  to_insert->prev = t->last;
+  if (t->last != 0) {
+    t->last->next = to_insert;
+  }
+  else {
+    t->first = to_insert;
+  }
+  t->last = to_insert;
+  (file->header->n_keys)++;
+  return 1;
+}
+
+const int        _sif_null_terminator_check(const char *v, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (v[i] == 0x00) { return 1; }
+  }
+  return 0;
+}
+
+
+/**
+ * Returns the value of a meta-data pair, reading it first if it is stored
+ * out of line and has not been read yet. Threads in concurrent read mode
+ * may read it at once; the first copy published is kept, in a block of
+ * the meta-data arena, and the others are freed.
+ *
+ * @param file     The file containing the pair.
+ * @param md       The pair.
+ *
+ * @return The value, or 0 if it could not be read.
+ */
+
+static char*            _sif_get_meta_data_value(sif_file *file, sif_meta_data *md) {
+  _sif_arena_block *b = 0;
+  void *head = 0;
+  char *v = 0, *held = 0;
+  if (md->value_location < 0) {
+    return md->value;
+  }
+  if ((v = (char*)SIF_ATOMIC_CAS_PTR(&md->value, (char*)0, (char*)0)) != 0) {
+    return v;
+  }
+  b = (_sif_arena_block*)malloc(SIF_ARENA_ALIGN(sizeof(_sif_arena_block)) + md->value_length);
+  SIF_ERROR_CHECK_RETURN(b == 0, SIF_ERROR_MEM, 0);
+  b->size = md->value_length;
+  b->used = md->value_length;
+  v = (char*)b + SIF_ARENA_ALIGN(sizeof(_sif_arena_block));
+  if (!_sif_read_at(file, v, (long)md->value_length, md->value_location)) {
+    free(b);
+    SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_READ, 0);
+  }
+  if ((held = (char*)SIF_ATOMIC_CAS_PTR(&md->value, (char*)0, v)) != 0) {
+    free(b);
+    return held;
+  }
+  /** The block is full, so later pairs are allocated from a new one. */
+  do {
+    head = SIF_ATOMIC_CAS_PTR(&file->meta_data_arena, (void*)0, (void*)0);
+    b->next = (_sif_arena_block*)head;
+  } while (SIF_ATOMIC_CAS_PTR(&file->meta_data_arena, head, (void*)b) != head);
+  return v;
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+const void*      sif_get_meta_data_binary(sif_file *file, const char *key, int *n_bytes) {
+  const void *retval = 0; /** By default, null is returned (not found).*/
+  sif_meta_data *q = 0;
+  SIF_CHECK_FILE(file);
+  q = _sif_get_meta_data_pair(file, key);
+  if (q == 0) {
+    file->error = SIF_ERROR_META_DATA_KEY;
+    *n_bytes = 0;
+  }
+  else {
+    *n_bytes = q->value_length;
+    retval = _sif_get_meta_data_value(file, q);
+  }
+  return retval;
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+int              sif_get_meta_data_length(sif_file *file, const char *key) {
+  sif_meta_data *q = 0;
+  SIF_CHECK_FILE(file);
+  q = _sif_get_meta_data_pair(file, key);
+  if (q == 0) {
+    file->error = SIF_ERROR_META_DATA_KEY;
+    return -1;
+  }
+  return (int)q->value_length;
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+long             sif_read_meta_data_binary(sif_file *file, const char *key, void *buffer, long offset, long n_bytes) {
+  sif_meta_data *q = 0;
+  const char *v = 0;
+  SIF_CHECK_FILE(file);
+  q = _sif_get_meta_data_pair(file, key);
+  if (q == 0) {
+    file->error = SIF_ERROR_META_DATA_KEY;
+    return -1;
+  }
+  if (offset < 0 || n_bytes <= 0 || (unsigned long)offset >= q->value_length) {
+    return 0;
+  }
+  n_bytes = (long)MIN((unsigned long)n_bytes, q->value_length - offset);
+  /** A value stored out of line is read from the file unless a copy of
+      it has been read already. */
+  v = q->value_location < 0 ? q->value : (const char*)SIF_ATOMIC_CAS_PTR(&q->value, (char*)0, (char*)0);
+  if (v != 0) {
+    memcpy(buffer, v + offset, n_bytes);
+  }
+  else if (!_sif_read_at(file, buffer, n_bytes, q->value_location + offset)) {
+    SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_READ, -1);
+  }
+  return n_bytes;
+}
+
+
+/* See sif-io.h for detailed documentation of public functions. */
+const char       *sif_get_meta_data(sif_file *file, const char *key) {
+  const char *retval = 0; /** By default, null is returned (not found).*/
+  sif_meta_data *q = 0;
+  SIF_CHECK_FILE(file);
+  q = _sif_get_meta_data_pair(file, key);
+  if (q == 0) {
+    file->error = SIF_ERROR_META_DATA_KEY;
+    retval = 0;
+  }
+  else {
+    retval = _sif_get_meta_data_value(file, q);
+    if (retval != 0 && !_sif_null_terminator_check(retval, q->value_length)) {
+      file->error = SIF_ERROR_META_DATA_VALUE;
+    }
+  }
+  return retval;
+}
+
+/**
+ * Puts a meta-data pair on the list of pairs whose records are written,
+ * or, once the pair has been removed, freed, on the next flush.
+ *
+ * @param file      The file.
+ * @param pair      The pair.
+ * @param dirty     1 to write the record, 2 to free it.
+ */
+
+static void             _sif_mark_meta_data_pair(sif_file *file, sif_meta_data *pair, int dirty) {
+  if (pair->dirty == 0) {
+    pair->next_dirty = file->meta_data.dirty;
+    file->meta_data.dirty = pair;
+  }
+  pair->dirty = dirty;
+}
+
+/**
+ * Sets a meta-data field with a given key to a value. The
+ * length of the value is specified, thereby allowing for
+ * binary, non-null-terminated, meta-data.
+ *
+ * @param file      The file to set the meta-data.
+ * @param key       The key of the field to set.
+ * @param value     The value for which to set the field.
+ * @param value_len The length of the value.
+ */
+
+static void             _sif_set_meta_data_len(sif_file *file, const char *key, const char *value, int value_len) {
+  size_t key_len;       /** We need room for the null terminator. */
+  sif_meta_data *i = 0;
+  unsigned long hash;
+  long slot;
+  LONGLONG pos;
+  int out_of_line;
+  char *p;
+
+  assert(file);
+  _sif_load_meta_data(file);
+  /** Large values of a file with a meta-data extent are written to the
+      file from the caller's buffer, out of line, and not kept in memory.
+      In shared access mode, every value is kept with its key. */
+  out_of_line = value_len >= SIF_META_DATA_OUT_OF_LINE_BYTES && file->use_file_version >= 4
+    && !file->read_only && !file->shared;
+  hash = _sif_hash((const unsigned char*)key);
+  slot = _sif_meta_data_find(file, key, hash);
+  i = slot < 0 ? 0 : file->meta_data.slots[slot];
+  if (i == 0) {
+    /** The pair, its key, and its value are allocated together. */
+    key_len = strlen(key) + 1;
+    i = (sif_meta_data*)_sif_arena_alloc(file, sizeof(sif_meta_data) + key_len + (out_of_line ? 0 : value_len));
+    if (i == 0) {
+      return;
+    }
+    i->key = (char*)(i + 1);
+    i->value = i->key + key_len;
+    i->key_length = key_len;
+    i->value_length = 0;
+    i->value_capacity = out_of_line ? 0 : value_len;
+    i->value_location = -1;
+    i->location = -1;
+    i->record_bytes = 0;
+    i->dirty = 0;
+    memcpy(i->key, key, sizeof(char) * key_len);
+    if (!_sif_insert_meta_data_pair(file, hash, i)) {
+      return;
+    }
+  }
+  if (out_of_line) {
+    /** A value is written over the one it replaces if it fits there. */
+    pos = i->value_location >= 0 && (unsigned long)value_len <= i->value_capacity
+      ? i->value_location : _sif_get_free_value_location(file);
+    SIF_ERROR_CHECK_RETURN_V(!_sif_write_at(file, value, value_len, pos), SIF_ERROR_WRITE);
+    if (pos != i->value_location) {
+      i->value_location = pos;
+      i->value_capacity = value_len;
+    }
+    i->value = 0;
+    _sif_note_meta_data_value(file, pos, value_len);
+  }
+  else {
+    if ((unsigned long)value_len > i->value_capacity || i->value_location >= 0) {
+      /** The old value stays in the arena until it is compacted, so
+          the new one is given room to grow. */
+      if ((p = (char*)_sif_arena_alloc(file, 2 * (size_t)value_len)) == 0) {
+        return;
+      }
+      i->value = p;
+      i->value_capacity = 2 * value_len;
+      i->value_location = -1;
+    }
+    memmove(i->value, value, sizeof(char) * value_len);
+  }
+  i->value_length = value_len;
+  _sif_mark_meta_data_pair(file, i, 1);
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+void             sif_set_meta_data(sif_file *file, const char *key, const char *value) {
+  SIF_CHECK_FILE_V(file);
+  _sif_set_meta_data_len(file, key, value, strlen(value) + 1);
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+void             sif_set_meta_data_binary(sif_file *file, const char *key, const void *buffer, int n_bytes) {
+  SIF_CHECK_FILE_V(file);
+  _sif_set_meta_data_len(file, key, (const char*)buffer, n_bytes);
+}
+
+/**
+ * Return the last used block index in the file.
+ *
+ * @param file The file to compute the last used block index.
+ *
+ * @return The last used block index. -1 is returned
+ *         if no blocks are in use.
+ */
+
+static long         _sif_get_last_used_block_index(sif_file *file) {
+  long i = 0;
+  long last_known_used_block = -1;
+  for (; i < file->header->n_tiles; i++) {
+    if (file->blocks_to_tiles[i] != -1) {
+      last_known_used_block = i;
+    }
+  }
+  return last_known_used_block;
+}
+
+/**
+ * Truncate the file at a particular position.
+ *
+ * @param file   The file to truncate.
+ * @param pos    The position of truncation.
+ */
+
+static void             _sif_truncate(sif_file *file, LONGLONG pos) {
+#ifdef WIN32
+  FSEEK64V(file->fp, pos, SEEK_SET);
+  SIF_ERROR_CHECK_RETURN_V(SetEndOfFile(file->fp) == 0, SIF_ERROR_TRUNCATE)
+#else
+  SIF_ERROR_CHECK_RETURN_V(ftruncate(fileno(file->fp), pos) != 0, SIF_ERROR_TRUNCATE);
+#endif
+}
+
+/**
+ * Returns the size of a file in bytes.
+ *
+ * @param file   The file.
+ *
+ * @return       The size of the file.
+ */
+
+static LONGLONG         _sif_get_file_size(sif_file *file) {
+#ifdef WIN32
+  return _sif_fseek_win(file->fp, 0, FILE_END);
+#else
+  return lseek(fileno(file->fp), 0, SEEK_END);
+#endif
+}
+
+/**
+ * Records where the meta-data section of a file starts, one block after
+ * the last block in use, and how many bytes it takes, up to the end of
+ * the file. Must be called once the block map is known and before any
+ * block is allocated or released, as either changes the last block in
+ * use while the section stays where it is until it is written again.
+ * The meta-data extent of a file of format version 4 or higher is where
+ * the file header says, so nothing is done for those.
+ *
+ * @param file   The file.
+ */
+
+static void             _sif_locate_meta_data(sif_file *file) {
+  LONGLONG size;
+  if (file->header->version >= 4) {
+    return;
+  }
+  file->meta_data_location = _sif_get_block_location(file, _sif_get_last_used_block_index(file) + 1);
+  size = _sif_get_file_size(file);
+  file->meta_data_bytes = size > file->meta_data_location ? size - file->meta_data_location : 0;
+}
+
+/**
+ * Read the meta-data from the disk, storing the contents in
+ * the file structure for easy access. The meta-data is read from where
+ * _sif_locate_meta_data found it, with a single read into one block of
+ * the file's meta-data arena, sized for it and for the pairs, and the
+ * keys and values are used where they lie.
+ *
+ * In files of format version 4 and higher, each pair remembers where its
+ * record lies in the extent, and the records freed are counted. Values
+ * stored out of line are left in the file, and the range holding them is
+ * noted.
+ *
+ * @param file   The file to read the meta data.
+ *
+ * @return       1 if successful, 0 otherwise, in which case the
+ *               meta-data is left empty.
+ */
+static int              _sif_read_meta_data(sif_file *file) {
+  sif_header *header = 0;
+  sif_meta_data *md = 0;
+  u_char *p = 0, *start = 0, *end = 0;
+  unsigned long key_len = 0, value_len = 0, room = 0;
+  long nbytes, flags = 0;
+  int i, n_keys, extent;
+  header = file->header;
+
+  n_keys = header->n_keys;
+  header->n_keys = 0;
+  extent = header->version >= 4;
+  if (n_keys <= 0) {
+    file->meta_data_free_bytes = file->meta_data_bytes;
+    if (!extent) {
+      file->meta_data_location = -1;
+    }
+    return 1;
+  }
+  nbytes = (long)file->meta_data_bytes;
+
+  /** The meta-data is left empty, not half read, upon an error. */
+  if (!_sif_meta_data_reserve(file, n_keys)
+      || !_sif_arena_reserve(file, SIF_ARENA_ALIGN(nbytes) + SIF_ARENA_ALIGN(sizeof(sif_meta_data)) * n_keys)) {
+    _sif_free_meta_data(file);
+    return 0;
+  }
+  start = p = (u_char*)_sif_arena_alloc(file, nbytes);
+  if (!_sif_read_at(file, p, nbytes, file->meta_data_location)) {
+    _sif_free_meta_data(file);
+    SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_READ, 0);
+  }
+  end = p + nbytes;
+  for (i = 0; extent ? p < end : i < n_keys; ) {
+    if (extent) {
+      /** Each record is its room, a key length, a value length, flags,
+          and the room for the key and the value, or the location of a
+          value stored out of line; a freed record has a key length of
+          zero. One that runs past the end of the extent, or has flags
+          this library does not know, is an error. */
+      if (end - p < SIF_META_DATA_RECORD_BYTES
+          || (room = (unsigned long)_sif_packed_bytes_to_int32(p)) > (unsigned long)(end - p - SIF_META_DATA_RECORD_BYTES)) {
+        _sif_free_meta_data(file);
+        SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_READ, 0);
+      }
+      key_len = (unsigned long)_sif_packed_bytes_to_int32(p + 4);
+      value_len = (unsigned long)_sif_packed_bytes_to_int32(p + 8);
+      flags = _sif_packed_bytes_to_int32(p + 12);
+      if (key_len == 0) {
+        file->meta_data_free_bytes += SIF_META_DATA_RECORD_BYTES + room;
+        p += SIF_META_DATA_RECORD_BYTES + room;
+        continue;
+      }
+      if (key_len > room || ((flags & SIF_META_DATA_OUT_OF_LINE) ? 8 : value_len) > room - key_len
+          || (flags & ~SIF_META_DATA_OUT_OF_LINE) != 0) {
+        _sif_free_meta_data(file);
+        SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_READ, 0);
+      }
+      md = (sif_meta_data*)_sif_arena_alloc(file, sizeof(sif_meta_data));
+      md->key = (char*)p + SIF_META_DATA_RECORD_BYTES;
+      md->value = md->key + key_len;
+      md->value_capacity = room - key_len;
+      md->value_location = -1;
+      if (flags & SIF_META_DATA_OUT_OF_LINE) {
+        md->value_location = _sif_packed_bytes_to_int64((const u_char*)md->value);
+        md->value = 0;
+        md->value_capacity = value_len;
+        _sif_note_meta_data_value(file, md->value_location, value_len);
+      }
+      md->location = file->meta_data_location + (p - start);
+      md->record_bytes = room;
+      p += SIF_META_DATA_RECORD_BYTES + room;
+    }
+    else {
+      md = (sif_meta_data*)_sif_arena_alloc(file, sizeof(sif_meta_data));
+      /** Each pair is a key length, a null-terminated key, a value length,
+          and a value; one that runs past the end of the file is an error. */
+      if (end - p < 4 || (key_len = (unsigned long)_sif_packed_bytes_to_int32(p)) == 0
+          || key_len > (unsigned long)(end - p - 4)) {
+        _sif_free_meta_data(file);
+        SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_READ, 0);
+      }
+      md->key = (char*)p + 4;
+      p += 4 + key_len;
+      if (end - p < 4 || (value_len = (unsigned long)_sif_packed_bytes_to_int32(p)) > (unsigned long)(end - p - 4)) {
+        _sif_free_meta_data(file);
+        SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_READ, 0);
+      }
+      md->value = (char*)p + 4;
+      md->value_capacity = value_len;
+      md->value_location = -1;
+      md->location = -1;
+      md->record_bytes = 0;
+      p += 4 + value_len;
+    }
+    md->key[key_len - 1] = 0;
+    md->key_length = key_len;
+    md->value_length = value_len;
+    md->dirty = 0;
+    md->next_dirty = 0;
+    _sif_insert_meta_data_pair(file, _sif_hash((const unsigned char*)md->key), md);
+    i++;
+  }
+  /** Older versions have no extent to keep; the meta-data is written
+      whole wherever it goes next. */
+  if (!extent) {
+    file->meta_data_location = -1;
+  }
+  return 1;
+}
+
+/**
+ * Returns the number of bytes the value of a meta-data pair takes in its
+ * record: the value itself, or the location of a value stored out of line.
+ *
+ * @param md     The pair.
+ *
+ * @return       The number of bytes.
+ */
+
+static unsigned long   _sif_get_meta_data_stored_bytes(const sif_meta_data *md) {
+  return md->value_location >= 0 ? 8 : md->value_length;
+}
+
+/**
+ * Writes the record of a meta-data pair in the meta-data extent at the
+ * current position of the file.
+ *
+ * @param file   The file.
+ * @param md     The pair, whose record_bytes is set.
+ *
+ * @return       1 if successful, 0 otherwise.
+ */
+
+static int             _sif_write_meta_data_record(sif_file *file, const sif_meta_data *md) {
+  FWRITE64INT32(md->record_bytes, file);
+  FWRITE64INT32(md->key_length, file);
+  FWRITE64INT32(md->value_length, file);
+  FWRITE64INT32(md->value_location >= 0 ? SIF_META_DATA_OUT_OF_LINE : 0, file);
+  FWRITE64(md->key, md->key_length, 1, file->fp);
+  if (md->value_location >= 0) {
+    SIF_ERROR_CHECK_RETURN(_sif_write_int64(file, md->value_location) == 0, SIF_ERROR_WRITE, 0);
+  }
+  else if (md->value_length > 0) {
+    FWRITE64(md->value, md->value_length, 1, file->fp);
+  }
+  return 1;
+}
+
+/**
+ * Writes the meta-data extent of a file of format version 4 or higher
+ * whole at a location, with no room to spare in the records, and
+ * truncates the file after it. Nothing is left to write or free.
+ *
+ * @param file   The file.
+ * @param loc    Where the extent starts.
+ *
+ * @return       1 if successful, 0 otherwise.
+ */
+
+static int             _sif_write_meta_data_extent(sif_file *file, LONGLONG loc) {
+  LONGLONG end = loc;
+  sif_meta_data *i = 0, *next = 0;
+  FSEEK64(file->fp, loc, SEEK_SET);
+  /** The pairs are written in the order they were added. */
+  for (i = file->meta_data.first; i != 0; i = i->next) {
+    i->location = end;
+    i->record_bytes = i->key_length + _sif_get_meta_data_stored_bytes(i);
+    if (!_sif_write_meta_data_record(file, i)) {
+      return 0;
+    }
+    end += SIF_META_DATA_RECORD_BYTES + i->record_bytes;
+  }
+  for (i = file->meta_data.dirty; i != 0; i = next) {
+    next = i->next_dirty;
+    i->next_dirty = 0;
+    i->dirty = 0;
+  }
+  file->meta_data.dirty = 0;
+  file->meta_data_location = loc;
+  file->meta_data_bytes = end - loc;
+  file->meta_data_free_bytes = 0;
+  file->meta_data_displaced = 0;
+  if (loc >= file->meta_data_values_end) {
+    file->meta_data_limit = 0;
+  }
+  /** The values written after a compacted extent are kept. */
+  _sif_truncate(file, MAX(end, file->meta_data_values_end));
+  return file->error == 0;
+}
+
+/**
+ * Write the meta data from the file structure to the disk, all of it,
+ * right after the last block in use, or, in files of format version 4 and
+ * higher, after the values stored out of line if they follow the blocks.
+ *
+ * @param file        The file containing the meta-data structure to write.
+ */
+
+static int             _sif_write_meta_data(sif_file *file) {
+  sif_header *header = 0;
+  LONGLONG loc = 0, eofpos = 0;
+  sif_meta_data *i = 0;
+  header = file->header;
+  loc = _sif_get_block_location(file, _sif_get_last_used_block_index(file) + 1);
+  if (file->use_file_version >= 4) {
+    return _sif_write_meta_data_extent(file, MAX(loc, file->meta_data_values_end));
+  }
+  /** The blocks will run over it, so there is no extent to keep. */
+  file->meta_data_location = -1;
+  eofpos = loc;
+  FSEEK64(file->fp, loc, SEEK_SET);
+  /** The pairs are written in the order they were added. */
+  for (i = file->meta_data.first; i != 0; i = i->next) {
+    FWRITE64INT32(i->key_length, file); eofpos += 4;
+    FWRITE64(i->key, i->key_length, 1, file->fp); eofpos += i->key_length;
+    FWRITE64INT32(i->value_length, file); eofpos += 4;
+    FWRITE64(i->value, i->value_length, 1, file->fp); eofpos += i->value_length;
+  }
+  eofpos = eofpos + 1;
+  _sif_truncate(file, eofpos);
+  return 1;
+}
+
+/**
+ * Brings the meta-data on disk up to date. Files of format versions
+ * before 4 write it whole after the last block. Files of version 4 and
+ * higher rewrite only the records of the pairs changed or removed since
+ * it was last written: a record is rewritten in place while its pair
+ * still fits its room, and is freed otherwise, the pair being appended
+ * to the extent with room for its value to grow as far as it can in
+ * memory. The extent is written whole when it has not been written yet,
+ * when blocks have been allocated over it, in which case it is moved past
+ * them with room for an eighth more, when a record appended would run
+ * into a value stored out of line after it, in which case it is moved
+ * past the values, and when more than half of it is freed records.
+ *
+ * @param file   The file.
+ *
+ * @return       1 if successful, 0 otherwise.
+ */
+
+static int             _sif_flush_meta_data(sif_file *file) {
+  sif_meta_data *i = 0, *next = 0;
+  LONGLONG end;
+  long b;
+  int dirty;
+  if (file->use_file_version < 4) {
+    return _sif_write_meta_data(file);
+  }
+  if (file->meta_data_location < 0 || file->meta_data_displaced) {
+    b = _sif_get_last_used_block_index(file) + 1;
+    if (file->meta_data_displaced) {
+      b = MIN(b + b / SIF_META_DATA_HEADROOM_DIV, file->header->n_tiles);
+    }
+    return _sif_write_meta_data_extent(file, MAX(_sif_get_block_location(file, b), file->meta_data_values_end));
+  }
+  end = file->meta_data_location + file->meta_data_bytes;
+  for (i = file->meta_data.dirty; i != 0 && file->error == 0; i = next) {
+    next = i->next_dirty;
+    dirty = i->dirty;
+    i->next_dirty = 0;
+    i->dirty = 0;
+    file->meta_data.dirty = next;
+    if (i->location >= 0 && (dirty == 2 || i->key_length + _sif_get_meta_data_stored_bytes(i) > i->record_bytes)) {
+      /** A freed record keeps its room, so that readers step over it. */
+      FSEEK64(file->fp, i->location + 4, SEEK_SET);
+      FWRITE64INT32(0, file);
+      file->meta_data_free_bytes += SIF_META_DATA_RECORD_BYTES + i->record_bytes;
+      i->location = -1;
+    }
+    if (dirty == 2) {
+      continue;
+    }
+    if (i->location < 0) {
+      i->record_bytes = i->key_length + (i->value_location >= 0 ? 8 : i->value_capacity);
+      if (file->meta_data_limit > 0 && end + SIF_META_DATA_RECORD_BYTES + i->record_bytes > file->meta_data_limit) {
+        /** The extent ran out of room before a value written after it. */
+        return _sif_write_meta_data_extent(file, MAX(_sif_get_block_location(file, _sif_get_last_used_block_index(file) + 1),
+                                                     file->meta_data_values_end));
+      }
+      i->location = end;
+      end += SIF_META_DATA_RECORD_BYTES + i->record_bytes;
+    }
+    FSEEK64(file->fp, i->location, SEEK_SET);
+    _sif_write_meta_data_record(file, i);
+  }
+  file->meta_data_bytes = end - file->meta_data_location;
+  if (file->meta_data_free_bytes * 2 > file->meta_data_bytes) {
+    return _sif_write_meta_data_extent(file, file->meta_data_location);
+  }
+  /** The room of the last record appended may not have been written. */
+  _sif_truncate(file, MAX(end, file->meta_data_values_end));
+  return file->error == 0;
+}
+
+/**
+ * Returns where the next meta-data value stored out of line is written:
+ * past the blocks, with room for an eighth more so that the file can
+ * grow a while before the values have to move, and past the other
+ * values and the meta-data extent, with room for the extent to grow by
+ * an eighth before it has to move past the values.
+ *
+ * @param file   The file.
+ *
+ * @return       The location.
+ */
+
+static LONGLONG         _sif_get_free_value_location(sif_file *file) {
+  long b = _sif_get_last_used_block_index(file) + 1;
+  LONGLONG loc;
+  b = MIN(b + b / SIF_META_DATA_HEADROOM_DIV, file->header->n_tiles);
+  loc = MAX(_sif_get_block_location(file, b), file->meta_data_values_end);
+  if (file->meta_data_location >= 0) {
+    loc = MAX(loc, file->meta_data_location + file->meta_data_bytes
+              + file->meta_data_bytes / SIF_META_DATA_HEADROOM_DIV);
+  }
+  return loc;
+}
+
+/**
+ * Adds a meta-data value stored out of line to the range of the file
+ * holding the values, and stops the meta-data extent from growing into
+ * it if it lies after the extent.
+ *
+ * @param file   The file.
+ * @param loc    The location of the value.
+ * @param len    The length of the value.
+ */
+
+static void             _sif_note_meta_data_value(sif_file *file, LONGLONG loc, unsigned long len) {
+  if (file->meta_data_values_start == file->meta_data_values_end) {
+    file->meta_data_values_start = loc;
+    file->meta_data_values_end = loc;
+  }
+  file->meta_data_values_start = MIN(file->meta_data_values_start, loc);
+  file->meta_data_values_end = MAX(file->meta_data_values_end, loc + (LONGLONG)len);
+  if (file->meta_data_location >= 0 && loc >= file->meta_data_location
+      && (file->meta_data_limit == 0 || loc < file->meta_data_limit)) {
+    file->meta_data_limit = loc;
+  }
+}
+
+/**
+ * Copies the value of a meta-data pair stored out of line to another
+ * location of the file, a chunk at a time. The pair's record is left for
+ * the caller to mark. A copy to a lower location may overlap the value.
+ *
+ * @param file   The file.
+ * @param md     The pair.
+ * @param loc    The new location of the value.
+ * @param buf    A buffer of SIF_META_DATA_COPY_BYTES bytes.
+ *
+ * @return       1 if successful, 0 otherwise.
+ */
+
+static int              _sif_move_meta_data_value(sif_file *file, sif_meta_data *md, LONGLONG loc, u_char *buf) {
+  unsigned long k;
+  long n;
+  for (k = 0; k < md->value_length; k += n) {
+    n = (long)MIN(md->value_length - k, (unsigned long)SIF_META_DATA_COPY_BYTES);
+    SIF_ERROR_CHECK_RETURN(!_sif_read_at(file, buf, n, md->value_location + k), SIF_ERROR_READ, 0);
+    SIF_ERROR_CHECK_RETURN(!_sif_write_at(file, buf, n, loc + k), SIF_ERROR_WRITE, 0);
+  }
+  md->value_location = loc;
+  md->value_capacity = md->value_length;
+  return 1;
+}
+
+/**
+ * Moves the meta-data values stored out of line that lie before a
+ * location, before a block is allocated over them, and notes the range
+ * the values are left in. They are moved past the other values, their
+ * own old copies included so that no copy overlaps what it copies, and
+ * past the meta-data extent, with room for the blocks to grow by an
+ * eighth, or by as many bytes as the values moved if that is more, so
+ * that copying them costs no more than writing the blocks that take
+ * their place.
+ *
+ * @param file   The file, or a per-call copy of it, which does the I/O.
+ * @param owner  The file itself, whose meta-data is changed.
+ * @param before The end of the block to allocate.
+ *
+ * @return       1 if successful, 0 otherwise.
+ */
+
+static int              _sif_move_meta_data_values(sif_file *file, sif_file *owner, LONGLONG before) {
+  sif_meta_data *i = 0;
+  LONGLONG loc = owner->meta_data_values_end, moved = 0;
+  long b;
+  u_char *buf = 0;
+  /** A displaced extent is written elsewhere anyway. */
+  if (owner->meta_data_location >= 0 && !owner->meta_data_displaced) {
+    loc = MAX(loc, owner->meta_data_location + owner->meta_data_bytes
+              + owner->meta_data_bytes / SIF_META_DATA_HEADROOM_DIV);
+  }
+  for (i = owner->meta_data.first; i != 0; i = i->next) {
+    if (i->value_location >= 0 && i->value_location < before) {
+      moved += i->value_length;
+    }
+  }
+  b = _sif_get_last_used_block_index(owner) + 1;
+  b = (long)MIN(b + MAX(b / SIF_META_DATA_HEADROOM_DIV, (moved + owner->header->tile_bytes - 1) / owner->header->tile_bytes),
+                (LONGLONG)owner->header->n_tiles);
+  loc = MAX(loc, _sif_get_block_location(owner, b));
+  buf = (u_char*)malloc(SIF_META_DATA_COPY_BYTES);
+  SIF_ERROR_CHECK_RETURN(buf == 0, SIF_ERROR_MEM, 0);
+  owner->meta_data_values_start = 0;
+  owner->meta_data_values_end = 0;
+  owner->meta_data_limit = 0;
+  for (i = owner->meta_data.first; i != 0; i = i->next) {
+    if (i->value_location < 0) {
+      continue;
+    }
+    if (i->value_location < before) {
+      if (!_sif_move_meta_data_value(file, i, loc, buf)) {
+        free(buf);
+        return 0;
+      }
+      _sif_mark_meta_data_pair(owner, i, 1);
+      loc += i->value_length;
+    }
+    _sif_note_meta_data_value(owner, i->value_location, i->value_length);
+  }
+  free(buf);
+  return 1;
+}
+
+/**
+ * Copies the meta-data section as it lies in the file to a higher
+ * location, a chunk at a time from its end so that the copy may overlap
+ * it. Used in shared access mode, where the section holds the pairs of
+ * other processes as well, so it is moved as it is rather than written
+ * again from memory.
+ *
+ * @param file   The file, or a per-call copy of it.
+ * @param from   Where the section starts.
+ * @param nbytes The number of bytes it takes.
+ * @param to     Where it is copied to.
+ *
+ * @return       1 if successful, 0 otherwise.
+ */
+
+static int              _sif_move_meta_data_section(sif_file *file, LONGLONG from, LONGLONG nbytes, LONGLONG to) {
+  u_char *buf = 0;
+  LONGLONG k = nbytes;
+  long n;
+  if (nbytes <= 0 || from == to) {
+    return 1;
+  }
+  buf = (u_char*)malloc(SIF_META_DATA_COPY_BYTES);
+  SIF_ERROR_CHECK_RETURN(buf == 0, SIF_ERROR_MEM, 0);
+  for (; k > 0; k -= n) {
+    n = (long)MIN(k, (LONGLONG)SIF_META_DATA_COPY_BYTES);
+    if (!_sif_read_at(file, buf, n, from + k - n)) {
+      free(buf);
+      SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_READ, 0);
+    }
+    if (!_sif_write_at(file, buf, n, to + k - n)) {
+      free(buf);
+      SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_WRITE, 0);
+    }
+  }
+  free(buf);
+  return 1;
+}
+
+/**
+ * Compares two meta-data pairs by the location of their values. Used to
+ * sort the values stored out of line with qsort.
+ */
+
+static int              _sif_compare_value_locations(const void *a, const void *b) {
+  LONGLONG la = (*(sif_meta_data* const*)a)->value_location;
+  LONGLONG lb = (*(sif_meta_data* const*)b)->value_location;
+  return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+/**
+ * Moves the meta-data values stored out of line down, in the order they
+ * lie in the file, so that they follow the last block in use without
+ * gaps. The room of values replaced or removed is reclaimed this way.
+ *
+ * @param file   The file.
+ *
+ * @return       1 if successful, 0 otherwise.
+ */
+
+static int              _sif_pack_meta_data_values(sif_file *file) {
+  sif_meta_data *i = 0, **values = 0;
+  LONGLONG loc;
+  u_char *buf = 0;
+  long n = 0, j;
+  int ok = 1;
+  if (file->meta_data_values_start == file->meta_data_values_end) {
+    return 1;
+  }
+  values = (sif_meta_data**)malloc(sizeof(sif_meta_data*) * MAX(file->header->n_keys, 1));
+  buf = (u_char*)malloc(SIF_META_DATA_COPY_BYTES);
+  if (values == 0 || buf == 0) {
+    free(values);
+    free(buf);
+    SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_MEM, 0);
+  }
+  for (i = file->meta_data.first; i != 0; i = i->next) {
+    if (i->value_location >= 0) {
+      values[n++] = i;
+    }
+  }
+  qsort(values, n, sizeof(sif_meta_data*), _sif_compare_value_locations);
+  /** Each value moves down over the room left before it, so a value is
+      read before anything is written over it. */
+  loc = _sif_get_block_location(file, _sif_get_last_used_block_index(file) + 1);
+  file->meta_data_values_start = loc;
+  for (j = 0; j < n && ok; j++) {
+    if (values[j]->value_location != loc) {
+      ok = _sif_move_meta_data_value(file, values[j], loc, buf);
+      _sif_mark_meta_data_pair(file, values[j], 1);
+    }
+    loc += values[j]->value_length;
+  }
+  file->meta_data_values_end = loc;
+  /** The extent is written after them. */
+  file->meta_data_limit = 0;
+  free(values);
+  free(buf);
+  return ok;
+}
+
+/**
+ * Reads the meta-data values stored out of line into memory, so that
+ * they are stored with their keys from then on. Used before the
+ * meta-data is written in a version without an extent, or by several
+ * processes.
+ *
+ * @param file   The file.
+ *
+ * @return       1 if successful, 0 otherwise.
+ */
+
+static int              _sif_inline_meta_data_values(sif_file *file) {
+  sif_meta_data *i = 0;
+  for (i = file->meta_data.first; i != 0; i = i->next) {
+    if (i->value_location < 0) {
+      continue;
+    }
+    if (_sif_get_meta_data_value(file, i) == 0) {
+      return 0;
+    }
+    i->value_location = -1;
+    i->value_capacity = i->value_length;
+    _sif_mark_meta_data_pair(file, i, 1);
+  }
+  file->meta_data_values_start = 0;
+  file->meta_data_values_end = 0;
+  file->meta_data_limit = 0;
+  return 1;
+}
+
+/**
+ * Returns the number of bits used to store each palette index for
+ * a slice encoding code.
+ *
+ * @param encoding  A slice encoding code.
+ *
+ * @return          The number of bits per index, or 0 if the encoding
+ *                  is not a palette encoding.
+ */
+
+static int               _sif_palette_bits(int encoding) {
+  switch (encoding) {
+  case SIF_SLICE_ENCODING_PALETTE1:
+    return 1;
+  case SIF_SLICE_ENCODING_PALETTE2:
+    return 2;
+  case SIF_SLICE_ENCODING_PALETTE4:
+    return 4;
+  case SIF_SLICE_ENCODING_PALETTE8:
+    return 8;
+  }
+  return 0;
+}
+
+/**
+ * Returns the number of bytes a tile slice occupies in its block when
+ * it is stored with the encoding passed. A palette encoded slice is
+ * stored as the palette (one data unit for each possible index) followed
+ * by the bit-packed indices. Linear ramps occupy no bytes.
+ *
+ * @param file      The file containing the slice.
+ * @param encoding  A slice encoding code.
+ *
+ * @return          The number of bytes to read or write.
+ */
+
+static long              _sif_encoded_slice_bytes(const sif_file *file, int encoding) {
+  long dus = file->header->data_unit_size;
+  long bits = _sif_palette_bits(encoding);
+  switch (encoding) {
+  case SIF_SLICE_ENCODING_PLANE:
+    return 0;
+  case SIF_SLICE_ENCODING_ROWS:
+    return dus * file->header->tile_height;
+  case SIF_SLICE_ENCODING_COLUMNS:
+    return dus * file->header->tile_width;
+  case SIF_SLICE_ENCODING_BITS:
+    return (file->units_per_slice + 7) / 8;
+  }
+  if (bits == 0) {
+    return dus * file->units_per_slice;
+  }
+  return (dus << bits) + (file->units_per_slice * bits + 7) / 8;
+}
+
+/**
+ * Hashes a data unit (packed into a 64-bit integer) to a slot in the
+ * table used to build palettes.
+ */
+
+#define SIF_PALETTE_HASH(v) ((unsigned int)(((v) * 0x9E3779B97F4A7C15ULL) >> 55))
+
+/**
+ * The number of slots in the table used to build palettes. It must be
+ * a power of two and at least twice the maximum palette size.
+ */
+
+#define SIF_PALETTE_SLOTS 512
+
+/**
+ * Finds the palette index of a data unit, adding the data unit to the
+ * palette if it is not already there.
+ *
+ * @param keys      The data units stored in each slot.
+ * @param slots     The palette index stored in each slot, -1 if empty.
+ * @param palette   The palette of data units.
+ * @param n         The number of data units in the palette. Incremented if
+ *                  the data unit is added.
+ * @param v         The data unit to look up.
+ * @param dus       The data unit size.
+ *
+ * @return          The palette index of the data unit.
+ */
+
+static int               _sif_palette_lookup(unsigned long long *keys, short *slots,
+                                             u_char *palette, int *n,
+                                             unsigned long long v, int dus) {
+  unsigned int h = SIF_PALETTE_HASH(v);
+  while (slots[h] != -1) {
+    if (keys[h] == v) {
+      return slots[h];
+    }
+    h = (h + 1) & (SIF_PALETTE_SLOTS - 1);
+  }
+  keys[h] = v;
+  slots[h] = (short)*n;
+  if (*n < 256) {
+    memcpy(palette + (*n) * dus, &v, dus);
+  }
+  return (*n)++;
+}
+
+/**
+ * Tries to encode a tile slice as a palette with bit-packed indices. The
+ * smallest index width that can address every distinct data unit in the
+ * slice is chosen. Only data units inside the image are considered; the
+ * indices of data units beyond the right or bottom edge of the image are
+ * set to zero.
+ *
+ * @param file      The file containing the slice.
+ * @param data      The raw tile slice.
+ * @param extentX   The number of columns of the slice inside the image.
+ * @param extentY   The number of rows of the slice inside the image.
+ * @param out       The buffer to store the encoded slice. It must be at
+ *                  least as large as a raw slice.
+ *
+ * @return          The slice encoding code. If SIF_SLICE_ENCODING_RAW is
+ *                  returned, the palette encoding would not save any bytes
+ *                  and nothing useful is stored in <code>out</code>.
+ */
+
+static int               _sif_palette_encode(sif_file *file, const void *data,
+                                             long extentX, long extentY, u_char *out) {
+  sif_header *hd = file->header;
+  const u_char *datau = data;
+  int dus = hd->data_unit_size, n = 0, bits = 0, encoding, idx;
+  long x, y, j, raw_bytes = dus * file->units_per_slice, bit;
+  unsigned long long keys[SIF_PALETTE_SLOTS], v = 0;
+  short slots[SIF_PALETTE_SLOTS];
+  u_char palette[256 * 8], *packed;
+
+  if (dus > 8 || !_sif_has_slice_encodings(file)) {
+    return SIF_SLICE_ENCODING_RAW;
+  }
+  memset(slots, 0xFF, sizeof(slots));
+
+  /** First pass: collect the distinct data units. Give up as soon as
+      there are more than an 8-bit index can address. */
+  for (y = 0; y < extentY && n <= 256; y++) {
+    for (x = 0, j = y * hd->tile_width; x < extentX && n <= 256; x++, j++) {
+      memcpy(&v, datau + j * dus, dus);
+      _sif_palette_lookup(keys, slots, palette, &n, v, dus);
+    }
+  }
+  if (n > 256) {
+    return SIF_SLICE_ENCODING_RAW;
+  }
+  for (encoding = SIF_SLICE_ENCODING_PALETTE1; encoding <= SIF_SLICE_ENCODING_PALETTE8; encoding++) {
+    bits = _sif_palette_bits(encoding);
+    if (n <= (1 << bits)) {
+      break;
+    }
+  }
+  if (_sif_encoded_slice_bytes(file, encoding) >= raw_bytes) {
+    return SIF_SLICE_ENCODING_RAW;
+  }
+
+  /** Second pass: store the palette and pack the indices, least
+      significant bits first. */
+  bzero(out, _sif_encoded_slice_bytes(file, encoding));
+  memcpy(out, palette, n * dus);
+  packed = out + (dus << bits);
+  for (y = 0, bit = 0; y < hd->tile_height; y++) {
+    for (x = 0; x < hd->tile_width; x++, bit += bits) {
+      if (x < extentX && y < extentY) {
+        memcpy(&v, datau + (y * hd->tile_width + x) * dus, dus);
+        idx = _sif_palette_lookup(keys, slots, palette, &n, v, dus);
+        packed[bit >> 3] |= (u_char)(idx << (bit & 7));
+      }
+    }
+  }
+  return encoding;
+}
+
+/**
+ * Expands the bit-packed palette indices of a palette encoded tile slice
+ * into data units. When compiled with SSSE3 support, palettes with at
+ * most 16 entries and data units of 1, 2, or 4 bytes are decoded 16
+ * data units at a time with byte shuffles, using the palette split
+ * into one 16-byte lookup table per byte of the data unit.
+ *
+ * @param file      The file containing the slice.
+ * @param encoding  The palette encoding of the slice.
+ * @param in        The encoded slice as stored in the block.
+ * @param out       The buffer to store the raw tile slice.
+ */
+
+static void              _sif_palette_decode(const sif_file *file, int encoding,
+                                             const u_char *in, u_char *out) {
+  long dus = file->header->data_unit_size, ups = file->units_per_slice;
+  int bits = _sif_palette_bits(encoding), mask = (1 << bits) - 1, idx;
+  const u_char *palette = in, *packed = in + (dus << bits);
+  long j = 0, bit = 0;
+#ifdef SIF_HAVE_SSSE3
+  if (bits <= 4 && (dus == 1 || dus == 2 || dus == 4)) {
+    u_char planes[4][16], expanded[16];
+    __m128i tab[4], ix, b[4], t0, t1, t2, t3, lo4 = _mm_set1_epi8(0x0F);
+    long p, k;
+    bzero(planes, sizeof(planes));
+    for (k = 0; k <= mask; k++) {
+      for (p = 0; p < dus; p++) {
+        planes[p][k] = palette[k * dus + p];
+      }
+    }
+    for (p = 0; p < dus; p++) {
+      tab[p] = _mm_loadu_si128((const __m128i*)planes[p]);
+    }
+    for (; j + 16 <= ups; j += 16, bit += 16 * bits) {
+      if (bits == 4) {
+        t0 = _mm_loadl_epi64((const __m128i*)(packed + (bit >> 3)));
+        ix = _mm_unpacklo_epi8(_mm_and_si128(t0, lo4),
+                               _mm_and_si128(_mm_srli_epi16(t0, 4), lo4));
+      }
+      else {
+        for (k = 0; k < 16; k++) {
+          expanded[k] = (packed[(bit + k * bits) >> 3] >> ((bit + k * bits) & 7)) & mask;
+        }
+        ix = _mm_loadu_si128((const __m128i*)expanded);
+      }
+      for (p = 0; p < dus; p++) {
+        b[p] = _mm_shuffle_epi8(tab[p], ix);
+      }
+      if (dus == 1) {
+        _mm_storeu_si128((__m128i*)(out + j), b[0]);
+      }
+      else if (dus == 2) {
+        _mm_storeu_si128((__m128i*)(out + j * 2), _mm_unpacklo_epi8(b[0], b[1]));
+        _mm_storeu_si128((__m128i*)(out + j * 2 + 16), _mm_unpackhi_epi8(b[0], b[1]));
+      }
+      else {
+        t0 = _mm_unpacklo_epi8(b[0], b[1]);
+        t1 = _mm_unpackhi_epi8(b[0], b[1]);
+        t2 = _mm_unpacklo_epi8(b[2], b[3]);
+        t3 = _mm_unpackhi_epi8(b[2], b[3]);
+        _mm_storeu_si128((__m128i*)(out + j * 4), _mm_unpacklo_epi16(t0, t2));
+        _mm_storeu_si128((__m128i*)(out + j * 4 + 16), _mm_unpackhi_epi16(t0, t2));
+        _mm_storeu_si128((__m128i*)(out + j * 4 + 32), _mm_unpacklo_epi16(t1, t3));
+        _mm_storeu_si128((__m128i*)(out + j * 4 + 48), _mm_unpackhi_epi16(t1, t3));
+      }
+    }
+  }
+#endif
+  /** Decode whatever is left one data unit at a time. */
+  for (; j < ups; j++, bit += bits) {
+    idx = (packed[bit >> 3] >> (bit & 7)) & mask;
+    memcpy(out + j * dus, palette + idx * dus, dus);
+  }
+}
+
+/**
+ * Fills a tile slice, or part of a row, with copies of a single data unit.
+ * When compiled with SSE2 support, data units whose size divides 16 are
+ * broadcast to a vector and stored 16 bytes at a time.
+ *
+ * @param buffer    The buffer to fill.
+ * @param value     The data unit.
+ * @param dus       The data unit size.
+ * @param n         The number of data units to fill.
+ */
+
+static void              _sif_fill_units(u_char *buffer, const u_char *value, long dus, long n) {
+  long i, done, nbytes = dus * n;
+#ifdef SIF_HAVE_SSE2
+  u_char pattern[16];
+  __m128i v;
+#endif
+  if (dus == 1) {
+    memset(buffer, value[0], n);
+    return;
+  }
+  if (n < 1) {
+    return;
+  }
+#ifdef SIF_HAVE_SSE2
+  if (16 % dus == 0) {
+    for (i = 0; i < 16; i += dus) {
+      memcpy(pattern + i, value, dus);
+    }
+    v = _mm_loadu_si128((const __m128i*)pattern);
+    for (i = 0; i + 16 <= nbytes; i += 16) {
+      _mm_storeu_si128((__m128i*)(buffer + i), v);
+    }
+    memcpy(buffer + i, pattern, nbytes - i);
+    return;
+  }
+#endif
+  /** Copy the part filled so far onto the rest, doubling it each time. */
+  memcpy(buffer, value, dus);
+  for (done = dus; done < nbytes; done += i) {
+    i = MIN(done, nbytes - done);
+    memcpy(buffer + done, buffer, i);
+  }
+}
+
+/**
+ * Counts the set bits in a 64-bit word.
+ */
+
+#if defined(__GNUC__)
+#define SIF_POPCOUNT64(w) ((long)__builtin_popcountll(w))
+#else
+static long              _sif_popcount64(unsigned long long w) {
+  w = w - ((w >> 1) & 0x5555555555555555ULL);
+  w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+  w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  return (long)((w * 0x0101010101010101ULL) >> 56);
+}
+#define SIF_POPCOUNT64(w) _sif_popcount64(w)
+#endif
+
+/**
+ * Counts the set bits in a range of a bit-packed buffer (least significant
+ * bit first). Whole 64-bit words are counted at a time.
+ *
+ * @param p         The packed buffer.
+ * @param start     The index of the first bit to count.
+ * @param n         The number of bits to count.
+ *
+ * @return          The number of set bits.
+ */
+
+static long              _sif_popcount_bits(const u_char *p, long start, long n) {
+  long count = 0, end = start + n;
+  unsigned long long w;
+  /** Count bits up to the next byte boundary. */
+  for (; start < end && (start & 7) != 0; start++) {
+    count += (p[start >> 3] >> (start & 7)) & 1;
+  }
+  /** Count whole words, then whole bytes, then the remaining bits. */
+  for (; start + 64 <= end; start += 64) {
+    memcpy(&w, p + (start >> 3), 8);
+    count += SIF_POPCOUNT64(w);
+  }
+  for (; start + 8 <= end; start += 8) {
+    count += SIF_POPCOUNT64((unsigned long long)p[start >> 3]);
+  }
+  for (; start < end; start++) {
+    count += (p[start >> 3] >> (start & 7)) & 1;
+  }
+  return count;
+}
+
+/**
+ * Packs a buffer of bytes into bits, least significant bit first. A bit is
+ * set iff its byte is non-zero. When compiled with SSE2 support, 16 bytes
+ * are packed at a time with a compare and a movemask.
+ *
+ * @param in        The bytes to pack.
+ * @param n         The number of bytes to pack.
+ * @param out       The buffer to store <code>ceil(n/8)</code> bytes.
+ */
+
+static void              _sif_pack_bits(const u_char *in, long n, u_char *out) {
+  long j = 0, k;
+  u_char b;
+#ifdef SIF_HAVE_SSE2
+  __m128i zero = _mm_setzero_si128();
+  int m;
+  for (; j + 16 <= n; j += 16) {
+    m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(in + j)), zero));
+    out[j >> 3] = (u_char)m;
+    out[(j >> 3) + 1] = (u_char)(m >> 8);
+  }
+#endif
+  for (; j < n; j += 8) {
+    for (k = 0, b = 0; k < 8 && j + k < n; k++) {
+      b |= (u_char)((in[j + k] != 0) << k);
+    }
+    out[j >> 3] = b;
+  }
+}
+
+/**
+ * Unpacks bits (least significant bit first) into bytes of 0 or 1. When
+ * compiled with SSSE3 support, 16 bytes are unpacked at a time by
+ * broadcasting each packed byte to 8 lanes and testing one bit per lane.
+ *
+ * @param in        The packed bits.
+ * @param n         The number of bytes to unpack.
+ * @param out       The buffer to store the bytes.
+ */
+
+static void              _sif_unpack_bits(const u_char *in, long n, u_char *out) {
+  long j = 0;
+#ifdef SIF_HAVE_SSSE3
+  const __m128i spread = _mm_set_epi8(1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i bits = _mm_set_epi8((char)0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1,
+                                    (char)0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1);
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i v;
+  for (; j + 16 <= n; j += 16) {
+    v = _mm_shuffle_epi8(_mm_cvtsi32_si128(in[j >> 3] | (in[(j >> 3) + 1] << 8)), spread);
+    v = _mm_min_epu8(_mm_and_si128(v, bits), one);
+    _mm_storeu_si128((__m128i*)(out + j), v);
+  }
+#endif
+  for (; j < n; j++) {
+    out[j] = (in[j >> 3] >> (j & 7)) & 1;
+  }
+}
+
+/**
+ * Checks whether a bit-packed tile slice is uniform. Only pixels inside
+ * the image are examined. The packed words are tested with population
+ * counts rather than unpacking them.
+ *
+ * @param file      The file containing the slice.
+ * @param packed    The packed slice.
+ * @param extentX   The number of columns of the slice inside the image.
+ * @param extentY   The number of rows of the slice inside the image.
+ *
+ * @return          A non-zero value iff the slice is uniform.
+ */
+
+static int               _sif_packed_is_uniform(sif_file *file, const u_char *packed,
+                                                long extentX, long extentY) {
+  long tw = file->header->tile_width, y, want;
+  int first = packed[0] & 1;
+  if (extentX == tw) {
+    want = first ? extentX * extentY : 0;
+    return _sif_popcount_bits(packed, 0, extentX * extentY) == want;
+  }
+  want = first ? extentX : 0;
+  for (y = 0; y < extentY; y++) {
+    if (_sif_popcount_bits(packed, y * tw, extentX) != want) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Reads a data unit of 1 to 8 bytes as a little-endian integer.
+ *
+ * @param p         The data unit.
+ * @param dus       The data unit size.
+ *
+ * @return          The integer, zero extended to 64 bits.
+ */
+
+static unsigned long long _sif_get_le_unit(const u_char *p, int dus) {
+  unsigned long long v = 0;
+  int k;
+  for (k = dus - 1; k >= 0; k--) {
+    v = (v << 8) | p[k];
+  }
+  return v;
+}
+
+/**
+ * Stores the lowest 8*dus bits of an integer as a little-endian data unit.
+ *
+ * @param p         The data unit.
+ * @param v         The integer to store.
+ * @param dus       The data unit size.
+ */
+
+static void              _sif_put_le_unit(u_char *p, unsigned long long v, int dus) {
+  int k;
+  for (k = 0; k < dus; k++, v >>= 8) {
+    p[k] = (u_char)v;
+  }
+}
+
+/**
+ * Generates one row of a linear ramp, <code>v + step*j</code> for the
+ * j'th data unit, wrapping modulo <code>2^(8*dus)</code>. When compiled
+ * with SSE2 support, 16 bytes are generated per add.
+ *
+ * @param out       The buffer to store the row.
+ * @param v         The value of the first data unit.
+ * @param step      The increment between adjacent data units.
+ * @param n         The number of data units to generate.
+ * @param dus       The data unit size (1, 2, 4, or 8).
+ */
+
+static void              _sif_plane_row(u_char *out, unsigned long long v,
+                                        unsigned long long step, long n, int dus) {
+  long j = 0;
+#ifdef SIF_HAVE_SSE2
+  long k, lanes = 16 / dus;
+  u_char first[16], incs[16];
+  __m128i cur, inc;
+  if (n >= lanes) {
+    for (k = 0; k < lanes; k++) {
+      _sif_put_le_unit(first + k * dus, v + step * k, dus);
+      _sif_put_le_unit(incs + k * dus, step * lanes, dus);
+    }
+    cur = _mm_loadu_si128((const __m128i*)first);
+    inc = _mm_loadu_si128((const __m128i*)incs);
+    for (; j + lanes <= n; j += lanes) {
+      _mm_storeu_si128((__m128i*)(out + j * dus), cur);
+      switch (dus) {
+      case 1:
+        cur = _mm_add_epi8(cur, inc);
+        break;
+      case 2:
+        cur = _mm_add_epi16(cur, inc);
+        break;
+      case 4:
+        cur = _mm_add_epi32(cur, inc);
+        break;
+      default:
+        cur = _mm_add_epi64(cur, inc);
+        break;
+      }
+    }
+    v += step * j;
+  }
+#endif
+  for (; j < n; j++, v += step) {
+    _sif_put_le_unit(out + j * dus, v, dus);
+  }
+}
+
+/**
+ * Tries to find a compact encoding for a non-uniform tile slice. A slice
+ * that is an exact linear ramp is encoded with \ref SIF_SLICE_ENCODING_PLANE,
+ * its coefficients are stored in the tile header, and nothing is stored in
+ * <code>out</code>. Otherwise, slices with constant rows or columns store one
+ * data unit per row or column. Failing that, a palette encoding is tried.
+ * Only data units inside the image are considered.
+ *
+ * @param file      The file containing the slice.
+ * @param tile      The tile containing the slice.
+ * @param band      The band of the slice.
+ * @param data      The raw tile slice.
+ * @param extentX   The number of columns of the slice inside the image.
+ * @param extentY   The number of rows of the slice inside the image.
+ * @param out       The buffer to store the encoded slice. It must be at
+ *                  least as large as a raw slice.
+ *
+ * @return          The slice encoding code. If SIF_SLICE_ENCODING_RAW is
+ *                  returned, the slice should be stored as is.
+ */
+
+static int               _sif_encode_slice(sif_file *file, sif_tile *tile, long band,
+                                           const void *data, long extentX, long extentY,
+                                           u_char *out) {
+  sif_header *hd = file->header;
+  const u_char *datau = data;
+  int dus = hd->data_unit_size;
+  long y, rowb = hd->tile_width * dus;
+  unsigned long long a, b = 0, c = 0;
+  u_char *grad = tile->slice_gradients + band * dus * 2;
+
+  if (!_sif_has_slice_encodings(file)) {
+    return SIF_SLICE_ENCODING_RAW;
+  }
+
+  /** Is the slice a linear ramp? Generate each row and compare. */
+  if (dus == 1 || dus == 2 || dus == 4 || dus == 8) {
+    a = _sif_get_le_unit(datau, dus);
+    if (extentX > 1) {
+      b = _sif_get_le_unit(datau + dus, dus) - a;
+    }
+    if (extentY > 1) {
+      c = _sif_get_le_unit(datau + rowb, dus) - a;
+    }
+    for (y = 0; y < extentY; y++) {
+      _sif_plane_row(out, a + c * y, b, extentX, dus);
+      if (memcmp(out, datau + y * rowb, extentX * dus) != 0) {
+        break;
+      }
+    }
+    if (y == extentY) {
+      _sif_put_le_unit(tile->uniform_pixel_values + band * dus, a, dus);
+      _sif_put_le_unit(grad, b, dus);
+      _sif_put_le_unit(grad + dus, c, dus);
+      return SIF_SLICE_ENCODING_PLANE;
+    }
+  }
+
+  /** Is each row constant? */
+  for (y = 0; y < extentY; y++) {
+    if (memcmp(datau + y * rowb, datau + y * rowb + dus, (extentX - 1) * dus) != 0) {
+      break;
+    }
+  }
+  if (y == extentY) {
+    bzero(out, hd->tile_height * dus);
+    for (y = 0; y < extentY; y++) {
+      memcpy(out + y * dus, datau + y * rowb, dus);
+    }
+    return SIF_SLICE_ENCODING_ROWS;
+  }
+
+  /** Is each column constant? */
+  for (y = 1; y < extentY; y++) {
+    if (memcmp(datau + y * rowb, datau, extentX * dus) != 0) {
+      break;
+    }
+  }
+  if (y == extentY) {
+    bzero(out, rowb);
+    memcpy(out, datau, extentX * dus);
+    return SIF_SLICE_ENCODING_COLUMNS;
+  }
+  return _sif_palette_encode(file, data, extentX, extentY, out);
+}
+
+/**
+ * Expands an encoded tile slice into a raw tile slice.
+ *
+ * @param file      The file containing the slice.
+ * @param tile      The tile containing the slice.
+ * @param band      The band of the slice.
+ * @param encoding  The encoding of the slice.
+ * @param in        The encoded slice as stored in the block. Not used for
+ *                  linear ramps.
+ * @param out       The buffer to store the raw tile slice.
+ */
+
+static void              _sif_decode_slice(const sif_file *file, const sif_tile *tile, long band,
+                                           int encoding, const u_char *in, u_char *out) {
+  const sif_header *hd = file->header;
+  int dus = hd->data_unit_size;
+  long y, rowb = hd->tile_width * dus;
+  const u_char *grad = tile->slice_gradients + band * dus * 2;
+  unsigned long long a, b, c;
+  switch (encoding) {
+  case SIF_SLICE_ENCODING_PLANE:
+    a = _sif_get_le_unit(tile->uniform_pixel_values + band * dus, dus);
+    b = _sif_get_le_unit(grad, dus);
+    c = _sif_get_le_unit(grad + dus, dus);
+    for (y = 0; y < hd->tile_height; y++) {
+      _sif_plane_row(out + y * rowb, a + c * y, b, hd->tile_width, dus);
+    }
+    break;
+  case SIF_SLICE_ENCODING_ROWS:
+    for (y = 0; y < hd->tile_height; y++) {
+      _sif_fill_units(out + y * rowb, in + y * dus, dus, hd->tile_width);
+    }
+    break;
+  case SIF_SLICE_ENCODING_COLUMNS:
+    for (y = 0; y < hd->tile_height; y++) {
+      memcpy(out + y * rowb, in, rowb);
+    }
+    break;
+  case SIF_SLICE_ENCODING_BITS:
+    _sif_unpack_bits(in, file->units_per_slice, out);
+    break;
+  default:
+    _sif_palette_decode(file, encoding, in, out);
+    break;
+  }
+}
+
+/**
+ * Reads a non-uniform tile slice from its block, decoding it if it
+ * is not stored raw. Linear ramps are generated without any I/O.
+ *
+ * @param file      The file containing the slice.
+ * @param tile_num  The tile containing the slice.
+ * @param band      The band of the slice.
+ * @param buffer    The buffer to store the raw tile slice.
+ */
+
+static void              _sif_read_slice(sif_file *file, long tile_num, long band, u_char *buffer) {
+  sif_tile tile_view, *tile = _sif_tile_view(file, tile_num, &tile_view);
+  int encoding = tile->slice_encodings[band];
+  long nbytes = _sif_encoded_slice_bytes(file, encoding);
+  LONGLONG pos;
+  if (encoding == SIF_SLICE_ENCODING_PLANE) {
+    _sif_decode_slice(file, tile, band, encoding, 0, buffer);
+    return;
+  }
+  pos = _sif_get_slice_location(file, tile_num, band);
+  if (encoding == SIF_SLICE_ENCODING_RAW) {
+    SIF_ERROR_CHECK_RETURN_V(_sif_read_at(file, buffer, nbytes, pos) == 0, SIF_ERROR_READ);
+  }
+  else {
+    /** The encoded slice is never larger than a raw slice so it fits
+        in the second block buffer. */
+    SIF_ERROR_CHECK_RETURN_V(_sif_read_at(file, file->buffer[1], nbytes, pos) == 0, SIF_ERROR_READ);
+    _sif_decode_slice(file, tile, band, encoding, file->buffer[1], buffer);
+  }
+}
+
+/**
+ * The locks of a file in concurrent write mode. A tile's header and slices
+ * are guarded by its stripe lock; the block map by the block lock.
+ * Writers work on per-call copies of the file, so the locks also point
+ * back to the file itself, whose meta-data state a block allocation may
+ * change. The state is changed, and the file copied, under the block lock.
+ */
+
+typedef struct {
+  _sif_mutex tiles[SIF_LOCK_STRIPES];
+  _sif_mutex blocks;
+  sif_file *file;
+} _sif_locks;
+
+/**
+ * Prepares a private copy of a file handle for one read call in
+ * concurrent read mode. The copy shares the header, tile directory, and
+ * meta-data of the original but has its own scratch buffers and error
+ * state, so nothing in the shared handle is written during the call.
+ * In concurrent write mode, the handle is copied under the block lock,
+ * as a block allocation may change its meta-data state meanwhile.
+ *
+ * @param file      The shared file handle.
+ * @param view      The copy to prepare.
+ *
+ * @return          1 if successful, 0 if the scratch buffers could not be
+ *                  allocated, in which case the copy's error is set.
+ */
+
+static int               _sif_begin_concurrent_read(sif_file *file, sif_file *view) {
+  _sif_locks *locks = (_sif_locks*)file->locks;
+  long slice_bytes = file->header->data_unit_size * file->units_per_slice;
+  if (locks != 0) {
+    SIF_MUTEX_LOCK(&locks->blocks);
+  }
+  *view = *file;
+  if (locks != 0) {
+    SIF_MUTEX_UNLOCK(&locks->blocks);
+  }
+  view->error = 0;
+  view->error_line_no = 0;
+  view->sys_error_no = 0;
+  view->simple_region_buffer = 0;
+  view->simple_region_bytes = 0;
+  view->scratch_depth = 1;
+  view->buffer[0] = _sif_scratch_get(slice_bytes * 2);
+  if (view->buffer[0] == 0) {
+    view->error = SIF_ERROR_MEM;
+    return 0;
+  }
+  view->buffer[1] = ((u_char*)view->buffer[0]) + slice_bytes;
+  return 1;
+}
+
+/**
+ * Releases the scratch buffers of a per-call copy made by
+ * _sif_begin_concurrent_read.
+ *
+ * @param view      The per-call copy.
+ */
+
+static void              _sif_end_concurrent_read(sif_file *view) {
+  _sif_scratch_put(view->buffer[0]);
+  view->buffer[0] = 0;
+  view->buffer[1] = 0;
+}
+
+/**
+ * Returns the error of the last read call on a file, taking the
+ * per-thread error state into account in concurrent read mode.
+ *
+ * @param file      The file.
+ *
+ * @return          The error code, zero if the call succeeded.
+ */
+
+static int               _sif_read_error(sif_file *file) {
+  return file->concurrent_reads ? _sif_thread_error : file->error;
+}
+
+/**
+ * Allocates a slice cache entry for a tile slice. The entry is detached
+ * and its slice is left for the caller to fill.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param tile_num  The tile.
+ * @param band      The band.
+ * @param generation The generation of the file before the slice is read,
+ *                  from _sif_cache_pin.
+ *
+ * @return          The entry, or null if it could not be allocated.
+ */
+
+static _sif_cache_entry* _sif_cache_new_entry(sif_file *file, long tile_num, long band, long generation) {
+  long nbytes = file->header->data_unit_size * file->units_per_slice;
+  _sif_cache_entry *e = (_sif_cache_entry*)malloc(sizeof(_sif_cache_entry) + nbytes);
+  if (e != 0) {
+    e->file_id = file->cache_id;
+    e->tile_num = tile_num;
+    e->band = band;
+    e->nbytes = nbytes;
+    e->queue = SIF_CACHE_DETACHED;
+    e->pins = 0;
+    e->referenced = 0;
+    e->generation = generation;
+  }
+  return e;
+}
+
+/**
+ * Pins a cached slice.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param tile_num  The tile.
+ * @param band      The band.
+ * @param found     Set to the entry if the slice is cached.
+ * @param generation Set to the generation of the file if it is not.
+ *
+ * @return          1 if the slice is cached, 0 if it is not, or -1 if the
+ *                  cache is disabled.
+ */
+
+static int               _sif_cache_pin(sif_file *file, long tile_num, long band, _sif_cache_entry **found,
+                                        long *generation) {
+  _sif_cache_entry *e;
+  _sif_cache_file *f;
+  int rc = 0;
+  _sif_cache_lock();
+  if (_sif_cache.budget == 0) {
+    rc = -1;
+  }
+  else if ((e = _sif_cache_find(file->cache_id, tile_num, band)) != 0 && e->queue != SIF_CACHE_GHOST) {
+    e->pins++;
+    e->referenced = 1;
+    *found = e;
+    rc = 1;
+  }
+  else if ((f = _sif_cache_file_of(file->cache_id)) != 0) {
+    *generation = f->generation;
+  }
+  else {
+    rc = -1;
+  }
+  _sif_cache_unlock();
+  return rc;
+}
+
+/**
+ * Releases a pin on a slice, freeing the slice if it was detached or
+ * evicting slices if the cache is over its budget.
+ *
+ * @param e         The entry of the slice.
+ */
+
+static void              _sif_cache_unpin(_sif_cache_entry *e) {
+  _sif_cache_lock();
+  if (--e->pins == 0) {
+    if (e->queue == SIF_CACHE_DETACHED) {
+      free(e);
+    }
+    else {
+      _sif_cache_evict();
+    }
+  }
+  _sif_cache_unlock();
+}
+
+/**
+ * Adds a slice just read to the cache, on probation unless it has a
+ * ghost. If the slice was cached meanwhile by another thread, the new
+ * entry is dropped and any pin it holds moves to the cached one. An
+ * unpinned entry may be evicted at once. A slice of the file may have been
+ * dropped while the entry was read, possibly by a write through another
+ * handle; the entry is then not cached, since it may be stale.
+ *
+ * @param e         The entry, with its slice filled in.
+ *
+ * @return          The entry holding the slice if it is pinned, otherwise
+ *                  null.
+ */
+
+static _sif_cache_entry* _sif_cache_add(_sif_cache_entry *e) {
+  _sif_cache_entry *old;
+  _sif_cache_file *f;
+  int queue = SIF_CACHE_PROBATION;
+  _sif_cache_lock();
+  f = _sif_cache_file_of(e->file_id);
+  if (_sif_cache.budget != 0 && f != 0 && f->generation == e->generation) {
+    old = _sif_cache_find(e->file_id, e->tile_num, e->band);
+    if (old != 0 && old->queue != SIF_CACHE_GHOST) {
+      /** The cached entry may be evicted as soon as the cache is unlocked
+          unless the pin moved to it. */
+      old->pins += e->pins;
+      if (e->pins == 0) {
+        old = 0;
+      }
+      _sif_cache_unlock();
+      free(e);
+      return old;
+    }
+    if (old != 0) {
+      queue = SIF_CACHE_PROTECTED;
+      _sif_cache_remove(old);
+    }
+    if (_sif_cache_hash(e)) {
+      _sif_cache_enqueue(e, queue);
+      if (e->pins == 0) {
+        e = 0;
+      }
+      _sif_cache_evict();
+      _sif_cache_unlock();
+      return e;
+    }
+  }
+  _sif_cache_unlock();
+  if (e->pins == 0) {
+    free(e);
+    return 0;
+  }
+  return e;
+}
+
+/**
+ * Returns whether the slices of a tile band are kept in the slice cache.
+ * Uniform slices and those stored in the tile header need no I/O.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param tile_num  The tile.
+ * @param band      The band.
+ *
+ * @return          Non-zero if the slice may be cached.
+ */
+
+static int               _sif_cache_is_cacheable(sif_file *file, long tile_num, long band) {
+  return file->cache_id != 0 && !file->shared
+    && !_sif_band_of_tile_is_uniform_shallow(file, tile_num, band)
+    && file->tiles.slice_encodings[tile_num * file->header->bands + band] != SIF_SLICE_ENCODING_PLANE;
+}
+
+/**
+ * Reads and decodes a non-uniform tile slice through the slice cache. The
+ * caller holds the tile's lock.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param tile_num  The tile.
+ * @param band      The band.
+ * @param buffer    The buffer, one slice long.
+ */
+
+static void              _sif_read_cached_slice(sif_file *file, long tile_num, long band, u_char *buffer) {
+  _sif_cache_entry *e = 0;
+  long generation = 0;
+  int rc = -1;
+  if (_sif_cache_is_cacheable(file, tile_num, band)) {
+    rc = _sif_cache_pin(file, tile_num, band, &e, &generation);
+  }
+  if (rc == 1) {
+    memcpy(buffer, e + 1, e->nbytes);
+    _sif_cache_unpin(e);
+    return;
+  }
+  _sif_read_slice(file, tile_num, band, buffer);
+  if (rc == 0 && file->error == 0 && (e = _sif_cache_new_entry(file, tile_num, band, generation)) != 0) {
+    memcpy(e + 1, buffer, e->nbytes);
+    _sif_cache_add(e);
+  }
+}
+
+/**
+ * Takes a byte-range lock on a file in shared access mode, waiting until
+ * it is granted. The locks are advisory on POSIX systems.
+ *
+ * @param file      The file.
+ * @param pos       The first byte of the range.
+ * @param len       The number of bytes in the range.
+ * @param exclusive Non-zero for a write lock, zero for a read lock.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
+
+static int               _sif_lock_range(sif_file *file, LONGLONG pos, LONGLONG len, int exclusive) {
+#ifdef WIN32
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = (DWORD)(pos & 0xFFFFFFFF);
+  ov.OffsetHigh = (DWORD)(pos >> 32);
+  return LockFileEx(file->fp, exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0,
+		    (DWORD)(len & 0xFFFFFFFF), (DWORD)(len >> 32), &ov) != 0;
+#else
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = exclusive ? F_WRLCK : F_RDLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = (off_t)pos;
+  fl.l_len = (off_t)len;
+  while (fcntl(fileno(file->fp), SIF_SETLKW, &fl) == -1) {
+    if (errno != EINTR) {
+      return 0;
+    }
+  }
+  return 1;
+#endif
+}
+
+/**
+ * Releases a byte-range lock taken with _sif_lock_range.
+ *
+ * @param file      The file.
+ * @param pos       The first byte of the range.
+ * @param len       The number of bytes in the range.
+ */
+
+static void              _sif_unlock_range(sif_file *file, LONGLONG pos, LONGLONG len) {
+#ifdef WIN32
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = (DWORD)(pos & 0xFFFFFFFF);
+  ov.OffsetHigh = (DWORD)(pos >> 32);
+  UnlockFileEx(file->fp, 0, (DWORD)(len & 0xFFFFFFFF), (DWORD)(len >> 32), &ov);
+#else
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = (off_t)pos;
+  fl.l_len = (off_t)len;
+  fcntl(fileno(file->fp), SIF_SETLK, &fl);
+#endif
+}
+
+/**
+ * Returns the byte offset of a tile's entry in the tile directory.
+ *
+ * @param file      The file.
+ * @param tile_num  The tile.
+ *
+ * @return          The byte offset.
+ */
+
+static LONGLONG          _sif_get_tile_header_location(const sif_file *file, long tile_num) {
+  return (LONGLONG)file->header_bytes + (LONGLONG)tile_num * file->header->tile_header_bytes;
+}
+
+/**
+ * The loading state of a file opened with sif_open_lazy. The tile headers
+ * are loaded a chunk at a time as the tiles are touched; the block map
+ * once the whole directory is needed.
+ */
+
+typedef struct {
+  _sif_mutex mutex;          /** serializes the loading. */
+  long n_chunks;             /** the number of chunks of tile headers. */
+  volatile long *loaded;     /** non-zero for each chunk loaded. */
+  volatile long complete;    /** non-zero once every chunk and the block map are loaded. */
+} _sif_lazy;
+
+/**
+ * Allocates the loading state of a file opened with sif_open_lazy. No
+ * tile header is loaded yet.
+ *
+ * @param file      The file, whose header has been read.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
+
+static int               _sif_alloc_lazy(sif_file *file) {
+  _sif_lazy *lazy = (_sif_lazy*)malloc(sizeof(_sif_lazy));
+  SIF_ERROR_CHECK_RETURN(lazy == 0, SIF_ERROR_MEM, 0);
+  lazy->n_chunks = CEIL_DIV(file->header->n_tiles, SIF_LAZY_CHUNK_TILES);
+  lazy->loaded = (volatile long*)calloc(MAX(lazy->n_chunks, 1), sizeof(long));
+  if (lazy->loaded == 0) {
+    free(lazy);
+    SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_MEM, 0);
+  }
+  lazy->complete = 0;
+  SIF_MUTEX_INIT(&lazy->mutex);
+  file->lazy = lazy;
+  return 1;
+}
+
+/**
+ * Destroys and frees the loading state of a file opened with
+ * sif_open_lazy.
+ *
+ * @param file      The file.
+ */
+
+static void              _sif_free_lazy(sif_file *file) {
+  _sif_lazy *lazy = (_sif_lazy*)file->lazy;
+  if (lazy == 0) {
+    return;
+  }
+  SIF_MUTEX_DESTROY(&lazy->mutex);
+  free((void*)lazy->loaded);
+  free(lazy);
+  file->lazy = 0;
+}
+
+/**
+ * Loads the tile headers of a range of tiles of a file opened with
+ * sif_open_lazy. Each chunk of headers not loaded yet is read with a
+ * single read and decoded into the tile directory. Chunks are loaded
+ * once, whichever thread touches them first. Does nothing for files
+ * opened otherwise.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param first     The first tile of the range.
+ * @param last      The last tile of the range.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
+
+static int               _sif_load_tile_headers(sif_file *file, long first, long last) {
+  _sif_lazy *lazy = (_sif_lazy*)file->lazy;
+  sif_header *hd = file->header;
+  long c, i, n, thb = hd->tile_header_bytes;
+  u_char *dir = 0, *rec;
+  int error = 0;
+  if (lazy == 0 || SIF_ATOMIC_FETCH_ADD(&lazy->complete, 0) != 0) {
+    return 1;
+  }
+  for (c = first / SIF_LAZY_CHUNK_TILES; c <= last / SIF_LAZY_CHUNK_TILES && error == 0; c++) {
+    if (SIF_ATOMIC_FETCH_ADD(lazy->loaded + c, 0) != 0) {
+      continue;
+    }
+    SIF_MUTEX_LOCK(&lazy->mutex);
+    if (SIF_ATOMIC_FETCH_ADD(lazy->loaded + c, 0) == 0) {
+      i = c * SIF_LAZY_CHUNK_TILES;
+      n = MIN(SIF_LAZY_CHUNK_TILES, hd->n_tiles - i);
+      if (dir == 0 && (dir = (u_char*)malloc(thb * SIF_LAZY_CHUNK_TILES)) == 0) {
+	error = SIF_ERROR_MEM;
+      }
+      else if (!_sif_read_at(file, dir, n * thb, _sif_get_tile_header_location(file, i))) {
+	error = SIF_ERROR_READ;
+      }
+      else {
+	/** Files without slice encodings leave them as initialized. */
+	_sif_init_tile_headers(file, i, n);
+	for (rec = dir; n > 0; i++, n--, rec += thb) {
+	  _sif_unpack_tile_header(file, i, rec);
+	}
+	/** Publish the chunk only once its headers are in place. */
+	SIF_ATOMIC_FETCH_ADD(lazy->loaded + c, 1);
+      }
+    }
+    SIF_MUTEX_UNLOCK(&lazy->mutex);
+  }
+  free(dir);
+  SIF_ERROR_CHECK_RETURN(error != 0, error, 0);
+  return 1;
+}
+
+/**
+ * Loads the tile headers not loaded yet of a file opened with
+ * sif_open_lazy and builds its block map. Does nothing for files opened
+ * otherwise.
+ *
+ * @param file      The file, or a per-call copy of it.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
+
+static int               _sif_load_directory(sif_file *file) {
+  _sif_lazy *lazy = (_sif_lazy*)file->lazy;
+  sif_header *hd = file->header;
+  long i;
+  if (lazy == 0 || SIF_ATOMIC_FETCH_ADD(&lazy->complete, 0) != 0) {
+    return 1;
+  }
+  if (hd->n_tiles > 0 && !_sif_load_tile_headers(file, 0, hd->n_tiles - 1)) {
+    return 0;
+  }
+  SIF_MUTEX_LOCK(&lazy->mutex);
+  if (SIF_ATOMIC_FETCH_ADD(&lazy->complete, 0) == 0) {
+    /** The block map is only built here, once every header is loaded. */
+    for (i = 0; i < hd->n_tiles; i++) {
+      file->blocks_to_tiles[i] = -1;
+    }
+    for (i = 0; i < hd->n_tiles; i++) {
+      if (file->tiles.block_nums[i] != -1) {
+	file->blocks_to_tiles[file->tiles.block_nums[i]] = (int)i;
+      }
+    }
+    /** No block has been allocated or released yet. */
+    _sif_locate_meta_data(file);
+    SIF_ATOMIC_FETCH_ADD(&lazy->complete, 1);
+  }
+  SIF_MUTEX_UNLOCK(&lazy->mutex);
+  return 1;
+}
+
+/**
+ * Loads the meta-data of an opened file the first time it is needed.
+ * A file opened with sif_open_lazy loads the rest of its tile directory
+ * first, which tells where the meta-data starts. Threads reading such a
+ * file in concurrent read mode may get here at once, so the load is
+ * serialized by its mutex; other files load before that mode is enabled.
+ *
+ * @param file      The file.
+ *
+ * @return          1 if the meta-data is loaded, 0 if it could not be.
+ */
+
+static int               _sif_load_meta_data(sif_file *file) {
+  _sif_lazy *lazy = (_sif_lazy*)file->lazy;
+  long state = SIF_ATOMIC_FETCH_ADD(&file->meta_data_loaded, 0);
+  if (state != 0) {
+    return state == 1;
+  }
+  if (lazy != 0) {
+    if (!_sif_load_directory(file)) {
+      return 0;
+    }
+    SIF_MUTEX_LOCK(&lazy->mutex);
+  }
+  if (SIF_ATOMIC_FETCH_ADD(&file->meta_data_loaded, 0) == 0) {
+    /** Publish the pairs only once they are in place. */
+    SIF_ATOMIC_FETCH_ADD(&file->meta_data_loaded, _sif_read_meta_data(file) ? 1 : -1);
+  }
+  if (lazy != 0) {
+    SIF_MUTEX_UNLOCK(&lazy->mutex);
+  }
+  return SIF_ATOMIC_FETCH_ADD(&file->meta_data_loaded, 0) == 1;
+}
+
+/**
+ * Reloads one tile header from the file and brings the block map up to
+ * date with it. Used in shared access mode, where other processes may
+ * have changed the tile. The caller holds the tile's lock.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param tile_num  The tile.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
+
+static int               _sif_refresh_tile(sif_file *file, long tile_num) {
+  _sif_locks *locks = (_sif_locks*)file->locks;
+  long thb = file->header->tile_header_bytes, old = file->tiles.block_nums[tile_num], b;
+  u_char stack_rec[SIF_TILE_HEADER_STACK_BYTES];
+  u_char *rec = thb <= SIF_TILE_HEADER_STACK_BYTES ? stack_rec : (u_char*)malloc(thb);
+  int ok;
+  SIF_ERROR_CHECK_RETURN(rec == 0, SIF_ERROR_MEM, 0);
+  ok = _sif_read_at(file, rec, thb, _sif_get_tile_header_location(file, tile_num));
+  if (ok) {
+    _sif_unpack_tile_header(file, tile_num, rec);
+  }
+  if (rec != stack_rec) {
+    free(rec);
+  }
+  SIF_ERROR_CHECK_RETURN(!ok, SIF_ERROR_READ, 0);
+  b = file->tiles.block_nums[tile_num];
+  if (b != old) {
+    if (locks != 0) {
+      SIF_MUTEX_LOCK(&locks->blocks);
+    }
+    if (old >= 0 && old < file->header->n_tiles && file->blocks_to_tiles[old] == tile_num) {
+      file->blocks_to_tiles[old] = -1;
+    }
+    if (b >= 0 && b < file->header->n_tiles) {
+      file->blocks_to_tiles[b] = tile_num;
+    }
+    if (locks != 0) {
+      SIF_MUTEX_UNLOCK(&locks->blocks);
+    }
+  }
+  return 1;
+}
+
+/**
+ * Reloads the tile directory from the file with a single read and rebuilds
+ * the block map from it.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param unpack    Non-zero to reload the tile headers as well as the
+ *                  block map. The directory is then read under a read lock
+ *                  in shared access mode, so the caller may not hold any
+ *                  tile locks.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
+
+static int               _sif_refresh_directory(sif_file *file, int unpack) {
+  sif_header *hd = file->header;
+  LONGLONG len = (LONGLONG)hd->n_tiles * hd->tile_header_bytes;
+  u_char *dir = (u_char*)malloc(len), *rec;
+  long i, b, nfb = hd->n_uniform_flags + hd->data_unit_size * hd->bands;
+  int ok;
+  SIF_ERROR_CHECK_RETURN(dir == 0, SIF_ERROR_MEM, 0);
+  if (unpack && file->shared && !_sif_lock_range(file, file->header_bytes, len, 0)) {
+    free(dir);
+    SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_LOCK, 0);
+  }
+  ok = _sif_read_at(file, dir, (long)len, file->header_bytes);
+  if (unpack && file->shared) {
+    _sif_unlock_range(file, file->header_bytes, len);
+  }
+  if (!ok) {
+    free(dir);
+    SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_READ, 0);
+  }
+  for (i = 0; i < hd->n_tiles; i++) {
+    file->blocks_to_tiles[i] = -1;
+  }
+  for (i = 0, rec = dir; i < hd->n_tiles; i++, rec += hd->tile_header_bytes) {
+    if (unpack) {
+      _sif_unpack_tile_header(file, i, rec);
+    }
+    /** A block number out of range could only come from an entry that
+        was being rewritten; it is ignored. */
+    b = _sif_packed_bytes_to_int32(rec + nfb);
+    if (b >= 0 && b < hd->n_tiles) {
+      file->blocks_to_tiles[b] = i;
+    }
+  }
+  free(dir);
+  return 1;
+}
+
+/**
+ * Allocates the locks used in concurrent write and shared access modes.
+ *
+ * @param file      The file.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
+
+static int               _sif_alloc_locks(sif_file *file) {
+  _sif_locks *locks;
+  int i;
+  if (file->locks != 0) {
+    return 1;
+  }
+  locks = (_sif_locks*)malloc(sizeof(_sif_locks));
+  SIF_ERROR_CHECK_RETURN(locks == 0, SIF_ERROR_MEM, 0);
+  for (i = 0; i < SIF_LOCK_STRIPES; i++) {
+    SIF_MUTEX_INIT(locks->tiles + i);
+  }
+  SIF_MUTEX_INIT(&locks->blocks);
+  locks->file = file;
+  file->locks = locks;
+  return 1;
+}
+
+/**
+ * Locks a tile against concurrent writers. Does nothing unless the file is
+ * in concurrent write or shared access mode, except to load the tile's
+ * header if the file was opened lazily. In shared access mode, the
+ * tile's directory entry is also locked in the file, for writing if the
+ * file is open for update, and the tile header is reloaded.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param tile_num  The tile to lock.
+ *
+ * @return          1 if successful, 0 if the tile could not be locked.
+ */
+
+static int               _sif_lock_tile(sif_file *file, long tile_num) {
+  _sif_mutex *m = 0;
+  LONGLONG loc;
+  if (!_sif_load_tile_headers(file, tile_num, tile_num)) {
+    return 0;
+  }
+  if (file->locks != 0) {
+    m = ((_sif_locks*)file->locks)->tiles + tile_num % SIF_LOCK_STRIPES;
+    SIF_MUTEX_LOCK(m);
+  }
+  if (file->shared) {
+    loc = _sif_get_tile_header_location(file, tile_num);
+    if (!_sif_lock_range(file, loc, file->header->tile_header_bytes, !file->read_only)) {
+      if (m != 0) {
+	SIF_MUTEX_UNLOCK(m);
+      }
+      SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_LOCK, 0);
+    }
+    if (!_sif_refresh_tile(file, tile_num)) {
+      _sif_unlock_range(file, loc, file->header->tile_header_bytes);
+      if (m != 0) {
+	SIF_MUTEX_UNLOCK(m);
+      }
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Unlocks a tile locked with _sif_lock_tile.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param tile_num  The tile to unlock.
+ */
+
+static void              _sif_unlock_tile(sif_file *file, long tile_num) {
+  if (file->shared) {
+    _sif_unlock_range(file, _sif_get_tile_header_location(file, tile_num), file->header->tile_header_bytes);
+  }
+  if (file->locks != 0) {
+    SIF_MUTEX_UNLOCK(((_sif_locks*)file->locks)->tiles + tile_num % SIF_LOCK_STRIPES);
+  }
+}
+
+/**
+ * Gives a tile the first free storage block. The caller holds the tile's
+ * lock; the block map is locked here.
+ *
+ * In shared access mode, other processes allocate blocks too. The block
+ * allocator is then guarded by a write lock on the start of the file:
+ * where the meta-data begins is read again from the file header, the
+ * block there is taken, the meta-data section is copied as it lies in the
+ * file to after it, and the tile header is written before the lock is
+ * released. Only when every block index is in use up to where the
+ * meta-data begins is the directory reread for a free block. The file
+ * itself learns where the section went; its pairs are left as they are,
+ * to be merged into the section when it is flushed.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param tile_num  The tile that needs a block.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
+
+static int               _sif_alloc_block(sif_file *file, long tile_num) {
+  _sif_locks *locks = (_sif_locks*)file->locks;
+  sif_file *owner = locks != 0 ? locks->file : file;
+  sif_header *hd = file->header;
+  long i, free_b = 0, end_b = -1;
+  LONGLONG loc = -1, nbytes = 0, to = 0;
+  u_char p[16];
+  int ok = 1, extent = file->use_file_version >= 4 && file->header_bytes >= SIF_HEADER_BYTES_V4;
+  /** A new block may be placed over the meta-data, so a lazily opened
+      file must have it in memory first. */
+  if (!_sif_load_meta_data(file)) {
+    return 0;
+  }
+  if (locks != 0) {
+    SIF_MUTEX_LOCK(&locks->blocks);
+  }
+  if (file->shared) {
+    if (!_sif_lock_range(file, 0, SIF_ALLOC_LOCK_BYTES, 1)) {
+      if (locks != 0) {
+	SIF_MUTEX_UNLOCK(&locks->blocks);
+      }
+      SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_LOCK, 0);
+    }
+    /** The meta-data starts right after the last block any process has
+        allocated. A header with room for it says where, as another
+        process may have moved it; otherwise the directory is read
+        again, and the meta-data runs from there to the end of the file. */
+    if (extent && _sif_read_at(file, p, 16, SIF_HEADER_BYTES_V4 - 16)
+        && (loc = _sif_packed_bytes_to_int64(p)) >= file->base_location) {
+      nbytes = _sif_packed_bytes_to_int64(p + 8);
+      end_b = (long)((loc - file->base_location + hd->tile_bytes - 1) / hd->tile_bytes);
+    }
+    else {
+      ok = _sif_refresh_directory(file, 0);
+      end_b = _sif_get_last_used_block_index(file) + 1;
+      if (!extent) {
+        loc = _sif_get_block_location(file, end_b);
+        nbytes = MAX(_sif_get_file_size(file) - loc, 0);
+      }
+      else {
+        loc = -1;
+      }
+    }
+    if (end_b >= hd->n_tiles) {
+      end_b = -1;
+      ok = _sif_refresh_directory(file, 0) && ok;
+    }
+  }
+  if (end_b != -1) {
+    free_b = end_b;
+  }
+  else {
+    /** Look for the first free tile block. */
+    for (i = 0; i < hd->n_tiles; i++) {
+      if (file->blocks_to_tiles[i] == -1) {
+	free_b = i;
+	break;
+      }
+    }
+  }
+  /** A block that runs into the meta-data extent displaces it. The
+      file itself is told, not the copy a writer may be working on. */
+  if (!file->shared && owner->use_file_version >= 4 && owner->meta_data_location >= 0
+      && _sif_get_block_location(file, free_b + 1) > owner->meta_data_location) {
+    owner->meta_data_displaced = 1;
+  }
+  file->tiles.block_nums[tile_num] = (int)free_b;
+  file->blocks_to_tiles[free_b] = (int)tile_num;
+  /** Values stored out of line that it runs into are moved out of its
+      way before it is written. */
+  if (owner->meta_data_values_start < owner->meta_data_values_end
+      && _sif_get_block_location(file, free_b + 1) > owner->meta_data_values_start) {
+    ok = _sif_move_meta_data_values(file, owner, _sif_get_block_location(file, free_b + 1)) && ok;
+  }
+  if (file->shared) {
+    if (ok) {
+      _sif_write_tile_header(file, tile_num);
+    }
+    /** The meta-data follows the last block, so it is moved past the new
+        one, and the header told where it went, before any other process
+        may allocate. */
+    if (ok && end_b != -1 && loc >= 0 && file->error == 0) {
+      to = MAX(_sif_get_block_location(file, free_b + 1), owner->meta_data_values_end);
+      if (loc < to) {
+        ok = _sif_move_meta_data_section(file, loc, nbytes, to);
+        if (ok && extent) {
+          _sif_int64_to_packed_bytes(to, p);
+          if ((ok = _sif_write_at(file, p, 8, SIF_HEADER_BYTES_V4 - 16)) != 0) {
+            owner->meta_data_location = to;
+            owner->meta_data_bytes = nbytes;
+          }
+          else {
+            file->error = SIF_ERROR_WRITE;
+          }
+        }
+      }
+    }
+    _sif_unlock_range(file, 0, SIF_ALLOC_LOCK_BYTES);
+  }
+  if (locks != 0) {
+    SIF_MUTEX_UNLOCK(&locks->blocks);
+  }
+  return ok && file->error == 0;
+}
+
+/**
+ * Frees the storage block of a tile if the tile no longer needs one. The
+ * caller holds the tile's lock; the block map is locked here.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param tile_num  The tile.
+ */
+
+static void              _sif_release_block(sif_file *file, long tile_num) {
+  _sif_locks *locks = (_sif_locks*)file->locks;
+  int *block_num = file->tiles.block_nums + tile_num;
+  if (_sif_tile_needs_block(file, tile_num) || *block_num == -1) {
+    return;
+  }
+  if (!_sif_load_directory(file)) {
+    return;
+  }
+  if (locks != 0) {
+    SIF_MUTEX_LOCK(&locks->blocks);
+  }
+  file->blocks_to_tiles[*block_num] = -1;
+  *block_num = -1;
+  if (locks != 0) {
+    SIF_MUTEX_UNLOCK(&locks->blocks);
+  }
+}
+
+/**
+ * Destroys and frees the locks of a file in concurrent write mode.
+ *
+ * @param file      The file.
+ */
+
+static void              _sif_free_locks(sif_file *file) {
+  _sif_locks *locks = (_sif_locks*)file->locks;
+  int i;
+  if (locks == 0) {
+    return;
+  }
+  for (i = 0; i < SIF_LOCK_STRIPES; i++) {
+    SIF_MUTEX_DESTROY(locks->tiles + i);
+  }
+  SIF_MUTEX_DESTROY(&locks->blocks);
+  free(locks);
+  file->locks = 0;
+}
+
+/**
+ * The start routine and argument of a thread created by the built-in
+ * executor.
+ */
+
+typedef struct {
+  void (*worker)(void *);
+  void *worker_data;
+} _sif_thread_start;
+
+#ifdef WIN32
+static DWORD WINAPI      _sif_thread_main(LPVOID arg) {
+  _sif_thread_start *start = (_sif_thread_start*)arg;
+  start->worker(start->worker_data);
+  return 0;
+}
+#else
+static void*             _sif_thread_main(void *arg) {
+  _sif_thread_start *start = (_sif_thread_start*)arg;
+  start->worker(start->worker_data);
+  return 0;
+}
+#endif
+
+/**
+ * The built-in executor, used when the caller does not supply one. It
+ * runs n_workers - 1 workers on new threads and one on the calling
+ * thread. Workers take their tasks from a shared queue, so a worker whose
+ * thread cannot be created is simply run on the calling thread afterwards.
+ *
+ * @param executor_data  Unused.
+ * @param n_workers      The number of workers to run.
+ * @param worker         The worker routine.
+ * @param worker_data    The argument passed to each worker.
+ */
+
+static void              _sif_thread_executor(void *executor_data, int n_workers,
+					      void (*worker)(void *), void *worker_data) {
+#ifdef WIN32
+  HANDLE *threads;
+#else
+  pthread_t *threads;
+#endif
+  char *started;
+  _sif_thread_start start;
+  int i;
+  start.worker = worker;
+  start.worker_data = worker_data;
+  threads = malloc(sizeof(*threads) * n_workers);
+  started = calloc(n_workers, 1);
+  if (threads == 0 || started == 0) {
+    n_workers = 1;
+  }
+  for (i = 1; i < n_workers; i++) {
+#ifdef WIN32
+    threads[i] = CreateThread(NULL, 0, _sif_thread_main, &start, 0, NULL);
+    started[i] = threads[i] != NULL;
+#else
+    started[i] = pthread_create(&threads[i], NULL, _sif_thread_main, &start) == 0;
+#endif
+  }
+  worker(worker_data);
+  for (i = 1; i < n_workers; i++) {
+    if (started[i]) {
+#ifdef WIN32
+      WaitForSingleObject(threads[i], INFINITE);
+      CloseHandle(threads[i]);
+#else
+      pthread_join(threads[i], NULL);
+#endif
+    }
+    else {
+      worker(worker_data);
+    }
+  }
+  free(threads);
+  free(started);
+}
+
+/**
+ * Copies a tile slice to a buffer, expanding uniform slices. The caller
+ * holds the tile's lock in concurrent write mode.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param buffer    The buffer, one slice long.
+ * @param tile_num  The tile.
+ * @param band      The band.
+ */
+
+static void      _sif_copy_tile_slice(sif_file *file, void *buffer, long tile_num, long band) {
+  sif_tile tile_view, *tile = _sif_tile_view(file, tile_num, &tile_view);
+  sif_header *hd = file->header;
+  u_char *upv;
+  if (_sif_band_of_tile_is_uniform_shallow(file, tile_num, band)) {
+    upv = tile->uniform_pixel_values + (hd->data_unit_size * band);
+    _sif_fill_units(buffer, upv, hd->data_unit_size, file->units_per_slice);
+  }
+  else {
+    _sif_read_cached_slice(file, tile_num, band, buffer);
+  }
+}
+
+/**
+ * Retrieves a tile slice. See sif_get_tile_slice.
+ */
+
+static void      _sif_get_tile_slice(sif_file *file, void *buffer, long tx, long ty, long band) {
+  sif_header *hd = 0;
+  long tile_num = 0;
+  hd = file->header;
+  if (tx < 0 || ty < 0 || tx >= hd->n_tiles_across) {
+    file->error = SIF_ERROR_INVALID_TN;
+    return;
+  }
+  if (band < 0 || band >= hd->bands) {
+    file->error = SIF_ERROR_INVALID_BAND;
+    return;
+  }
+  if (buffer == 0) {
+    file->error = SIF_ERROR_INVALID_BUFFER;
+    return;
+  }
+  tile_num = (hd->n_tiles_across * ty) + tx;
+  if (!_sif_lock_tile(file, tile_num)) {
+    return;
+  }
+  _sif_copy_tile_slice(file, buffer, tile_num, band);
+  _sif_unlock_tile(file, tile_num);
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+void             sif_get_tile_slice(sif_file *file, void *buffer, long tx, long ty, long band) {
+  sif_file view;
+  SIF_CHECK_FILE_V(file);
+  if (file->concurrent_reads) {
+    if (_sif_begin_concurrent_read(file, &view)) {
+      _sif_get_tile_slice(&view, buffer, tx, ty, band);
+      _sif_end_concurrent_read(&view);
+    }
+    _sif_thread_error = view.error;
+    return;
+  }
+  if (_sif_borrow_buffers(file)) {
+    _sif_get_tile_slice(file, buffer, tx, ty, band);
+    _sif_return_buffers(file);
+  }
+}
+
+/**
+ * Makes a tile slice uniform. See sif_fill_tile_slice.
+ */
+
+static void     _sif_fill_tile_slice(sif_file *file, long tx, long ty, long band, const void *value) {
+  sif_tile tile_view, *tile;
+  sif_header *hd = 0;
+  long tile_num;
+  hd = file->header;
+  if (tx < 0 || ty < 0 || tx >= hd->n_tiles_across) {
+    file->error = SIF_ERROR_INVALID_TN;
+    return;
+  }
+  if (band < 0 || band >= hd->bands) {
+    file->error = SIF_ERROR_INVALID_BAND;
+    return;
+  }
+  if (value == 0) {
+    file->error = SIF_ERROR_INVALID_BUFFER;
+    return;
+  }
+  /** Compute the tile number using the stride stored in the header. */
+  tile_num = (hd->n_tiles_across * ty) + tx;
+  tile = _sif_tile_view(file, tile_num, &tile_view);
+  //  printf("set x: %d y: %d b: %d\n", tx, ty, band);
+
+  /** We should not be changing tiles for read-only files. Return an error. */
+  if (file->read_only) {
+    file->error = SIF_ERROR_INVALID_FILE_MODE;
+    return;
+  }
+
+  if (!_sif_lock_tile(file, tile_num)) {
+    return;
+  }
+  memcpy(tile->uniform_pixel_values + (hd->data_unit_size * band), value, hd->data_unit_size);
+  SIF_SET_BIT(tile->uniform_flags, band);
+  tile->slice_encodings[band] = SIF_SLICE_ENCODING_RAW;
+  _sif_release_block(file, tile_num);
+  _sif_write_tile_header(file, tile_num);
+  _sif_unlock_tile(file, tile_num);
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+void            sif_fill_tile_slice(sif_file *file, long tx, long ty, long band, const void *value) {
+  sif_file view;
+  SIF_CHECK_FILE_V(file);
+  if (file->concurrent_writes) {
+    if (_sif_begin_concurrent_read(file, &view)) {
+      _sif_fill_tile_slice(&view, tx, ty, band, value);
+      _sif_end_concurrent_read(&view);
+    }
+    _sif_thread_error = view.error;
+    return;
+  }
+  _sif_fill_tile_slice(file, tx, ty, band, value);
+}
+
+/**
+ * Reads a tile slice and pins it. See sif_pin_tile_slice.
+ */
+
+static const void* _sif_pin_tile_slice(sif_file *file, long tx, long ty, long band) {
+  sif_header *hd = file->header;
+  _sif_cache_entry *e = 0;
+  long tile_num, generation = 0;
+  int rc = -1;
+  if (tx < 0 || ty < 0 || tx >= hd->n_tiles_across) {
+    file->error = SIF_ERROR_INVALID_TN;
+    return 0;
   }
-  else {
-    if (value_len != i->value_length) {
-      SIF_ERROR_CHECK_RETURN_V((i->value = (char*)realloc(i->value, value_len * sizeof(char))) == 0, SIF_ERROR_MEM);
-      i->value_length = value_len;
-      memcpy(i->value, value, sizeof(char) * value_len);
+  if (band < 0 || band >= hd->bands) {
+    file->error = SIF_ERROR_INVALID_BAND;
+    return 0;
+  }
+  tile_num = (hd->n_tiles_across * ty) + tx;
+  if (tile_num >= hd->n_tiles) {
+    file->error = SIF_ERROR_INVALID_TN;
+    return 0;
+  }
+  if (!_sif_lock_tile(file, tile_num)) {
+    return 0;
+  }
+  if (_sif_cache_is_cacheable(file, tile_num, band)) {
+    rc = _sif_cache_pin(file, tile_num, band, &e, &generation);
+  }
+  if (rc != 1) {
+    e = _sif_cache_new_entry(file, tile_num, band, generation);
+    if (e == 0) {
+      _sif_unlock_tile(file, tile_num);
+      SIF_ERROR_CHECK_RETURN(1, SIF_ERROR_MEM, 0);
+    }
+    e->pins = 1;
+    /** A slice that is not cached is decoded into the pin's own memory. */
+    if (rc == -1) {
+      _sif_copy_tile_slice(file, e + 1, tile_num, band);
+    }
+    else {
+      _sif_read_slice(file, tile_num, band, (u_char*)(e + 1));
+    }
+    if (file->error != 0) {
+      free(e);
+      e = 0;
+    }
+    else if (rc == 0) {
+      e = _sif_cache_add(e);
     }
   }
+  _sif_unlock_tile(file, tile_num);
+  return e != 0 ? (const void*)(e + 1) : 0;
+}
 
+/* See sif-io.h for detailed documentation of public functions. */
+const void*     sif_pin_tile_slice(sif_file *file, long tx, long ty, long band) {
+  sif_file view;
+  const void *slice = 0;
+  SIF_CHECK_FILE(file);
+  if (file->concurrent_reads) {
+    if (_sif_begin_concurrent_read(file, &view)) {
+      slice = _sif_pin_tile_slice(&view, tx, ty, band);
+      _sif_end_concurrent_read(&view);
+    }
+    _sif_thread_error = view.error;
+    return slice;
+  }
+  if (_sif_borrow_buffers(file)) {
+    slice = _sif_pin_tile_slice(file, tx, ty, band);
+    _sif_return_buffers(file);
+  }
+  return slice;
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
-void             sif_set_meta_data(sif_file *file, const char *key, const char *value) {
+void            sif_unpin_tile_slice(const void *slice) {
+  if (slice != 0) {
+    _sif_cache_unpin(((_sif_cache_entry*)slice) - 1);
+  }
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+void            sif_set_cache_size(size_t n_bytes) {
+  _sif_cache_lock();
+  _sif_cache.budget = n_bytes;
+  _sif_cache_evict();
+  _sif_cache_unlock();
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+void            sif_trim_memory(sif_file *file) {
+  _sif_scratch *b;
+  if (file != 0) {
+    free(file->simple_region_buffer);
+    file->simple_region_buffer = 0;
+    file->simple_region_bytes = 0;
+    _sif_compact_meta_data(file);
+  }
+  _sif_cache_lock();
+  if (file != 0 && file->cache_id != 0) {
+    _sif_cache_purge(file->cache_id);
+  }
+  /** free the idle blocks of the scratch pool. Blocks borrowed by calls in
+      progress come back to the pool as usual. */
+  while ((b = _sif_cache.scratch) != 0) {
+    _sif_cache.scratch = b->next;
+    free(b);
+  }
+  _sif_cache.n_scratch = 0;
+  _sif_cache_unlock();
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+size_t          sif_get_memory_usage(sif_file *file) {
+  sif_header *hd;
+  _sif_arena_block *b;
+  _sif_cache_entry *e;
+  size_t total;
+  int j;
+  if (file == 0 || file->header == 0) {
+    return 0;
+  }
+  hd = file->header;
+  total = sizeof(sif_file) + sizeof(sif_header);
+
+  /** the tile directory: the headers, their flags, uniform pixel values,
+      slice encodings and gradients, and the block map. */
+  if (file->tiles.block_nums != 0) {
+    total += (size_t)hd->n_tiles * (hd->n_uniform_flags + sizeof(int) + hd->bands
+                                    + hd->bands * hd->data_unit_size * 3);
+  }
+  if (file->blocks_to_tiles != 0) {
+    total += (size_t)hd->n_tiles * sizeof(int);
+  }
+  if (file->dirty_tiles != 0) {
+    total += SIF_SIZE_FLAG_ARRAY((size_t)hd->n_tiles);
+  }
+
+  /** the meta-data table and the arena holding its items. */
+  total += file->meta_data.n_slots * (sizeof(sif_meta_data*) + sizeof(unsigned long));
+  for (b = (_sif_arena_block*)file->meta_data_arena; b != 0; b = b->next) {
+    total += SIF_ARENA_ALIGN(sizeof(_sif_arena_block)) + b->size;
+  }
+  total += file->simple_region_bytes;
+  if (file->scratch_depth > 0) {
+    total += (size_t)hd->data_unit_size * file->units_per_tile * 2;
+  }
+  if (file->locks != 0) {
+    total += sizeof(_sif_locks);
+  }
+  if (file->lazy != 0) {
+    total += sizeof(_sif_lazy) + ((_sif_lazy*)file->lazy)->n_chunks * sizeof(long);
+  }
+
+  /** the slices of the file in the slice cache. */
+  if (file->cache_id != 0) {
+    _sif_cache_lock();
+    for (j = SIF_CACHE_PROBATION; j <= SIF_CACHE_PROTECTED; j++) {
+      for (e = _sif_cache.head[j]; e != 0; e = e->next) {
+        if (e->file_id == file->cache_id) {
+          total += sizeof(_sif_cache_entry) + e->nbytes;
+        }
+      }
+    }
+    _sif_cache_unlock();
+  }
+  return total;
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+void            sif_fill_tiles(sif_file *file, long band, const void *value) {
+  sif_tile tile_view, *tile;
+  sif_header *hd = 0;
+  long tile_num;
+
   SIF_CHECK_FILE_V(file);
-  _sif_set_meta_data_len(file, key, value, strlen(value) + 1);
+  hd = file->header;
+  if (band < 0 || band >= hd->bands) {
+    file->error = SIF_ERROR_INVALID_BAND;
+    return;
+  }
+  if (value == 0) {
+    file->error = SIF_ERROR_INVALID_BUFFER;
+    return;
+  }
+  /** We should not be changing tiles for read-only files. Return an error. */
+  if (file->read_only) {
+     file->error = SIF_ERROR_INVALID_FILE_MODE;
+     return;
+  }
+  if (!_sif_load_directory(file)) {
+    return;
+  }
+
+  for (tile_num = 0; tile_num < hd->n_tiles; tile_num++) {
+     /** Compute the tile number using the stride stored in the header. */
+     tile = _sif_tile_view(file, tile_num, &tile_view);
+     /**  printf("set x: %d y: %d b: %d\n", tx, ty, band);**/
+  
+     memcpy(tile->uniform_pixel_values + (hd->data_unit_size * band), value, hd->data_unit_size);
+     SIF_SET_BIT(tile->uniform_flags, band);
+     tile->slice_encodings[band] = SIF_SLICE_ENCODING_RAW;
+     _sif_release_block(file, tile_num);
+     _sif_cache_invalidate(file, tile_num);
+  }
+  _sif_write_tile_headers(file);
+#ifndef WIN32
+  /** Positional writes by concurrent writers must not be overtaken by
+      buffered ones. */
+  if (file->concurrent_writes) {
+    fflush(file->fp);
+  }
+#endif
+}
+
+/**
+ * Writes a tile slice. The caller has checked the arguments and holds the
+ * tile's lock in concurrent write mode. Uses the second block buffer of
+ * the file as scratch space.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param buffer    The slice to write.
+ * @param tile_num  The tile.
+ * @param band      The band.
+ */
+
+static void     _sif_put_tile_slice(sif_file *file, const void *buffer, long tile_num, long band) {
+  sif_tile tile_view, *tile = 0;
+  sif_header *hd = file->header;
+  long i = 0, tx, ty, extentX = 0, extentY = 0, slice_bytes;
+  int encoding = SIF_SLICE_ENCODING_RAW, packed;
+  tx = tile_num % hd->n_tiles_across;
+  ty = tile_num / hd->n_tiles_across;
+  extentX = MIN(hd->tile_width, hd->width - tx * hd->tile_width);
+  extentY = MIN(hd->tile_height, hd->height - ty * hd->tile_height);
+  tile = _sif_tile_view(file, tile_num, &tile_view);
+
+  /** Slices of 1-bit mask files are always packed. */
+  packed = _sif_has_packed_slices(file);
+  if (packed) {
+    _sif_pack_bits(buffer, file->units_per_slice, file->buffer[1]);
+    encoding = SIF_SLICE_ENCODING_BITS;
+  }
+
+  /** If the flag intrinsic_write is set, that means we check for pixel
+      uniformity on a write. */
+  if (hd->intrinsic_write
+      && (packed ? _sif_packed_is_uniform(file, file->buffer[1], extentX, extentY)
+          : _sif_is_uniform(file, buffer, extentX, extentY))) {
+    memcpy(tile->uniform_pixel_values + (hd->data_unit_size * band), buffer, hd->data_unit_size);
+    if (packed) {
+      tile->uniform_pixel_values[band] = (((u_char*)file->buffer[1])[0] & 1);
+    }
+    SIF_SET_BIT(tile->uniform_flags, band);
+    tile->slice_encodings[band] = SIF_SLICE_ENCODING_RAW;
+    _sif_release_block(file, tile_num);
+    _sif_write_tile_header(file, tile_num);
+    return;
+  }
+  /** Look for a more compact way of storing the slice. A linear ramp is
+      stored entirely in the tile header so it may free up the block. */
+  if (hd->intrinsic_write && !packed) {
+    encoding = _sif_encode_slice(file, tile, band, buffer, extentX, extentY, file->buffer[1]);
+    if (encoding == SIF_SLICE_ENCODING_PLANE) {
+      SIF_CLEAR_BIT(tile->uniform_flags, band);
+      tile->slice_encodings[band] = (u_char)encoding;
+      _sif_release_block(file, tile_num);
+      _sif_write_tile_header(file, tile_num);
+      return;
+    }
+  }
+  /** If we've gotten here then the tile is non-uniform or we're presuming that
+      it is. If each slice of the tile cube was uniform before, we need to find
+      a free spot on disk to put the tile cube. */
+  if (file->tiles.block_nums[tile_num] == -1) {
+    if (!_sif_alloc_block(file, tile_num)) {
+      return;
+    }
+    /** Write the buffer out n times where n is the number of bands. Raster
+        data stored for uniform bands will be ignored.*/
+    slice_bytes = hd->tile_bytes / hd->bands;
+    for (i = 0; i < hd->bands; i++) {
+      SIF_ERROR_CHECK_RETURN_V(_sif_write_at(file, buffer, slice_bytes,
+                                             _sif_get_block_location(file, file->tiles.block_nums[tile_num]) + i * slice_bytes) == 0,
+                               SIF_ERROR_WRITE);
+    }
+  }
+  /** If we already checked for pixel uniformity, we don't need to do
+      it again. */
+  if (hd->intrinsic_write == 0) {
+    SIF_ATOMIC_SET_BIT(file->dirty_tiles, tile_num);
+  }
+  /** Write the non-uniform slice to disk at its location in the block. */
+  if (encoding == SIF_SLICE_ENCODING_RAW) {
+    SIF_ERROR_CHECK_RETURN_V(_sif_write_at(file, buffer, hd->data_unit_size * file->units_per_slice,
+                                           _sif_get_slice_location(file, tile_num, band)) == 0, SIF_ERROR_WRITE);
+  }
+  else {
+    SIF_ERROR_CHECK_RETURN_V(_sif_write_at(file, file->buffer[1], _sif_encoded_slice_bytes(file, encoding),
+                                           _sif_get_slice_location(file, tile_num, band)) == 0, SIF_ERROR_WRITE);
+  }
+
+  /** Set the uniformity flag for this band to false. */
+  SIF_CLEAR_BIT(tile->uniform_flags, band);
+  tile->slice_encodings[band] = (u_char)encoding;
+
+  /** Write the tile header out to disk. */
+  _sif_write_tile_header(file, tile_num);
+}
+
+/**
+ * Writes a tile slice. See sif_set_tile_slice.
+ */
+
+static void     _sif_set_tile_slice(sif_file *file, const void *buffer, long tx, long ty, long band) {
+  sif_header *hd = file->header;
+  long tile_num;
+  if (tx < 0 || ty < 0 || tx >= hd->n_tiles_across) {
+    file->error = SIF_ERROR_INVALID_TN;
+    return;
+  }
+  if (band < 0 || band >= hd->bands) {
+    file->error = SIF_ERROR_INVALID_BAND;
+    return;
+  }
+  if (buffer == 0) {
+    file->error = SIF_ERROR_INVALID_BUFFER;
+    return;
+  }
+  /** We should not be changing tiles for read-only files. Return an error. */
+  if (file->read_only) {
+    file->error = SIF_ERROR_INVALID_FILE_MODE;
+    return;
+  }
+  /** Compute the tile number using the stride stored in the header. */
+  tile_num = (hd->n_tiles_across * ty) + tx;
+  if (!_sif_lock_tile(file, tile_num)) {
+    return;
+  }
+  _sif_put_tile_slice(file, buffer, tile_num, band);
+  _sif_unlock_tile(file, tile_num);
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
-void             sif_set_meta_data_binary(sif_file *file, const char *key, const void *buffer, int n_bytes) {
+void            sif_set_tile_slice(sif_file *file, const void *buffer, long tx, long ty, long band) {
+  sif_file view;
   SIF_CHECK_FILE_V(file);
-  _sif_set_meta_data_len(file, key, (const char*)buffer, n_bytes);
+  if (file->concurrent_writes) {
+    if (_sif_begin_concurrent_read(file, &view)) {
+      _sif_set_tile_slice(&view, buffer, tx, ty, band);
+      _sif_end_concurrent_read(&view);
+    }
+    _sif_thread_error = view.error;
+    return;
+  }
+  if (_sif_borrow_buffers(file)) {
+    _sif_set_tile_slice(file, buffer, tx, ty, band);
+    _sif_return_buffers(file);
+  }
+}
+
+/**
+ * Writes a rectangular region. See sif_set_raster.
+ */
+
+static void      _sif_set_raster(sif_file* file, const void *data,
+                                 long x, long y, long w, long h, long band) {
+  const unsigned char *datav = data; /** makes VC++ happy. can't do
+                                         pointer arithmetic on void*'s! */
+  long tnx1, tny1, tnx2, tny2; /** the starting and ending tile indices. */
+  long sxt, syt, ext, eyt;     /** the starting and ending coordinates on the tile raster. */
+  long sxd, syd;               /** the starting coordinates on the data raster. */
+  long cyd, cyt;               /** the current ordinates for the data and tile rasters. */
+  long tx, ty;                 /** the current working tile indices. */
+  long tw, th, trs, dus, wdus; /** the tile width, height, data unit size, scan line byte size. */
+  long tile_num;
+  sif_header *hd;                  /** header */
+  unsigned char *buffer;                     /** buffer */
+  if (file->read_only) {
+    return;
+  }
+  hd = file->header;
+  if (x < 0 || y < 0) {
+    file->error = SIF_ERROR_INVALID_COORD;
+    return;
+  }
+  if (w < 1 || h < 1 || x + w > hd->width || y + h > hd->height) {
+    file->error = SIF_ERROR_INVALID_REGION_SIZE;
+    return;
+  }
+  if (band < 0 || band >= hd->bands) {
+    file->error = SIF_ERROR_INVALID_BAND;
+    return;
+  }
+  buffer = file->buffer[0];
+  tw = hd->tile_width;
+  th = hd->tile_height;
+  trs = tw * hd->data_unit_size; /** the number of bytes in a tile row. */
+  dus = hd->data_unit_size;/** size of a single pixel in bytes. */
+  wdus = dus * w;          /** width of a single scan line. */
+  tnx1 = x / tw;           /** the starting tile horizontal index. */
+  tny1 = y / th;           /** the starting tile vertical index. */
+  tnx2 = (x + w - 1) / tw; /** the end tile horizontal index. */
+  tny2 = (y + h - 1) / th; /** the end tile vertical index. */
+  for (ty = tny1; ty <= tny2; ty++) {
+    for (tx = tnx1; tx <= tnx2; tx++) {
+      /** grab the tile, keeping it locked until it is put back. */
+      tile_num = (hd->n_tiles_across * ty) + tx;
+      if (!_sif_lock_tile(file, tile_num)) {
+	return;
+      }
+      _sif_copy_tile_slice(file, buffer, tile_num, band);
+      if (file->error != 0) {
+	_sif_unlock_tile(file, tile_num);
+	return;
+      }
+      sxt = MAX(0, x - tx * tw);                  /** starting x pixel on tile raster. */
+      syt = MAX(0, y - ty * th);                  /** starting y pixel on tile raster. */
+      ext = MIN(tw - 1, x + w - 1 - (tx * tw));   /** ending x pixel on tile raster. */
+      eyt = MIN(th - 1, y + h - 1 - (ty * th));   /** ending y pixel on tile raster. */
+      sxd = (tx * tw + sxt) - x;                  /** starting x pixel on data raster. */
+      syd = (ty * th + syt) - y;                  /** starting y pixel on data raster. */
+
+      /** copy the window from the raster to the tile.*/
+      for (cyd = syd, cyt = syt; cyt <= eyt; cyd++, cyt++) {
+	memcpy(buffer + (cyt * trs) + (sxt * dus), datav + (cyd * wdus) + (sxd * dus), (ext - sxt + 1) * dus);
+      }
+      /** put the tile back with modifications. */
+      _sif_put_tile_slice(file, buffer, tile_num, band);
+      _sif_unlock_tile(file, tile_num);
+      if (file->error) {
+	return;
+      }
+    }
+  }
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+void             sif_set_raster(sif_file* file, const void *data,
+                                long x, long y, long w, long h, long band) {
+  sif_file view;
+  SIF_CHECK_FILE_V(file);
+  if (file->concurrent_writes) {
+    if (_sif_begin_concurrent_read(file, &view)) {
+      _sif_set_raster(&view, data, x, y, w, h, band);
+      _sif_end_concurrent_read(&view);
+    }
+    _sif_thread_error = view.error;
+    return;
+  }
+  if (_sif_borrow_buffers(file)) {
+    _sif_set_raster(file, data, x, y, w, h, band);
+    _sif_return_buffers(file);
+  }
 }
 
 /**
- * Return the last used block index in the file.
- *
- * @param file The file to compute the last used block index.
+ * The state of a streaming scan line writer. Rows are gathered into one of
+ * two buffers, each holding a row of tiles as consecutive tile slices; the
+ * other buffer is written by the background thread.
+ */
+
+struct _sif_row_writer {
+  sif_file *file;                   /** the file written. */
+  long band;                        /** the band written. */
+  long row;                         /** the next scan line to be put. */
+  u_char *rows[2];                  /** the two row-of-tiles buffers. */
+  int fill;                         /** the index of the buffer being filled. */
+  u_char *job;                      /** the buffer being written. */
+  long job_ty;                      /** the row of tiles being written. */
+  long job_rows;                    /** the number of scan lines in it. */
+  int job_error;                    /** the error of the background write. */
+  int error;                        /** the first error, kept by the caller's thread. */
+  int started;                      /** non-zero while a thread is running. */
+  _sif_thread_start start;          /** the start routine of the thread. */
+#ifdef WIN32
+  HANDLE thread;
+#else
+  pthread_t thread;
+#endif
+};
+
+/**
+ * Writes the row of tiles of a streaming writer's job. A tile of which
+ * only the top scan lines were given is merged with its previous contents.
  *
- * @return The last used block index. -1 is returned
- *         if no blocks are in use.
+ * @param arg       The writer.
  */
 
-static long         _sif_get_last_used_block_index(sif_file *file) {
-  long i = 0;
-  long last_known_used_block = -1;
-  for (; i < file->header->n_tiles; i++) {
-    if (file->blocks_to_tiles[i] != -1) {
-      last_known_used_block = i;
+static void      _sif_row_writer_main(void *arg) {
+  sif_row_writer *writer = (sif_row_writer*)arg;
+  sif_file view, *file = writer->file;
+  sif_header *hd = file->header;
+  long tx, tile_num, extentY;
+  long slice_bytes = hd->data_unit_size * file->units_per_slice;
+  const u_char *src;
+  if (file->concurrent_writes) {
+    if (!_sif_begin_concurrent_read(file, &view)) {
+      writer->job_error = view.error;
+      return;
     }
+    file = &view;
+  }
+  extentY = MIN(hd->tile_height, hd->height - writer->job_ty * hd->tile_height);
+  for (tx = 0; tx < hd->n_tiles_across; tx++) {
+    tile_num = (hd->n_tiles_across * writer->job_ty) + tx;
+    if (!_sif_lock_tile(file, tile_num)) {
+      break;
+    }
+    src = writer->job + tx * slice_bytes;
+    if (writer->job_rows < extentY) {
+      _sif_copy_tile_slice(file, file->buffer[0], tile_num, writer->band);
+      memcpy(file->buffer[0], src, writer->job_rows * hd->tile_width * hd->data_unit_size);
+      src = file->buffer[0];
+    }
+    if (file->error == 0) {
+      _sif_put_tile_slice(file, src, tile_num, writer->band);
+    }
+    _sif_unlock_tile(file, tile_num);
+    if (file->error != 0) {
+      break;
+    }
+  }
+  writer->job_error = file->error;
+  if (file == &view) {
+    _sif_end_concurrent_read(&view);
   }
-  return last_known_used_block;
 }
 
 /**
- * Truncate the file at a particular position.
+ * Waits for the background thread of a streaming writer, if one is
+ * running, and takes up the error of its write.
  *
- * @param file   The file to truncate.
- * @param pos    The position of truncation.
+ * @param writer    The writer.
  */
 
-static void             _sif_truncate(sif_file *file, LONGLONG pos) {
+static void      _sif_row_writer_join(sif_row_writer *writer) {
+  if (writer->started) {
 #ifdef WIN32
-  FSEEK64V(file->fp, pos, SEEK_SET);
-  SIF_ERROR_CHECK_RETURN_V(SetEndOfFile(file->fp) == 0, SIF_ERROR_TRUNCATE)
+    WaitForSingleObject(writer->thread, INFINITE);
+    CloseHandle(writer->thread);
 #else
-  SIF_ERROR_CHECK_RETURN_V(ftruncate(fileno(file->fp), pos) != 0, SIF_ERROR_TRUNCATE);
+    pthread_join(writer->thread, NULL);
 #endif
+    writer->started = 0;
+  }
+  if (writer->error == 0) {
+    writer->error = writer->job_error;
+  }
 }
 
 /**
- * Read the meta-data from the disk, storing the contents in
- * the file structure for easy access.
+ * Hands the buffer being filled to the background thread, once the
+ * previous one has been written, and switches to the other buffer.
  *
- * @param file   The file to read the meta data.
+ * @param writer    The writer.
+ * @param n_rows    The number of scan lines in the buffer.
  */
-static void             _sif_read_meta_data(sif_file *file) {
-  sif_header *header = 0;
-  LONGLONG loc = 0;
-  unsigned int i = 0;
-  long val = 0;
-  int n_keys;
 
-  /**  sif_meta_data *md = 0;**/
-  sif_meta_data md;
-  header = file->header;
-
-  n_keys = header->n_keys;
-  header->n_keys = 0;
-  /** move the file pointer to one after the last used block. **/
-  loc = _sif_get_block_location(file, _sif_get_last_used_block_index(file) + 1);
-  FSEEK64V(file->fp, loc, SEEK_SET);
-
-  /**
-   * This code is usually executed during an open. As such, the file structure
-   * has not been completely initialized. FREAD64NEC must be used instead of FREAD64
-   * because we must free the memory before returning upon an error.
-   */
-  for (i = 0; i < n_keys; i++) {
-    if (FREAD64INT32NEC(val, file) == 0) {
-      _sif_free_meta_data(file);
-      SIF_ERROR_CHECK_RETURN_V(1, SIF_ERROR_READ);
-    }
-    md.key_length = (unsigned long)val;
-    if ((md.key = malloc(sizeof(char) * md.key_length)) == 0) {
-      _sif_free_meta_data(file);
-      SIF_ERROR_CHECK_RETURN_V(1, SIF_ERROR_MEM);
-    }
-    if (md.key_length != 0) {
-      (md.key)[md.key_length - 1] = 0;
-    }
-    if (FREAD64NEC(md.key, 1, md.key_length, file->fp) != md.key_length) {
-      free(md.key);
-      _sif_free_meta_data(file);
-      SIF_ERROR_CHECK_RETURN_V(1, SIF_ERROR_READ);
-    }
-    if (FREAD64INT32NEC(val, file) == 0) {
-      free(md.key);
-      _sif_free_meta_data(file);
-      SIF_ERROR_CHECK_RETURN_V(1, SIF_ERROR_READ);
-    }
-    md.value_length = val;
-    if ((md.value = malloc(sizeof(char) * md.value_length)) == 0) {
-      free(md.key);
-      _sif_free_meta_data(file);
-      SIF_ERROR_CHECK_RETURN_V(1, SIF_ERROR_MEM);
-    }
-    /**    (md.value)[md.value_length] = 0;**/
-    if (FREAD64NEC(md.value, 1, md.value_length, file->fp) == 0) {
-      free(md.value);
-      free(md.key);
-      _sif_free_meta_data(file);
-      SIF_ERROR_CHECK_RETURN_V(1, SIF_ERROR_READ);
-    }
-    sif_set_meta_data_binary(file, md.key, md.value, md.value_length);
-    free(md.value);
-    free(md.key);
-    if (file->error) {
-      return;
-    }
+static void      _sif_row_writer_emit(sif_row_writer *writer, long n_rows) {
+  _sif_row_writer_join(writer);
+  if (writer->error != 0) {
+    return;
+  }
+  writer->job = writer->rows[writer->fill];
+  writer->job_ty = (writer->row - 1) / writer->file->header->tile_height;
+  writer->job_rows = n_rows;
+  writer->job_error = 0;
+  writer->fill ^= 1;
+#ifdef WIN32
+  writer->thread = CreateThread(NULL, 0, _sif_thread_main, &writer->start, 0, NULL);
+  writer->started = writer->thread != NULL;
+#else
+  writer->started = pthread_create(&writer->thread, NULL, _sif_thread_main, &writer->start) == 0;
+#endif
+  if (!writer->started) {
+    _sif_row_writer_main(writer);
+    writer->error = writer->job_error;
   }
 }
 
 /**
- * Write the meta data from the file structure to the disk.
+ * Reports the error of a streaming writer the way the file reports errors
+ * of write calls. The error is only reported once the background thread
+ * has been joined, so that the file is not changed while it is in use.
  *
- * @param file        The file containing the meta-data structure to write.
+ * @param writer    The writer.
+ *
+ * @return          Zero if there is no error, -1 otherwise.
  */
 
-static int             _sif_write_meta_data(sif_file *file) {
-  sif_header *header = 0;
-  LONGLONG loc = 0, eofpos = 0;
-  sif_meta_data *i = 0;
-  int j = 0;
-  header = file->header;
-  loc = _sif_get_block_location(file, _sif_get_last_used_block_index(file) + 1);
-  eofpos = loc;
-  FSEEK64(file->fp, loc, SEEK_SET);
-  for (j = 0; j < SIF_HASH_TABLE_SIZE; j++) {
-    for (i = file->meta_data[j]; i != 0; i = i->next) {
-      FWRITE64INT32(i->key_length, file); eofpos += 4;
-      FWRITE64(i->key, i->key_length, 1, file->fp); eofpos += i->key_length;
-      FWRITE64INT32(i->value_length, file); eofpos += 4;
-      FWRITE64(i->value, i->value_length, 1, file->fp); eofpos += i->value_length;
-    }
+static int       _sif_row_writer_result(sif_row_writer *writer) {
+  if (writer->error == 0) {
+    return 0;
   }
-  eofpos = eofpos + 1;
-  _sif_truncate(file, eofpos);
-  return 1;
+  if (writer->file->concurrent_writes) {
+    _sif_thread_error = writer->error;
+  }
+  else {
+    writer->file->error = writer->error;
+  }
+  return -1;
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
-void             sif_get_tile_slice(sif_file *file, void *buffer, long tx, long ty, long band) {
-  sif_tile *tile = 0;
-  sif_header *hd = 0;
-  long i = 0, tile_num = 0;
-  LONGLONG pos = 0;
-  u_char *data = buffer, *upv;
-  //  printf("get x: %d y: %d b: %d\n", tx, ty, band);
-  SIF_CHECK_FILE_V(file);
-  hd = file->header;
-  if (tx < 0 || ty < 0 || tx >= hd->n_tiles_across) {
-    file->error = SIF_ERROR_INVALID_TN;
-    return;
+sif_row_writer*  sif_row_writer_open(sif_file *file, long band) {
+  sif_row_writer *writer;
+  long row_bytes;
+  SIF_CHECK_FILE(file);
+  if (file->read_only) {
+    file->error = SIF_ERROR_INVALID_FILE_MODE;
+    return 0;
   }
-  if (band < 0 || band >= hd->bands) {
+  if (band < 0 || band >= file->header->bands) {
     file->error = SIF_ERROR_INVALID_BAND;
-    return;
+    return 0;
   }
-  if (buffer == 0) {
-    file->error = SIF_ERROR_INVALID_BUFFER;
-    return;
+  /** Without concurrent writes, the background thread uses the file's
+      own block buffers, held until the writer is closed. */
+  if (!file->concurrent_writes && !_sif_borrow_buffers(file)) {
+    return 0;
   }
-  tile_num = (hd->n_tiles_across * ty) + tx;
-  tile = file->tiles + tile_num;
-  bzero(buffer, hd->data_unit_size * file->units_per_slice);
-  if (_sif_band_of_tile_is_uniform_shallow(file, tile_num, band)) {
-	  upv = tile->uniform_pixel_values + (hd->data_unit_size * band);
-	  if (hd->data_unit_size > 1) {
-		for (i = 0, data = buffer; i < file->units_per_slice; i++, data += hd->data_unit_size) {
-			memcpy(data, upv, hd->data_unit_size);
-		}
-	  }
-	  else {
-		memset(data, upv[0], file->units_per_slice);
-	  }
+  writer = (sif_row_writer*)malloc(sizeof(sif_row_writer));
+  row_bytes = file->header->n_tiles_across * file->units_per_slice * file->header->data_unit_size;
+  if (writer == 0 || (writer->rows[0] = (u_char*)calloc(2, row_bytes)) == 0) {
+    free(writer);
+    if (!file->concurrent_writes) {
+      _sif_return_buffers(file);
+    }
+    file->error = SIF_ERROR_MEM;
+    file->error_line_no = __LINE__;
+    return 0;
   }
-  else {
-    pos = _sif_get_block_location(file, tile->block_num) + (hd->data_unit_size * file->units_per_slice) * band;
-    FSEEK64V(file->fp, pos, SEEK_SET);
-    FREAD64V(buffer, hd->data_unit_size, file->units_per_slice, file->fp);
+  writer->rows[1] = writer->rows[0] + row_bytes;
+  writer->file = file;
+  writer->band = band;
+  writer->row = 0;
+  writer->fill = 0;
+  writer->job = 0;
+  writer->job_error = 0;
+  writer->error = 0;
+  writer->started = 0;
+  writer->start.worker = _sif_row_writer_main;
+  writer->start.worker_data = writer;
+  return writer;
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+int              sif_row_writer_put(sif_row_writer *writer, const void *rows, long n_rows) {
+  sif_file *file = writer->file;
+  sif_header *hd = file->header;
+  const u_char *src = (const u_char*)rows;
+  long tw = hd->tile_width, th = hd->tile_height, dus = hd->data_unit_size;
+  long slice_bytes = dus * file->units_per_slice;
+  long tx, r, cyt;
+  u_char *dst;
+  int error = 0;
+  if (n_rows < 0 || writer->row + n_rows > hd->height) {
+    error = SIF_ERROR_INVALID_REGION_SIZE;
+  }
+  else if (rows == 0 && n_rows > 0) {
+    error = SIF_ERROR_INVALID_BUFFER;
+  }
+  if (error != 0) {
+    _sif_row_writer_join(writer);
+    if (writer->error == 0) {
+      writer->error = error;
+    }
   }
-  return;
+  for (r = 0; r < n_rows && writer->error == 0; r++, src += hd->width * dus) {
+    /** scatter the scan line over the tiles of the row. */
+    cyt = writer->row % th;
+    dst = writer->rows[writer->fill] + cyt * tw * dus;
+    for (tx = 0; tx < hd->n_tiles_across; tx++, dst += slice_bytes) {
+      memcpy(dst, src + tx * tw * dus, MIN(tw, hd->width - tx * tw) * dus);
+    }
+    writer->row++;
+    if (cyt == th - 1 || writer->row == hd->height) {
+      _sif_row_writer_emit(writer, cyt + 1);
+    }
+  }
+  return _sif_row_writer_result(writer);
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
-void            sif_fill_tile_slice(sif_file *file, long tx, long ty, long band, const void *value) {
-  sif_tile *tile;
-  sif_header *hd = 0;
-  long tile_num;
-  SIF_CHECK_FILE_V(file);
-  hd = file->header;
-  if (tx < 0 || ty < 0 || tx >= hd->n_tiles_across) {
-    file->error = SIF_ERROR_INVALID_TN;
-    return;
+int              sif_row_writer_close(sif_row_writer *writer) {
+  int result;
+  long pending = writer->row % writer->file->header->tile_height;
+  if (pending != 0 && writer->row < writer->file->header->height && writer->error == 0) {
+    _sif_row_writer_emit(writer, pending);
+  }
+  _sif_row_writer_join(writer);
+  result = _sif_row_writer_result(writer);
+  if (!writer->file->concurrent_writes) {
+    _sif_return_buffers(writer->file);
+  }
+  free(writer->rows[0]);
+  free(writer);
+  return result;
+}
+
+/**
+ * The state of a streaming scan line reader. One of its two buffers holds
+ * the row of tiles scan lines are returned from, as consecutive tile
+ * slices; the next row of tiles is read into the other by the background
+ * thread.
+ */
+
+struct _sif_row_reader {
+  sif_file *file;                   /** the file read. */
+  long band;                        /** the band read. */
+  long row;                         /** the next scan line to be returned. */
+  u_char *rows[2];                  /** the two row-of-tiles buffers. */
+  u_char *cur;                      /** the buffer scan lines are returned from. */
+  long cur_ty;                      /** the row of tiles in it, or -1. */
+  u_char *job;                      /** the buffer being read. */
+  long job_ty;                      /** the row of tiles being read, or -1. */
+  int job_error;                    /** the error of the background read. */
+  int error;                        /** the first error, kept by the caller's thread. */
+  int started;                      /** non-zero while a thread is running. */
+  _sif_thread_start start;          /** the start routine of the thread. */
+#ifdef WIN32
+  HANDLE thread;
+#else
+  pthread_t thread;
+#endif
+};
+
+/**
+ * Reads the row of tiles of a streaming reader's job.
+ *
+ * @param arg       The reader.
+ */
+
+static void      _sif_row_reader_main(void *arg) {
+  sif_row_reader *reader = (sif_row_reader*)arg;
+  sif_file view, *file = reader->file;
+  sif_header *hd = file->header;
+  long tx, tile_num;
+  long slice_bytes = hd->data_unit_size * file->units_per_slice;
+  if (file->concurrent_reads) {
+    if (!_sif_begin_concurrent_read(file, &view)) {
+      reader->job_error = view.error;
+      return;
+    }
+    file = &view;
   }
-  if (band < 0 || band >= hd->bands) {
-    file->error = SIF_ERROR_INVALID_BAND;
-    return;
+  for (tx = 0; tx < hd->n_tiles_across; tx++) {
+    tile_num = (hd->n_tiles_across * reader->job_ty) + tx;
+    if (!_sif_lock_tile(file, tile_num)) {
+      break;
+    }
+    _sif_copy_tile_slice(file, reader->job + tx * slice_bytes, tile_num, reader->band);
+    _sif_unlock_tile(file, tile_num);
+    if (file->error != 0) {
+      break;
+    }
   }
-  if (value == 0) {
-    file->error = SIF_ERROR_INVALID_BUFFER;
-    return;
+  reader->job_error = file->error;
+  if (file == &view) {
+    _sif_end_concurrent_read(&view);
   }
-  /** Compute the tile number using the stride stored in the header. */
-  tile_num = (hd->n_tiles_across * ty) + tx;
-  tile = file->tiles + tile_num;
-  //  printf("set x: %d y: %d b: %d\n", tx, ty, band);
+}
 
-  /** We should not be changing tiles for read-only files. Return an error. */
-  if (file->read_only) {
-    file->error = SIF_ERROR_INVALID_FILE_MODE;
-    return;
+/**
+ * Waits for the read ahead of a streaming reader, if one is running, and
+ * takes up the error of its read.
+ *
+ * @param reader    The reader.
+ */
+
+static void      _sif_row_reader_join(sif_row_reader *reader) {
+  if (reader->started) {
+#ifdef WIN32
+    WaitForSingleObject(reader->thread, INFINITE);
+    CloseHandle(reader->thread);
+#else
+    pthread_join(reader->thread, NULL);
+#endif
+    reader->started = 0;
+  }
+  if (reader->error == 0) {
+    reader->error = reader->job_error;
   }
+}
 
-  memcpy(tile->uniform_pixel_values + (hd->data_unit_size * band), value, hd->data_unit_size);
-  SIF_SET_BIT(tile->uniform_flags, band);
-  if (_sif_completely_uniform_shallow(file, tile_num) && tile->block_num != -1) {
-    file->blocks_to_tiles[file->tiles[tile_num].block_num] = -1;
-    file->tiles[tile_num].block_num = -1;
+/**
+ * Starts reading a row of tiles into the buffer not in use, on the
+ * background thread if possible.
+ *
+ * @param reader    The reader.
+ * @param ty        The row of tiles.
+ * @param ahead     Non-zero to read on the background thread.
+ */
+
+static void      _sif_row_reader_fetch(sif_row_reader *reader, long ty, int ahead) {
+  reader->job = reader->cur == reader->rows[0] ? reader->rows[1] : reader->rows[0];
+  reader->job_ty = ty;
+  reader->job_error = 0;
+  if (ahead) {
+#ifdef WIN32
+    reader->thread = CreateThread(NULL, 0, _sif_thread_main, &reader->start, 0, NULL);
+    reader->started = reader->thread != NULL;
+#else
+    reader->started = pthread_create(&reader->thread, NULL, _sif_thread_main, &reader->start) == 0;
+#endif
+    if (reader->started) {
+      return;
+    }
   }
-  _sif_write_tile_header(file, tile, tile_num);
-  return;
+  _sif_row_reader_main(reader);
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
-void            sif_fill_tiles(sif_file *file, long band, const void *value) {
-  sif_tile *tile;
-  sif_header *hd = 0;
-  long tile_num;
-
-  SIF_CHECK_FILE_V(file);
-  hd = file->header;
-  if (band < 0 || band >= hd->bands) {
+sif_row_reader*  sif_row_reader_open(sif_file *file, long band) {
+  sif_row_reader *reader;
+  long row_bytes;
+  SIF_CHECK_FILE(file);
+  if (band < 0 || band >= file->header->bands) {
     file->error = SIF_ERROR_INVALID_BAND;
-    return;
-  }
-  if (value == 0) {
-    file->error = SIF_ERROR_INVALID_BUFFER;
-    return;
+    return 0;
   }
-  /** We should not be changing tiles for read-only files. Return an error. */
-  if (file->read_only) {
-     file->error = SIF_ERROR_INVALID_FILE_MODE;
-     return;
+  /** Without concurrent reads, the background thread uses the file's
+      own block buffers, held until the reader is closed. */
+  if (!file->concurrent_reads && !_sif_borrow_buffers(file)) {
+    return 0;
   }
-
-  for (tile_num = 0; tile_num < hd->n_tiles; tile_num++) {
-     /** Compute the tile number using the stride stored in the header. */
-     tile = file->tiles + tile_num;
-     /**  printf("set x: %d y: %d b: %d\n", tx, ty, band);**/
-  
-     memcpy(tile->uniform_pixel_values + (hd->data_unit_size * band), value, hd->data_unit_size);
-     SIF_SET_BIT(tile->uniform_flags, band);
-     if (_sif_completely_uniform_shallow(file, tile_num) && tile->block_num != -1) {
-        file->blocks_to_tiles[file->tiles[tile_num].block_num] = -1;
-        file->tiles[tile_num].block_num = -1;
-     }
+  reader = (sif_row_reader*)malloc(sizeof(sif_row_reader));
+  row_bytes = file->header->n_tiles_across * file->units_per_slice * file->header->data_unit_size;
+  if (reader == 0 || (reader->rows[0] = (u_char*)malloc(2 * row_bytes)) == 0) {
+    free(reader);
+    if (!file->concurrent_reads) {
+      _sif_return_buffers(file);
+    }
+    file->error = SIF_ERROR_MEM;
+    file->error_line_no = __LINE__;
+    return 0;
   }
-  _sif_write_tile_headers(file);
+  reader->rows[1] = reader->rows[0] + row_bytes;
+  reader->file = file;
+  reader->band = band;
+  reader->row = 0;
+  reader->cur = 0;
+  reader->cur_ty = -1;
+  reader->job = 0;
+  reader->job_ty = -1;
+  reader->job_error = 0;
+  reader->error = 0;
+  reader->started = 0;
+  reader->start.worker = _sif_row_reader_main;
+  reader->start.worker_data = reader;
+  return reader;
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
-void            sif_set_tile_slice(sif_file *file, const void *buffer, long tx, long ty, long band) {
-  sif_tile *tile = 0;
-  sif_header *hd = 0;
-  long i = 0, free_b = 0, extentX = 0, extentY = 0;             ;
-  LONGLONG loc, tile_num;
-  SIF_CHECK_FILE_V(file);
-  hd = file->header;
-
-  if (tx < 0 || ty < 0 || tx >= hd->n_tiles_across) {
-    file->error = SIF_ERROR_INVALID_TN;
-    return;
+int              sif_row_reader_get(sif_row_reader *reader, void *rows, long n_rows) {
+  sif_file *file = reader->file;
+  sif_header *hd = file->header;
+  u_char *dst = (u_char*)rows;
+  long tw = hd->tile_width, th = hd->tile_height, dus = hd->data_unit_size;
+  long slice_bytes = dus * file->units_per_slice;
+  long n_tiles_down = hd->n_tiles / hd->n_tiles_across;
+  long tx, r, ty;
+  const u_char *src;
+  int error = 0;
+  if (n_rows < 0 || reader->row + n_rows > hd->height) {
+    error = SIF_ERROR_INVALID_REGION_SIZE;
+  }
+  else if (rows == 0 && n_rows > 0) {
+    error = SIF_ERROR_INVALID_BUFFER;
+  }
+  if (error != 0) {
+    _sif_row_reader_join(reader);
+    if (reader->error == 0) {
+      reader->error = error;
+    }
   }
-  if (band < 0 || band >= hd->bands) {
-    file->error = SIF_ERROR_INVALID_BAND;
-    return;
+  for (r = 0; r < n_rows && reader->error == 0; r++, dst += hd->width * dus) {
+    ty = reader->row / th;
+    if (ty != reader->cur_ty) {
+      /** take the row of tiles read ahead, or read it now, and start
+          reading the next one. */
+      if (reader->job_ty != ty) {
+        _sif_row_reader_fetch(reader, ty, 0);
+      }
+      _sif_row_reader_join(reader);
+      if (reader->error != 0) {
+        break;
+      }
+      reader->cur = reader->job;
+      reader->cur_ty = ty;
+      if (ty + 1 < n_tiles_down) {
+        _sif_row_reader_fetch(reader, ty + 1, 1);
+      }
+    }
+    /** gather the scan line from the tiles of the row. */
+    src = reader->cur + (reader->row % th) * tw * dus;
+    for (tx = 0; tx < hd->n_tiles_across; tx++, src += slice_bytes) {
+      memcpy(dst + tx * tw * dus, src, MIN(tw, hd->width - tx * tw) * dus);
+    }
+    reader->row++;
   }
-  if (buffer == 0) {
-    file->error = SIF_ERROR_INVALID_BUFFER;
-    return;
+  if (reader->error == 0) {
+    return 0;
   }
-  extentX = hd->tile_width;
-  extentY = hd->tile_height;
-  //  printf("set x: %d y: %d b: %d\n", tx, ty, band);
-  /** We should not be changing tiles for read-only files. Return an error. */
-  if (file->read_only) {
-    file->error = SIF_ERROR_INVALID_FILE_MODE;
-    return;
+  if (file->concurrent_reads) {
+    _sif_thread_error = reader->error;
+  }
+  else {
+    file->error = reader->error;
   }
+  return -1;
+}
 
-  extentX = MIN(hd->tile_width, hd->width - tx * hd->tile_width);
-  extentY = MIN(hd->tile_height, hd->height - ty * hd->tile_height);
+/* See sif-io.h for detailed documentation of public functions. */
+void             sif_row_reader_close(sif_row_reader *reader) {
+  _sif_row_reader_join(reader);
+  if (!reader->file->concurrent_reads) {
+    _sif_return_buffers(reader->file);
+  }
+  free(reader->rows[0]);
+  free(reader);
+}
 
-  /** Compute the tile number using the stride stored in the header. */
-  tile_num = (hd->n_tiles_across * ty) + tx;
-  tile = file->tiles + tile_num;
-  /** If the flag intrinsic_write is set, that means we check for pixel
-      uniformity on a write. */
-  if (hd->intrinsic_write && _sif_is_uniform(file, buffer, extentX, extentY)) {
-    memcpy(tile->uniform_pixel_values + (hd->data_unit_size * band), buffer, hd->data_unit_size);
-    SIF_SET_BIT(tile->uniform_flags, band);
-    if (_sif_completely_uniform_shallow(file, tile_num) && tile->block_num != -1) {
-      file->blocks_to_tiles[file->tiles[tile_num].block_num] = -1;
-      file->tiles[tile_num].block_num = -1;
+/**
+ * Retrieves an entire tile (all bands).
+ *
+ * @param file    The file where the tile is stored.
+ * @param tile_no The index of the tile.
+ * @param data    The buffer to store the result of the read.
+ */
+
+void              _sif_get_tile(sif_file *file, LONGLONG tile_no, unsigned char *data) {
+  sif_tile tile_view, *tile = _sif_tile_view(file, tile_no, &tile_view);
+  sif_header *hd = file->header;
+  u_char *buffer = 0;
+  u_char *upv = 0;
+  long i = 0;
+  for (i = 0; i < hd->bands; i++) {
+    buffer = ((u_char*)data) + (file->units_per_slice * hd->data_unit_size * i);
+    if (SIF_GET_BIT(tile->uniform_flags, i)) {
+      upv = tile->uniform_pixel_values + i * hd->data_unit_size;
+      _sif_fill_units(buffer, upv, hd->data_unit_size, file->units_per_slice);
     }
-    _sif_write_tile_header(file, tile, tile_num);
-    return;
-  }
-  /** If we've gotten here then the tile is non-uniform or we're presuming that
-      it is. If each slice of the tile cube was uniform before, we need to find
-      a free spot on disk to put the tile cube. */
-  if (tile->block_num == -1) {
-    /** Look for the first free tile block. */
-    for (i = 0; i < hd->n_tiles; i++) {
-      if (file->blocks_to_tiles[i] == -1) {
-	free_b = i;
-	break;
+    else {
+      _sif_read_slice(file, (long)tile_no, i, buffer);
+      if (file->error != 0) {
+        return;
       }
     }
-    tile->block_num = free_b;
-    file->blocks_to_tiles[free_b] = tile_num;
-    loc = _sif_get_block_location(file, tile->block_num);
-    FSEEK64V(file->fp, loc, SEEK_SET);
-    /** Write the buffer out n times where n is the number of bands. Raster
-        data stored for uniform bands will be ignored.*/
-    for (i = 0; i < hd->bands; i++) {
-      FWRITE64V((u_char*)buffer, hd->data_unit_size, file->units_per_slice, file->fp);
-    }
- 
-  }
-  /** If we already checked for pixel uniformity, we don't need to do
-      it again. */
-  if (hd->intrinsic_write == 0) {
-    file->dirty_tiles[tile_num] = 1;
   }
-  /** Compute the location for the non-uniform slice and go there. */
-  loc = _sif_get_block_location(file, tile->block_num) + hd->data_unit_size * file->units_per_slice * band;
-  FSEEK64V(file->fp, loc, SEEK_SET);
-  /** Write the non-uniform slice to disk. */
-  FWRITE64V((u_char*)buffer, hd->data_unit_size, file->units_per_slice, file->fp);
-
-  /** Set the uniformity flag for this band to false. */
-  SIF_CLEAR_BIT(tile->uniform_flags, band);
-
-  /** Write the tile header out to disk. */
-  _sif_write_tile_header(file, tile, tile_num);
+  return;
 }
 
-/* See sif-io.h for detailed documentation of public functions. */
-static void             _sif_swap_blocks(sif_file *file, long a, long b, void *da, void *db, int assign) {
-  LONGLONG pos_a = 0, pos_b = 0, tb = file->header->tile_bytes;
-  if (a == b) {
+/**
+ * Copies the part of a region covered by one tile slice to the region's
+ * buffer. Uniform slices are filled directly without I/O; other slices
+ * are read into the file's first block buffer first.
+ *
+ * @param file      The file, or a per-call copy of it.
+ * @param data      The region's buffer.
+ * @param x, y      The region's upper-left pixel.
+ * @param w, h      The region's width and height.
+ * @param band      The band to read.
+ * @param tx, ty    The tile indices.
+ */
+
+static void      _sif_get_raster_tile(sif_file *file, u_char *data, long x, long y,
+				      long w, long h, long band, long tx, long ty) {
+  sif_header *hd = file->header;
+  long tw = hd->tile_width, th = hd->tile_height, dus = hd->data_unit_size;
+  long trs = tw * dus, wdus = w * dus;
+  long sxt, syt, ext, eyt, sxd, syd, cyd, cyt, tile_num;
+  u_char *buffer = file->buffer[0];
+  u_char *upv;
+  sxt = MAX(0, x - tx * tw);                  /** starting x pixel on tile raster. */
+  syt = MAX(0, y - ty * th);                  /** starting y pixel on tile raster. */
+  ext = MIN(tw - 1, x + w - 1 - (tx * tw));   /** ending x pixel on tile raster. */
+  eyt = MIN(th - 1, y + h - 1 - (ty * th));   /** ending y pixel on tile raster. */
+  sxd = (tx * tw + sxt) - x;                  /** starting x pixel on data raster. */
+  syd = (ty * th + syt) - y;                  /** starting y pixel on data raster. */
+  tile_num = (hd->n_tiles_across * ty) + tx;
+  if (!_sif_lock_tile(file, tile_num)) {
     return;
   }
-  pos_a = _sif_get_block_location(file, a);
-  pos_b = _sif_get_block_location(file, b);
-  if (a != -1 && !assign) {
-    FSEEK64V(file->fp, pos_a, SEEK_SET);
-    FREAD64V((unsigned char*)da, 1, tb, file->fp);
-  }
-  if (b != -1) {
-    FSEEK64V(file->fp, pos_b, SEEK_SET);
-    FREAD64V((unsigned char*)db, 1, tb, file->fp);
+  if (_sif_band_of_tile_is_uniform_shallow(file, tile_num, band)) {
+    upv = file->tiles.uniform_pixel_values + ((size_t)tile_num * hd->bands + band) * dus;
+    for (cyd = syd, cyt = syt; cyt <= eyt; cyd++, cyt++) {
+      _sif_fill_units(data + (cyd * wdus) + (sxd * dus), upv, dus, ext - sxt + 1);
+    }
+    _sif_unlock_tile(file, tile_num);
+    return;
   }
-  if (a != -1 && !assign) {
-    FSEEK64V(file->fp, pos_b, SEEK_SET);
-    FWRITE64V((unsigned char*)da, 1, tb, file->fp);
+  _sif_read_cached_slice(file, tile_num, band, buffer);
+  _sif_unlock_tile(file, tile_num);
+  if (file->error != 0) {
+    return;
   }
-  if (b != -1) {
-    FSEEK64V(file->fp, pos_a, SEEK_SET);
-    FWRITE64V((unsigned char*)db, 1, tb, file->fp);
+  for (cyd = syd, cyt = syt; cyt <= eyt; cyd++, cyt++) {
+    memcpy(data + (cyd * wdus) + (sxd * dus), buffer + (cyt * trs) + (sxt * dus), (ext - sxt + 1) * dus);
   }
 }
 
-/* See sif-io.h for detailed documentation of public functions. */
-void             sif_set_raster(sif_file* file, const void *data,
-                                long x, long y, long w, long h, long band) {
-  const unsigned char *datav = data; /** makes VC++ happy. can't do
-                                         pointer arithmetic on void*'s! */
+/**
+ * Reads a rectangular region. See sif_get_raster.
+ */
+
+static void      _sif_get_raster(sif_file* file, void *data,
+				 long x, long y, long w, long h, long band) {
   long tnx1, tny1, tnx2, tny2; /** the starting and ending tile indices. */
-  long sxt, syt, ext, eyt;     /** the starting and ending coordinates on the tile raster. */
-  long sxd, syd;               /** the starting coordinates on the data raster. */
-  long cyd, cyt;               /** the current ordinates for the data and tile rasters. */
   long tx, ty;                 /** the current working tile indices. */
-  long tw, th, trs, dus, wdus; /** the tile width, height, data unit size, scan line byte size. */
+  long tw, th;                 /** the tile width and height. */
   sif_header *hd;                  /** header */
-  unsigned char *buffer;                     /** buffer */
-  SIF_CHECK_FILE_V(file);
-  if (file->read_only) {
-    return;
-  }
   hd = file->header;
   if (x < 0 || y < 0) {
     file->error = SIF_ERROR_INVALID_COORD;
@@ -1637,133 +6273,458 @@ void             sif_set_raster(sif_file* file, const void *data,
     file->error = SIF_ERROR_INVALID_BAND;
     return;
   }
-  buffer = file->buffer[0];
   tw = hd->tile_width;
   th = hd->tile_height;
-  trs = hd->n_tiles_across;
-  dus = hd->data_unit_size;/** size of a single pixel in bytes. */
-  wdus = dus * w;          /** width of a single scan line. */
   tnx1 = x / tw;           /** the starting tile horizontal index. */
   tny1 = y / th;           /** the starting tile vertical index. */
   tnx2 = (x + w - 1) / tw; /** the end tile horizontal index. */
   tny2 = (y + h - 1) / th; /** the end tile vertical index. */
   for (ty = tny1; ty <= tny2; ty++) {
     for (tx = tnx1; tx <= tnx2; tx++) {
-      /** grab the tile. */
-      sif_get_tile_slice(file, buffer, tx, ty, band);
-      sxt = MAX(0, x - tx * tw);                  /** starting x pixel on tile raster. */
-      syt = MAX(0, y - ty * th);                  /** starting y pixel on tile raster. */
-      ext = MIN(tw - 1, x + w - 1 - (tx * tw));   /** ending x pixel on tile raster. */
-      eyt = MIN(th - 1, y + h - 1 - (ty * th));   /** ending y pixel on tile raster. */
-      sxd = (tx * tw + sxt) - x;                  /** starting x pixel on data raster. */
-      syd = (ty * th + syt) - y;                  /** starting y pixel on data raster. */
+      /** copy the window of the tile to the region. A uniform slice is
+          filled straight into the region, without expanding it first. */
+      _sif_get_raster_tile(file, (u_char*)data, x, y, w, h, band, tx, ty);
+      if (file->error != 0) {
+	return;
+      }
+    }
+  }
+}
 
-      /** copy the window from the raster to the tile.*/
-      for (cyd = syd, cyt = syt; cyt <= eyt; cyd++, cyt++) {
-	memcpy(buffer + (cyt * trs) + (sxt * dus), datav + (cyd * wdus) + (sxd * dus), (ext - sxt + 1) * dus);
+/* See sif-io.h for detailed documentation of public functions. */
+void             sif_get_raster(sif_file* file, void *data,
+				long x, long y, long w, long h, long band) {
+  sif_file view;
+  SIF_CHECK_FILE_V(file);
+  if (file->concurrent_reads) {
+    if (_sif_begin_concurrent_read(file, &view)) {
+      _sif_get_raster(&view, data, x, y, w, h, band);
+      _sif_end_concurrent_read(&view);
+    }
+    _sif_thread_error = view.error;
+    return;
+  }
+  if (_sif_borrow_buffers(file)) {
+    _sif_get_raster(file, data, x, y, w, h, band);
+    _sif_return_buffers(file);
+  }
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+int              sif_enable_concurrent_reads(sif_file *file) {
+  SIF_CHECK_FILE(file);
+  SIF_ERROR_CHECK_RETURN(!file->read_only, SIF_ERROR_INVALID_FILE_MODE, 0);
+  /** Reads may look up meta-data on any thread. A lazily opened file
+      serializes the load instead, to keep its directory unread. */
+  if (file->lazy == 0 && !_sif_load_meta_data(file)) {
+    return 0;
+  }
+  file->concurrent_reads = 1;
+  return 1;
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+int              sif_enable_concurrent_writes(sif_file *file) {
+  SIF_CHECK_FILE(file);
+  SIF_ERROR_CHECK_RETURN(file->read_only, SIF_ERROR_INVALID_FILE_MODE, 0);
+  /** Writers allocate blocks on any thread, so a lazily opened file is
+      loaded first. */
+  if (!_sif_load_meta_data(file) || !_sif_alloc_locks(file)) {
+    return 0;
+  }
+#ifndef WIN32
+  /** From here on the file is read and written with positional I/O. */
+  fflush(file->fp);
+#endif
+  file->concurrent_reads = 1;
+  file->concurrent_writes = 1;
+  return 1;
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+int              sif_enable_shared_access(sif_file *file) {
+  int locked = 0, ok = 1;
+  SIF_CHECK_FILE(file);
+  /** Other processes may have moved the meta-data since the file was
+      opened, so where it lies is read again under the allocation lock
+      before it is loaded. */
+  if (SIF_ATOMIC_FETCH_ADD(&file->meta_data_loaded, 0) == 0 && file->lazy == 0) {
+    locked = _sif_lock_range(file, 0, SIF_ALLOC_LOCK_BYTES, 0);
+#ifndef WIN32
+    /** What the C library read ahead may be stale by now. */
+    fflush(file->fp);
+#endif
+    ok = _sif_refresh_directory(file, 0) && _sif_reread_meta_data_header(file);
+  }
+  ok = ok && _sif_load_meta_data(file);
+  if (locked) {
+    _sif_unlock_range(file, 0, SIF_ALLOC_LOCK_BYTES);
+  }
+  /** Other processes may move the values stored out of line, so they are
+      kept in memory. */
+  if (!ok || !_sif_inline_meta_data_values(file)) {
+    return 0;
+  }
+  if (file->read_only) {
+    if (!sif_enable_concurrent_reads(file) || !_sif_alloc_locks(file)) {
+      return 0;
+    }
+  }
+  else if (!sif_enable_concurrent_writes(file)) {
+    return 0;
+  }
+  file->shared = 1;
+  return 1;
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+int              sif_refresh(sif_file *file) {
+  SIF_CHECK_FILE(file);
+  return _sif_refresh_directory(file, 1);
+}
+
+/**
+ * A range of tile indices owned by one worker of sif_for_each_tile, packed
+ * as (first << 32) | end so that it can be updated atomically. The owner
+ * takes tiles from the front; other workers steal half from the back.
+ */
+
+typedef unsigned long long _sif_tile_range;
+
+#define SIF_RANGE(lo, hi) ((((_sif_tile_range)(lo)) << 32) | (_sif_tile_range)(hi))
+#define SIF_RANGE_LO(r) ((long)((r) >> 32))
+#define SIF_RANGE_HI(r) ((long)((r) & 0xFFFFFFFFULL))
+
+/**
+ * The state shared by the workers of sif_for_each_tile.
+ */
+
+typedef struct {
+  sif_file *file;
+  const char *band_mask;
+  sif_tile_callback callback;
+  sif_uniform_tile_callback uniform_callback;
+  void *user;
+  int flags;
+  int n_workers;
+  volatile _sif_tile_range *ranges; /** the tiles left to each worker. */
+  volatile long next_worker;        /** hands out the worker indices. */
+  volatile int stop;                /** set when a callback asks to stop. */
+  volatile int error;               /** the first error encountered by a worker. */
+  volatile int error_line_no;
+} _sif_tile_map_job;
+
+/**
+ * Takes the next tile from a worker's own range, or failing that steals
+ * the back half of the largest range of another worker.
+ *
+ * @param job       The job.
+ * @param me        The index of the calling worker.
+ *
+ * @return          The tile index, or -1 if no tiles are left.
+ */
+
+static long      _sif_tile_map_next(_sif_tile_map_job *job, int me) {
+  _sif_tile_range r, v;
+  long lo, hi, best, size;
+  int i, victim;
+  for (;;) {
+    r = job->ranges[me];
+    lo = SIF_RANGE_LO(r);
+    hi = SIF_RANGE_HI(r);
+    if (lo < hi) {
+      if (SIF_ATOMIC_CAS64(&job->ranges[me], r, SIF_RANGE(lo + 1, hi))) {
+        return lo;
       }
-      /** put the tile back with modifications. */
-      sif_set_tile_slice(file, buffer, tx, ty, band);
-      if (file->error) {
-	return;
+      continue;
+    }
+    victim = -1;
+    best = 0;
+    for (i = 0; i < job->n_workers; i++) {
+      v = job->ranges[i];
+      size = SIF_RANGE_HI(v) - SIF_RANGE_LO(v);
+      if (i != me && size > best) {
+        best = size;
+        victim = i;
       }
     }
+    if (victim == -1) {
+      return -1;
+    }
+    v = job->ranges[victim];
+    lo = SIF_RANGE_LO(v);
+    hi = SIF_RANGE_HI(v);
+    if (lo >= hi) {
+      continue;
+    }
+    size = (hi - lo + 1) / 2;
+    if (SIF_ATOMIC_CAS64(&job->ranges[victim], v, SIF_RANGE(lo, hi - size))) {
+      /** Only this worker adds to its own range, and it is empty. */
+      job->ranges[me] = SIF_RANGE(hi - size, hi);
+    }
   }
 }
 
 /**
- * Retrieves an entire tile (all bands).
+ * Records the error of a worker's copy of a file as the first error of
+ * its job, unless another worker has recorded one already.
  *
- * @param file    The file where the tile is stored.
- * @param tile_no The index of the tile.
- * @param data    The buffer to store the result of the read.
+ * @param error         The job's error.
+ * @param error_line_no The job's error line number.
+ * @param view          The worker's copy of the file.
  */
 
-void              _sif_get_tile(sif_file *file, LONGLONG tile_no, unsigned char *data) {
-  sif_tile *tile = file->tiles + tile_no;
+static void      _sif_keep_first_error(volatile int *error, volatile int *error_line_no, const sif_file *view) {
+  if (view->error != 0 && SIF_ATOMIC_CAS(error, 0, view->error)) {
+    *error_line_no = view->error_line_no;
+  }
+}
+
+/**
+ * A worker of sif_for_each_tile.
+ *
+ * @param arg       The job.
+ */
+
+static void      _sif_tile_map_worker(void *arg) {
+  _sif_tile_map_job *job = (_sif_tile_map_job*)arg;
+  sif_file *file = job->file;
   sif_header *hd = file->header;
-  u_char *buffer = 0;
-  u_char *upv = 0;
-  long i = 0, j = 0;
-  LONGLONG pos = 0;
-  bzero(data, hd->tile_bytes);
-  buffer = data;
-  for (i = 0; i < hd->bands; i++) {
-    buffer = ((u_char*)data) + (file->units_per_slice * hd->data_unit_size * i);
-	if (_sif_completely_uniform_shallow(file, tile_no)) {
-		upv = tile->uniform_pixel_values + i * hd->data_unit_size;
-		if (hd->data_unit_size == 1) {
-			for (j = 0; j < file->units_per_slice; j++, buffer += hd->data_unit_size) {
-				memcpy(buffer, upv, hd->data_unit_size);
-			}
-		}
-		else {
-			memset(buffer, upv[0], file->units_per_slice);
-		}
-	}
-	else {
-		pos = _sif_get_block_location(file, tile->block_num) + file->units_per_slice * hd->data_unit_size * i;
-		FSEEK64V(file->fp, pos, SEEK_SET);
-		FREAD64V(buffer, 1, hd->tile_bytes, file->fp);
-	}
+  int me = (int)SIF_ATOMIC_FETCH_ADD(&job->next_worker, 1);
+  sif_file view;
+  sif_tile tile_view, *tile;
+  long t, band, tx, ty;
+  u_char *upv;
+  int rc, uniform;
+  if (me >= job->n_workers) {
+    return;
   }
-  return;
+  if (_sif_begin_concurrent_read(file, &view)) {
+    view.concurrent_reads = 1;
+    while (!job->stop && job->error == 0 && (t = _sif_tile_map_next(job, me)) != -1) {
+      tile = _sif_tile_view(file, t, &tile_view);
+      tx = t % hd->n_tiles_across;
+      ty = t / hd->n_tiles_across;
+      for (band = 0; band < hd->bands && !job->stop; band++) {
+        if (job->band_mask != 0 && !job->band_mask[band]) {
+          continue;
+        }
+        rc = 0;
+        /** The callbacks run with the tile unlocked, so a uniform value is
+            copied out first. */
+        if (!_sif_lock_tile(&view, t)) {
+          break;
+        }
+        uniform = _sif_band_of_tile_is_uniform_shallow(file, t, band);
+        if (uniform) {
+          upv = view.buffer[1];
+          memcpy(upv, tile->uniform_pixel_values + hd->data_unit_size * band, hd->data_unit_size);
+        }
+        else {
+          _sif_read_cached_slice(&view, t, band, view.buffer[0]);
+        }
+        _sif_unlock_tile(&view, t);
+        if (view.error != 0) {
+          break;
+        }
+        if (!uniform) {
+          rc = job->callback(job->user, tx, ty, band, view.buffer[0]);
+        }
+        else if (job->uniform_callback != 0) {
+          rc = job->uniform_callback(job->user, tx, ty, band, upv);
+        }
+        else if (!(job->flags & SIF_TILE_SKIP_UNIFORM)) {
+          _sif_fill_units(view.buffer[0], upv, hd->data_unit_size, file->units_per_slice);
+          rc = job->callback(job->user, tx, ty, band, view.buffer[0]);
+        }
+        if (rc != 0) {
+          job->stop = 1;
+        }
+      }
+      if (view.error != 0) {
+        break;
+      }
+    }
+    _sif_end_concurrent_read(&view);
+  }
+  _sif_keep_first_error(&job->error, &job->error_line_no, &view);
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
-void             sif_get_raster(sif_file* file, void *data,
-				long x, long y, long w, long h, long band) {
-  unsigned char *datav = data;
-  long tnx1, tny1, tnx2, tny2; /** the starting and ending tile indices. */
-  long sxt, syt, ext, eyt;     /** the starting and ending coordinates on the tile raster. */
-  long sxd, syd;               /** the starting coordinates on the data raster. */
-  long cyd, cyt;               /** the current ordinates for the data and tile rasters. */
-  long tx, ty;                 /** the current working tile indices. */
-  long tw, th, trs, dus, wdus; /** the tile width, height, data unit size, scan line byte size. */
-  sif_header *hd;                  /** header */
-  unsigned char *buffer;                    /** buffer */
-  SIF_CHECK_FILE_V(file);
+int              sif_for_each_tile(sif_file *file, const char *band_mask,
+                                   sif_tile_callback callback,
+                                   sif_uniform_tile_callback uniform_callback,
+                                   void *user, int flags, int n_workers) {
+  _sif_tile_map_job job;
+  sif_header *hd;
+  sif_executor executor;
+  long i, per;
+  int error = 0, error_line_no = __LINE__;
+  SIF_CHECK_FILE(file);
   hd = file->header;
-  if (x < 0 || y < 0) {
-    file->error = SIF_ERROR_INVALID_COORD;
-    return;
+  if (callback == 0) {
+    error = SIF_ERROR_INVALID_BUFFER;
   }
-  if (w < 1 || h < 1 || x + w > hd->width || y + h > hd->height) {
-    file->error = SIF_ERROR_INVALID_REGION_SIZE;
-    return;
+  if (error == 0 && !_sif_sync_for_positional_io(file)) {
+    return 0;
   }
-  if (band < 0 || band >= hd->bands) {
-    file->error = SIF_ERROR_INVALID_BAND;
-    return;
+  if (n_workers < 1) {
+    n_workers = file->n_workers < 1 ? 1 : file->n_workers;
   }
-  buffer = file->buffer[0];
-  tw = hd->tile_width;
-  th = hd->tile_height;
-  trs = hd->n_tiles_across;
-  dus = hd->data_unit_size;/** size of a single pixel in bytes. */
-  wdus = dus * w;          /** width of a single scan line. */
-  tnx1 = x / tw;           /** the starting tile horizontal index. */
-  tny1 = y / th;           /** the starting tile vertical index. */
-  tnx2 = (x + w - 1) / tw; /** the end tile horizontal index. */
-  tny2 = (y + h - 1) / th; /** the end tile vertical index. */
-  for (ty = tny1; ty <= tny2; ty++) {
-    for (tx = tnx1; tx <= tnx2; tx++) {
+  n_workers = (int)MIN(n_workers, hd->n_tiles);
+  job.ranges = (_sif_tile_range*)malloc(sizeof(_sif_tile_range) * n_workers);
+  if (error == 0 && job.ranges == 0) {
+    error = SIF_ERROR_MEM;
+  }
+  if (error == 0) {
+    /** Each worker starts with a run of consecutive tiles so that its
+        reads are mostly sequential. */
+    per = CEIL_DIV(hd->n_tiles, n_workers);
+    for (i = 0; i < n_workers; i++) {
+      job.ranges[i] = SIF_RANGE(MIN(i * per, hd->n_tiles), MIN((i + 1) * per, hd->n_tiles));
+    }
+    job.file = file;
+    job.band_mask = band_mask;
+    job.callback = callback;
+    job.uniform_callback = uniform_callback;
+    job.user = user;
+    job.flags = flags;
+    job.n_workers = n_workers;
+    job.next_worker = 0;
+    job.stop = 0;
+    job.error = 0;
+    job.error_line_no = 0;
+    executor = file->executor ? file->executor : _sif_thread_executor;
+    executor(file->executor_data, n_workers, _sif_tile_map_worker, &job);
+    error = job.error;
+    error_line_no = job.error_line_no;
+  }
+  free((void*)job.ranges);
+  if (file->concurrent_reads) {
+    _sif_thread_error = error;
+  }
+  else if (error != 0) {
+    file->error = error;
+    file->error_line_no = error_line_no;
+  }
+  return error == 0 && !job.stop;
+}
 
-      sxt = MAX(0, x - tx * tw);                  /** starting x pixel on tile raster. */
-      syt = MAX(0, y - ty * th);                  /** starting y pixel on tile raster. */
-      ext = MIN(tw - 1, x + w - 1 - (tx * tw));   /** ending x pixel on tile raster. */
-      eyt = MIN(th - 1, y + h - 1 - (ty * th));   /** ending y pixel on tile raster. */
-      sxd = (tx * tw + sxt) - x;                  /** starting x pixel on data raster. */
-      syd = (ty * th + syt) - y;                  /** starting y pixel on data raster. */
+/* See sif-io.h for detailed documentation of public functions. */
+void             sif_set_workers(sif_file *file, int n_workers, sif_executor executor,
+				 void *executor_data) {
+  SIF_CHECK_FILE_V(file);
+  file->n_workers = n_workers < 1 ? 1 : n_workers;
+  file->executor = executor;
+  file->executor_data = executor_data;
+}
 
-      /** grab the tile. */
-      sif_get_tile_slice(file, buffer, tx, ty, band);
+/* See sif-io.h for detailed documentation of public functions. */
+int              sif_get_thread_error(void) {
+  return _sif_thread_error;
+}
 
-      /** copy the window from the tile to the input raster.*/
-      for (cyd = syd, cyt = syt; cyt <= eyt; cyd++, cyt++) {
-	memcpy(datav + (cyd * wdus) + (sxd * dus), buffer + (cyt * trs) + (sxt * dus), (ext - sxt + 1) * dus);
+/**
+ * The state shared by the workers of a parallel region read.
+ */
+
+typedef struct {
+  sif_file *file;
+  u_char *data;
+  long x, y, w, h, band;
+  long tnx1, tny1;          /** the first tile of the region. */
+  long n_across;            /** the number of tiles across the region. */
+  long n_tiles;             /** the number of tiles in the region. */
+  volatile long next;       /** the index of the next tile to read. */
+  volatile int error;       /** the first error encountered by a worker. */
+  volatile int error_line_no;
+} _sif_raster_job;
+
+/**
+ * A worker of a parallel region read. It reads tiles from the job's queue
+ * until the queue is empty or a worker has failed, using positional I/O
+ * and scratch buffers of its own.
+ *
+ * @param arg       The job.
+ */
+
+static void      _sif_get_raster_worker(void *arg) {
+  _sif_raster_job *job = (_sif_raster_job*)arg;
+  sif_file view;
+  long k;
+  if (_sif_begin_concurrent_read(job->file, &view)) {
+    view.concurrent_reads = 1;
+    while (job->error == 0 && (k = SIF_ATOMIC_FETCH_ADD(&job->next, 1)) < job->n_tiles) {
+      _sif_get_raster_tile(&view, job->data, job->x, job->y, job->w, job->h, job->band,
+			   job->tnx1 + k % job->n_across, job->tny1 + k / job->n_across);
+      if (view.error != 0) {
+	break;
       }
     }
+    _sif_end_concurrent_read(&view);
+  }
+  _sif_keep_first_error(&job->error, &job->error_line_no, &view);
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+void             sif_get_raster_parallel(sif_file* file, void *data,
+					 long x, long y, long w, long h, long band,
+					 int n_workers, sif_executor executor,
+					 void *executor_data) {
+  _sif_raster_job job;
+  sif_header *hd;
+  int error = 0, error_line_no = __LINE__;
+  SIF_CHECK_FILE_V(file);
+  hd = file->header;
+  if (x < 0 || y < 0) {
+    error = SIF_ERROR_INVALID_COORD;
+  }
+  else if (w < 1 || h < 1 || x + w > hd->width || y + h > hd->height) {
+    error = SIF_ERROR_INVALID_REGION_SIZE;
+  }
+  else if (band < 0 || band >= hd->bands) {
+    error = SIF_ERROR_INVALID_BAND;
+  }
+  else if (data == 0) {
+    error = SIF_ERROR_INVALID_BUFFER;
+  }
+  if (error == 0 && !_sif_sync_for_positional_io(file)) {
+    return;
+  }
+  if (error == 0) {
+    job.file = file;
+    job.data = (u_char*)data;
+    job.x = x;
+    job.y = y;
+    job.w = w;
+    job.h = h;
+    job.band = band;
+    job.tnx1 = x / hd->tile_width;
+    job.tny1 = y / hd->tile_height;
+    job.n_across = (x + w - 1) / hd->tile_width - job.tnx1 + 1;
+    job.n_tiles = job.n_across * ((y + h - 1) / hd->tile_height - job.tny1 + 1);
+    job.next = 0;
+    job.error = 0;
+    job.error_line_no = 0;
+    if (n_workers < 1) {
+      n_workers = 1;
+    }
+    if (n_workers > job.n_tiles) {
+      n_workers = job.n_tiles;
+    }
+    if (executor == 0) {
+      executor = _sif_thread_executor;
+    }
+    executor(executor_data, n_workers, _sif_get_raster_worker, &job);
+    error = job.error;
+    error_line_no = job.error_line_no;
+  }
+  if (file->concurrent_reads) {
+    _sif_thread_error = error;
+  }
+  else if (error != 0) {
+    file->error = error;
+    file->error_line_no = error_line_no;
   }
 }
 
@@ -1774,38 +6735,46 @@ int              sif_is_shallow_uniform(sif_file *file, long x, long y, long w,
   long sy = 0;            /** starting tile y index **/
   long ex = 0;            /** ending tile x index **/
   long ey = 0;            /** ending tile y index **/
-  long ix, iy;            /** current tile index. */
-  int uniform = 1;
-  sif_tile *first_tile = 0;
-  u_char *upv = 0;
+  long t, iy;             /** current tile index. */
+  long fb, upvb, dus;
+  const u_char *flags, *upv, *first;
+  u_char mask;
   SIF_CHECK_FILE(file);
   hd = file->header;
   sx = x / hd->tile_width;
   sy = y / hd->tile_height;
   ex = (x + w - 1) / hd->tile_width;
   ey = (y + h - 1) / hd->tile_height;
-  first_tile = file->tiles + ((hd->n_tiles_across * sy) + sx);
-  upv = ((u_char*)first_tile->uniform_pixel_values) + hd->data_unit_size * band;
+
+  /** The flag of the band and its uniform pixel value are at a fixed
+      stride in the tile directory, so the scan reads it row by row. */
+  dus = hd->data_unit_size;
+  fb = hd->n_uniform_flags;
+  upvb = hd->bands * dus;
+  flags = file->tiles.uniform_flags + band / 8;
+  upv = file->tiles.uniform_pixel_values + band * dus;
+  mask = (u_char)(0x1 << (7 - (band % 8)));
+  first = upv + (size_t)((hd->n_tiles_across * sy) + sx) * upvb;
 
   /** Scan through each tile in the region. If we reach a tile that is
       uncompressed, stop, return false.  If we reach a tile that is
       compressed but whose data differs from the first tile, stop,
       return false.  If we scan through every tile, and each one is
       compressed and has a uniform pixel value that is identical to
-      the first tile, return true. Note that we incure the cost,
-      albeit minimal, by comparing the first tile with itself. This
-      approach has the advantage of avoiding an extra if in the for
-      statement.*/
+      the first tile, return true. */
 
-  for (ix = sx; (ix <= ex) && uniform; ix++) {
-    for (iy = sy; (iy <= ey) && uniform; iy++) {
-      uniform =
-	uniform
-	&& sif_is_slice_shallow_uniform(file, ix, iy, band, uniform_value)
-	&& !memcmp(upv, uniform_value, hd->data_unit_size);
+  for (iy = sy; iy <= ey; iy++) {
+    if (!_sif_load_tile_headers(file, hd->n_tiles_across * iy + sx, hd->n_tiles_across * iy + ex)) {
+      return 0;
+    }
+    for (t = hd->n_tiles_across * iy + sx; t <= hd->n_tiles_across * iy + ex; t++) {
+      if (!(flags[(size_t)t * fb] & mask) || memcmp(upv + (size_t)t * upvb, first, dus) != 0) {
+        return 0;
+      }
     }
   }
-  return uniform;
+  memcpy(uniform_value, first, dus);
+  return 1;
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
@@ -1813,13 +6782,16 @@ int              sif_is_slice_shallow_uniform(sif_file *file, long tx, long ty,
 					      void *uniform_value) {
   sif_header *hd = 0;
   long tile_num = 0;
-  sif_tile *tile = 0;
+  sif_tile tile_view, *tile = 0;
   u_char *upv = 0;
   SIF_CHECK_FILE(file);
 
   hd = file->header;
   tile_num = (hd->n_tiles_across * ty) + tx;
-  tile = file->tiles + tile_num;
+  if (!_sif_load_tile_headers(file, tile_num, tile_num)) {
+    return 0;
+  }
+  tile = _sif_tile_view(file, tile_num, &tile_view);
   upv = ((u_char*)tile->uniform_pixel_values) + band * hd->data_unit_size;
 
   /** Is the bit for the band set? If so, the tile is compressed. Copy the
@@ -1832,55 +6804,167 @@ int              sif_is_slice_shallow_uniform(sif_file *file, long tx, long ty,
   return 0;
 }
 
+/* See sif-io.h for detailed documentation of public functions. */
+sif_tile*        sif_get_tile_header(sif_file *file, long tile_num, sif_tile *view) {
+  SIF_CHECK_FILE(file);
+  SIF_ERROR_CHECK_RETURN(tile_num < 0 || tile_num >= file->header->n_tiles, SIF_ERROR_INVALID_TN, 0);
+  if (!_sif_load_tile_headers(file, tile_num, tile_num)) {
+    return 0;
+  }
+  return _sif_tile_view(file, tile_num, view);
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+long             sif_get_tile_block_num(sif_file *file, long tile_num) {
+  if (file == 0) {
+    return -2;
+  }
+  SIF_CHECK_FILE(file);
+  SIF_ERROR_CHECK_RETURN(tile_num < 0 || tile_num >= file->header->n_tiles, SIF_ERROR_INVALID_TN, -2);
+  if (!_sif_load_tile_headers(file, tile_num, tile_num)) {
+    return -2;
+  }
+  return file->tiles.block_nums[tile_num];
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+int              sif_get_slice_encoding(sif_file *file, long tx, long ty, long band) {
+  sif_header *hd = 0;
+  sif_tile tile_view, *tile = 0;
+  if (file == 0) {
+    return -1;
+  }
+  SIF_CHECK_FILE(file);
+  hd = file->header;
+  if (tx < 0 || ty < 0 || tx >= hd->n_tiles_across
+      || (hd->n_tiles_across * ty) + tx >= hd->n_tiles) {
+    file->error = SIF_ERROR_INVALID_TN;
+    return -1;
+  }
+  if (band < 0 || band >= hd->bands) {
+    file->error = SIF_ERROR_INVALID_BAND;
+    return -1;
+  }
+  if (!_sif_load_tile_headers(file, (hd->n_tiles_across * ty) + tx, (hd->n_tiles_across * ty) + tx)) {
+    return -1;
+  }
+  tile = _sif_tile_view(file, (hd->n_tiles_across * ty) + tx, &tile_view);
+  if (SIF_GET_BIT(tile->uniform_flags, band)) {
+    return SIF_SLICE_ENCODING_UNIFORM;
+  }
+  return tile->slice_encodings[band];
+}
+
 /**
- * Check whether a tile (all bands) is uniform. If the tile is found to be
- * uniform (i.e., each data unit in the tile is represented by an identical
- * sequence of bytes), this common data unit sequence is stored in the
- * tile's header, and the physical block is freed. If the tile is already
- * uniform, no change is made to the file or tile header. The tile's dirty flag
- * is set to FALSE (not dirty) upon completion.
+ * Checks whether the slices of a dirty tile are uniform or can be stored
+ * more compactly, without changing the file or the tile directory. The
+ * tile's new header is built in <code>shadow</code>, and the encoded
+ * slices that need to be written to the block are stored in
+ * <code>payload</code>, the slice of band i at offset i times the number
+ * of bytes in a raw slice. The new header and slices are applied with
+ * _sif_commit_tile_check.
+ *
+ * Several tiles may be checked at once from different threads, each on a
+ * per-call copy of the file made with _sif_begin_concurrent_read.
  *
  * @param file    The file containing the tile to check.
  * @param tile_no The index of the tile to check.
- * @param data    A buffer which contains enough bytes to store the tile.
+ * @param shadow  A tile header with arrays of its own to store the result.
+ * @param data    A buffer which contains enough bytes to store the raw tile.
+ * @param payload A buffer which contains enough bytes to store the raw tile.
+ *
+ * @return        1 if successful, 0 if an error occurred.
  */
 
-static int             _sif_uniform_check(sif_file *file, long tile_no, void *data) {
-  long i = 0;  
-  int uniform = 1;
-  sif_tile *tiles = file->tiles;
-  sif_tile *tile = tiles + tile_no;
+static int             _sif_check_tile(sif_file *file, long tile_no, sif_tile *shadow,
+                                       u_char *data, u_char *payload) {
+  long i = 0;
+  sif_tile tile_view, *tile = _sif_tile_view(file, tile_no, &tile_view);
   sif_header *hd = file->header;
+  long slice_bytes = file->units_per_slice * hd->data_unit_size;
   u_char *datau = data, *upv = 0;
-  long row = tile_no / hd->n_tiles_across, col = tile_no % hd->n_tiles_across, extentX = hd->tile_width, extentY = hd->tile_height;
-
-  if (tile->block_num == -1) {
+  int encoding;
+  long row = tile_no / hd->n_tiles_across, col = tile_no % hd->n_tiles_across, extentX, extentY;
+
+  memcpy(shadow->uniform_flags, tile->uniform_flags, SIF_SIZE_FLAG_ARRAY(hd->bands));
+  memcpy(shadow->uniform_pixel_values, tile->uniform_pixel_values, hd->bands * hd->data_unit_size);
+  memcpy(shadow->slice_encodings, tile->slice_encodings, hd->bands);
+  memcpy(shadow->slice_gradients, tile->slice_gradients, hd->bands * hd->data_unit_size * 2);
+  if (file->tiles.block_nums[tile_no] == -1) {
     return 1;
   }
   _sif_get_tile(file, tile_no, data);
   if (file->error != 0) {
-    return -1;
+    return 0;
   }
 
   extentX = MIN(hd->tile_width, hd->width - col * hd->tile_width);
   extentY = MIN(hd->tile_height, hd->height - row * hd->tile_height);
 
   for (i = 0; i < hd->bands; i++) {
-    datau = ((u_char*)data) + (i * file->units_per_slice * hd->data_unit_size);
-    if (!SIF_GET_BIT(tile->uniform_flags, i)
-		&& _sif_is_uniform(file, datau, extentX, extentY)
-		&& tile->block_num != -1) {
-      upv = tile->uniform_pixel_values + (i * hd->data_unit_size);
+    datau = data + (i * slice_bytes);
+    if (!SIF_GET_BIT(shadow->uniform_flags, i)
+		&& _sif_is_uniform(file, datau, extentX, extentY)) {
+      upv = shadow->uniform_pixel_values + (i * hd->data_unit_size);
       memcpy(upv, datau, hd->data_unit_size);
-      SIF_SET_BIT(tile->uniform_flags, i);
+      SIF_SET_BIT(shadow->uniform_flags, i);
+      shadow->slice_encodings[i] = SIF_SLICE_ENCODING_RAW;
+    }
+    /** Slices written without the intrinsic write check are stored raw.
+        Store them more compactly if possible. */
+    else if (!SIF_GET_BIT(shadow->uniform_flags, i)
+             && shadow->slice_encodings[i] == SIF_SLICE_ENCODING_RAW) {
+      encoding = _sif_encode_slice(file, shadow, i, datau, extentX, extentY, payload + i * slice_bytes);
+      shadow->slice_encodings[i] = (u_char)encoding;
     }
   }
-  if (_sif_completely_uniform_shallow(file, tile_no) && tile->block_num != -1) {
-    file->blocks_to_tiles[tiles[tile_no].block_num] = -1;
-    tile->block_num = -1;
+  return 1;
+}
+
+/**
+ * Applies the result of _sif_check_tile to a tile: newly encoded slices
+ * are written to the tile's block, the tile's header is replaced with
+ * <code>shadow</code>, and the block is freed if the tile no longer
+ * needs one. The tile's header is then written to the file.
+ *
+ * @param file    The file containing the tile.
+ * @param tile_no The index of the tile.
+ * @param shadow  The tile's new header.
+ * @param payload The encoded slices.
+ */
+
+static void            _sif_commit_tile_check(sif_file *file, long tile_no, sif_tile *shadow,
+                                              const u_char *payload) {
+  long i = 0;
+  sif_tile tile_view, *tile = _sif_tile_view(file, tile_no, &tile_view);
+  int *block_num = file->tiles.block_nums + tile_no;
+  sif_header *hd = file->header;
+  long slice_bytes = file->units_per_slice * hd->data_unit_size;
+  int encoding;
+  LONGLONG pos;
+
+  if (*block_num == -1) {
+    return;
   }
-  _sif_write_tile_header(file, tiles + tile_no, tile_no);
-  return uniform;
+  for (i = 0; i < hd->bands; i++) {
+    encoding = shadow->slice_encodings[i];
+    if (!SIF_GET_BIT(shadow->uniform_flags, i)
+        && tile->slice_encodings[i] == SIF_SLICE_ENCODING_RAW
+        && encoding != SIF_SLICE_ENCODING_RAW && encoding != SIF_SLICE_ENCODING_PLANE) {
+      pos = _sif_get_slice_location(file, tile_no, i);
+      FSEEK64V(file->fp, pos, SEEK_SET);
+      FWRITE64V((u_char*)payload + i * slice_bytes, 1, _sif_encoded_slice_bytes(file, encoding), file->fp);
+    }
+  }
+  memcpy(tile->uniform_flags, shadow->uniform_flags, SIF_SIZE_FLAG_ARRAY(hd->bands));
+  memcpy(tile->uniform_pixel_values, shadow->uniform_pixel_values, hd->bands * hd->data_unit_size);
+  memcpy(tile->slice_encodings, shadow->slice_encodings, hd->bands);
+  memcpy(tile->slice_gradients, shadow->slice_gradients, hd->bands * hd->data_unit_size * 2);
+  if (!_sif_tile_needs_block(file, tile_no)) {
+    file->blocks_to_tiles[*block_num] = -1;
+    *block_num = -1;
+  }
+  _sif_write_tile_header(file, tile_no);
 }
 
 int             _sif_is_uniform(sif_file *file, const void *data, int extentX, int extentY) {
@@ -1927,97 +7011,309 @@ int             _sif_is_uniform(sif_file *file, const void *data, int extentX, i
 }
 
 /**
- * Check all tiles in a file for pixel uniformity. If any tiles are found
- * to be uniform (i.e., each data unit in a tile is represented by an
+ * The state shared by the workers of a consolidation batch.
+ */
+
+typedef struct {
+  sif_file *file;
+  long *tile_nos;           /** the dirty tiles of the batch. */
+  sif_tile *shadows;        /** the new header of each tile. */
+  u_char *payloads;         /** the encoded slices of each tile. */
+  long n;                   /** the number of tiles in the batch. */
+  volatile long next;       /** the index of the next tile to check. */
+  volatile int error;       /** the first error encountered by a worker. */
+  volatile int error_line_no;
+} _sif_consolidate_job;
+
+/**
+ * A worker of a consolidation batch. It checks tiles from the job's queue
+ * until the queue is empty or a worker has failed, using positional I/O
+ * and buffers of its own.
+ *
+ * @param arg       The job.
+ */
+
+static void             _sif_consolidate_worker(void *arg) {
+  _sif_consolidate_job *job = (_sif_consolidate_job*)arg;
+  sif_file *file = job->file;
+  long tb = file->header->data_unit_size * file->units_per_tile;
+  sif_file view;
+  u_char *data = 0;
+  long k;
+  if (_sif_begin_concurrent_read(file, &view) && (data = malloc(tb)) != 0) {
+    view.concurrent_reads = 1;
+    while (job->error == 0 && (k = SIF_ATOMIC_FETCH_ADD(&job->next, 1)) < job->n) {
+      if (!_sif_check_tile(&view, job->tile_nos[k], job->shadows + k, data, job->payloads + k * tb)) {
+        break;
+      }
+    }
+  }
+  else if (view.error == 0) {
+    view.error = SIF_ERROR_MEM;
+    view.error_line_no = __LINE__;
+  }
+  free(data);
+  _sif_end_concurrent_read(&view);
+  _sif_keep_first_error(&job->error, &job->error_line_no, &view);
+}
+
+/**
+ * Check all dirty tiles in a file for pixel uniformity. If any tiles are
+ * found to be uniform (i.e., each data unit in a tile is represented by an
  * identical sequence of bytes), the common data units are stored
- * in the tile headers, and the physical storage blocks are freed. If
+ * in the tile headers, and the physical storage blocks are freed. Raw
+ * slices are also stored more compactly where possible. If
  * the consolidation flag in the file's header is turned off or
  * the file is read only, this method does nothing.
  *
+ * The dirty tiles are processed in batches. The tiles of a batch are read
+ * and checked by the file's workers (see \ref sif_set_workers), then the
+ * results are applied to the tile directory and the file one tile at a
+ * time on the calling thread.
+ *
  * @param file   The file to mark for uniformity.
  */
 
-static void             _sif_mark_uniform_tiles(sif_file *file, void *buffer) {
-  long i = 0;
+static void             _sif_mark_uniform_tiles(sif_file *file) {
+  long i = 0, k, n, batch;
   sif_header *hd = file->header;
-  if (file->read_only || !file->header->consolidate) {
+  long tb = hd->data_unit_size * file->units_per_tile;
+  long s = SIF_SIZE_FLAG_ARRAY(hd->bands), upvb = hd->bands * hd->data_unit_size;
+  long per_shadow = s + upvb + hd->bands + 2 * upvb;
+  int n_workers = file->n_workers < 1 ? 1 : file->n_workers;
+  sif_executor executor = file->executor ? file->executor : _sif_thread_executor;
+  _sif_consolidate_job job;
+  u_char *shadow_bytes;
+  if (file->read_only || !file->header->consolidate || !_sif_load_directory(file)) {
     return;
   }
-  for (i = 0; i < hd->n_tiles; i++) {
-    if (file->tiles[i].block_num != -1 && file->dirty_tiles[i]) {
-      _sif_uniform_check(file, i, buffer);
-      if (file->error != 0) {
-	return;
+  batch = 16 * n_workers;
+  job.file = file;
+  job.tile_nos = (long*)malloc(sizeof(long) * batch);
+  job.shadows = (sif_tile*)malloc(sizeof(sif_tile) * batch);
+  job.payloads = (u_char*)malloc(tb * batch);
+  shadow_bytes = (u_char*)malloc(per_shadow * batch);
+  if (job.tile_nos == 0 || job.shadows == 0 || job.payloads == 0 || shadow_bytes == 0) {
+    free(job.tile_nos);
+    free(job.shadows);
+    free(job.payloads);
+    free(shadow_bytes);
+    SIF_ERROR_CHECK_RETURN_V(1, SIF_ERROR_MEM);
+  }
+  for (k = 0; k < batch; k++) {
+    job.shadows[k].uniform_flags = shadow_bytes + k * per_shadow;
+    job.shadows[k].uniform_pixel_values = job.shadows[k].uniform_flags + s;
+    job.shadows[k].slice_encodings = job.shadows[k].uniform_pixel_values + upvb;
+    job.shadows[k].slice_gradients = job.shadows[k].slice_encodings + hd->bands;
+  }
+  while (i < hd->n_tiles && file->error == 0) {
+    for (n = 0; i < hd->n_tiles && n < batch; i++) {
+      /** Skip eight clean tiles at a time. */
+      if (i % 8 == 0 && file->dirty_tiles[i / 8] == 0) {
+        i += 7;
+        continue;
       }
-      file->dirty_tiles[i] = 0;
+      if (SIF_GET_BIT(file->dirty_tiles, i) && file->tiles.block_nums[i] != -1) {
+        job.tile_nos[n++] = i;
+      }
+    }
+    if (n == 0) {
+      break;
+    }
+    if (!_sif_sync_for_positional_io(file)) {
+      break;
+    }
+    job.n = n;
+    job.next = 0;
+    job.error = 0;
+    job.error_line_no = 0;
+    executor(file->executor_data, MIN(n_workers, n), _sif_consolidate_worker, &job);
+    if (job.error != 0) {
+      file->error = job.error;
+      file->error_line_no = job.error_line_no;
+      break;
+    }
+    for (k = 0; k < n && file->error == 0; k++) {
+      _sif_commit_tile_check(file, job.tile_nos[k], job.shadows + k, job.payloads + k * tb);
+      SIF_CLEAR_BIT(file->dirty_tiles, job.tile_nos[k]);
+    }
+  }
+  free(job.tile_nos);
+  free(job.shadows);
+  free(job.payloads);
+  free(shadow_bytes);
+}
+
+/**
+ * The number of bytes of blocks moved at once during defragmentation.
+ */
+
+#ifndef SIF_DEFRAGMENT_WINDOW_BYTES
+#define SIF_DEFRAGMENT_WINDOW_BYTES (8 * 1024 * 1024)
+#endif
+
+/**
+ * Moves the blocks destined for one window of block indices during
+ * defragmentation. The blocks are read, coalescing runs of consecutive
+ * blocks into single reads, and then written to the window with one
+ * sequential write. Blocks of other tiles that occupy the window are
+ * moved to the block indices vacated by the window's blocks. Only the
+ * in-memory tile directory is updated.
+ *
+ * @param file    The file to defragment.
+ * @param order   The tiles with blocks, in the order of their destination.
+ * @param target  The destination block index of each tile.
+ * @param d       The first block index of the window.
+ * @param n       The number of blocks in the window.
+ * @param win     A buffer of n blocks.
+ * @param disp    A buffer of n blocks for the displaced blocks.
+ * @param free_at A buffer of n block indices.
+ */
+
+static void             _sif_defragment_window(sif_file *file, const long *order, const long *target,
+                                               long d, long n, u_char *win, u_char *disp,
+                                               long *free_at) {
+  LONGLONG tb = file->header->tile_bytes;
+  long j, r, src, t, n_free = 0, n_disp = 0;
+
+  /** Nothing to do if the window is already in place. */
+  for (j = 0; j < n && file->tiles.block_nums[order[d + j]] == d + j; j++);
+  if (j == n) {
+    return;
+  }
+
+  /** Read the window's blocks, one read per run of consecutive blocks. */
+  for (j = 0; j < n; j += r) {
+    src = file->tiles.block_nums[order[d + j]];
+    for (r = 1; j + r < n && file->tiles.block_nums[order[d + j + r]] == src + r; r++);
+    FSEEK64V(file->fp, _sif_get_block_location(file, src), SEEK_SET);
+    FREAD64V(win + j * tb, 1, tb * r, file->fp);
+  }
+
+  /** Block indices outside the window that its blocks vacate. */
+  for (j = 0; j < n; j++) {
+    src = file->tiles.block_nums[order[d + j]];
+    if (src < d || src >= d + n) {
+      free_at[n_free++] = src;
+    }
+  }
+
+  /** Read the blocks of tiles destined beyond the window that sit in it.
+      Each is given one of the vacated block indices. */
+  for (j = 0; j < n; j++) {
+    t = file->blocks_to_tiles[d + j];
+    if (t != -1 && target[t] >= d + n) {
+      FSEEK64V(file->fp, _sif_get_block_location(file, d + j), SEEK_SET);
+      FREAD64V(disp + n_disp * tb, 1, tb, file->fp);
+      n_disp++;
+    }
+  }
+
+  /** Write the window sequentially and the displaced blocks after it. */
+  FSEEK64V(file->fp, _sif_get_block_location(file, d), SEEK_SET);
+  FWRITE64V(win, 1, tb * n, file->fp);
+  for (j = 0; j < n_disp; j++) {
+    FSEEK64V(file->fp, _sif_get_block_location(file, free_at[j]), SEEK_SET);
+    FWRITE64V(disp + j * tb, 1, tb, file->fp);
+  }
+
+  /** Update the in-memory directory now that the blocks have moved. */
+  for (j = 0; j < n_free; j++) {
+    file->blocks_to_tiles[free_at[j]] = -1;
+  }
+  for (j = 0, n_disp = 0; j < n; j++) {
+    t = file->blocks_to_tiles[d + j];
+    if (t != -1 && target[t] >= d + n) {
+      file->tiles.block_nums[t] = (int)free_at[n_disp];
+      file->blocks_to_tiles[free_at[n_disp]] = (int)t;
+      n_disp++;
     }
   }
+  for (j = 0; j < n; j++) {
+    file->tiles.block_nums[order[d + j]] = (int)(d + j);
+    file->blocks_to_tiles[d + j] = (int)order[d + j];
+  }
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
 void             sif_defragment(sif_file *file) {
-  void *buf1, *buf2;
   sif_header *hd;
-  LONGLONG i = 0, tn1 = 0, tn2 = 0, bn1 = 0, bn2 = 0;
+  long i, k = 0, d, n, window;
+  long *order = 0, *target = 0, *free_at = 0;
+  u_char *win = 0;
   SIF_CHECK_FILE_V(file);
-  if (file->read_only || !file->header->defragment) {
+  if (file->read_only || !file->header->defragment || !_sif_load_meta_data(file)) {
     return;
   }
   hd = file->header;
-  buf1 = file->buffer[0];
-  buf2 = file->buffer[1];
-  for (i = 0, bn1 = 0; i < hd->n_tiles; i++) {
-    if (file->tiles[i].block_num != -1) {
-      bn2 = file->tiles[i].block_num;
-      tn1 = file->blocks_to_tiles[bn1];
-      tn2 = i;
-
-      /** Swap the block nums for bookkeeping purposes. **/
-      file->tiles[tn2].block_num = bn1;
-      file->blocks_to_tiles[bn1] = tn2;
-
-      /** It's possible that the other tile is uniform... */
-      if (tn1 != -1) {
-	file->tiles[tn1].block_num = bn2;
-	file->blocks_to_tiles[bn2] = tn1;
-	_sif_write_tile_header(file, file->tiles + tn1, tn1);
-	if (file->error != 0) {
-	  return;
-	}
-      }
-      else {
-	file->blocks_to_tiles[bn2] = -1;
-      }
-
-      /** Swap the disk blocks. **/
-      _sif_swap_blocks(file, bn1, bn2, buf1, buf2, tn1 == -1);
-      if (file->error != 0) {
-	return;
-      }
 
-      _sif_write_tile_header(file, file->tiles + tn2, tn2);
-      if (file->error != 0) {
-	return;
-      }
-      bn1++;
+  /** Plan the moves: the tiles with blocks, in tile order, get blocks 0, 1, ... */
+  order = (long*)malloc(sizeof(long) * hd->n_tiles);
+  target = (long*)malloc(sizeof(long) * hd->n_tiles);
+  if (order == 0 || target == 0) {
+    free(order);
+    free(target);
+    SIF_ERROR_CHECK_RETURN_V(1, SIF_ERROR_MEM);
+  }
+  for (i = 0; i < hd->n_tiles; i++) {
+    target[i] = -1;
+    if (file->tiles.block_nums[i] != -1) {
+      target[i] = k;
+      order[k++] = i;
     }
   }
 
-  /** Truncate the file. */
-  /**_sif_truncate(file, _sif_get_block_location(file, _sif_get_last_used_block_index(file) + 1));**/
+  /** Move the blocks a window at a time. */
+  window = MAX(1, SIF_DEFRAGMENT_WINDOW_BYTES / hd->tile_bytes);
+  window = MIN(window, MAX(k, 1));
+  win = (u_char*)malloc(hd->tile_bytes * window * 2);
+  free_at = (long*)malloc(sizeof(long) * window);
+  if (win == 0 || free_at == 0) {
+    file->error = SIF_ERROR_MEM;
+    file->error_line_no = __LINE__;
+  }
+  for (d = 0; d < k && file->error == 0 && (file->cancel == 0 || *file->cancel == 0); d += n) {
+    n = MIN(window, k - d);
+    _sif_defragment_window(file, order, target, d, n, win, win + hd->tile_bytes * window, free_at);
+  }
+  free(order);
+  free(target);
+  free(free_at);
+  free(win);
+
+  /** Write the tile directory once, even after an error, so it matches
+      the blocks that were moved. */
+  _sif_write_tile_headers(file);
   if (file->error != 0) {
     return;
   }
 
-  /** We lost the meta data, write it out again. */
-  _sif_write_meta_data(file);
-  if (file->error != 0) {
+  /** The values stored out of line follow the blocks. */
+  if (!_sif_pack_meta_data_values(file)) {
     return;
   }
+
+  /** We lost the meta data, write it out again. A meta-data extent is
+      only moved down, over the blocks freed below it. */
+  if (file->use_file_version < 4 || file->meta_data_displaced
+      || file->meta_data_location != MAX(_sif_get_block_location(file, _sif_get_last_used_block_index(file) + 1),
+                                         file->meta_data_values_end)) {
+    _sif_write_meta_data(file);
+  }
 }
 
-/* See sif-io.h for detailed documentation of public functions. */
-sif_file*        sif_open(const char *filename, int read_only) {
+/**
+ * Opens a file. See sif_open and sif_open_lazy.
+ *
+ * @param filename  The filename of the file to open.
+ * @param read_only Non-zero to open the file read-only.
+ * @param lazy      Non-zero to load the tile directory and meta-data
+ *                  only when they are needed.
+ *
+ * @return          The opened file, or NULL if an error occured.
+ */
+
+static sif_file*        _sif_open(const char *filename, int read_only, int lazy) {
   sif_file *retval = 0;
 #ifdef WIN32
   HANDLE fp = 0;
@@ -2025,7 +7321,7 @@ sif_file*        sif_open(const char *filename, int read_only) {
   FILE *fp = 0;
 #endif
   sif_header *header = 0;
-  int i = 0;
+  int i = 0, locked;
 #ifdef WIN32
   if (read_only) {
     fp = CreateFile(TEXT(filename), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_READONLY, NULL);
@@ -2049,21 +7345,26 @@ sif_file*        sif_open(const char *filename, int read_only) {
     }
     retval->fp = fp;
     retval->error = 0;
+    /** Keep processes writing the file in shared access mode from moving
+        blocks and meta-data while they are read. Closing the file on an
+        error releases the lock. A file system without locks cannot be
+        shared, so it is read all the same. */
+    locked = _sif_lock_range(retval, 0, SIF_ALLOC_LOCK_BYTES, 0);
     header = (retval->header = _sif_alloc_header());
     if (header == 0) {
       free(retval);
       FCLOSE64(fp);
       return 0;
     }
-    retval->tiles = 0;
 
-    retval->meta_data = _sif_alloc_meta_data_table();
     retval->read_only = read_only;
     REWIND64NEC(fp);
     if (_sif_read_header(retval) != 1 ||
 	header->version > SIF_VERSION ||
         strncmp(header->magic_number, SIF_MAGIC_NUMBER, SIF_MAGIC_NUMBER_SIZE) != 0 ||
-	(retval->tiles = _sif_alloc_tile_headers(retval)) == 0) {
+	(lazy && !_sif_alloc_lazy(retval)) ||
+	!_sif_alloc_tile_headers(retval)) {
+      _sif_free_lazy(retval);
       free(header);
       free(retval);
       FCLOSE64(fp);
@@ -2073,107 +7374,363 @@ sif_file*        sif_open(const char *filename, int read_only) {
     retval->units_per_tile = header->tile_width * header->tile_height * header->bands;
     retval->units_per_slice = header->tile_width * header->tile_height;
 
-    if (_sif_read_tile_headers(retval) != 1 ||
-	(retval->blocks_to_tiles = (long*)malloc(header->n_tiles * sizeof(long))) == 0 ||
-	(retval->dirty_tiles = (long*)malloc(header->n_tiles * sizeof(long))) == 0 ||
-	(retval->buffer[0] = malloc(header->tile_bytes)) == 0 ||
-	(retval->buffer[1] = malloc(header->tile_bytes)) == 0) {
+    if (!lazy) {
+      if (_sif_read_tile_headers(retval) != 1) {
+	_sif_free_tile_headers(retval);
+	free(header);
+	free(retval);
+	FCLOSE64(fp);
+	return 0;
+      }
+      for (i = 0; i < header->n_tiles; i++) {
+	if (retval->tiles.block_nums[i] != -1) {
+	  retval->blocks_to_tiles[retval->tiles.block_nums[i]] = (int)i;
+	}
+      }
+      /** The meta-data is read when it is first needed. */
+      _sif_locate_meta_data(retval);
+    }
+    if (retval->error != 0) {
+      _sif_free_tile_headers(retval);
+      _sif_free_meta_data(retval);
+      _sif_free_lazy(retval);
       free(header);
-      free(retval->tiles);
-      free(retval->blocks_to_tiles);
-      free(retval->dirty_tiles);
-      free(retval->buffer[0]);
-      free(retval->buffer[1]);
       free(retval);
       FCLOSE64(fp);
-      return 0;
+      retval = 0;
     }
-    bzero(retval->dirty_tiles, sizeof(long) * header->n_tiles);
-    for (i = 0; i < header->n_tiles; i++) {
-      retval->blocks_to_tiles[i] = -1;
+    else {
+      if (locked) {
+        _sif_unlock_range(retval, 0, SIF_ALLOC_LOCK_BYTES);
+      }
+      _sif_cache_attach(retval, 0);
     }
-    for (i = 0; i < header->n_tiles; i++) {
-      if (retval->tiles[i].block_num != -1) {
-	retval->blocks_to_tiles[retval->tiles[i].block_num] = i;
+  }
+  return retval;
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+sif_file*        sif_open(const char *filename, int read_only) {
+  return _sif_open(filename, read_only, 0);
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+sif_file*        sif_open_lazy(const char *filename, int read_only) {
+  return _sif_open(filename, read_only, 1);
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+int              sif_close(sif_file* file) {
+  int status = 0;
+  /** Flush whatever data has not been written to disk. */
+  sif_flush(file);
+  _sif_free_tile_headers(file);
+  _sif_free_meta_data(file);
+  free(file->header);
+  free(file->simple_region_buffer);
+  _sif_free_locks(file);
+  _sif_free_lazy(file);
+  _sif_cache_detach(file);
+  status = FCLOSE64(file->fp);
+  if (file->error) { free(file); return -1; }
+  free(file);
+  return status;
+}
+
+/**
+ * Reads again from the file header how many meta-data pairs there are
+ * and, in files of format version 4 or higher, where they lie; older
+ * files have them after the last block in the block map. Used in shared
+ * access mode, where other processes change both, under the allocation
+ * lock.
+ *
+ * @param file      The file.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
+
+static int              _sif_reread_meta_data_header(sif_file *file) {
+  u_char p[16];
+  /** The number of keys follows the header size, the magic number, the
+      version, and the three dimensions. */
+  SIF_ERROR_CHECK_RETURN(!_sif_read_at(file, p, 4, 4 + SIF_MAGIC_NUMBER_SIZE + 4 * 4), SIF_ERROR_READ, 0);
+  file->header->n_keys = _sif_packed_bytes_to_int32(p);
+  if (file->header->version >= 4) {
+    SIF_ERROR_CHECK_RETURN(!_sif_read_at(file, p, 16, SIF_HEADER_BYTES_V4 - 16), SIF_ERROR_READ, 0);
+    file->meta_data_location = _sif_packed_bytes_to_int64(p);
+    file->meta_data_bytes = _sif_packed_bytes_to_int64(p + 8);
+  }
+  _sif_locate_meta_data(file);
+  return 1;
+}
+
+/**
+ * Merges the meta-data pairs set or removed since the last flush into the
+ * meta-data as other processes left it in the file, and writes the result
+ * and the header. Used in shared access mode, under the allocation lock.
+ * The header and meta-data are read into a copy of the file, which takes
+ * the changes and is written; the file's own pairs are left as they are,
+ * and are no longer dirty.
+ *
+ * @param file      The file.
+ *
+ * @return          1 if successful, 0 otherwise.
+ */
+
+static int              _sif_merge_meta_data(sif_file *file) {
+  sif_file view = *file;
+  sif_header hd = *file->header;
+  sif_meta_data *i = 0, *next = 0;
+  int pass;
+  view.header = &hd;
+  view.meta_data_arena = 0;
+  bzero(&view.meta_data, sizeof(sif_meta_data_table));
+  view.meta_data_free_bytes = 0;
+  view.meta_data_displaced = 0;
+  view.meta_data_values_start = 0;
+  view.meta_data_values_end = 0;
+  view.meta_data_limit = 0;
+  view.error = 0;
+  /** Only the number of keys and where they lie are taken from the
+      header in the file; the rest is this process's to write. */
+  if (!_sif_reread_meta_data_header(&view) || !_sif_read_meta_data(&view)) {
+    file->error = view.error;
+    return 0;
+  }
+  /** A key removed and set again has both pairs on the list, so the
+      removals are done first. */
+  for (pass = 2; pass >= 1; pass--) {
+    for (i = file->meta_data.dirty; i != 0 && view.error == 0; i = i->next_dirty) {
+      if (i->dirty != pass) {
+        continue;
+      }
+      if (pass == 2) {
+        sif_remove_meta_data_item(&view, i->key);
+      }
+      else {
+        _sif_set_meta_data_len(&view, i->key, i->value, (int)i->value_length);
       }
     }
-    _sif_read_meta_data(retval);
-    if (retval->error != 0) {
-      free(header);
-      free(retval->tiles);
-      free(retval->blocks_to_tiles);
-      free(retval->dirty_tiles);
-      free(retval->buffer[0]);
-      free(retval->buffer[1]);
-      free(retval);
-      FCLOSE64(fp);
+  }
+  if (view.error == 0) {
+    _sif_write_meta_data(&view);
+    _sif_write_header(&view);
+  }
+  for (i = file->meta_data.dirty; i != 0; i = next) {
+    next = i->next_dirty;
+    i->next_dirty = 0;
+    i->dirty = 0;
+  }
+  file->meta_data.dirty = 0;
+  file->meta_data_location = view.meta_data_location;
+  file->meta_data_bytes = view.meta_data_bytes;
+  if (view.error != 0) {
+    file->error = view.error;
+  }
+  _sif_free_meta_data(&view);
+  return file->error == 0;
+}
+
+/**
+ * Flushes a file in shared access mode. The tile headers were written as
+ * the tiles changed, so only the header and meta-data are written, under
+ * the allocation lock so that no block is allocated over the meta-data
+ * meanwhile. Consolidation and defragmentation, which would move the
+ * blocks of other processes, are skipped.
+ *
+ * @param file      The file to flush.
+ */
+
+static void             _sif_flush_shared(sif_file *file) {
+  SIF_ERROR_CHECK_RETURN_V(!_sif_lock_range(file, 0, SIF_ALLOC_LOCK_BYTES, 1), SIF_ERROR_LOCK);
+  /** Only the block map is read again. A process allocating a block
+      holds the tile's lock while it waits for the allocation lock, so
+      locking the directory here could deadlock; no block is allocated
+      or moved while the allocation lock is held. */
+  if (_sif_refresh_directory(file, 0)) {
+    _sif_merge_meta_data(file);
+  }
+#ifndef WIN32
+  fflush(file->fp);
+#endif
+  _sif_unlock_range(file, 0, SIF_ALLOC_LOCK_BYTES);
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+int             sif_flush(sif_file* file) {
+  int concurrent_writes = file->concurrent_writes;
+  /** A lazily opened file is written out whole, so everything is loaded
+      first; a file that could not be loaded is not written. */
+  if (!file->read_only && _sif_load_meta_data(file)) {
+    /** Flushing is done on this thread alone, with buffered I/O. */
+    file->concurrent_writes = 0;
+    if (file->shared) {
+      _sif_flush_shared(file);
+    }
+    else {
+      _sif_write_tile_headers(file);
+      /** Detect pixel uniformity in blocks. Any block that has pixel uniformity will be compressed. */
+      if (file->header->consolidate) {
+        sif_consolidate(file);
+      }
+      /** Defragment the block space. */
+      if (file->header->defragment) {
+        sif_defragment(file);
+      }
+      /** The header says where the meta-data extent ended up. */
+      _sif_flush_meta_data(file);
+      _sif_write_header(file);
     }
+#ifdef WIN32
+    FlushFileBuffers(file->fp);
+#else
+    fflush(file->fp);
+#endif
+    _sif_cache_flushed(file);
+    file->concurrent_writes = concurrent_writes;
+  }
+  return 0;
+}
+
+/**
+ * The state of a flush or close running in the background.
+ */
+
+struct _sif_async {
+  sif_file *file;                   /** the file flushed or closed. */
+  int close;                        /** non-zero to close the file after flushing it. */
+  int result;                       /** the result returned by sif_async_wait. */
+  int started;                      /** non-zero if the thread was created. */
+  volatile int done;                /** set once the operation has finished. */
+  volatile int cancel;              /** set to stop defragmenting. */
+  _sif_thread_start start;          /** the start routine of the thread. */
+#ifdef WIN32
+  HANDLE thread;
+#else
+  pthread_t thread;
+#endif
+};
+
+/**
+ * Flushes or closes the file of a background operation.
+ *
+ * @param arg       The operation.
+ */
+
+static void             _sif_async_main(void *arg) {
+  sif_async *op = (sif_async*)arg;
+  sif_file *file = op->file;
+  file->cancel = &op->cancel;
+  if (op->close) {
+    op->result = sif_close(file) == 0 ? 0 : -1;
+  }
+  else {
+    sif_flush(file);
+    file->cancel = 0;
+    op->result = file->error == 0 ? 0 : -1;
+  }
+  op->done = 1;
+}
+
+/**
+ * Starts a flush or close on a new thread, or runs it on the calling
+ * thread if no thread can be created.
+ *
+ * @param file      The file to flush or close.
+ * @param close     Non-zero to close the file.
+ *
+ * @return          The operation, or null if it could not be allocated.
+ */
+
+static sif_async*       _sif_async_start(sif_file *file, int close) {
+  sif_async *op = (sif_async*)malloc(sizeof(sif_async));
+  if (op == 0) {
+    file->error = SIF_ERROR_MEM;
+    file->error_line_no = __LINE__;
+    return 0;
   }
-  return retval;
+  bzero(op, sizeof(sif_async));
+  op->file = file;
+  op->close = close;
+  op->start.worker = _sif_async_main;
+  op->start.worker_data = op;
+#ifdef WIN32
+  op->thread = CreateThread(NULL, 0, _sif_thread_main, &op->start, 0, NULL);
+  op->started = op->thread != NULL;
+#else
+  op->started = pthread_create(&op->thread, NULL, _sif_thread_main, &op->start) == 0;
+#endif
+  if (!op->started) {
+    _sif_async_main(op);
+  }
+  return op;
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
-int              sif_close(sif_file* file) {
-  int status = 0;
-  /** Flush whatever data has not been written to disk. */
-  sif_flush(file);
-  _sif_free_tile_headers(file);
-  _sif_free_meta_data(file);
-  free(file->header);
-  free(file->blocks_to_tiles);
-  free(file->dirty_tiles);
-  free(file->buffer[0]);
-  free(file->buffer[1]);
-  free(file->simple_region_buffer);
-  status = FCLOSE64(file->fp);
-  if (file->error) { free(file); return -1; }
-  free(file);
-  return status;
+sif_async*       sif_flush_async(sif_file *file) {
+  SIF_CHECK_FILE(file);
+  return _sif_async_start(file, 0);
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
-int             sif_flush(sif_file* file) {
-  if (!file->read_only) {
-    _sif_write_header(file);
-    _sif_write_tile_headers(file);
-    _sif_write_meta_data(file);
-    /** Detect pixel uniformity in blocks. Any block that has pixel uniformity will be compressed. */
-    if (file->header->consolidate) {
-        sif_consolidate(file);
-    }
-    /** Defragment the block space. */
-    if (file->header->defragment) {
-        sif_defragment(file);
-    }
+sif_async*       sif_close_async(sif_file *file) {
+  SIF_CHECK_FILE(file);
+  return _sif_async_start(file, 1);
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+int              sif_async_is_done(sif_async *op) {
+  return op->done;
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+void             sif_async_cancel(sif_async *op) {
+  op->cancel = 1;
+}
+
+/* See sif-io.h for detailed documentation of public functions. */
+int              sif_async_wait(sif_async *op) {
+  int result;
+  if (op->started) {
 #ifdef WIN32
-    FlushFileBuffers(file->fp);
+    WaitForSingleObject(op->thread, INFINITE);
+    CloseHandle(op->thread);
 #else
-    fflush(file->fp);
+    pthread_join(op->thread, NULL);
 #endif
   }
-  return 0;
+  result = op->result;
+  free(op);
+  return result;
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
 void             sif_consolidate(sif_file *file) {
-  if (file->read_only || !file->header->consolidate) {
+  if (file->read_only || !file->header->consolidate || !_sif_load_meta_data(file)) {
     return;
   }
-  _sif_mark_uniform_tiles(file, file->buffer[0]);
+  _sif_mark_uniform_tiles(file);
   /**_sif_truncate(file, _sif_get_block_location(file, _sif_get_last_used_block_index(file) + 1));**/
-  _sif_write_meta_data(file);
+  _sif_flush_meta_data(file);
 }
 
-/* See sif-io.h for detailed documentation of public functions. */
-sif_file*        sif_create(const char *filename, long width, long height,
+/**
+ * Creates a new SIF file. See \ref sif_create for a description of the
+ * parameters.
+ *
+ * @param packed   If non-zero, non-uniform slices are stored with one bit
+ *                 per data unit and the blocks are sized accordingly. The
+ *                 data unit size must be 1.
+ */
+
+static sif_file*        _sif_create(const char *filename, long width, long height,
 			    long bands, int data_unit_size,
 			    int user_data_type, int consolidate_on_close,
 			    int defragment_on_close,
                             long tile_width, long tile_height,
-			    int intrinsic_write) {
+			    int intrinsic_write, int packed) {
   sif_file *retval = 0;
   sif_header *hd = 0;
-  long i = 0, tb = tile_width * tile_height * bands * data_unit_size;
 
   /** Check for basic sanity of the arguments. */
   if (bands < 1 || width < 1 || height < 1 || tile_width < 1 || tile_height < 1 || data_unit_size < 1
@@ -2191,17 +7748,15 @@ sif_file*        sif_create(const char *filename, long width, long height,
     return 0;
   }
   if ((retval = _sif_alloc_fp()) == 0
-      || (hd = _sif_alloc_header()) == 0
-      || (retval->buffer[0] = malloc(tb)) == 0
-      || (retval->buffer[1] = malloc(tb)) == 0) {
+      || (hd = _sif_alloc_header()) == 0) {
     free(hd);
-    free(retval->buffer[0]);
     free(retval);
     return 0;
   }
   retval->fp = fp;
   retval->header = hd;
   retval->read_only = 0;
+  retval->meta_data_loaded = 1;
   retval->simple_region_buffer = 0;
   retval->simple_region_bytes = 0;
   hd->consolidate = consolidate_on_close;
@@ -2217,39 +7772,29 @@ sif_file*        sif_create(const char *filename, long width, long height,
   retval->units_per_tile = tile_width * tile_height * bands;
   retval->units_per_slice = tile_width * tile_height;
   hd->tile_bytes = tile_width * tile_height * bands * data_unit_size;
+  if (packed) {
+    hd->tile_bytes = ((tile_width * tile_height + 7) / 8) * bands;
+  }
   hd->data_unit_size = data_unit_size;
   hd->user_data_type = user_data_type;
   hd->n_tiles_across = CEIL_DIV(hd->width, hd->tile_width);
   hd->n_tiles = hd->n_tiles_across * CEIL_DIV(hd->height, hd->tile_height);
   hd->n_keys = 0;
-  retval->meta_data = _sif_alloc_meta_data_table();
-  if ((retval->tiles = _sif_alloc_tile_headers(retval)) == 0 ||
-      (retval->blocks_to_tiles = (long*)malloc(hd->n_tiles * sizeof(long))) == 0 ||
-      (retval->dirty_tiles = (long*)malloc(hd->n_tiles * sizeof(long))) == 0) {
-    _sif_free_tile_headers(retval);
+  if (!_sif_alloc_tile_headers(retval)) {
     free(hd);
-    free(retval->meta_data);
-    free(retval->blocks_to_tiles);
-    free(retval->dirty_tiles);
-    free(retval->buffer[0]);
-    free(retval->buffer[1]);
     free(retval);
     return 0;
   }
-  bzero(retval->dirty_tiles, hd->n_tiles * sizeof(long));
-  for (i = 0; i < hd->n_tiles; i++) {
-    retval->blocks_to_tiles[i] = -1;
-  }
   memcpy(&(hd->magic_number), SIF_MAGIC_NUMBER, SIF_MAGIC_NUMBER_SIZE);
+  /** The header is written with room for the fields of the latest
+      version; the meta-data extent is placed on the first flush. */
+  retval->use_file_version = SIF_VERSION;
+  retval->meta_data_location = -1;
   _sif_write_header(retval);
   retval->base_location = retval->header_bytes + (hd->tile_header_bytes * hd->n_tiles);
   if (retval->error != 0) {
     _sif_free_tile_headers(retval);
     free(hd);
-    free(retval->blocks_to_tiles);
-    free(retval->dirty_tiles);
-    free(retval->buffer[0]);
-    free(retval->buffer[1]);
     _sif_truncate(retval, 0);
     FCLOSE64(fp);
     free(retval);
@@ -2259,18 +7804,28 @@ sif_file*        sif_create(const char *filename, long width, long height,
   if (retval->error != 0) {
     _sif_free_tile_headers(retval);
     free(hd);
-    free(retval->blocks_to_tiles);
-    free(retval->dirty_tiles);
-    free(retval->buffer[0]);
-    free(retval->buffer[1]);
     _sif_truncate(retval, 0);
     FCLOSE64(fp);
     free(retval);
+    return 0;
   }
   sif_use_file_format_version(retval, sif_get_version());
+  _sif_cache_attach(retval, 1);
   return retval;
 }
 
+/* See sif-io.h for detailed documentation of public functions. */
+sif_file*        sif_create(const char *filename, long width, long height,
+			    long bands, int data_unit_size,
+			    int user_data_type, int consolidate_on_close,
+			    int defragment_on_close,
+                            long tile_width, long tile_height,
+			    int intrinsic_write) {
+  return _sif_create(filename, width, height, bands, data_unit_size, user_data_type,
+                     consolidate_on_close, defragment_on_close, tile_width, tile_height,
+                     intrinsic_write, 0);
+}
+
 /* See sif-io.h for detailed documentation of public functions. */
 sif_file         *sif_create_copy(sif_file *file, const char *filename) {
   sif_header *hd = file->header;
@@ -2287,6 +7842,10 @@ sif_file         *sif_create_copy(sif_file *file, const char *filename) {
     return 0;
   }
   sif_flush(file);
+  if (!_sif_borrow_buffers(file)) {
+    FCLOSE64(fp);
+    return 0;
+  }
   GetFileSizeEx(file->fp, &lsz);
   sz = lsz.QuadPart;
   REWIND64NEC(file->fp);
@@ -2295,6 +7854,7 @@ sif_file         *sif_create_copy(sif_file *file, const char *filename) {
     k = MIN(sz - j, bufsize);
     if (FREAD64NEC(file->buffer[0], 1, k, file->fp) == 0 ||
 	FWRITE64NEC(file->buffer[0], 1, k, fp) == 0) {
+      _sif_return_buffers(file);
       FCLOSE64(fp);
       return 0;
     }
@@ -2307,15 +7867,21 @@ sif_file         *sif_create_copy(sif_file *file, const char *filename) {
   if (!FILE_IS_OKAY(fp)) {
     return 0;
   }
+  if (!_sif_borrow_buffers(file)) {
+    fclose(fp);
+    return 0;
+  }
   while (!feof(file->fp)) {
     i = FREAD64NEC(file->buffer[0], 1, hd->data_unit_size * file->units_per_tile, file->fp);
     if (ferror(file->fp)
 	|| FWRITE64NEC(file->buffer[0], 1, i, fp) != i) {
+      _sif_return_buffers(file);
       fclose(fp);
       return 0;
     }
   }
 #endif
+  _sif_return_buffers(file);
   FCLOSE64(fp);
   return sif_open(filename, 0);
 }
@@ -2450,19 +8016,20 @@ int               sif_get_meta_data_num_items(sif_file *file) {
 void              sif_get_meta_data_keys(sif_file *file,
 					 const char *** key_strs,
 					 int *num_keys) {
-  int n, i, j;
+  int n, i;
   sif_meta_data *cur;
   SIF_CHECK_FILE_V(file);
+  _sif_load_meta_data(file);
   n = sif_get_meta_data_num_items(file);
   *key_strs = (const char**)malloc(sizeof(char*) * (n + 1));
   if (*key_strs == 0) {
     file->error = SIF_ERROR_MEM;
+    return;
   }
-  for (j = 0, i = 0; j < SIF_HASH_TABLE_SIZE; j++) {
-    for (cur = file->meta_data[j]; cur != 0; cur = cur->next) {
-      (*key_strs)[i] = cur->key;
-      i++;
-    }
+  /** The keys are listed in the order they were added. */
+  for (i = 0, cur = file->meta_data.first; cur != 0; cur = cur->next) {
+    (*key_strs)[i] = cur->key;
+    i++;
   }
   (*key_strs)[n] = 0;
   if (num_keys != 0) {
@@ -2474,23 +8041,58 @@ void              sif_get_meta_data_keys(sif_file *file,
 void              sif_remove_meta_data_item(sif_file *file, const char *key) {
   sif_meta_data *item;
   SIF_CHECK_FILE_V(file);
+  /** The pair's memory belongs to the arena and is freed with it. */
   item = _sif_unlink_meta_data_pair(file, key);
   if (item) {
-    free(item->value);
-    free(item->key);
-    free(item);
+    (file->header->n_keys)--;
+    _sif_mark_meta_data_pair(file, item, 2);
   }
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
 void              sif_use_file_format_version(sif_file *file, long version) {
-  if (version < 1) {
+  sif_header *hd = file->header;
+  long i;
+  if (version < 1 || version > SIF_VERSION) {
     file->error = SIF_ERROR_CANNOT_WRITE_VERSION;
     return;
   }
-  else {
-    file->use_file_version = version;
+  /** The meta-data is read in the version it was written in. */
+  if (!_sif_load_meta_data(file)) {
+    return;
+  }
+  /** Version 4 adds the location and size of the meta-data extent to the
+      file header, which a file written in an older version has no room
+      for. */
+  if (version >= 4 && file->header_bytes < SIF_HEADER_BYTES_V4) {
+    file->error = SIF_ERROR_CANNOT_WRITE_VERSION;
+    return;
+  }
+  /** Older versions store every value with its key. */
+  if (version < 4 && !_sif_inline_meta_data_values(file)) {
+    return;
+  }
+  /** Versions before 3 do not store slice encodings in the tile headers.
+      Dropping them moves the block region, which is only possible while
+      no blocks are in use. */
+  if (version < 3 && _sif_has_packed_slices(file)) {
+    file->error = SIF_ERROR_CANNOT_WRITE_VERSION;
+    return;
+  }
+  if (version < 3 && _sif_has_slice_encodings(file)) {
+    for (i = 0; i < hd->n_tiles; i++) {
+      if (file->tiles.block_nums[i] != -1) {
+        file->error = SIF_ERROR_CANNOT_WRITE_VERSION;
+        return;
+      }
+    }
+    hd->tile_header_bytes -= hd->bands + hd->bands * hd->data_unit_size * 2;
+    file->base_location = file->header_bytes + (hd->tile_header_bytes * hd->n_tiles);
+    if (!file->read_only) {
+      _sif_write_tile_headers(file);
+    }
   }
+  file->use_file_version = version;
 }
 
 /* See sif-io.h for detailed documentation of public functions. */
@@ -2516,17 +8118,19 @@ int               sif_is_possibly_sif_file(const char *filename) {
   if (FILE_IS_OKAY(fp)) {
     file->fp = fp;
     file->error = 0;
-    file->tiles = 0;
-    
-    file->meta_data = 0;
+    bzero(&file->tiles, sizeof(sif_tile_directory));
+    file->blocks_to_tiles = 0;
+    file->dirty_tiles = 0;
+    bzero(&file->meta_data, sizeof(sif_meta_data_table));
     file->read_only = 1;
     REWIND64NEC(fp);
     if (_sif_read_header(file) != 1 ||
 	strncmp(header->magic_number, SIF_MAGIC_NUMBER, SIF_MAGIC_NUMBER_SIZE) != 0 ||
-	(file->tiles = _sif_alloc_tile_headers(file)) == 0) {
+	!_sif_alloc_tile_headers(file)) {
       retval = 0;
     }
     else {
+      _sif_free_tile_headers(file);
       retval = 1;
     }
     FCLOSE64(fp);
@@ -2613,6 +8217,9 @@ const char *      sif_get_error_description(int code) {
   case SIF_ERROR_PNM_INCOMPATIBLE_DT_CONVENTION:
     str = "PNM output requires the 'simple' data type convention.";
     break;
+  case SIF_ERROR_LOCK:
+    str = "Error when locking part of the file.";
+    break;
   case SIF_SIMPLE_ERROR_UNDEFINED_DT:
     str = "Undefined data type code (simple).";
     break;
@@ -2629,12 +8236,37 @@ const char *      sif_get_error_description(int code) {
   return str;
 }
 
+static const long _sif_simple_data_type_sizes_bits [] = { 8, 8, 16, 16, 32, 32, 64, 64, 32, 64};
+static const long _sif_simple_data_type_sizes_bytes [] = { 1, 1,  2,  2,  4,  4,  8,  8,  4,  8};
+
+/**
+ * Returns the data unit size in bytes for a simple base type code.
+ *
+ * @param code     The base type code.
+ *
+ * @return         The data unit size, or 0 if the code is not defined.
+ */
+
+static long       _sif_simple_data_type_size(int code) {
+  if (code >= 0 && code <= 9) {
+    return _sif_simple_data_type_sizes_bytes[code];
+  }
+  switch (code) {
+  case SIF_SIMPLE_BIT:
+    return 1;
+  case SIF_SIMPLE_FLOAT16:
+  case SIF_SIMPLE_BFLOAT16:
+    return 2;
+  }
+  return 0;
+}
+
 void               sif_simple_set_endian(sif_file *file, int endian) {
   int simple_data_type;
   SIF_ERROR_CHECK_RETURN_V(endian < 0 || endian > 1, SIF_SIMPLE_ERROR_UNDEFINED_ENDIAN);
   SIF_CHECK_FILE_V(file);
   simple_data_type = SIF_SIMPLE_BASE_TYPE_CODE(file->header->user_data_type);
-  file->header->user_data_type = simple_data_type + 10 * endian;
+  file->header->user_data_type = SIF_SIMPLE_TYPE_CODE(simple_data_type, endian);
 }
 
 int               sif_simple_get_endian(sif_file *file) {
@@ -2644,10 +8276,10 @@ int               sif_simple_get_endian(sif_file *file) {
 
 void               sif_simple_set_data_type(sif_file *file, int data_type_code) {
   int simple_endian;
-  SIF_ERROR_CHECK_RETURN_V(data_type_code < 0 || data_type_code > 9, SIF_SIMPLE_ERROR_UNDEFINED_DT);
+  SIF_ERROR_CHECK_RETURN_V(_sif_simple_data_type_size(data_type_code) == 0, SIF_SIMPLE_ERROR_UNDEFINED_DT);
   SIF_CHECK_FILE_V(file);
   simple_endian = SIF_SIMPLE_ENDIAN(file->header->user_data_type);
-  file->header->user_data_type = data_type_code + 10 * simple_endian;
+  file->header->user_data_type = SIF_SIMPLE_TYPE_CODE(data_type_code, simple_endian);
 }
 
 int               sif_simple_get_data_type(sif_file *file) {
@@ -2655,15 +8287,18 @@ int               sif_simple_get_data_type(sif_file *file) {
   return SIF_SIMPLE_BASE_TYPE_CODE(file->header->user_data_type);
 }
 
-static const long _sif_simple_data_type_sizes_bits [] = { 8, 8, 16, 16, 32, 32, 64, 64, 32, 64};
-static const long _sif_simple_data_type_sizes_bytes [] = { 1, 1,  2,  2,  4,  4,  8,  8,  4,  8};
+/**
+ * Ensures the simple region buffer holds at least a given number of bytes,
+ * regardless of the byte order of the file.
+ *
+ * @param file     The SIF file.
+ * @param nbytes   The number of bytes needed.
+ *
+ * @return         1 if successful, 0 if memory could not be allocated.
+ */
 
-int              _sif_simple_alloc_region_buffer(sif_file *file, long nbytes) {
-  /** If the number of bytes requested for allocation is 0 or the
-      native endian is the same as the byte order of the image rasters,
-      do not allocate, return successful. */
-  if (nbytes == 0 || sif_simple_get_endian(file) == SIF_SIMPLE_NATIVE_ENDIAN
-      || nbytes <= file->simple_region_bytes) {
+static int       _sif_simple_grow_region_buffer(sif_file *file, long nbytes) {
+  if (nbytes <= file->simple_region_bytes) {
     return 1;
   }
   /** If the buffer is already allocated but not big enough, try expanding its size. */
@@ -2687,6 +8322,16 @@ int              _sif_simple_alloc_region_buffer(sif_file *file, long nbytes) {
   }
 }
 
+int              _sif_simple_alloc_region_buffer(sif_file *file, long nbytes) {
+  /** If the number of bytes requested for allocation is 0 or the
+      native endian is the same as the byte order of the image rasters,
+      do not allocate, return successful. */
+  if (nbytes == 0 || sif_simple_get_endian(file) == SIF_SIMPLE_NATIVE_ENDIAN) {
+    return 1;
+  }
+  return _sif_simple_grow_region_buffer(file, nbytes);
+}
+
 SIF_EXPORT sif_file*        sif_simple_create(const char *filename,
 					      long width, long height,
 					      long bands,
@@ -2697,17 +8342,18 @@ SIF_EXPORT sif_file*        sif_simple_create(const char *filename,
 					      int intrinsic_write) {
   int user_data_type, data_unit_size;
   sif_file *retval;
-  if (simple_data_type < 0 || simple_data_type > 9) {
+  if (_sif_simple_data_type_size(simple_data_type) == 0) {
     return 0;
   }
 
-  user_data_type = SIF_SIMPLE_NATIVE_ENDIAN * 10 + simple_data_type;
-  data_unit_size = _sif_simple_data_type_sizes_bytes[simple_data_type];
+  user_data_type = SIF_SIMPLE_TYPE_CODE(simple_data_type, SIF_SIMPLE_NATIVE_ENDIAN);
+  data_unit_size = _sif_simple_data_type_size(simple_data_type);
 
-  /** Now create the file. */
-  retval = sif_create(filename, width, height, bands, data_unit_size,
-		      user_data_type, consolidate_on_close,
-		      defragment_on_close, tile_width, tile_height, intrinsic_write);
+  /** Now create the file. 1-bit masks are stored packed. */
+  retval = _sif_create(filename, width, height, bands, data_unit_size,
+		       user_data_type, consolidate_on_close,
+		       defragment_on_close, tile_width, tile_height, intrinsic_write,
+		       simple_data_type == SIF_SIMPLE_BIT);
 
   /** If successful, set the file's region buffer and bytes fields. **/
   if (retval != 0) {
@@ -2758,13 +8404,257 @@ void              sif_simple_get_raster(sif_file* file, void *data, long x, long
   /** Get the raster from the file, being ignorant about the byte order. */
   sif_get_raster(file, data, x, y, w, h, band);
   /** If an error occured during the read, just return. */
-  if (file->error) { return; }
+  if (_sif_read_error(file)) { return; }
   /** Do a byte swap if the data elements stored in the file are in a different byte
       order than the native byte order. */
   if (file_endian != SIF_SIMPLE_NATIVE_ENDIAN) {
-    _sif_buffer_code_to_host(file->simple_region_buffer, region_bytes,
-			     file->header->data_unit_size, SIF_SIMPLE_NATIVE_ENDIAN);
+    _sif_buffer_code_to_host((unsigned char *)data, region_bytes,
+			     file->header->data_unit_size, file_endian);
+  }
+}
+
+/**
+ * Converts an IEEE 754 half precision value to single precision.
+ *
+ * @param h        The half precision bit pattern.
+ *
+ * @return         The single precision value.
+ */
+
+static float      _sif_half_to_float(unsigned short h) {
+  unsigned int sign = ((unsigned int)h & 0x8000) << 16;
+  unsigned int exponent = (h >> 10) & 0x1F;
+  unsigned int mantissa = h & 0x3FF;
+  unsigned int bits;
+  float f;
+  if (exponent == 0x1F) {
+    /** Infinity or NaN, the NaN payload is kept. */
+    bits = sign | 0x7F800000 | (mantissa << 13);
+  }
+  else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+  else if (mantissa == 0) {
+    bits = sign;
+  }
+  else {
+    /** Subnormal halves are normal floats, normalize the mantissa. */
+    exponent = 113;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+  }
+  memcpy(&f, &bits, 4);
+  return f;
+}
+
+/**
+ * Converts a single precision value to IEEE 754 half precision, rounding
+ * to nearest even. Values too large for a half become infinity.
+ *
+ * @param f        The single precision value.
+ *
+ * @return         The half precision bit pattern.
+ */
+
+static unsigned short _sif_float_to_half(float f) {
+  unsigned int bits, sign, mag, h, rem, half, shift;
+  memcpy(&bits, &f, 4);
+  sign = (bits >> 16) & 0x8000;
+  mag = bits & 0x7FFFFFFF;
+  if (mag >= 0x7F800000) {
+    /** Infinity stays infinity, NaNs stay (quiet) NaNs. */
+    return (unsigned short)(sign | 0x7C00 | (mag > 0x7F800000 ? 0x200 | ((mag >> 13) & 0x3FF) : 0));
+  }
+  if (mag >= 0x477FF000) {
+    return (unsigned short)(sign | 0x7C00);
+  }
+  if (mag < 0x38800000) {
+    /** Below the smallest normal half; 2^-25 and under rounds to zero. */
+    if (mag <= 0x33000000) {
+      return (unsigned short)sign;
+    }
+    shift = 126 - (mag >> 23);
+    mag = (mag & 0x7FFFFF) | 0x800000;
+    h = mag >> shift;
+    rem = mag & ((1u << shift) - 1);
+    half = 1u << (shift - 1);
+    if (rem > half || (rem == half && (h & 1))) {
+      h++;
+    }
+    return (unsigned short)(sign | h);
+  }
+  h = (mag - 0x38000000) >> 13;
+  rem = mag & 0x1FFF;
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) {
+    h++;
+  }
+  return (unsigned short)(sign | h);
+}
+
+/**
+ * Widens an array of 16-bit floating point values to single precision.
+ * The input and output may overlap when the input occupies the upper
+ * half of the output, i.e. in == (u_char*)out + 2 * n.
+ *
+ * @param in       The 16-bit values, in native byte order.
+ * @param out      The output buffer of n floats.
+ * @param n        The number of values.
+ * @param type     SIF_SIMPLE_FLOAT16 or SIF_SIMPLE_BFLOAT16.
+ */
+
+static void       _sif_widen_float16(const unsigned short *in, float *out, long n, int type) {
+  long i = 0;
+  unsigned int bits;
+  if (type == SIF_SIMPLE_BFLOAT16) {
+    /** A bfloat16 is the upper half of a float. */
+#ifdef SIF_HAVE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+      _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi16(zero, v));
+      _mm_storeu_si128((__m128i*)(out + i + 4), _mm_unpackhi_epi16(zero, v));
+    }
+#endif
+    for (; i < n; i++) {
+      bits = (unsigned int)in[i] << 16;
+      memcpy(out + i, &bits, 4);
+    }
+    return;
+  }
+#if defined(SIF_HAVE_AVX512F)
+  for (; i + 16 <= n; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+    _mm512_storeu_ps(out + i, _mm512_cvtph_ps(v));
+  }
+#endif
+#if defined(SIF_HAVE_F16C)
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(v));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = _sif_half_to_float(in[i]);
+  }
+}
+
+/**
+ * Narrows an array of single precision values to 16-bit floating point,
+ * rounding to nearest even.
+ *
+ * @param in       The floats.
+ * @param out      The output buffer of n 16-bit values, in native byte order.
+ * @param n        The number of values.
+ * @param type     SIF_SIMPLE_FLOAT16 or SIF_SIMPLE_BFLOAT16.
+ */
+
+static void       _sif_narrow_float32(const float *in, unsigned short *out, long n, int type) {
+  long i = 0;
+  unsigned int bits;
+  if (type == SIF_SIMPLE_BFLOAT16) {
+#ifdef SIF_HAVE_SSE2
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i bias = _mm_set1_epi32(0x7FFF);
+    const __m128i abs_mask = _mm_set1_epi32(0x7FFFFFFF);
+    const __m128i inf = _mm_set1_epi32(0x7F800000);
+    const __m128i quiet = _mm_set1_epi32(0x40);
+    __m128i r[2];
+    int k;
+    for (; i + 8 <= n; i += 8) {
+      for (k = 0; k < 2; k++) {
+	__m128i x = _mm_loadu_si128((const __m128i*)(in + i + 4 * k));
+	__m128i lsb = _mm_and_si128(_mm_srli_epi32(x, 16), one);
+	__m128i rounded = _mm_add_epi32(x, _mm_add_epi32(bias, lsb));
+	__m128i nan = _mm_cmpgt_epi32(_mm_and_si128(x, abs_mask), inf);
+	rounded = _mm_or_si128(_mm_andnot_si128(nan, rounded),
+			       _mm_and_si128(nan, _mm_or_si128(x, _mm_slli_epi32(quiet, 16))));
+	/** The arithmetic shift keeps each value in int16 range so the
+	    saturating pack is exact. */
+	r[k] = _mm_srai_epi32(rounded, 16);
+      }
+      _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(r[0], r[1]));
+    }
+#endif
+    for (; i < n; i++) {
+      memcpy(&bits, in + i, 4);
+      if ((bits & 0x7FFFFFFF) > 0x7F800000) {
+	out[i] = (unsigned short)((bits >> 16) | 0x40);
+      }
+      else {
+	out[i] = (unsigned short)((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+      }
+    }
+    return;
+  }
+#if defined(SIF_HAVE_AVX512F)
+  for (; i + 16 <= n; i += 16) {
+    __m256i v = _mm512_cvtps_ph(_mm512_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm256_storeu_si256((__m256i*)(out + i), v);
+  }
+#endif
+#if defined(SIF_HAVE_F16C)
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128((__m128i*)(out + i), v);
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = _sif_float_to_half(in[i]);
+  }
+}
+
+void              sif_simple_get_raster_float32(sif_file* file, float *data, long x, long y,
+						long w, long h, long band) {
+  int type, file_endian;
+  unsigned short *packed;
+  long n;
+  SIF_CHECK_FILE_V(file);
+  type = sif_simple_get_data_type(file);
+  if (type == SIF_SIMPLE_FLOAT32) {
+    sif_simple_get_raster(file, data, x, y, w, h, band);
+    return;
+  }
+  SIF_ERROR_CHECK_RETURN_V(type != SIF_SIMPLE_FLOAT16 && type != SIF_SIMPLE_BFLOAT16,
+			   SIF_SIMPLE_ERROR_INCORRECT_DT);
+  SIF_ERROR_CHECK_RETURN_V(w < 1 || h < 1, SIF_ERROR_INVALID_REGION_SIZE);
+  n = w * h;
+  file_endian = sif_simple_get_endian(file);
+  /** Read the 16-bit values into the upper half of the caller's buffer and
+      widen them in place, front to back. */
+  packed = (unsigned short*)(((unsigned char*)data) + 2 * n);
+  sif_get_raster(file, packed, x, y, w, h, band);
+  if (_sif_read_error(file)) { return; }
+  if (file_endian != SIF_SIMPLE_NATIVE_ENDIAN) {
+    _sif_buffer_code_to_host((unsigned char *)packed, 2 * n, 2, file_endian);
+  }
+  _sif_widen_float16(packed, data, n, type);
+}
+
+void              sif_simple_set_raster_float32(sif_file* file, const float *data,
+						long x, long y, long w, long h, long band) {
+  int type, file_endian;
+  long n;
+  SIF_CHECK_FILE_V(file);
+  if (file->error) { return; }
+  type = sif_simple_get_data_type(file);
+  if (type == SIF_SIMPLE_FLOAT32) {
+    sif_simple_set_raster(file, data, x, y, w, h, band);
+    return;
+  }
+  SIF_ERROR_CHECK_RETURN_V(type != SIF_SIMPLE_FLOAT16 && type != SIF_SIMPLE_BFLOAT16,
+			   SIF_SIMPLE_ERROR_INCORRECT_DT);
+  SIF_ERROR_CHECK_RETURN_V(w < 1 || h < 1, SIF_ERROR_INVALID_REGION_SIZE);
+  n = w * h;
+  file_endian = sif_simple_get_endian(file);
+  SIF_ERROR_CHECK_RETURN_V(_sif_simple_grow_region_buffer(file, 2 * n) == 0, SIF_ERROR_MEM);
+  _sif_narrow_float32(data, (unsigned short*)file->simple_region_buffer, n, type);
+  if (file_endian != SIF_SIMPLE_NATIVE_ENDIAN) {
+    _sif_buffer_host_to_code(file->simple_region_buffer, 2 * n, 2, file_endian);
   }
+  sif_set_raster(file, file->simple_region_buffer, x, y, w, h, band);
 }
 
 void              sif_simple_fill_tiles(sif_file *file, long band, const void *value) {
@@ -2787,16 +8677,16 @@ void              sif_simple_get_tile_slice(sif_file *file, void *buffer, long t
   int file_endian;
   SIF_CHECK_FILE_V(file);
   file_endian = sif_simple_get_endian(file);
-  region_bytes = file->header->tile_bytes / file->header->bands;
+  region_bytes = file->header->data_unit_size * file->units_per_slice;
   /** Get the raster from the file, being ignorant about the byte order. */
   sif_get_tile_slice(file, buffer, tx, ty, band);
   /** If an error occured during the read, just return. */
-  if (file->error) { return; }
+  if (_sif_read_error(file)) { return; }
   /** Do a byte swap if the data elements stored in the file are in a different byte
       order than the native byte order. */
   if (file_endian != SIF_SIMPLE_NATIVE_ENDIAN) {
-    _sif_buffer_code_to_host((unsigned char *)file->simple_region_buffer, region_bytes,
-			     file->header->data_unit_size, SIF_SIMPLE_NATIVE_ENDIAN);
+    _sif_buffer_code_to_host((unsigned char *)buffer, region_bytes,
+			     file->header->data_unit_size, file_endian);
   }
 }
 
@@ -2806,7 +8696,7 @@ void              sif_simple_set_tile_slice(sif_file *file, const void *buffer,
   int file_endian;
   SIF_CHECK_FILE_V(file);
   if (file->read_only) { return; }
-  region_bytes = file->header->tile_bytes / file->header->bands;
+  region_bytes = file->header->data_unit_size * file->units_per_slice;
   file_endian = sif_simple_get_endian(file);
   /** If the byte order of the data elements in the file is not the same as the
       byte order of the current architecture, we need to do some byte swapping. */
@@ -2843,6 +8733,82 @@ void              sif_simple_fill_tile_slice(sif_file *file, long tx, long ty,
   }
 }
 
+long             sif_simple_count_set_pixels(sif_file *file, long tx, long ty, long band) {
+  sif_header *hd = 0;
+  sif_tile tile_view, *tile = 0;
+  long tile_num, extentX, extentY, y, x, count = 0;
+  u_char *data, zero[8];
+  if (file == 0) {
+    return -1;
+  }
+  SIF_CHECK_FILE(file);
+  hd = file->header;
+  if (tx < 0 || ty < 0 || tx >= hd->n_tiles_across
+      || (hd->n_tiles_across * ty) + tx >= hd->n_tiles) {
+    file->error = SIF_ERROR_INVALID_TN;
+    return -1;
+  }
+  if (band < 0 || band >= hd->bands) {
+    file->error = SIF_ERROR_INVALID_BAND;
+    return -1;
+  }
+  tile_num = (hd->n_tiles_across * ty) + tx;
+  if (!_sif_load_tile_headers(file, tile_num, tile_num)) {
+    return -1;
+  }
+  tile = _sif_tile_view(file, tile_num, &tile_view);
+  extentX = MIN(hd->tile_width, hd->width - tx * hd->tile_width);
+  extentY = MIN(hd->tile_height, hd->height - ty * hd->tile_height);
+  bzero(zero, sizeof(zero));
+
+  /** A uniform slice is either all set or all clear. */
+  if (SIF_GET_BIT(tile->uniform_flags, band)) {
+    if (memcmp(tile->uniform_pixel_values + band * hd->data_unit_size, zero, hd->data_unit_size) != 0) {
+      return extentX * extentY;
+    }
+    return 0;
+  }
+
+  if (!_sif_borrow_buffers(file)) {
+    return -1;
+  }
+  /** Count the packed bits without unpacking them. */
+  if (tile->slice_encodings[band] == SIF_SLICE_ENCODING_BITS) {
+    if (!_sif_read_at(file, file->buffer[1], _sif_encoded_slice_bytes(file, SIF_SLICE_ENCODING_BITS),
+                      _sif_get_slice_location(file, tile_num, band))) {
+      file->error = SIF_ERROR_READ;
+      file->error_line_no = __LINE__;
+      _sif_return_buffers(file);
+      return -1;
+    }
+    if (extentX == hd->tile_width) {
+      count = _sif_popcount_bits(file->buffer[1], 0, extentX * extentY);
+    }
+    else {
+      for (y = 0; y < extentY; y++) {
+        count += _sif_popcount_bits(file->buffer[1], y * hd->tile_width, extentX);
+      }
+    }
+    _sif_return_buffers(file);
+    return count;
+  }
+
+  /** Otherwise, count the non-zero data units. */
+  sif_get_tile_slice(file, file->buffer[0], tx, ty, band);
+  if (file->error != 0) {
+    _sif_return_buffers(file);
+    return -1;
+  }
+  for (y = 0; y < extentY; y++) {
+    data = (u_char*)file->buffer[0] + y * hd->tile_width * hd->data_unit_size;
+    for (x = 0; x < extentX; x++, data += hd->data_unit_size) {
+      count += (memcmp(data, zero, hd->data_unit_size) != 0);
+    }
+  }
+  _sif_return_buffers(file);
+  return count;
+}
+
 sif_file*        sif_simple_open(const char* filename, int read_only) {
   sif_file *retval;
   long simple_region_bytes;
@@ -2913,7 +8879,7 @@ int              sif_is_simple_by_name(const char *filename) {
       /** It may be the case that the file is no longer openable, for some odd reason.
 	  Let's check. */
       if (file) {
-	retval2 = sif_is_simple_file(file);
+	retval2 = sif_is_simple(file);
 	/** If the file is a simple file, set the return value accordingly. */
 	if (retval2 == 0) {
 	  retval = -2; /** -2: file is a SIF file but does not conform to the simple data type convention. */
@@ -2959,7 +8925,7 @@ int           _sif_create_blank_file(const char *filename, _sif_file_ptr *ptr) {
   if (!FILE_IS_OKAY(fp)) {
     return 0;
   }
-  ftr->fp = fp;
+  ptr->fp = fp;
   return 1;
 }
 
@@ -2973,15 +8939,22 @@ int          sif_export_to_pgm_file(sif_file *file, const char *filename) {
     file->error = SIF_ERROR_PNM_INCOMPATIBLE_DT_CONVENTION;
     return 0;
   }
-  if (file->header->n_bands != 1) {
+  if (file->header->bands != 1) {
     file->error = SIF_ERROR_PGM_INVALID_BAND_COUNT;
     return 0;
   }
-  if (!(user_data_type == 0 || user_data_type == 2)) {
+  user_data_type = sif_simple_get_data_type(file);
+  if (!(user_data_type == SIF_SIMPLE_UINT8 || user_data_type == SIF_SIMPLE_UINT16)) {
     file->error = SIF_ERROR_PNM_INCOMPATIBLE_TYPE_CODE;
     return 0;
   }
+  /** Writing the pixels is not done yet, so no file is reported written. */
   if (_sif_create_blank_file(filename, &ptr)) {
-
+#ifdef WIN32
+    CloseHandle(ptr.fp);
+#else
+    fclose(ptr.fp);
+#endif
   }
+  return 0;
 }
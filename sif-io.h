@@ -296,6 +296,16 @@
 
 #define SIF_ERROR_PNM_INCOMPATIBLE_DT_CONVENTION 23
 
+/**
+ * \def SIF_ERROR_LOCK
+ * \ingroup sif_ec
+ *
+ * @brief Returned if a byte-range lock on the file could not be taken in
+ * shared access mode.
+ */
+
+#define SIF_ERROR_LOCK 24
+
 /**
  * \defgroup simpdecs Simple Data Type Convention Macro Definitions
  */
@@ -338,6 +348,123 @@
 
 #define SIF_MAGIC_NUMBER_SIZE 8
 
+/**
+ * \defgroup sif_enc SIF Slice Encodings
+ */
+
+/**
+ * \def SIF_SLICE_ENCODING_RAW
+ * \ingroup sif_enc
+ *
+ * @brief A slice encoding code indicating that a non-uniform slice is stored
+ * in its block as a raw raster of <code>tile_width * tile_height</code> data units.
+ * This is the only encoding used by files of format version 2 and earlier.
+ */
+
+#define SIF_SLICE_ENCODING_RAW 0
+
+/**
+ * \def SIF_SLICE_ENCODING_PALETTE1
+ * \ingroup sif_enc
+ *
+ * @brief A slice encoding code indicating that a non-uniform slice is stored
+ * as a palette of 2 data units followed by a 1-bit palette index for each
+ * data unit in the slice.
+ */
+
+#define SIF_SLICE_ENCODING_PALETTE1 1
+
+/**
+ * \def SIF_SLICE_ENCODING_PALETTE2
+ * \ingroup sif_enc
+ *
+ * @brief A slice encoding code indicating that a non-uniform slice is stored
+ * as a palette of 4 data units followed by a 2-bit palette index for each
+ * data unit in the slice.
+ */
+
+#define SIF_SLICE_ENCODING_PALETTE2 2
+
+/**
+ * \def SIF_SLICE_ENCODING_PALETTE4
+ * \ingroup sif_enc
+ *
+ * @brief A slice encoding code indicating that a non-uniform slice is stored
+ * as a palette of 16 data units followed by a 4-bit palette index for each
+ * data unit in the slice.
+ */
+
+#define SIF_SLICE_ENCODING_PALETTE4 3
+
+/**
+ * \def SIF_SLICE_ENCODING_PALETTE8
+ * \ingroup sif_enc
+ *
+ * @brief A slice encoding code indicating that a non-uniform slice is stored
+ * as a palette of 256 data units followed by an 8-bit palette index for each
+ * data unit in the slice.
+ */
+
+#define SIF_SLICE_ENCODING_PALETTE8 4
+
+/**
+ * \def SIF_SLICE_ENCODING_PLANE
+ * \ingroup sif_enc
+ *
+ * @brief A slice encoding code indicating that a slice is an exact linear
+ * ramp <code>a + b*x + c*y</code>. The data units are interpreted as
+ * little-endian two's complement integers and the arithmetic wraps
+ * modulo <code>2^(8*data_unit_size)</code>. The coefficients are stored
+ * in the tile header so the slice is not stored in a block at all.
+ */
+
+#define SIF_SLICE_ENCODING_PLANE 5
+
+/**
+ * \def SIF_SLICE_ENCODING_ROWS
+ * \ingroup sif_enc
+ *
+ * @brief A slice encoding code indicating that each row of a slice is
+ * constant. The slice is stored as one data unit per row.
+ */
+
+#define SIF_SLICE_ENCODING_ROWS 6
+
+/**
+ * \def SIF_SLICE_ENCODING_COLUMNS
+ * \ingroup sif_enc
+ *
+ * @brief A slice encoding code indicating that each column of a slice is
+ * constant. The slice is stored as one data unit per column.
+ */
+
+#define SIF_SLICE_ENCODING_COLUMNS 7
+
+/**
+ * \def SIF_SLICE_ENCODING_BITS
+ * \ingroup sif_enc
+ *
+ * @brief A slice encoding code indicating that a slice of a 1-bit mask file
+ * (see \ref SIF_SIMPLE_BIT) is stored with one bit per data unit, least
+ * significant bit first. A bit is set iff the data unit is non-zero.
+ */
+
+#define SIF_SLICE_ENCODING_BITS 8
+
+/**
+ * \def SIF_SLICE_ENCODING_UNIFORM
+ * \ingroup sif_enc
+ *
+ * @brief Returned by \ref sif_get_slice_encoding when the slice is uniform and
+ * therefore not stored in a block at all. This code is never stored in a file.
+ */
+
+#define SIF_SLICE_ENCODING_UNIFORM 255
+
+/** The file handle, declared ahead for the function pointer types below. */
+
+struct sif_file;
+
 /**
  * @brief A type of function pointer, instances of which are stored internally in a sif_file object.
  *
@@ -356,7 +483,7 @@
  * @return The number of bytes written.
  */
 
-typedef int (*sif_buffer_preprocessor) (sif_file *file, size_t size, size_t nmemb, const void *buffer);
+typedef int (*sif_buffer_preprocessor) (struct sif_file *file, size_t size, size_t nmemb, const void *buffer);
 
 /**
  * @brief A type of function pointer, instances of which are stored internally in a sif_file object.
@@ -376,7 +503,67 @@ typedef int (*sif_buffer_preprocessor) (sif_file *file, size_t size, size_t nmem
  * @return The number of bytes read.
  */
 
-typedef int (*sif_buffer_postprocessor) (sif_file *file, size_t size, size_t nmemb, void *buffer);
+typedef int (*sif_buffer_postprocessor) (struct sif_file *file, size_t size, size_t nmemb, void *buffer);
+
+/**
+ * @brief A type of function pointer for running the workers of a parallel
+ * operation on a caller-supplied thread pool.
+ *
+ * The executor must call <code>worker(worker_data)</code> \a n_workers
+ * times, concurrently when it can, and return only after every call has
+ * returned. Workers take their share of the work from a queue in
+ * \a worker_data, so calls may also run one after another on fewer threads.
+ *
+ * @param executor_data The pointer passed by the caller with the executor.
+ * @param n_workers     The number of worker calls to make.
+ * @param worker        The worker routine.
+ * @param worker_data   The argument to pass to each worker call.
+ */
+
+typedef void (*sif_executor) (void *executor_data, int n_workers,
+			      void (*worker)(void *worker_data), void *worker_data);
+
+/**
+ * @brief A type of function pointer called by \ref sif_for_each_tile for
+ * each tile slice visited.
+ *
+ * @param user    The pointer passed to \ref sif_for_each_tile.
+ * @param tx      The horizontal tile index.
+ * @param ty      The vertical tile index.
+ * @param band    The band of the slice.
+ * @param slice   The raw slice, <code>tile_width * tile_height</code> data
+ *                units in the file's byte order. The units of border tiles
+ *                that lie outside the image are undefined. The buffer is
+ *                only valid during the call.
+ *
+ * @return Zero to continue, or non-zero to stop visiting tiles.
+ */
+
+typedef int (*sif_tile_callback) (void *user, long tx, long ty, long band, const void *slice);
+
+/**
+ * @brief A type of function pointer called by \ref sif_for_each_tile for
+ * each uniform tile slice visited.
+ *
+ * @param user    The pointer passed to \ref sif_for_each_tile.
+ * @param tx      The horizontal tile index.
+ * @param ty      The vertical tile index.
+ * @param band    The band of the slice.
+ * @param value   The slice's uniform pixel value, one data unit.
+ *
+ * @return Zero to continue, or non-zero to stop visiting tiles.
+ */
+
+typedef int (*sif_uniform_tile_callback) (void *user, long tx, long ty, long band, const void *value);
+
+/**
+ * \def SIF_TILE_SKIP_UNIFORM
+ *
+ * @brief A flag for \ref sif_for_each_tile to skip uniform tile slices
+ * when no uniform callback is given.
+ */
+
+#define SIF_TILE_SKIP_UNIFORM 1
 
 /**
  * \struct sif_header
@@ -594,15 +781,14 @@ typedef struct SIF_EXPORT {
 
 /**
  * \struct sif_tile
- * @brief A struct for storing a SIF tile header in memory. It
- * stores important information related to a tile, including
- * which of its bands are uniform, and the uniform pixel values
- * of the bands.
+ * @brief A view of one tile header in memory. It points at the
+ * information related to a tile, including which of its bands are
+ * uniform, and the uniform pixel values of the bands. The headers of a
+ * file are stored in its \ref sif_tile_directory; a view points into it,
+ * or into arrays of its own for a header being built.
  */
 
 typedef struct SIF_EXPORT {
-  //  long                   block_num;
-  //  char                   uniform_pixel_value[16];
 
   /**
    * @brief A byte sequence where the i'th bit in the sequence
@@ -620,22 +806,88 @@ typedef struct SIF_EXPORT {
   u_char                 *uniform_pixel_values;
 
   /**
-   * @brief The block location of the file where the tile is stored.
+   * @brief A sequence of slice encoding codes. The i'th code describes
+   * how the raster of the i'th band is stored in the tile's block when
+   * the band is not uniform. The number of bytes is n_bands.
+   *
+   * Only tile headers of files with format version 3 or higher store
+   * these codes. For earlier versions, every code is
+   * \ref SIF_SLICE_ENCODING_RAW.
    *
-   * This number is -1 if the tile is completely uniform, i.e. each
+   * @see sif_enc
+   */
+
+  u_char                 *slice_encodings;
+
+  /**
+   * @brief The horizontal and vertical increments of slices encoded with
+   * \ref SIF_SLICE_ENCODING_PLANE. Two data units are stored for each band,
+   * the horizontal increment followed by the vertical increment. The
+   * value at the origin of the slice is stored in
+   * <code>uniform_pixel_values</code>. The number of bytes is
+   * <code>2*n_bands*data_unit_size</code>.
+   *
+   * Only tile headers of files with format version 3 or higher store
+   * the increments.
+   */
+
+  u_char                 *slice_gradients;
+
+} sif_tile;
+
+/**
+ * \struct sif_tile_directory
+ * @brief The tile headers of a file in memory, stored as parallel arrays
+ * indexed by tile number so that scans over many tiles read contiguous
+ * memory. The fields of tile i start at i times the size of the field of
+ * one tile, as given for \ref sif_tile.
+ */
+
+typedef struct SIF_EXPORT {
+
+  /**
+   * @brief The uniformity flags of every tile, a bit matrix of
+   * <code>n_tiles</code> rows of \ref sif_header::n_uniform_flags bytes.
+   */
+
+  u_char                 *uniform_flags;
+
+  /**
+   * @brief The uniform pixel values of every tile.
+   */
+
+  u_char                 *uniform_pixel_values;
+
+  /**
+   * @brief The block location of the file where each tile is stored.
+   *
+   * The number is -1 if the tile is completely uniform, i.e. each
    * band in the tile is completely uniform. Note that the bands
    * of a tile (i.e. slices) may have different uniform pixel values.
    * A tile or block is uniform iff each of its slices is uniform.
+   * Block numbers are stored in 32 bits in the file.
    */
 
-  long                   block_num;
+  int                    *block_nums;
 
-} sif_tile;
+  /**
+   * @brief The slice encoding codes of every tile.
+   */
+
+  u_char                 *slice_encodings;
+
+  /**
+   * @brief The slice increments of every tile.
+   */
+
+  u_char                 *slice_gradients;
+
+} sif_tile_directory;
 
 /**
  * \struct sif_meta_data
  * @brief A struct for storing meta-data in memory. It stores a node
- * in a linked list of meta-data.
+ * in the list of meta-data, kept in the order the fields were added.
  *
  * @warning Do not modify this data structure directly. Instead use
  * the \ref sif_set_meta_data and \ref sif_set_meta_data_binary
@@ -651,7 +903,8 @@ typedef struct SIF_EXPORT sif_meta_data {
   char*                  key;
 
   /**
-   * @brief The value of this meta-data field.
+   * @brief The value of this meta-data field. A value stored out of line
+   * is NULL until it is first read.
    */
 
   char*                  value;
@@ -669,6 +922,23 @@ typedef struct SIF_EXPORT sif_meta_data {
 
   unsigned long          value_length;
 
+  /**
+   * @brief The number of bytes available to the value where it is
+   * stored, in memory or, for a value stored out of line, in the file. A
+   * longer value is stored elsewhere.
+   */
+
+  unsigned long          value_capacity;
+
+  /**
+   * @brief Where the value lies in the file when it is stored out of
+   * line, apart from the meta-data extent, or -1 if it is stored with the
+   * key. Values of at least SIF_META_DATA_OUT_OF_LINE_BYTES bytes are
+   * stored out of line in files of format version 4 and higher.
+   */
+
+  LONGLONG               value_location;
+
   /**
    * @brief A pointer to the next meta-data field. The value is NULL if
    * there is no next meta-data field.
@@ -676,8 +946,100 @@ typedef struct SIF_EXPORT sif_meta_data {
 
   struct sif_meta_data*  next;
 
+  /**
+   * @brief A pointer to the previous meta-data field. The value is NULL
+   * if there is no previous meta-data field.
+   */
+
+  struct sif_meta_data*  prev;
+
+  /**
+   * @brief Where the record of this field starts in the meta-data extent
+   * of a file of format version 4 or higher, or -1 if the field has no
+   * record there yet.
+   */
+
+  LONGLONG               location;
+
+  /**
+   * @brief The number of bytes the record of this field has room for,
+   * for the key and the value together.
+   */
+
+  unsigned long          record_bytes;
+
+  /**
+   * @brief Non-zero while the field is on the list of fields whose
+   * records are to be written (1) or, once it has been removed, freed (2)
+   * on the next flush.
+   */
+
+  int                    dirty;
+
+  /**
+   * @brief A pointer to the next field on that list.
+   */
+
+  struct sif_meta_data*  next_dirty;
+
 } sif_meta_data;
 
+/**
+ * \struct sif_meta_data_table
+ * @brief The meta-data of a file in memory: an open-addressing hash
+ * table of the fields, keyed by the hash of their keys, and the list of
+ * the fields in the order they were added, in which they are written.
+ *
+ * @warning Do not modify this data structure directly. Instead use
+ * the \ref sif_set_meta_data and \ref sif_remove_meta_data_item
+ * functions.
+ */
+
+typedef struct SIF_EXPORT sif_meta_data_table {
+
+  /**
+   * @brief The field in each slot of the table, or NULL if the slot is
+   * empty. Fields are found by linear probing from the slot their hash
+   * maps to.
+   */
+
+  sif_meta_data**        slots;
+
+  /**
+   * @brief The hash of the key of the field in each slot, so that probes
+   * compare keys only when their hashes match.
+   */
+
+  unsigned long*         hashes;
+
+  /**
+   * @brief The number of slots, zero or a power of two. The table doubles
+   * before it is three quarters full.
+   */
+
+  unsigned long          n_slots;
+
+  /**
+   * @brief The first meta-data field added.
+   */
+
+  sif_meta_data*         first;
+
+  /**
+   * @brief The last meta-data field added.
+   */
+
+  sif_meta_data*         last;
+
+  /**
+   * @brief The fields changed or removed since the meta-data was last
+   * written, most recent first.
+   */
+
+  sif_meta_data*         dirty;
+
+} sif_meta_data_table;
+
 /** \internal
    We need the CFile class for 64-bit file support in windows. Microsoft does
    not conform to the LFS standard.
@@ -692,7 +1054,7 @@ typedef struct SIF_EXPORT sif_meta_data {
  */
 
 
-typedef struct SIF_EXPORT {
+typedef struct SIF_EXPORT sif_file {
 #ifdef WIN32 
   /** @brief The handle to the internal file pointer. */
   HANDLE                   fp;
@@ -707,17 +1069,68 @@ typedef struct SIF_EXPORT {
   sif_header*              header;
 
   /**
-   * @brief An array of tiles to store.
+   * @brief The headers of the tiles.
    */
 
-  sif_tile*                tiles;
+  sif_tile_directory       tiles;
 
   /**
-   * @brief The meta-data for the file. This structure is a linked list
-   * of (key, value) pairs. Meta-data in SIF can be null-terminated strings
-   * or binary data blocks.   
+   * @brief The meta-data for the file, a table of (key, value) pairs.
+   * Meta-data in SIF can be null-terminated strings or binary data blocks.
    */
-  sif_meta_data**          meta_data;
+  sif_meta_data_table      meta_data;
+
+  /**
+   * @brief The blocks of memory from which the meta-data pairs, their keys,
+   * and their values are allocated. They are freed together when the file
+   * is closed.
+   */
+  void*                    meta_data_arena;
+
+  /**
+   * @brief Where the meta-data section of an opened file starts on disk,
+   * and its size in bytes. They are recorded when the file is opened,
+   * and the section is read from there the first time it is needed. In
+   * files of format version 4 and higher, the section is the meta-data
+   * extent, and they are stored in the file header; the location is -1
+   * until the extent is first written.
+   */
+  LONGLONG                 meta_data_location;
+  LONGLONG                 meta_data_bytes;
+
+  /**
+   * @brief The number of bytes of the meta-data extent taken by the
+   * records of fields since changed or removed. The extent is compacted
+   * once they are more than half of it.
+   */
+  LONGLONG                 meta_data_free_bytes;
+
+  /**
+   * @brief Non-zero once a storage block has been allocated over the
+   * meta-data extent. The extent is then written again, past the blocks,
+   * on the next flush.
+   */
+  int                      meta_data_displaced;
+
+  /**
+   * @brief The range of the file holding the meta-data values stored out
+   * of line, empty if there are none. It may extend over the room of values
+   * since replaced or removed.
+   */
+  LONGLONG                 meta_data_values_start;
+  LONGLONG                 meta_data_values_end;
+
+  /**
+   * @brief Where the meta-data extent has to stop growing because a value
+   * stored out of line was written after it, or 0 if nothing follows it.
+   */
+  LONGLONG                 meta_data_limit;
+
+  /**
+   * @brief 1 once the meta-data has been read, or for a created file,
+   * 0 while it is still on disk, and -1 if it could not be read.
+   */
+  volatile long            meta_data_loaded;
 
   /**
    * @brief A flag indicating whether the file is open in
@@ -735,17 +1148,14 @@ typedef struct SIF_EXPORT {
    * consolidated or defragmented.
    */
 
-  long*                    blocks_to_tiles;
+  int*                     blocks_to_tiles;
 
   /**
-   * @brief An array of booleans where the i'th value is one iff the
-   * i'th tile has been written and no uniformity check was made
-   * during the write. In this future, the type of the values contained
-   * in the array will be changed to char*, pending confirmation that
-   * the change does not break regression tests.
+   * @brief A bit set where the i'th bit is one iff the i'th tile has
+   * been written and no uniformity check was made during the write.
    */
 
-  long*                    dirty_tiles;
+  u_char*                  dirty_tiles;
 
   /**
    * @brief Two buffers with enough memory to each store one block. The
@@ -753,6 +1163,8 @@ typedef struct SIF_EXPORT {
    * \code
    *    tile_width * tile_height * n_bands * data_unit_size .
    * \endcode
+   * They are borrowed from a process-wide pool while a call runs and are
+   * null while the handle is idle. See \ref sif_file::scratch_depth.
    */
 
   void*                    buffer[2];
@@ -860,8 +1272,106 @@ typedef struct SIF_EXPORT {
 
   sif_buffer_postprocessor postprocessor;
 
+  /**
+   * @brief A flag indicating whether concurrent read mode is enabled.
+   * See \ref sif_enable_concurrent_reads.
+   */
+
+  int                      concurrent_reads;
+
+  /**
+   * @brief The number of workers used by operations that run in
+   * parallel. See \ref sif_set_workers.
+   */
+
+  int                      n_workers;
+
+  /**
+   * @brief The executor on which workers are run, or null to create
+   * threads as needed. See \ref sif_set_workers.
+   */
+
+  sif_executor             executor;
+
+  /**
+   * @brief The pointer passed to the executor.
+   */
+
+  void*                    executor_data;
+
+  /**
+   * @brief The cancellation flag of the asynchronous operation running on
+   * the file, or null. See \ref sif_async_cancel.
+   */
+
+  volatile int*            cancel;
+
+  /**
+   * @brief A flag indicating whether concurrent write mode is enabled.
+   * See \ref sif_enable_concurrent_writes.
+   */
+
+  int                      concurrent_writes;
+
+  /**
+   * @brief The tile and block locks used in concurrent write mode.
+   */
+
+  void*                    locks;
+
+  /**
+   * @brief The loading state of the tile directory and meta-data of a
+   * file opened with \ref sif_open_lazy, or null.
+   */
+
+  void*                    lazy;
+
+  /**
+   * @brief A flag indicating whether shared access mode is enabled.
+   * See \ref sif_enable_shared_access.
+   */
+
+  int                      shared;
+
+  /**
+   * @brief The identity of the file in the process-wide slice cache, shared
+   * by every handle open on the same file, or zero. See
+   * \ref sif_set_cache_size.
+   */
+
+  long                     cache_id;
+
+  /**
+   * @brief The number of calls in progress that borrowed the block
+   * buffers from the process-wide scratch pool. The buffers are returned
+   * when it drops to zero.
+   */
+
+  int                      scratch_depth;
+
 } sif_file;
 
+/**
+ * @brief A handle to a flush or close running in the background. See
+ * \ref sif_flush_async and \ref sif_close_async.
+ */
+
+typedef struct _sif_async sif_async;
+
+/**
+ * @brief A handle to a streaming writer that takes a band of a file one
+ * scan line at a time. See \ref sif_row_writer_open.
+ */
+
+typedef struct _sif_row_writer sif_row_writer;
+
+/**
+ * @brief A handle to a streaming reader that returns a band of a file one
+ * scan line at a time. See \ref sif_row_reader_open.
+ */
+
+typedef struct _sif_row_reader sif_row_reader;
+
 /**
  * @brief Return the latest version of the SIF file format that the
  * currently loaded SIF library can process.
@@ -875,6 +1385,14 @@ SIF_EXPORT long             sif_get_version();
 /**
  * @brief Open a Sparse Image File (SIF) format file for reading or update.
  *
+ * The header and the tile directory are read at once. The meta-data is
+ * not: its location and size are recorded, and it is read with a single
+ * read the first time a meta-data function needs it, a storage block is
+ * allocated, or the file is flushed or defragmented. A file opened only
+ * to read a few tiles therefore never reads its meta-data. Enabling
+ * concurrent read, concurrent write, or shared access mode reads it
+ * right away.
+ *
  * @param filename  The filename of the SIF file to open.
  * @param read_only A flag indicating whether to open as read-only (1)
  *                  or update (0).
@@ -886,6 +1404,40 @@ SIF_EXPORT long             sif_get_version();
 
 SIF_EXPORT sif_file*        sif_open(const char* filename, int read_only);
 
+/**
+ * @brief Open a Sparse Image File (SIF) format file without loading its
+ * tile directory up front.
+ *
+ * \ref sif_open reads and decodes every tile header, builds the map from
+ * storage blocks to tiles, and reads the meta-data before it returns,
+ * which dominates the cost of opening a file with millions of tiles only
+ * to read a few of them. A file opened with this function reads only its
+ * header. The tile headers are then read and decoded in chunks of
+ * SIF_LAZY_CHUNK_TILES tiles, each with a single read, the first time a
+ * tile of the chunk is touched. The rest of the directory and the block
+ * map are loaded the first time the whole directory is needed: when a
+ * storage block is allocated or freed, when the file is consolidated, and
+ * when \ref sif_fill_tiles or \ref sif_use_file_format_version is
+ * called. The meta-data, which follows the last block in use, is loaded
+ * along with them the first time it is needed, as with \ref sif_open.
+ * Concurrent write and shared access modes load everything when they are
+ * enabled; concurrent read mode loads nothing up front.
+ *
+ * A file opened for update is therefore loaded completely no later than
+ * when it is flushed or closed. Otherwise, the handle behaves exactly as
+ * one returned by \ref sif_open, and may be read from several threads in
+ * concurrent read mode. Errors reading the directory are reported by the
+ * call that touched it.
+ *
+ * @param filename  The filename of the SIF file to open.
+ * @param read_only A flag indicating whether to open as read-only (1)
+ *                  or update (0).
+ *
+ * @return The opened file, or NULL if an error occured during open.
+ */
+
+SIF_EXPORT sif_file*        sif_open_lazy(const char* filename, int read_only);
+
 /**
  * @brief Create a new Sparse Image Format (SIF) file with a given filename
  * and attributes. The file's header and tile headers are written. No
@@ -932,107 +1484,449 @@ SIF_EXPORT sif_file*        sif_create(const char *filename, long width, long he
  *          creation.
  */
 
-SIF_EXPORT sif_file*        sif_create_copy(sif_file *file, const char *filename);
+SIF_EXPORT sif_file*        sif_create_copy(sif_file *file, const char *filename);
+
+/**
+ * @brief Close a SIF file.
+
+ * If the file is open for reading and writing, defragmentation
+ * and consolidation occur only if the defragment and consolidate
+ * flags are set in the file's header. The file header, tile headers, and
+ * meta data are written upon close.
+ *
+ * @param file   The SIF file to close.
+ *
+ * @return       The status of the close.
+ *
+ * @see sif_header::consolidate
+ * @see sif_header::defragment
+ * @see sif_set_consolidate
+ * @see sif_unset_consolidate
+ * @see sif_is_consolidate_set
+ */
+
+SIF_EXPORT int              sif_close(sif_file* file);
+
+/**
+ * @brief Check all tiles in a file for intrinsic uniformity.
+ *
+ * If a tile is found to be intrinsically uniform, its common pixel values
+ * for each slice is stored in its header and the physical storage block it
+ * is using is freed. If the consolidation flag in the file's header is
+ * turned off or the file is read only, this method does nothing.
+ *
+ * Only tiles written since they were last checked are read. The reads and
+ * checks are split across the workers set with \ref sif_set_workers.
+ *
+ * @param file   The file to mark for uniformity.
+ */
+
+SIF_EXPORT void             sif_consolidate(sif_file* file);
+
+/**
+ * @brief Defragment the file.
+ *
+ * This results in a sort of the storage blocks
+ * so they are in the order of their corresponding tile indices. This
+ * enables faster reading/writing of continguous blocks. No unused
+ * storage blocks remain in the file (i.e. the used blocks are shifted
+ * so that they write over the unused blocks). The file is
+ * truncated at the position of the last used storage block byte. Meta-data
+ * and the file's header are rewritten.
+ *
+ * The destination of every block is planned up front. Blocks are then moved
+ * a window of consecutive destinations at a time: runs of consecutive
+ * blocks are read with single reads and each window is written with one
+ * sequential write, so the cost approaches that of a sequential copy. The
+ * tile headers are written once at the end.
+ *
+ * @param file   The file to defragment.
+ */
+
+SIF_EXPORT void             sif_defragment(sif_file* file);
+
+/**
+ * @brief Writes a rectangular image region to a file.
+ *
+ * The tiles changed by this write are not checked for pixel uniformity.
+ * This results in the dirty flags in their respective tile headers being
+ * set to true. This results in a uniformity check during the file's close unless
+ * the uniformity check flag is set to false in the file's header. Also, any
+ * fragmentation caused by this function is not resolved until the file is closed.
+ *
+ * @warning This function has not been tested.
+ *
+ * @param file   The file on which to write the raster plane.
+ * @param data   The buffer containing the raster to write.
+ * @param x      The starting horizontal pixel offset (0..N-1 indexed) to write.
+ * @param y      The starting vertical pixel offset (0..N-1 indexed) to write.
+ * @param w      The width of the region.
+ * @param h      The height of the region.
+ * @param band   The band offset (0..N-1 indexed).
+ *
+ * @see sif_get_raster
+ * @see sif_get_tile_slice
+ * @see sif_set_tile_slice
+ */
+
+SIF_EXPORT void             sif_set_raster(sif_file* file, const void *data,
+                                long x, long y, long w, long h, long band);
+
+/**
+ * @brief Reads a rectangular raster region from a file. It may overlap
+ * multiple tiles in the file.
+ *
+ * @warning This function has not been tested.
+ *
+ * @param file   The file on which to read the raster plane out.
+ * @param data   The buffer to store the raster plane.
+ * @param x      The starting horizontal pixel offset (0..N-1 indexed) to read.
+ * @param y      The starting vertical pixel offset (0..N-1 indexed) to read.
+ * @param w      The width of the region.
+ * @param h      The height of the region.
+ * @param band   The band offset (0..N-1 indexed).
+ *
+ * @see sif_set_raster
+ * @see sif_get_tile_slice
+ * @see sif_set_tile_slice
+ */
+
+
+SIF_EXPORT void             sif_get_raster(sif_file* file, void *data,
+                                long x, long y, long w, long h, long band);
+
+/**
+ * @brief Starts writing a band of a file as a stream of scan lines.
+ *
+ * The rows are given top to bottom with \ref sif_row_writer_put. They are
+ * gathered in memory, one row of tiles at a time, and each tile slice is
+ * written exactly once when its row of tiles is complete, so no tile is
+ * read back and merged as with \ref sif_set_raster. Full rows of tiles are
+ * written on a background thread while the next one is filled. If the
+ * thread cannot be created, the tiles are written before
+ * \ref sif_row_writer_put returns.
+ *
+ * The file must not be used by any other call until
+ * \ref sif_row_writer_close returns, unless concurrent write mode is
+ * enabled (see \ref sif_enable_concurrent_writes), in which case the tiles
+ * are locked while they are written.
+ *
+ * @param file   The file to write.
+ * @param band   The band offset (0..N-1 indexed).
+ *
+ * @return A handle to the writer, or null if the file is read-only, the
+ *         band is invalid, or no memory could be allocated. The error is
+ *         then set in \ref sif_file::error.
+ *
+ * @see sif_row_writer_put
+ * @see sif_row_writer_close
+ */
+
+SIF_EXPORT sif_row_writer*  sif_row_writer_open(sif_file *file, long band);
+
+/**
+ * @brief Writes the next scan lines of a band.
+ *
+ * @param writer The writer.
+ * @param rows   The scan lines, each as wide as the file, one after the other.
+ * @param n_rows The number of scan lines. They may not run past the bottom
+ *               of the file.
+ *
+ * @return Zero if successful, or -1 if an error occurred, either now or
+ *         while writing an earlier row of tiles. The error is left in
+ *         \ref sif_file::error, or, in concurrent write mode, returned by
+ *         \ref sif_get_thread_error.
+ */
+
+SIF_EXPORT int              sif_row_writer_put(sif_row_writer *writer, const void *rows, long n_rows);
+
+/**
+ * @brief Writes the rows still held by a streaming writer, waits for the
+ * background thread, and frees the writer.
+ *
+ * If the scan lines given stop short of the bottom of a row of tiles,
+ * the rest of those tiles keeps its previous contents.
+ *
+ * @param writer The writer.
+ *
+ * @return Zero if successful, or -1 if an error occurred. The error is
+ *         reported as for \ref sif_row_writer_put.
+ */
+
+SIF_EXPORT int              sif_row_writer_close(sif_row_writer *writer);
+
+/**
+ * @brief Starts reading a band of a file as a stream of scan lines.
+ *
+ * The rows are returned top to bottom by \ref sif_row_reader_get. Each row
+ * of tiles is read once and kept in memory until its last scan line has
+ * been returned, and the next row of tiles is read ahead on a background
+ * thread, so no tile is read more than once as with repeated calls to
+ * \ref sif_get_raster. If the thread cannot be created, each row of tiles
+ * is read when it is first needed.
+ *
+ * The file must not be used by any other call until
+ * \ref sif_row_reader_close returns, unless concurrent read mode is
+ * enabled (see \ref sif_enable_concurrent_reads).
+ *
+ * @param file   The file to read.
+ * @param band   The band offset (0..N-1 indexed).
+ *
+ * @return A handle to the reader, or null if the band is invalid or no
+ *         memory could be allocated. The error is then set in
+ *         \ref sif_file::error.
+ *
+ * @see sif_row_reader_get
+ * @see sif_row_reader_close
+ */
+
+SIF_EXPORT sif_row_reader*  sif_row_reader_open(sif_file *file, long band);
+
+/**
+ * @brief Reads the next scan lines of a band.
+ *
+ * @param reader The reader.
+ * @param rows   The buffer to store the scan lines, each as wide as the
+ *               file, one after the other.
+ * @param n_rows The number of scan lines. They may not run past the bottom
+ *               of the file.
+ *
+ * @return Zero if successful, or -1 if an error occurred. The error is left
+ *         in \ref sif_file::error, or, in concurrent read mode, returned by
+ *         \ref sif_get_thread_error. Once an error has occurred, every
+ *         later call fails.
+ */
+
+SIF_EXPORT int              sif_row_reader_get(sif_row_reader *reader, void *rows, long n_rows);
 
 /**
- * @brief Close a SIF file.
+ * @brief Waits for the read ahead of a streaming reader, if any, and frees
+ * the reader.
+ *
+ * @param reader The reader.
+ */
 
- * If the file is open for reading and writing, defragmentation
- * and consolidation occur only if the defragment and consolidate
- * flags are set in the file's header. The file header, tile headers, and
- * meta data are written upon close.
+SIF_EXPORT void             sif_row_reader_close(sif_row_reader *reader);
+
+/**
+ * @brief Enable concurrent read mode on a file opened read-only.
  *
- * @param file   The SIF file to close.
+ * In this mode several threads may call \ref sif_get_raster,
+ * \ref sif_get_tile_slice, \ref sif_simple_get_raster,
+ * \ref sif_simple_get_tile_slice, and \ref sif_simple_get_raster_float32
+ * on the same handle at once. Each call reads with positional I/O
+ * (<code>pread</code>, or <code>ReadFile</code> with an offset on Windows),
+ * so the shared file position is not used, and decodes into scratch
+ * buffers of its own. The header, tile directory, and meta-data are shared
+ * by all threads and are never modified by these calls.
  *
- * @return       The status of the close.
+ * The \a error field of the handle is not set by these calls. Instead,
+ * \ref sif_get_thread_error returns the error code of the last such call
+ * made by the calling thread.
  *
- * @see sif_header::consolidate
- * @see sif_header::defragment
- * @see sif_set_consolidate
- * @see sif_unset_consolidate
- * @see sif_is_consolidate_set
+ * Concurrent read mode cannot be disabled. Closing the file while reads
+ * are in progress is not permitted.
+ *
+ * @param file The file on which to perform the operation.
+ *
+ * @return 1 if successful. If the file was not opened read-only, zero is
+ * returned and the error is set to \ref SIF_ERROR_INVALID_FILE_MODE.
  */
 
-SIF_EXPORT int              sif_close(sif_file* file);
+SIF_EXPORT int              sif_enable_concurrent_reads(sif_file *file);
 
 /**
- * @brief Check all tiles in a file for intrinsic uniformity.
+ * @brief Enable concurrent write mode on a file opened for update.
  *
- * If a tile is found to be intrinsically uniform, its common pixel values
- * for each slice is stored in its header and the physical storage block it
- * is using is freed. If the consolidation flag in the file's header is
- * turned off or the file is read only, this method does nothing.
+ * In this mode several threads may call \ref sif_set_raster,
+ * \ref sif_set_tile_slice, \ref sif_fill_tile_slice, and the functions
+ * allowed in concurrent read mode (see \ref sif_enable_concurrent_reads)
+ * on the same handle at once. The tiles are guarded by a fixed number of
+ * striped locks, so calls on different tiles rarely wait for each other,
+ * while a region write updates each tile it covers atomically. Storage
+ * blocks are allocated under a lock of their own. Slices and tile headers
+ * are written with positional I/O (<code>pwrite</code>, or
+ * <code>WriteFile</code> with an offset on Windows).
  *
- * @param file   The file to mark for uniformity.
+ * Errors are reported by \ref sif_get_thread_error as in concurrent read
+ * mode. Other functions, including those that change meta-data, those of
+ * the simple interface that swap bytes, and \ref sif_flush, must not run
+ * while writes are in progress. Concurrent write mode cannot be disabled.
+ *
+ * @param file The file on which to perform the operation.
+ *
+ * @return 1 if successful. If the file was opened read-only, zero is
+ * returned and the error is set to \ref SIF_ERROR_INVALID_FILE_MODE.
+ */
+
+SIF_EXPORT int              sif_enable_concurrent_writes(sif_file *file);
+
+/**
+ * @brief Enable shared access mode, in which several processes may open and
+ * update the same file at once.
+ *
+ * Besides the guarantees of concurrent write mode (or of concurrent read
+ * mode for a file opened read-only), each access to a tile takes a
+ * byte-range lock on the tile's entry in the tile directory
+ * (<code>fcntl</code> locks, or <code>LockFileEx</code> on Windows): a
+ * write lock if the file is open for update, a read lock otherwise. The
+ * locks belong to the handle where the system has open file description
+ * locks, such as Linux, and to the process elsewhere; there, a process
+ * must not open or close another handle to a file it has open in this
+ * mode, since that would release the locks of the first. The
+ * entry is reloaded under the lock, so reads and writes always see the
+ * tile as the last process left it. Storage blocks belong to one tile,
+ * so the entry's lock is also the lock on the tile's block: no range of
+ * the block region itself is locked.
+ *
+ * Storage blocks are allocated under a write lock on the first bytes of
+ * the file, which \ref sif_open also takes briefly while it reads the
+ * file. A new block is taken where the file header says the meta-data
+ * begins, and the meta-data, which follows the last block, is copied as
+ * it is to after the new block; blocks freed by other processes are
+ * reused only once the file is full. Flushing writes the header and
+ * meta-data under the same lock, and skips consolidation and
+ * defragmentation since they move blocks that other processes may be
+ * using. Meta-data is merged between processes: a flush reads the
+ * meta-data in the file, sets and removes there only the items this
+ * handle set or removed since its last flush, and writes the result. The
+ * last flush wins for an item set by several processes, and items set by
+ * other processes are seen once the file is opened again. Meta-data
+ * values stored out of line are read into memory when this mode is
+ * enabled, and are written with their keys from then on.
+ *
+ * Every process that opens the file for update must enable this mode
+ * before writing. Shallow queries such as \ref sif_is_shallow_uniform use
+ * the tile directory as it was last loaded; see \ref sif_refresh.
+ *
+ * @param file The file on which to perform the operation.
+ *
+ * @return 1 if successful, zero otherwise.
  */
 
-SIF_EXPORT void             sif_consolidate(sif_file* file);
+SIF_EXPORT int              sif_enable_shared_access(sif_file *file);
 
 /**
- * @brief Defragment the file.
+ * @brief Reloads the tile directory of a file.
  *
- * This results in a sort of the storage blocks
- * so they are in the order of their corresponding tile indices. This
- * enables faster reading/writing of continguous blocks. No unused
- * storage blocks remain in the file (i.e. the used blocks are shifted
- * so that they write over the unused blocks). The file is
- * truncated at the position of the last used storage block byte. Meta-data
- * and the file's header are rewritten.
+ * The whole directory is read at once and the block map rebuilt from it,
+ * so changes made by other processes become visible to the shallow
+ * queries. In shared access mode the directory is read under a read lock.
+ * No other call may be in progress on the handle.
  *
- * @param file   The file to defragment.
+ * @param file The file on which to perform the operation.
+ *
+ * @return 1 if successful, zero otherwise.
  */
 
-SIF_EXPORT void             sif_defragment(sif_file* file);
+SIF_EXPORT int              sif_refresh(sif_file *file);
 
 /**
- * @brief Writes a rectangular image region to a file.
+ * @brief Visits the tile slices of a file on several workers.
  *
- * The tiles changed by this write are not checked for pixel uniformity.
- * This results in the dirty flags in their respective tile headers being
- * set to true. This results in a uniformity check during the file's close unless
- * the uniformity check flag is set to false in the file's header. Also, any
- * fragmentation caused by this function is not resolved until the file is closed.
+ * Each worker starts with a run of consecutive tiles and, when it runs
+ * out, steals half of the tiles left to the busiest other worker. For
+ * every tile taken, the selected bands are visited in order. Non-uniform
+ * slices are read and decoded with positional I/O into a buffer of the
+ * worker's own and passed to \a callback. Uniform slices are passed to
+ * \a uniform_callback with their value without any I/O; if it is null,
+ * they are skipped if \a flags includes \ref SIF_TILE_SKIP_UNIFORM, and
+ * otherwise expanded and passed to \a callback.
  *
- * @warning This function has not been tested.
+ * The callbacks are called concurrently from the worker threads, in no
+ * particular order. If a callback returns non-zero, the workers stop after
+ * their current slice.
  *
- * @param file   The file on which to write the raster plane.
- * @param data   The buffer containing the raster to write.
- * @param x      The starting horizontal pixel offset (0..N-1 indexed) to write.
- * @param y      The starting vertical pixel offset (0..N-1 indexed) to write.
- * @param w      The width of the region.
- * @param h      The height of the region.
- * @param band   The band offset (0..N-1 indexed).
+ * If the file is in concurrent read mode, errors are reported through
+ * \ref sif_get_thread_error.
  *
- * @see sif_get_raster
- * @see sif_get_tile_slice
- * @see sif_set_tile_slice
+ * @param file             The file on which to perform the operation.
+ * @param band_mask        An array with one entry per band, non-zero for the
+ *                         bands to visit, or null to visit every band.
+ * @param callback         The function to call for each slice.
+ * @param uniform_callback The function to call for each uniform slice, or null.
+ * @param user             The pointer passed to the callbacks.
+ * @param flags            Zero or \ref SIF_TILE_SKIP_UNIFORM.
+ * @param n_workers        The number of workers, or zero to use the file's
+ *                         workers (see \ref sif_set_workers). The workers run
+ *                         on the file's executor if one is set.
+ *
+ * @return 1 if every selected slice was visited, or zero if a callback
+ * stopped the visit or an error occurred.
  */
 
-SIF_EXPORT void             sif_set_raster(sif_file* file, const void *data,
-                                long x, long y, long w, long h, long band);
+SIF_EXPORT int              sif_for_each_tile(sif_file *file, const char *band_mask,
+					      sif_tile_callback callback,
+					      sif_uniform_tile_callback uniform_callback,
+					      void *user, int flags, int n_workers);
 
 /**
- * @brief Reads a rectangular raster region from a file. It may overlap
- * multiple tiles in the file.
+ * @brief Sets the workers used by operations on a file that run in
+ * parallel. Presently, this is the consolidation pass of
+ * \ref sif_consolidate, which is also run by \ref sif_flush and
+ * \ref sif_close. Dirty tiles are read and checked for uniformity by the
+ * workers, each with buffers of its own, and the results are applied to
+ * the tile directory serially. The file must not be used by other threads
+ * while such an operation runs.
  *
- * @warning This function has not been tested.
+ * By default, one worker is used.
  *
- * @param file   The file on which to read the raster plane out.
- * @param data   The buffer to store the raster plane.
- * @param x      The starting horizontal pixel offset (0..N-1 indexed) to read.
- * @param y      The starting vertical pixel offset (0..N-1 indexed) to read.
- * @param w      The width of the region.
- * @param h      The height of the region.
- * @param band   The band offset (0..N-1 indexed).
+ * @param file          The file on which to perform the operation.
+ * @param n_workers     The number of workers. Values less than 1 are
+ *                      treated as 1.
+ * @param executor      The executor to run the workers on, or null to
+ *                      create threads as needed.
+ * @param executor_data The pointer passed to the executor.
+ */
+
+SIF_EXPORT void             sif_set_workers(sif_file *file, int n_workers,
+					    sif_executor executor, void *executor_data);
+
+/**
+ * @brief Returns the error code of the last read made by the calling thread
+ * on a file in concurrent read mode, or zero if it succeeded. See
+ * \ref sif_enable_concurrent_reads.
  *
- * @see sif_set_raster
- * @see sif_get_tile_slice
- * @see sif_set_tile_slice
+ * @return The error code.
  */
 
+SIF_EXPORT int              sif_get_thread_error(void);
 
-SIF_EXPORT void             sif_get_raster(sif_file* file, void *data,
-                                long x, long y, long w, long h, long band);
+/**
+ * @brief Reads a rectangular raster region from a file, splitting the tiles
+ * of the region across several workers.
+ *
+ * Each worker reads and copies whole tiles into disjoint parts of \a data,
+ * using positional I/O and scratch buffers of its own, so several reads are
+ * outstanding at once. Uniform tile slices are filled without any I/O.
+ * The result is the same as \ref sif_get_raster.
+ *
+ * When \a executor is null, <code>n_workers - 1</code> threads are created
+ * for the call and the calling thread acts as the last worker. The number
+ * of workers never exceeds the number of tiles in the region.
+ *
+ * The file may be in concurrent read mode, in which case errors are
+ * reported through \ref sif_get_thread_error.
+ *
+ * @param file          The file on which to read the raster plane out.
+ * @param data          The buffer to store the raster plane.
+ * @param x             The starting horizontal pixel offset (0..N-1 indexed) to read.
+ * @param y             The starting vertical pixel offset (0..N-1 indexed) to read.
+ * @param w             The width of the region.
+ * @param h             The height of the region.
+ * @param band          The band offset (0..N-1 indexed).
+ * @param n_workers     The number of workers.
+ * @param executor      The executor to run the workers on, or null to use
+ *                      threads created for the call.
+ * @param executor_data The pointer passed to the executor.
+ *
+ * @see sif_get_raster
+ */
+
+SIF_EXPORT void             sif_get_raster_parallel(sif_file* file, void *data,
+						    long x, long y, long w, long h, long band,
+						    int n_workers, sif_executor executor,
+						    void *executor_data);
 
 /**
  * @brief Fill all tiles of a particular band with a constant value.
@@ -1108,6 +2002,96 @@ SIF_EXPORT void             sif_set_tile_slice(sif_file *file, const void *buffe
 
 SIF_EXPORT void             sif_fill_tile_slice(sif_file *file, long tx, long ty, long band, const void *value);
 
+/**
+ * @brief Sets the size of the slice cache shared by every open file.
+ *
+ * Decoded tile slices read from disk are kept in a cache common to all
+ * \ref sif_file handles in the process, keyed by the file (so handles on
+ * the same file share entries), the tile, and the band. Slices read once
+ * are kept on probation and are the first to be evicted, while those read
+ * again move to a protected set, so one pass over a large file does not
+ * flush a small set of slices in frequent use. Uniform slices and slices
+ * stored in the tile header are never cached, since reading them needs no
+ * I/O. Writing a tile through any handle drops its cached slices, and
+ * flushing a handle drops every slice of its file while other handles are
+ * open on it, as they only see the new slices once they reach the file.
+ * Files in shared access mode are not cached.
+ *
+ * The cache is empty and disabled until this function is called.
+ *
+ * @param n_bytes The most memory the cached slices may take. Pinned slices
+ *                (see \ref sif_pin_tile_slice) may go over it. Zero
+ *                disables the cache and frees every slice not pinned.
+ */
+
+SIF_EXPORT void             sif_set_cache_size(size_t n_bytes);
+
+/**
+ * @brief Reads a tile slice and pins it in the slice cache.
+ *
+ * The slice stays in memory, unchanged and not evicted, until it is
+ * released with \ref sif_unpin_tile_slice, so it can be read without a
+ * copy. Later writes to the tile do not change a pinned slice; it is
+ * dropped from the cache and freed when it is unpinned. Slices that cannot
+ * be cached are decoded into memory owned by the pin in the same way.
+ *
+ * In concurrent read mode, the error is returned by
+ * \ref sif_get_thread_error.
+ *
+ * @param file   The file to read.
+ * @param tx     The horizontal tile index (0..N-1 indexed).
+ * @param ty     The vertical tile index (0..N-1 indexed).
+ * @param band   The band offset (0..N-1 indexed).
+ *
+ * @return The slice, laid out as by \ref sif_get_tile_slice, or null if an
+ *         error occurred.
+ */
+
+SIF_EXPORT const void*      sif_pin_tile_slice(sif_file *file, long tx, long ty, long band);
+
+/**
+ * @brief Releases a tile slice pinned with \ref sif_pin_tile_slice.
+ *
+ * @param slice  The slice returned by \ref sif_pin_tile_slice. It must not be
+ *               used afterwards.
+ */
+
+SIF_EXPORT void             sif_unpin_tile_slice(const void *slice);
+
+/**
+ * @brief Releases memory held for reuse after large reads or writes.
+ *
+ * Frees the region buffer of the simple interface, which otherwise stays
+ * as large as the largest region converted, the cached slices of the file
+ * that are not pinned (for every handle on the file), and the idle blocks
+ * of the scratch pool shared by all files. The tile directory and
+ * meta-data are kept, but the meta-data is moved into a single block of
+ * memory, leaving behind the values replaced and the fields removed, so
+ * keys and values returned earlier must not be used afterwards. No other
+ * call may be in progress on the handle.
+ *
+ * @param file   The file to trim, or null to free only the scratch pool.
+ */
+
+SIF_EXPORT void             sif_trim_memory(sif_file *file);
+
+/**
+ * @brief Returns the number of bytes of memory held for a file.
+ *
+ * The count covers the handle and header, the tile directory and block
+ * map, the dirty tile flags, the meta-data, the simple interface region
+ * buffer, the block buffers while a call has them, the locks of concurrent
+ * write mode, and the cached slices of the file. Cached slices are shared,
+ * so every handle open on the same file counts them. Allocator overhead is
+ * not counted.
+ *
+ * @param file   The file.
+ *
+ * @return The number of bytes, or zero if the file is null.
+ */
+
+SIF_EXPORT size_t           sif_get_memory_usage(sif_file *file);
+
 /**
  * @brief Set a meta-data field with a given key to a value defined by
  * a null-terminated character string.
@@ -1116,6 +2100,9 @@ SIF_EXPORT void             sif_fill_tile_slice(sif_file *file, long tx, long ty
  * @param key       The key of the field to set.
  * @param value     The value to set the field.
  *
+ * A long value may be written to the file right away; see
+ * \ref sif_set_meta_data_binary.
+ *
  * @see sif_set_meta_data_binary
  * @see sif_get_meta_data
  * @see sif_get_meta_data_binary
@@ -1138,6 +2125,22 @@ SIF_EXPORT void             sif_set_meta_data(sif_file *file, const char *key, c
  * @warning The meta-data is not written to the file until the file
  * is closed or flushed.
  *
+ * In a file of format version 4 or higher opened for writing, a value of
+ * at least SIF_META_DATA_OUT_OF_LINE_BYTES bytes is written to the file
+ * right away, out of line, instead of being copied into memory. It is
+ * then only read back when it is asked for; see
+ * \ref sif_read_meta_data_binary.
+ *
+ * Such a value is not written as part of a flush: it reaches the file
+ * before the record of its key does, and the record is only written
+ * when the file is flushed or closed. A value that replaces one taking
+ * at least as many bytes is written over the old one. Until the next
+ * flush, the file thus holds the old record, and either the old value
+ * or, where it was overwritten, a value the record does not describe; a
+ * file left unflushed, say by a process that ends, may be left so. Flush
+ * the file after setting a value that must be kept consistent with the
+ * rest of the meta-data.
+ *
  * @see sif_set_meta_data
  * @see sif_get_meta_data
  * @see sif_get_meta_data_binary
@@ -1167,6 +2170,10 @@ SIF_EXPORT const char*      sif_get_meta_data(sif_file *file, const char *key);
  * @brief Get a string meta-data field with a given key. This function
  * returns 0 and sets the error field in the file's header.
  *
+ * A value stored out of line is read whole the first time it is asked
+ * for, and kept in memory until the file is closed. Use
+ * \ref sif_read_meta_data_binary to read it a part at a time instead.
+ *
  * @param file      The file to set the meta-data.
  * @param key       The key of the field to set.
  * @param n_bytes   A pointer to an integer value. This
@@ -1179,6 +2186,42 @@ SIF_EXPORT const char*      sif_get_meta_data(sif_file *file, const char *key);
 
 SIF_EXPORT const void*      sif_get_meta_data_binary(sif_file *file, const char *key, int *n_bytes);
 
+/**
+ * @brief Get the size of the value of a meta-data field with a given key,
+ * without reading the value. The error field in the file's header is set
+ * if the field could not be found.
+ *
+ * @param file      The file containing the meta-data field.
+ * @param key       The key of the field.
+ *
+ * @return          The number of bytes of the value, or -1 if the field
+ *                  could not be found.
+ */
+
+SIF_EXPORT int              sif_get_meta_data_length(sif_file *file, const char *key);
+
+/**
+ * @brief Copy part of the value of a meta-data field with a given key into
+ * a buffer. A value stored out of line is read from the file, so a large
+ * value can be streamed a chunk at a time without being held in memory.
+ * In concurrent read mode, threads may read values at once.
+ *
+ * @param file      The file containing the meta-data field.
+ * @param key       The key of the field.
+ * @param buffer    The buffer to copy the bytes into.
+ * @param offset    The offset of the first byte in the value.
+ * @param n_bytes   The most bytes to copy.
+ *
+ * @return          The number of bytes copied, fewer than n_bytes when the
+ *                  value ends first, or -1 if the field could not be found
+ *                  or read.
+ *
+ * @see sif_get_meta_data_length
+ * @see sif_get_meta_data_binary
+ */
+
+SIF_EXPORT long             sif_read_meta_data_binary(sif_file *file, const char *key, void *buffer, long offset, long n_bytes);
+
 /**
  * @brief Determine if the tiles comprising a region are shallow uniform.
  *
@@ -1223,10 +2266,69 @@ SIF_EXPORT int              sif_is_shallow_uniform(sif_file *file, long x, long
 
 SIF_EXPORT int              sif_is_slice_shallow_uniform(sif_file *file, long tx, long ty, long band, void *uniform_value);
 
+/**
+ * @brief Get a view of the header of a tile in the file's tile directory.
+ *
+ * The tile headers are no longer an array of \ref sif_tile in the file
+ * structure; code that used <code>file->tiles[i]</code> uses the view
+ * returned here instead, and \ref sif_get_tile_block_num for the block
+ * number the array held. The view points into the directory, and stays
+ * valid until the file is closed. A file opened with \ref sif_open_lazy
+ * loads the tile's header first.
+ *
+ * @param file          The file.
+ * @param tile_num      The tile index (0..N-1 indexed).
+ * @param view          The view to fill in.
+ *
+ * @return The view, or 0 if the tile index is out of range or the header
+ *         could not be loaded, in which case the error field is set.
+ */
+
+SIF_EXPORT sif_tile*        sif_get_tile_header(sif_file *file, long tile_num, sif_tile *view);
+
+/**
+ * @brief Get the storage block of a tile.
+ *
+ * @param file          The file.
+ * @param tile_num      The tile index (0..N-1 indexed).
+ *
+ * @return The block number, -1 if the tile is completely uniform and has
+ *         no block, or -2 if the tile index is out of range or its header
+ *         could not be loaded, in which case the error field is set.
+ */
+
+SIF_EXPORT long             sif_get_tile_block_num(sif_file *file, long tile_num);
+
+/**
+ * @brief Return the encoding used to store a tile slice in its block.
+ *
+ * When the intrinsic write flag is set, each non-uniform slice written to
+ * a file of format version 3 or higher is checked for a more compact
+ * representation. Slices that are linear ramps are stored entirely in the
+ * tile header and are generated when read. Slices with constant rows or
+ * columns store one data unit per row or column. Otherwise, if few enough
+ * distinct values are found, the slice is stored as a palette with
+ * bit-packed indices. These reduce the number of bytes read when the slice
+ * is retrieved. The encoding is chosen automatically and is transparent to
+ * callers of \ref sif_get_tile_slice and \ref sif_get_raster.
+ *
+ * @param file          The file to perform the check.
+ * @param tx            The horizontal tile index (0..N-1 indexed).
+ * @param ty            The vertical tile index (0..N-1 indexed).
+ * @param band          The band offset (0..N-1 indexed).
+ *
+ * @return One of the \ref sif_enc codes, \ref SIF_SLICE_ENCODING_UNIFORM
+ *         if the slice is shallow uniform, or -1 if an error occurred.
+ */
+
+SIF_EXPORT int              sif_get_slice_encoding(sif_file *file, long tx, long ty, long band);
+
 /**
  * @brief Flush all remaining unwritten data to the file.
  *
  * This function immediately returns if the file passed is read-only.
+ * In files of format version 4 and higher, only the meta-data items
+ * changed since the last flush are written.
  *
  * @param file   The SIF file to flush.
  *
@@ -1235,6 +2337,75 @@ SIF_EXPORT int              sif_is_slice_shallow_uniform(sif_file *file, long tx
 
 SIF_EXPORT int              sif_flush(sif_file* file);
 
+/**
+ * @brief Flushes a file on a background thread.
+ *
+ * Does the work of \ref sif_flush, including consolidation and
+ * defragmentation when they are set, on a thread created for the purpose,
+ * and returns at once. The file must not be used by any other call until
+ * \ref sif_async_wait returns. If the thread cannot be created, the flush
+ * is done before returning.
+ *
+ * @param file   The SIF file to flush.
+ *
+ * @return A handle to wait on with \ref sif_async_wait, or null if no
+ *         memory could be allocated for it.
+ */
+
+SIF_EXPORT sif_async*       sif_flush_async(sif_file* file);
+
+/**
+ * @brief Closes a file on a background thread.
+ *
+ * Does the work of \ref sif_close on a thread created for the purpose and
+ * returns at once. The file must not be used again. If the thread cannot
+ * be created, the file is closed before returning.
+ *
+ * @param file   The SIF file to close.
+ *
+ * @return A handle to wait on with \ref sif_async_wait, or null if no
+ *         memory could be allocated for it. In that case the file is not
+ *         closed.
+ */
+
+SIF_EXPORT sif_async*       sif_close_async(sif_file* file);
+
+/**
+ * @brief Returns whether a background flush or close has finished.
+ *
+ * @param op     The handle of the operation.
+ *
+ * @return 1 if the operation has finished, zero otherwise.
+ */
+
+SIF_EXPORT int              sif_async_is_done(sif_async* op);
+
+/**
+ * @brief Asks a background flush or close to stop defragmenting.
+ *
+ * Defragmentation stops after the window of blocks it is moving (see
+ * \ref sif_defragment), and the tile headers and meta-data are then
+ * written so that the file stays valid, only partially defragmented. If
+ * defragmentation has not started yet, it is skipped. Everything else the
+ * operation does still completes. The request may be made from any thread.
+ *
+ * @param op     The handle of the operation.
+ */
+
+SIF_EXPORT void             sif_async_cancel(sif_async* op);
+
+/**
+ * @brief Waits for a background flush or close to finish and frees its
+ * handle.
+ *
+ * @param op     The handle of the operation.
+ *
+ * @return Zero if the operation succeeded, or -1 if an error occurred. For a
+ *         flush, the error is left in \ref sif_file::error.
+ */
+
+SIF_EXPORT int              sif_async_wait(sif_async* op);
+
 /**
  * @brief Set the user data type for the file.
  *
@@ -1521,6 +2692,16 @@ SIF_EXPORT void              sif_remove_meta_data_item(sif_file *file, const cha
  * written with using the SIF file format version specified. If the version
  * is not supported for write, a SIF_ERROR_CANNOT_WRITE_VERSION error
  * is set in the header's error code field.
+ *
+ * Versions before 3 do not store slice encodings in the tile headers. A
+ * newly created file can only be switched to one of these versions
+ * before any non-uniform slice is written to it.
+ *
+ * Version 4 stores the location of the meta-data in the header, which
+ * needs more room than the header of a file created by an earlier version
+ * of this library has; such a file cannot be switched to version 4.
+ * Switching to an earlier version reads the meta-data values stored out
+ * of line into memory, as those versions store every value with its key.
  */
 SIF_EXPORT void              sif_use_file_format_version(sif_file *file, long version);
 
@@ -1676,6 +2857,43 @@ SIF_EXPORT const char *      sif_get_error_description(int code);
 
 #define SIF_SIMPLE_FLOAT64 9
 
+/**
+ * \def SIF_SIMPLE_BIT
+ * \ingroup simpdecs
+ *
+ * @brief The base type code for storing 1-bit masks. Buffers passed to and
+ * returned by the I/O functions use one byte per pixel (0 or 1), so the data
+ * unit size is 1. However, non-uniform slices are packed 8 pixels per byte
+ * in the file's blocks. Any non-zero byte written is stored as 1.
+ *
+ * Base type codes of 100 and higher are combined with the endian code
+ * as <code>base + 1000*endian</code> rather than <code>base + 10*endian</code>.
+ */
+
+#define SIF_SIMPLE_BIT 100
+
+/**
+ * \def SIF_SIMPLE_FLOAT16
+ * \ingroup simpdecs
+ *
+ * @brief The base type code for storing IEEE-754 standard 16-bit (half
+ * precision) floats. See sif_simple_get_raster_float32() for reading and
+ * writing them as 32-bit floats.
+ */
+
+#define SIF_SIMPLE_FLOAT16 101
+
+/**
+ * \def SIF_SIMPLE_BFLOAT16
+ * \ingroup simpdecs
+ *
+ * @brief The base type code for storing bfloat16 values, i.e. the upper
+ * 16 bits of an IEEE-754 32-bit float. See sif_simple_get_raster_float32()
+ * for reading and writing them as 32-bit floats.
+ */
+
+#define SIF_SIMPLE_BFLOAT16 102
+
 /**
  * \def SIF_SIMPLE_LITTLE_ENDIAN
  * \ingroup simpdecs
@@ -1714,7 +2932,7 @@ SIF_EXPORT const char *      sif_get_error_description(int code);
  * @brief A function macro that returns the endian code for a simple type code \a t.
  */
 
-#define SIF_SIMPLE_ENDIAN(t) (((int)t)/10)
+#define SIF_SIMPLE_ENDIAN(t) (((int)(t)) >= 100 ? ((int)(t))/1000 : ((int)(t))/10)
 
 /**
  * \def SIF_SIMPLE_TYPE_CODE(bt, ec)
@@ -1724,7 +2942,7 @@ SIF_EXPORT const char *      sif_get_error_description(int code);
  * and endian code \a ec.
  */
 
-#define SIF_SIMPLE_TYPE_CODE(bt, ec) ((bt)+(ec))
+#define SIF_SIMPLE_TYPE_CODE(bt, ec) ((bt) + ((bt) >= 100 ? 1000 : 10) * (ec))
 
 /**
  * \def SIF_SIMPLE_BASE_TYPE_CODE(bt, ec)
@@ -1733,7 +2951,7 @@ SIF_EXPORT const char *      sif_get_error_description(int code);
  * @brief A function macro that computes the base type code from the compound type code.
  */
 
-#define SIF_SIMPLE_BASE_TYPE_CODE(x) (((int)x)%10)
+#define SIF_SIMPLE_BASE_TYPE_CODE(x) (((int)(x)) >= 100 ? ((int)(x))%1000 : ((int)(x))%10)
 
 
 /**
@@ -1892,6 +3110,53 @@ SIF_EXPORT void              sif_simple_get_raster(sif_file* file,
 						   long x, long y,
 						   long w, long h,
 						   long band);
+
+/**
+ * @brief Read a rectangular region from a file of 16-bit floats
+ * (SIF_SIMPLE_FLOAT16 or SIF_SIMPLE_BFLOAT16) as 32-bit floats in host
+ * byte order. Files of type SIF_SIMPLE_FLOAT32 are read unconverted.
+ * Any other type sets SIF_SIMPLE_ERROR_INCORRECT_DT.
+ *
+ * The 16-bit values are read into the upper half of \a data and widened
+ * in place, so no intermediate buffer is allocated. The F16C or AVX-512
+ * conversion instructions are used when the library is compiled for them.
+ *
+ * @param file The file on which to perform the operation.
+ * @param data The buffer of <code>w*h</code> floats into which the data will be read.
+ * @param x    The horizontal starting index of the file.
+ * @param y    The vertical starting index of the file.
+ * @param w    The width of the region.
+ * @param h    The height of the region.
+ * @param band The band of the region.
+ */
+
+SIF_EXPORT void              sif_simple_get_raster_float32(sif_file* file,
+							   float *data,
+							   long x, long y,
+							   long w, long h,
+							   long band);
+
+/**
+ * @brief Write a rectangular region of 32-bit floats to a file of 16-bit
+ * floats (SIF_SIMPLE_FLOAT16 or SIF_SIMPLE_BFLOAT16), rounding each
+ * value to nearest even. Half precision values too large to represent
+ * become infinity. Files of type SIF_SIMPLE_FLOAT32 are written
+ * unconverted. Any other type sets SIF_SIMPLE_ERROR_INCORRECT_DT.
+ *
+ * @param file The file on which to perform the operation.
+ * @param data The buffer of <code>w*h</code> floats to write.
+ * @param x    The horizontal starting index of the file.
+ * @param y    The vertical starting index of the file.
+ * @param w    The width of the region.
+ * @param h    The height of the region.
+ * @param band The band of the region.
+ */
+
+SIF_EXPORT void              sif_simple_set_raster_float32(sif_file* file,
+							   const float *data,
+							   long x, long y,
+							   long w, long h,
+							   long band);
 /**
  * @brief Fill a band with a constant value. The byte order of the
  * value is converted to the byte order of the file's image.
@@ -2015,6 +3280,22 @@ SIF_EXPORT int              sif_simple_is_shallow_uniform(sif_file *file, long x
 
 SIF_EXPORT int              sif_simple_is_slice_shallow_uniform(sif_file *file, long tx, long ty, long band, void *uniform_value);
 
+/**
+ * Count the number of non-zero pixels in a tile slice. Only pixels inside
+ * the image are counted. For 1-bit mask files (see \ref SIF_SIMPLE_BIT),
+ * the packed bits are counted with population count instructions without
+ * unpacking them. Uniform slices are counted without any I/O.
+ *
+ * @param file          The file on which to perform the operation.
+ * @param tx            The horizontal tile index (0..N-1 indexed).
+ * @param ty            The vertical tile index (0..N-1 indexed).
+ * @param band          The band offset (0..N-1 indexed).
+ *
+ * @return The number of non-zero pixels, or -1 if an error occurred.
+ */
+
+SIF_EXPORT long             sif_simple_count_set_pixels(sif_file *file, long tx, long ty, long band);
+
 /**
  * Return if the file conforms to the "simple" data type convention.
  *
@@ -2135,7 +3416,7 @@ SIF_EXPORT int              sif_export_slices_to_ppm_file(sif_file *file, const
  * @return A nonzero value if successful.
  */
 
-SIF_EXPORT int              sif_export_region_to_ppm_file(sif_file *file, const char *filename,
+SIF_EXPORT int              sif_export_region_to_pam_file(sif_file *file, const char *filename,
 							  int x, int y, int width, int height,
 							  int *bands, int nbands);
 
@@ -2155,7 +3436,7 @@ SIF_EXPORT int              sif_export_region_to_ppm_file(sif_file *file, const
  * @return A nonzero value if successful.
  */
 
-SIF_EXPORT int              sif_export_slices_to_ppm_file(sif_file *file, const char *filename,
+SIF_EXPORT int              sif_export_slices_to_pam_file(sif_file *file, const char *filename,
 							  int tx, int ty,
 							  int *bands, int nbands);
 
@@ -0,0 +1,156 @@
+/**
+ * Round-trip test of the meta-data extent of format version 4: records
+ * rewritten in place, appended when they grow, moved past blocks that
+ * displace the extent, and compacted once most of them are freed. The
+ * file is reopened after each step and every item checked.
+ */
+
+#include "sif-io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_KEYS 200
+#define FILENAME "test-meta-data-v4.sif"
+
+#define CHECK(c) do { if (!(c)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #c); exit(1); } } while (0)
+
+static char values[N_KEYS][64];
+static int present[N_KEYS];
+static int n_others = -1;   /* items the library keeps of its own */
+
+static void check_items(sif_file *file) {
+  char key[32];
+  const char *v;
+  int i, n = 0;
+  for (i = 0; i < N_KEYS; i++) {
+    sprintf(key, "key%d", i);
+    v = sif_get_meta_data(file, key);
+    if (present[i]) {
+      CHECK(v != 0 && strcmp(v, values[i]) == 0);
+      n++;
+    }
+    else {
+      CHECK(v == 0 && file->error == SIF_ERROR_META_DATA_KEY);
+      file->error = SIF_ERROR_NONE;
+    }
+  }
+  if (n_others < 0) {
+    n_others = sif_get_meta_data_num_items(file) - n;
+  }
+  CHECK(sif_get_meta_data_num_items(file) == n + n_others);
+}
+
+static unsigned short pixel(long tx, long k) {
+  unsigned long x = (unsigned long)(tx * 32 * 32 + k) * 2654435761UL;
+  return (unsigned short)(x >> 13);
+}
+
+static sif_file *reopen(sif_file *file) {
+  CHECK(sif_close(file) == 0);
+  file = sif_open(FILENAME, 0);
+  CHECK(file != 0 && file->header->version >= 4);
+  check_items(file);
+  return file;
+}
+
+static void set_item(sif_file *file, int i, const char *value) {
+  char key[32];
+  sprintf(key, "key%d", i);
+  strcpy(values[i], value);
+  present[i] = 1;
+  sif_set_meta_data(file, key, value);
+}
+
+int main(void) {
+  sif_file *file;
+  unsigned short tile[32 * 32];
+  LONGLONG location, bytes;
+  char key[32], value[64];
+  long tx, k;
+  int i;
+
+  /* No consolidation or defragmentation, so the extent only moves when
+     blocks displace it. */
+  file = sif_simple_create(FILENAME, 32 * 16, 32 * 16, 1, SIF_SIMPLE_UINT16, 0, 0, 32, 32, 0);
+  CHECK(file != 0);
+  for (i = 0; i < N_KEYS; i++) {
+    sprintf(value, "value%d", i);
+    set_item(file, i, value);
+  }
+  file = reopen(file);
+  location = file->meta_data_location;
+  bytes = file->meta_data_bytes;
+  CHECK(location > 0 && bytes > 0 && file->meta_data_free_bytes == 0);
+
+  /* A value that still fits its record is rewritten in place. */
+  set_item(file, 7, "VALUE7");
+  sif_flush(file);
+  CHECK(file->meta_data_location == location && file->meta_data_bytes == bytes
+        && file->meta_data_free_bytes == 0);
+  file = reopen(file);
+
+  /* A value that outgrows its record is appended and the old one freed. */
+  set_item(file, 9, "a value much longer than the one it replaces");
+  sif_flush(file);
+  CHECK(file->meta_data_location == location && file->meta_data_bytes > bytes
+        && file->meta_data_free_bytes > 0);
+  file = reopen(file);
+  CHECK(file->meta_data_free_bytes > 0);
+
+  /* Blocks allocated over the extent displace it past them. The pixels
+     are noise, so that no slice encoding spares a tile its block. */
+  for (tx = 0; tx < 16; tx++) {
+    for (k = 0; k < 32 * 32; k++) {
+      tile[k] = pixel(tx, k);
+    }
+    sif_simple_set_tile_slice(file, tile, tx, 0, 0);
+  }
+  CHECK(file->error == 0 && file->meta_data_displaced);
+  sif_flush(file);
+  CHECK(file->meta_data_location > location && !file->meta_data_displaced);
+  file = reopen(file);
+  for (tx = 0; tx < 16; tx++) {
+    sif_simple_get_tile_slice(file, tile, tx, 0, 0);
+    for (k = 0; k < 32 * 32; k++) {
+      CHECK(tile[k] == pixel(tx, k));
+    }
+  }
+
+  /* Removing most items compacts the extent. */
+  location = file->meta_data_location;
+  bytes = file->meta_data_bytes;
+  for (i = 0; i < N_KEYS; i += 4) {
+    if (i != 0) {
+      sprintf(key, "key%d", i - 1);
+      sif_remove_meta_data_item(file, key);
+      present[i - 1] = 0;
+      sprintf(key, "key%d", i - 2);
+      sif_remove_meta_data_item(file, key);
+      present[i - 2] = 0;
+      sprintf(key, "key%d", i - 3);
+      sif_remove_meta_data_item(file, key);
+      present[i - 3] = 0;
+    }
+  }
+  sif_flush(file);
+  CHECK(file->meta_data_location == location && file->meta_data_bytes < bytes / 2
+        && file->meta_data_free_bytes == 0);
+  file = reopen(file);
+
+  /* Writing the file in version 3 and back keeps every item. */
+  sif_use_file_format_version(file, 3);
+  CHECK(file->error == 0);
+  CHECK(sif_close(file) == 0);
+  file = sif_open(FILENAME, 0);
+  CHECK(file != 0 && file->header->version == 3);
+  check_items(file);
+  sif_use_file_format_version(file, 4);
+  CHECK(file->error == 0);
+  file = reopen(file);
+
+  CHECK(sif_close(file) == 0);
+  remove(FILENAME);
+  printf("PASS\n");
+  return 0;
+}